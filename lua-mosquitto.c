@@ -34,11 +34,30 @@
  * @module mosquitto
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <assert.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define LUA_MOSQUITTO_IO_POOL
+#endif
 
 #include <lua.h>
 #include <lualib.h>
@@ -47,6 +66,7 @@
 #include <mosquitto.h>
 #include <mqtt_protocol.h>
 #include "compat.h"
+#include "lua-mosquitto.h"
 
 enum callback_types {
 	CALLBACK_ON_CONNECT,
@@ -64,12 +84,222 @@ enum callback_types {
 	CALLBACK_ON_LOG,
 };
 
+enum publish_priority {
+	PRIORITY_CONTROL,
+	PRIORITY_NORMAL,
+	PRIORITY_BULK,
+};
+
 /* unique naming for userdata metatables */
 #define MOSQ_META_CTX	"mosquitto.ctx"
+#define MOSQ_META_POOL	"mosquitto.worker_pool"
+#define MOSQ_META_IO	"mosquitto.io_pool"
+#define MOSQ_META_PUB	"mosquitto.publisher"
+#define MOSQ_META_GROUP	"mosquitto.shared_group"
+#define MOSQ_META_MATCHER	"mosquitto.matcher"
+#define MOSQ_META_BUFFER	"mosquitto.buffer"
+#define MOSQ_META_SWARM	"mosquitto.swarm"
+#define MOSQ_META_FFI	"mosquitto.ffi"
+#define MOSQ_META_RELAY	"mosquitto.relay"
+
+/* registry table, weak values, of the clients attached to I/O pools */
+#define MOSQ_IO_CLIENTS	"mosquitto.io_clients"
+
+/* upper bound in ms for how long a loop may block when C side work is pending */
+#define CTX_SERVICE_INTERVAL	100
+
+/* messages taken from a publisher queue per loop iteration */
+#define PUBLISHER_BATCH	256
+
+/* a message queued inside the bindings, topic and payload share one allocation */
+typedef struct pubmsg {
+	struct pubmsg *next;
+	char *topic;
+	void *payload;
+	int payloadlen;
+	int qos;
+	bool retain;
+	mosquitto_property *props;
+} pubmsg_t;
+
+typedef struct {
+	pubmsg_t *head;
+	pubmsg_t *tail;
+	size_t len;
+} pubq_t;
+
+typedef struct {
+	pubmsg_t *head;		/* producers */
+	pubmsg_t *tail;		/* consumer */
+	pubmsg_t stub;
+} mpsc_t;
+
+struct ctx;
+struct spool;
+struct offline;
+struct bulk;
+struct conflate;
+struct ratelimit;
+struct timers;
+struct rpc;
+struct dedup;
+struct shed;
+struct stream_tx;
+struct stream_rx;
+struct recorder;
+struct replay;
+struct native;
+struct ffi_queue;
+struct intern;
+
+/* shared between the ctx and any number of handles, possibly in other states */
+typedef struct {
+	int refs;
+	bool closed;		/* owning ctx destroyed */
+	bool wake;			/* owning ctx is serviced by an I/O thread */
+	pthread_mutex_t lock;	/* protects ctx while waking its I/O thread */
+	struct ctx *ctx;
+	mpsc_t q;
+	unsigned long queued;
+	unsigned long published;
+	unsigned long dropped;
+} publisher_t;
+
+typedef struct {
+	unsigned long messages;		/* atomic, counted on the network side */
+	unsigned long expired;
+	unsigned long rules_matched;	/* by rules on the network side */
+	unsigned long rules_published;
+	unsigned long rules_failed;
+} ctx_stats_t;
+
+typedef struct {
+	char *key;
+	uint32_t hash;
+	void *value;
+} strmap_slot_t;
+
+typedef struct {
+	strmap_slot_t *slots;
+	size_t mask;		/* size - 1, a power of 2 */
+	size_t len;
+} strmap_t;
+
+/* handler of a subscription, indexed by subscription identifier - 1 */
+typedef struct {
+	int ref;
+	char *filter;
+} sub_handler_t;
+
+/* largest value of the subscription-identifier varint */
+#define SUB_ID_MAX	268435455
+
+struct worker_pool;
+
+typedef struct {
+	struct worker_pool *pool;
+	int index;
+	lua_State *L;
+	int handler;
+	pthread_t thread;
+	bool started;
+	bool stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t nonempty;
+	pthread_cond_t nonfull;
+	pubq_t queue;
+} worker_t;
+
+typedef struct worker_pool {
+	int n;
+	size_t max_queue;
+	worker_t *workers;
+	pthread_mutex_t lock;	/* protects results */
+	pubq_t results;
+	unsigned long dispatched;
+	unsigned long processed;
+	unsigned long errors;
+} worker_pool_t;
+
+/* a callback invocation recorded on an I/O thread, replayed on the Lua thread */
+typedef struct ctx_event {
+	struct ctx_event *next;
+	int type;	/* one of callback_types */
+	int rc;		/* rc, reason code or log level */
+	int mid;
+	int flags;
+	int qos_count;
+	int *granted_qos;
+	char *str;
+	struct mosquitto_message msg;
+	mosquitto_property *props;
+	uint64_t received;	/* ms, of a message */
+} ctx_event_t;
+
+struct io_pool;
+struct io_thread;
 
 typedef struct {
+	struct io_pool *pool;
+	struct io_thread *thread;
+	int ref;			/* keeps the pool alive while attached */
+	uint64_t key;		/* epoll key, slot index and generation */
+	int fd;				/* socket as registered with epoll */
+	uint32_t events;	/* epoll interest currently registered */
+	bool reset;			/* socket may have been replaced, re-register */
+	bool kick_reset;	/* reset requested by the Lua thread, under dirty_lock */
+	bool dirty;
+	struct ctx *dirty_next;
+	uint64_t reconnect_at;
+	pthread_mutex_t lock;	/* protects the event queue */
+	ctx_event_t *head;
+	ctx_event_t *tail;
+	unsigned long depth;	/* messages in the event queue */
+	bool ready;			/* on the pool's ready list, under pool lock */
+	struct ctx *ready_next;
+} ctx_io_t;
+
+/* the loop_start thread of the bindings */
+typedef struct {
+	pthread_t thread;
+	bool running;
+	bool stopping;
+	int wake[2];		/* pipe polled next to the socket, -1 until first started */
+} ctx_loop_t;
+
+typedef struct ctx {
 	lua_State *L;
 	struct mosquitto *mosq;
+	worker_pool_t *pool;
+	int pool_ref;
+	bool disconnecting;
+	ctx_io_t io;
+	ctx_loop_t loop;
+	publisher_t *publisher;
+	struct spool *spool;
+	struct offline *offline;
+	struct bulk *bulk;	/* PRIORITY_BULK publishes */
+	struct conflate *conflate;
+	struct ratelimit *ratelimit;
+	struct timers *timers;	/* publish_every and publish_at */
+	struct rpc *rpc;		/* pending requests */
+	struct dedup *dedup;
+	struct shed *shed;
+	struct stream_tx *stream_tx;	/* outgoing streams, in turn */
+	struct stream_credit *stream_credit;	/* their chunks in flight */
+	struct stream_rx *stream_rx;
+	struct recorder *recorder;
+	pthread_rwlock_t record_lock;	/* write held to swap recorder */
+	struct replay *replay;
+	struct native *native;	/* C handlers of lua-mosquitto.h */
+	struct ffi_queue *ffi;	/* messages for LuaJIT's FFI */
+	struct intern *intern;	/* topics pushed to Lua */
+	const struct mosquitto_message *native_msg;	/* left by the v3 callback for the v5 one */
+	const struct mosquitto_message *drop_msg;	/* verdict of the v3 callback */
+	bool drop_verdict;
+	char *auto_sub;		/* subscribed on every successful connect */
+	int auto_sub_qos;
+	ctx_stats_t stats;
 	int on_connect;
 	int on_connect_v5;
 	int on_disconnect;
@@ -83,14 +313,110 @@ typedef struct {
 	int on_unsubscribe;
 	int on_unsubscribe_v5;
 	int on_log;
+	bool message_v5_set;	/* ctx_on_message_v5 is installed */
+	bool drop_expired;
+	int expiry_skew;	/* ms added to the expiry interval */
+	sub_handler_t *subs;
+	int nsubs;
 } ctx_t;
 
 static int mosq_initialized = 0;
 
 static int lua_table_on_stack(lua_State *L, int index);
+static void ctx_on_connect(struct mosquitto *mosq, void *obj, int rc);
+static void ctx_on_publish(struct mosquitto *mosq, void *obj, int mid);
+static void ctx_on_message_v5(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg, const mosquitto_property *props);
 static int create_property_list_from_lua_stack(lua_State *L, int index, mosquitto_property** proplist, int command);
 static int create_lua_stack_from_property_list(lua_State *L, const mosquitto_property *properties);
 static void parse_basic_parameter_for_publish(lua_State *L, const char **topic, const void **payload, size_t *payloadlen, int *qos, bool *retain);
+static int worker_pool__dispatch(worker_pool_t *pool, const char *topic, const void *payload, int payloadlen, int qos, bool retain);
+static void ctx__service(ctx_t *ctx);
+static bool ctx__io_deferred(ctx_t *ctx);
+static ctx_event_t *ctx_event__new(int type, int rc, int mid, const mosquitto_property *props);
+static void ctx__io_defer(ctx_t *ctx, ctx_event_t *ev);
+static void ctx__io_kick(ctx_t *ctx, bool reset);
+static void ctx__io_detach(ctx_t *ctx);
+static bool ctx__publisher_drain(ctx_t *ctx);
+static void ctx__loop_wake(ctx_t *ctx);
+static void ctx__loop_stop(ctx_t *ctx, bool force);
+static void publisher__close(publisher_t *pub);
+static void publisher__wake_set(publisher_t *pub, bool wake);
+static int spool__publish(ctx_t *ctx, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *props);
+static int spool__replay(ctx_t *ctx);
+static void spool__ack(struct spool *sp, int mid);
+static void spool__service(struct spool *sp);
+static void spool__close(struct spool *sp);
+static void spool__stats(lua_State *L, struct spool *sp);
+static bool offline__pending(struct offline *o);
+static void offline__buffer(struct offline *o, bool no_conn, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *props);
+static void offline__flush(ctx_t *ctx);
+static void offline__online(ctx_t *ctx);
+static void offline__stats(lua_State *L, struct offline *o);
+static void offline__free(struct offline *o);
+static int bulk__push(ctx_t *ctx, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *props);
+static void bulk__feed(ctx_t *ctx);
+static void bulk__ack(struct bulk *b, int mid);
+static void bulk__reset(struct bulk *b);
+static void bulk__stats(lua_State *L, struct bulk *b);
+static void bulk__free(struct bulk *b);
+static bool conflate__take(struct conflate *c, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *props);
+static void conflate__flush(ctx_t *ctx, bool force);
+static void conflate__stats(lua_State *L, struct conflate *c);
+static void conflate__free(struct conflate *c);
+static int ctx__publish_send(ctx_t *ctx, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *props, int priority);
+static bool ratelimit__admit(ctx_t *ctx, int *rc, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *props, int priority);
+static void ratelimit__drain(ctx_t *ctx);
+static bool ratelimit__bulk(ctx_t *ctx, const char *topic);
+static void ratelimit__stats(lua_State *L, struct ratelimit *r);
+static void ratelimit__free(struct ratelimit *r);
+static uint64_t mosq__now_ms(void);
+static uint64_t timers__next(struct timers *t, uint64_t now);
+static void timers__service(ctx_t *ctx);
+static void timers__stats(lua_State *L, struct timers *t);
+static void timers__free(lua_State *L, struct timers *t);
+static bool rpc__is_reply(struct rpc *r, const char *topic);
+static void rpc__subscribe(ctx_t *ctx);
+static void rpc__reply(ctx_t *ctx, const struct mosquitto_message *msg, const mosquitto_property *props);
+static void rpc__service(ctx_t *ctx);
+static void rpc__stats(lua_State *L, struct rpc *r);
+static void rpc__free(lua_State *L, struct rpc *r);
+static void dedup__stats(lua_State *L, struct dedup *d);
+static void dedup__free(struct dedup *d);
+static bool ctx__drop(ctx_t *ctx, const struct mosquitto_message *msg, const mosquitto_property *props, bool v5);
+static void shed__lag(struct shed *s, uint64_t received);
+static void shed__stats(lua_State *L, struct shed *s);
+static void shed__free(struct shed *s);
+static const void *buffer__payload(lua_State *L, int i, size_t *len);
+static void stream_tx__feed(ctx_t *ctx);
+static void stream_tx__free_all(ctx_t *ctx);
+static void stream_credit__ack(struct stream_credit *c, int mid);
+static void stream_credit__reset(struct stream_credit *c);
+static void stream_credit__free(struct stream_credit *c);
+static bool stream_rx__is_chunk(struct stream_rx *rx, const char *topic);
+static void stream_rx__chunk(ctx_t *ctx, const struct mosquitto_message *msg, const mosquitto_property *props);
+static void stream_rx__expire(ctx_t *ctx);
+static void stream_rx__free(lua_State *L, struct stream_rx *rx);
+static void stream__stats(lua_State *L, ctx_t *ctx);
+static void recorder__write(ctx_t *ctx, const struct mosquitto_message *msg);
+static void recorder__flush(ctx_t *ctx);
+static int recorder__close(struct recorder *r);
+static void recorder__stats(lua_State *L, struct recorder *r);
+static void replay__feed(ctx_t *ctx);
+static uint64_t replay__wait(struct replay *p, uint64_t now);
+static void replay__stats(lua_State *L, struct replay *p);
+static void replay__free(lua_State *L, struct replay *p);
+static bool native__message(struct native *n, const struct mosquitto_message *msg, const mosquitto_property *props);
+static void native__publish(struct native *n, int mid, int reason_code, const mosquitto_property *props);
+static void native__connect(struct native *n, int reason_code, int flags, const mosquitto_property *props);
+static void native__enable(ctx_t *ctx);
+static void native__stats(lua_State *L, struct native *n);
+static void native__free(struct native *n);
+static bool ffi__push(struct ffi_queue *q, const struct mosquitto_message *msg);
+static void ffi__stats(lua_State *L, struct ffi_queue *q);
+static void ffi__free(struct ffi_queue *q);
+static void ctx__push_topic(ctx_t *ctx, const char *topic);
+static void intern__stats(lua_State *L, struct intern *t);
+static void intern__free(lua_State *L, struct intern *t);
 
 /* handle mosquitto lib return codes */
 static int mosq__pstatus(lua_State *L, int mosq_errno) {
@@ -227,6 +553,13 @@ static void ctx__on_init(ctx_t *ctx)
 	ctx->on_unsubscribe = LUA_REFNIL;
 	ctx->on_unsubscribe_v5 = LUA_REFNIL;
 	ctx->on_log = LUA_REFNIL;
+	ctx->message_v5_set = false;
+	ctx->subs = NULL;
+	ctx->nsubs = 0;
+	ctx->pool = NULL;
+	ctx->pool_ref = LUA_NOREF;
+	/* nothing to reconnect to until one of the connect functions is called */
+	ctx->disconnecting = true;
 }
 
 static void ctx__on_clear(ctx_t *ctx)
@@ -244,6 +577,77 @@ static void ctx__on_clear(ctx_t *ctx)
 	luaL_unref(ctx->L, LUA_REGISTRYINDEX, ctx->on_unsubscribe);
 	luaL_unref(ctx->L, LUA_REGISTRYINDEX, ctx->on_unsubscribe_v5);
 	luaL_unref(ctx->L, LUA_REGISTRYINDEX, ctx->on_log);
+	luaL_unref(ctx->L, LUA_REGISTRYINDEX, ctx->pool_ref);
+	ctx->pool = NULL;
+	ctx->pool_ref = LUA_NOREF;
+
+	for (int i = 0; i < ctx->nsubs; i++) {
+		luaL_unref(ctx->L, LUA_REGISTRYINDEX, ctx->subs[i].ref);
+		free(ctx->subs[i].filter);
+	}
+	free(ctx->subs);
+	ctx->subs = NULL;
+	ctx->nsubs = 0;
+}
+
+static void ctx__message_v5_enable(ctx_t *ctx)
+{
+	ctx->message_v5_set = true;
+	mosquitto_message_v5_callback_set(ctx->mosq, ctx_on_message_v5);
+}
+
+static void ctx__sub_release(ctx_t *ctx, int id)
+{
+	sub_handler_t *h = &ctx->subs[id - 1];
+
+	luaL_unref(ctx->L, LUA_REGISTRYINDEX, h->ref);
+	free(h->filter);
+	h->ref = LUA_NOREF;
+	h->filter = NULL;
+}
+
+static int ctx__sub_find(ctx_t *ctx, const char *filter)
+{
+	for (int i = 0; i < ctx->nsubs; i++) {
+		if (ctx->subs[i].filter && strcmp(ctx->subs[i].filter, filter) == 0)
+			return i + 1;
+	}
+	return 0;
+}
+
+/* bind the function at index to a fresh subscription identifier, 0 on failure */
+static int ctx__sub_add(lua_State *L, ctx_t *ctx, const char *filter, int index)
+{
+	sub_handler_t *subs;
+	int i, id = 0;
+
+	/* the broker replaces the subscription, and with it the identifier */
+	i = ctx__sub_find(ctx, filter);
+	if (i)
+		ctx__sub_release(ctx, i);
+
+	for (i = 0; i < ctx->nsubs; i++) {
+		if (ctx->subs[i].filter == NULL) {
+			id = i + 1;
+			break;
+		}
+	}
+	if (id == 0) {
+		if (ctx->nsubs >= SUB_ID_MAX)
+			return 0;
+		subs = realloc(ctx->subs, (ctx->nsubs + 1) * sizeof(sub_handler_t));
+		if (subs == NULL)
+			return 0;
+		ctx->subs = subs;
+		id = ++ctx->nsubs;
+	}
+
+	ctx->subs[id - 1].filter = strdup(filter);
+	if (ctx->subs[id - 1].filter == NULL)
+		return 0;
+	lua_pushvalue(L, index);
+	ctx->subs[id - 1].ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	return id;
 }
 
 /***
@@ -276,6 +680,39 @@ static int mosq_new(lua_State *L)
 	ctx->L = L;
 	ctx__on_init(ctx);
 
+	memset(&ctx->io, 0, sizeof(ctx_io_t));
+	ctx->io.ref = LUA_NOREF;
+	ctx->io.fd = -1;
+	pthread_mutex_init(&ctx->io.lock, NULL);
+	pthread_rwlock_init(&ctx->record_lock, NULL);
+	memset(&ctx->loop, 0, sizeof(ctx_loop_t));
+	ctx->loop.wake[0] = ctx->loop.wake[1] = -1;
+	ctx->publisher = NULL;
+	ctx->spool = NULL;
+	ctx->offline = NULL;
+	ctx->bulk = NULL;
+	ctx->conflate = NULL;
+	ctx->ratelimit = NULL;
+	ctx->timers = NULL;
+	ctx->rpc = NULL;
+	ctx->dedup = NULL;
+	ctx->shed = NULL;
+	ctx->stream_tx = NULL;
+	ctx->stream_credit = NULL;
+	ctx->stream_rx = NULL;
+	ctx->recorder = NULL;
+	ctx->replay = NULL;
+	ctx->native = NULL;
+	ctx->ffi = NULL;
+	ctx->intern = NULL;
+	ctx->native_msg = NULL;
+	ctx->drop_msg = NULL;
+	ctx->auto_sub = NULL;
+	ctx->auto_sub_qos = 0;
+	ctx->drop_expired = false;
+	ctx->expiry_skew = 0;
+	memset(&ctx->stats, 0, sizeof(ctx_stats_t));
+
 	luaL_getmetatable(L, MOSQ_META_CTX);
 	lua_setmetatable(L, -2);
 
@@ -307,7 +744,91 @@ static ctx_t * ctx_check(lua_State *L, int i)
 static int ctx_destroy(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
+
+	/* the I/O thread must let go of the client before it's gone */
+	ctx__io_detach(ctx);
+	ctx__loop_stop(ctx, true);
+	if (ctx->loop.wake[0] >= 0) {
+		close(ctx->loop.wake[0]);
+		close(ctx->loop.wake[1]);
+		ctx->loop.wake[0] = ctx->loop.wake[1] = -1;
+	}
+	if (ctx->publisher) {
+		publisher__close(ctx->publisher);
+		ctx->publisher = NULL;
+	}
 	mosquitto_destroy(ctx->mosq);
+	ctx->mosq = NULL;
+	if (ctx->spool) {
+		spool__close(ctx->spool);
+		ctx->spool = NULL;
+	}
+	if (ctx->offline) {
+		offline__free(ctx->offline);
+		ctx->offline = NULL;
+	}
+	if (ctx->bulk) {
+		bulk__free(ctx->bulk);
+		ctx->bulk = NULL;
+	}
+	if (ctx->conflate) {
+		conflate__free(ctx->conflate);
+		ctx->conflate = NULL;
+	}
+	if (ctx->ratelimit) {
+		ratelimit__free(ctx->ratelimit);
+		ctx->ratelimit = NULL;
+	}
+	if (ctx->timers) {
+		timers__free(ctx->L, ctx->timers);
+		ctx->timers = NULL;
+	}
+	if (ctx->rpc) {
+		rpc__free(ctx->L, ctx->rpc);
+		ctx->rpc = NULL;
+	}
+	if (ctx->dedup) {
+		dedup__free(ctx->dedup);
+		ctx->dedup = NULL;
+	}
+	if (ctx->shed) {
+		shed__free(ctx->shed);
+		ctx->shed = NULL;
+	}
+	if (ctx->stream_tx)
+		stream_tx__free_all(ctx);
+	if (ctx->stream_credit) {
+		stream_credit__free(ctx->stream_credit);
+		ctx->stream_credit = NULL;
+	}
+	if (ctx->stream_rx) {
+		stream_rx__free(ctx->L, ctx->stream_rx);
+		ctx->stream_rx = NULL;
+	}
+	if (ctx->recorder) {
+		recorder__close(ctx->recorder);
+		ctx->recorder = NULL;
+	}
+	if (ctx->replay) {
+		replay__free(ctx->L, ctx->replay);
+		ctx->replay = NULL;
+	}
+	if (ctx->native) {
+		native__free(ctx->native);
+		ctx->native = NULL;
+	}
+	if (ctx->ffi) {
+		ffi__free(ctx->ffi);
+		ctx->ffi = NULL;
+	}
+	if (ctx->intern) {
+		intern__free(ctx->L, ctx->intern);
+		ctx->intern = NULL;
+	}
+	pthread_mutex_destroy(&ctx->io.lock);
+	pthread_rwlock_destroy(&ctx->record_lock);
+	free(ctx->auto_sub);
+	ctx->auto_sub = NULL;
 
 	/* clean up Lua callback functions in the registry */
 	ctx__on_clear(ctx);
@@ -342,12 +863,37 @@ static int ctx_reinitialise(lua_State *L)
 		return luaL_argerror(L, 3, "if 'id' is nil then 'clean session' must be true");
 	}
 
+	ctx__io_detach(ctx);
 	int rc = mosquitto_reinitialise(ctx->mosq, id, clean_session, ctx);
 
 	/* clean up Lua callback functions in the registry */
 	ctx__on_clear(ctx);
 	ctx__on_init(ctx);
 
+	/* whatever libmosquitto had in flight is gone with the old session */
+	if (rc == MOSQ_ERR_SUCCESS && ctx->spool) {
+		mosquitto_publish_callback_set(ctx->mosq, ctx_on_publish);
+		spool__replay(ctx);
+	}
+	if (rc == MOSQ_ERR_SUCCESS && ctx->offline)
+		mosquitto_connect_callback_set(ctx->mosq, ctx_on_connect);
+	if (rc == MOSQ_ERR_SUCCESS && ctx->bulk) {
+		mosquitto_publish_callback_set(ctx->mosq, ctx_on_publish);
+		bulk__reset(ctx->bulk);
+	}
+	if (rc == MOSQ_ERR_SUCCESS && ctx->stream_credit) {
+		mosquitto_publish_callback_set(ctx->mosq, ctx_on_publish);
+		stream_credit__reset(ctx->stream_credit);
+	}
+	if (rc == MOSQ_ERR_SUCCESS && ctx->rpc) {
+		mosquitto_connect_callback_set(ctx->mosq, ctx_on_connect);
+		ctx__message_v5_enable(ctx);
+	}
+	if (rc == MOSQ_ERR_SUCCESS && (ctx->stream_rx || ctx->recorder || ctx->ffi))
+		ctx__message_v5_enable(ctx);
+	if (rc == MOSQ_ERR_SUCCESS && ctx->native)
+		native__enable(ctx);
+
 	return mosq__pstatus(L, rc);
 }
 
@@ -631,7 +1177,9 @@ static int ctx_connect(lua_State *L)
 	int port = luaL_optinteger(L, 3, 1883);
 	int keepalive = luaL_optinteger(L, 4, 60);
 
+	ctx->disconnecting = false;
 	int rc = mosquitto_connect(ctx->mosq, host, port, keepalive);
+	ctx__io_kick(ctx, true);
 	return mosq__pstatus(L, rc);
 }
 
@@ -667,7 +1215,9 @@ static int ctx_connect_bind_v5(lua_State *L)
 		}
 	}
 
+	ctx->disconnecting = false;
 	rc = mosquitto_connect_bind_v5(ctx->mosq, host, port, keepalive, bind_address, proplist);
+	ctx__io_kick(ctx, true);
 	mosquitto_property_free_all(&proplist);
 	return mosq__pstatus(L, rc);
 }
@@ -692,7 +1242,9 @@ static int ctx_connect_async(lua_State *L)
 	int port = luaL_optinteger(L, 3, 1883);
 	int keepalive = luaL_optinteger(L, 4, 60);
 
+	ctx->disconnecting = false;
 	int rc =  mosquitto_connect_async(ctx->mosq, host, port, keepalive);
+	ctx__io_kick(ctx, true);
 	return mosq__pstatus(L, rc);
 }
 
@@ -709,7 +1261,9 @@ static int ctx_reconnect(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
 
+	ctx->disconnecting = false;
 	int rc = mosquitto_reconnect(ctx->mosq);
+	ctx__io_kick(ctx, true);
 	return mosq__pstatus(L, rc);
 }
 
@@ -726,7 +1280,9 @@ static int ctx_reconnect_async(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
 
+	ctx->disconnecting = false;
 	int rc = mosquitto_reconnect_async(ctx->mosq);
+	ctx__io_kick(ctx, true);
 	return mosq__pstatus(L, rc);
 }
 
@@ -743,7 +1299,9 @@ static int ctx_disconnect(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
 
+	ctx->disconnecting = true;
 	int rc = mosquitto_disconnect(ctx->mosq);
+	ctx__io_kick(ctx, false);
 	return mosq__pstatus(L, rc);
 }
 
@@ -772,22 +1330,99 @@ static int ctx_disconnect_v5(lua_State *L)
 		}
 	}
 
+	ctx->disconnecting = true;
 	rc = mosquitto_disconnect_v5(ctx->mosq, reason_code, proplist);
+	ctx__io_kick(ctx, false);
 	mosquitto_property_free_all(&proplist);
 	return mosq__pstatus(L, rc);
 }
 
+/* straight to libmosquitto, through the spool for QoS>0 */
+static int ctx__publish_now(ctx_t *ctx, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *props)
+{
+	if (ctx->spool && qos > 0)
+		return spool__publish(ctx, mid, topic, payloadlen, payload, qos, retain, props);
+
+	return mosquitto_publish_v5(ctx->mosq, mid, topic, payloadlen, payload, qos, retain, props);
+}
+
+/* past the rate limits, through the offline buffer */
+static int ctx__publish_send(ctx_t *ctx, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *props, int priority)
+{
+	bool queued = false;
+	int rc;
+
+	/* buffered messages go first, control traffic jumps the queue */
+	if (ctx->offline && qos == 0 && priority != PRIORITY_CONTROL && offline__pending(ctx->offline)) {
+		offline__flush(ctx);
+		queued = offline__pending(ctx->offline);
+	}
+
+	if (!queued) {
+		rc = ctx__publish_now(ctx, mid, topic, payloadlen, payload, qos, retain, props);
+		if (rc != MOSQ_ERR_NO_CONN || ctx->offline == NULL)
+			return rc;
+	}
+
+	offline__buffer(ctx->offline, !queued, topic, payloadlen, payload, qos, retain, props);
+	if (mid)
+		*mid = 0;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* past conflation, through the rate limits, for messages it mustn't replace */
+static int ctx__publish_limited(ctx_t *ctx, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *props, int priority)
+{
+	int rc;
+
+	if (ctx->ratelimit) {
+		ratelimit__drain(ctx);
+		if (!ratelimit__admit(ctx, &rc, mid, topic, payloadlen, payload, qos, retain, props, priority))
+			return rc;
+	}
+
+	return ctx__publish_send(ctx, mid, topic, payloadlen, payload, qos, retain, props, priority);
+}
+
+/* every publish from the bindings goes through here */
+static int ctx__publish(ctx_t *ctx, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *props, int priority)
+{
+	if (priority == PRIORITY_BULK)
+		return bulk__push(ctx, mid, topic, payloadlen, payload, qos, retain, props);
+
+	if (ctx->conflate && priority == PRIORITY_NORMAL) {
+		/* loop_start users have no loop to flush from */
+		conflate__flush(ctx, false);
+		if (conflate__take(ctx->conflate, topic, payloadlen, payload, qos, retain, props)) {
+			if (mid)
+				*mid = 0;
+			return MOSQ_ERR_SUCCESS;
+		}
+	}
+
+	return ctx__publish_limited(ctx, mid, topic, payloadlen, payload, qos, retain, props, priority);
+}
+
+static int opt__priority(lua_State *L, int index)
+{
+	lua_Integer priority = luaL_optinteger(L, index, PRIORITY_NORMAL);
+
+	luaL_argcheck(L, priority >= PRIORITY_CONTROL && priority <= PRIORITY_BULK, index, "not a priority class");
+	return priority;
+}
+
 /***
  * Publish a message
  * @function publish
  * @tparam string topic
- * @tparam string payload (may be nil)
+ * @tparam string|buffer payload (may be nil)
  * @tparam[opt=0] number qos 0, 1 or 2
  * @tparam[opt=nil] boolean retain flag
- * @tparam[opt=nil] table properties
+ * @tparam[opt=PRIORITY_NORMAL] number priority PRIORITY_CONTROL, PRIORITY_NORMAL
+ *   or PRIORITY_BULK, bulk messages wait in their own queue, see bulk_options
  * @return 
  * @see mosquitto_publish
- * @treturn[1] number MID can be used for correlation with callbacks
+ * @treturn[1] number MID can be used for correlation with callbacks, 0 when queued
  * @return[2] nil
  * @treturn[2] number error code
  * @treturn[2] string error description.
@@ -803,7 +1438,9 @@ static int ctx_publish(lua_State *L)
 	bool retain;
 
 	parse_basic_parameter_for_publish(L, &topic, &payload, &payloadlen, &qos, &retain);
-	int rc = mosquitto_publish(ctx->mosq, &mid, topic, payloadlen, payload, qos, retain);
+	int priority = opt__priority(L, 6);
+	int rc = ctx__publish(ctx, &mid, topic, payloadlen, payload, qos, retain, NULL, priority);
+	ctx__io_kick(ctx, false);
 
 	if (rc != MOSQ_ERR_SUCCESS) {
 		return mosq__pstatus(L, rc);
@@ -817,13 +1454,14 @@ static int ctx_publish(lua_State *L)
  * Publish a message with v5 properties 
  * @function publish_v5
  * @tparam string topic
- * @tparam string payload (may be nil)
+ * @tparam string|buffer payload (may be nil)
  * @tparam[opt=0] number qos 0, 1 or 2
  * @tparam[opt=nil] boolean retain flag
  * @tparam[opt=nil] table properties
+ * @tparam[opt=PRIORITY_NORMAL] number priority as for publish
  * @return 
  * @see mosquitto_publish_v5
- * @treturn[1] number MID can be used for correlation with callbacks
+ * @treturn[1] number MID can be used for correlation with callbacks, 0 when queued
  * @return[2] nil
  * @treturn[2] number error code
  * @treturn[2] string error description.
@@ -840,6 +1478,7 @@ static int ctx_publish_v5(lua_State *L)
 	mosquitto_property *proplist = NULL;
 
 	parse_basic_parameter_for_publish(L, &topic, &payload, &payloadlen, &qos, &retain);
+	int priority = opt__priority(L, 7);
 
 	if (lua_table_on_stack(L, 6)) {
 		rc = create_property_list_from_lua_stack(L, 6, &proplist, CMD_PUBLISH);
@@ -848,7 +1487,8 @@ static int ctx_publish_v5(lua_State *L)
 		}
 	}
 
-	rc = mosquitto_publish_v5(ctx->mosq, &mid, topic, payloadlen, payload, qos, retain, proplist);
+	rc = ctx__publish(ctx, &mid, topic, payloadlen, payload, qos, retain, proplist, priority);
+	ctx__io_kick(ctx, false);
 	mosquitto_property_free_all(&proplist);
 
 	if (rc != MOSQ_ERR_SUCCESS) {
@@ -879,6 +1519,7 @@ static int ctx_subscribe(lua_State *L)
 	int qos = luaL_optinteger(L, 3, 0);
 
 	int rc = mosquitto_subscribe(ctx->mosq, &mid, sub, qos);
+	ctx__io_kick(ctx, false);
 
 	if (rc != MOSQ_ERR_SUCCESS) {
 		return mosq__pstatus(L, rc);
@@ -890,11 +1531,15 @@ static int ctx_subscribe(lua_State *L)
 
 /***
  * Subscribe to a topic with v5 properties
+ * When a handler is given, the subscription gets a subscription-identifier
+ * assigned and matching messages are passed straight to the handler, called
+ * like ON_MESSAGE_V5, instead of the ON_MESSAGE_V5 callback.
  * @function subscribe_v5
  * @tparam string topic eg "blah/+/json/#"
  * @tparam[opt=0] number qos 0, 1 or 2
  * @tparam[opt=0] number option
  * @tparam[opt=nil] table properties
+ * @tparam[opt=nil] function handler
  * @treturn[1] number MID can be used for correlation with callbacks
  * @return[2] nil
  * @treturn[2] number error code
@@ -912,6 +1557,11 @@ static int ctx_subscribe_v5(lua_State *L)
 	const char *sub = luaL_checkstring(L, 2);
 	int qos = luaL_optinteger(L, 3, 0);
 	int options = luaL_optinteger(L, 4, 0);
+	uint32_t id = 0;
+
+	if (!lua_isnoneornil(L, 6)) {
+		luaL_checktype(L, 6, LUA_TFUNCTION);
+	}
 
 	if (lua_table_on_stack(L, 5)) {
 		rc = create_property_list_from_lua_stack(L, 5, &proplist, CMD_SUBSCRIBE);
@@ -920,9 +1570,30 @@ static int ctx_subscribe_v5(lua_State *L)
 		}
 	} 	
 
+	if (lua_isfunction(L, 6)) {
+		if (mosquitto_property_read_varint(proplist, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, &id, false)) {
+			mosquitto_property_free_all(&proplist);
+			return luaL_argerror(L, 5, "subscription-identifier is assigned for subscriptions with a handler");
+		}
+		id = ctx__sub_add(L, ctx, sub, 6);
+		if (id == 0 || mosquitto_property_add_varint(&proplist, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, id) != MOSQ_ERR_SUCCESS) {
+			if (id)
+				ctx__sub_release(ctx, id);
+			mosquitto_property_free_all(&proplist);
+			return mosq__pstatus(L, MOSQ_ERR_NOMEM);
+		}
+		if (!ctx->message_v5_set)
+			ctx__message_v5_enable(ctx);
+	}
+
 	rc = mosquitto_subscribe_v5(ctx->mosq, &mid, sub, qos, options, proplist);
+	ctx__io_kick(ctx, false);
 	mosquitto_property_free_all(&proplist);
 
+	if (rc != MOSQ_ERR_SUCCESS && id) {
+		ctx__sub_release(ctx, id);
+	}
+
 	if (rc != MOSQ_ERR_SUCCESS) {
 		return mosq__pstatus(L, rc);
 	} else {
@@ -949,6 +1620,11 @@ static int ctx_unsubscribe(lua_State *L)
 	const char *sub = luaL_checkstring(L, 2);
 
 	int rc = mosquitto_unsubscribe(ctx->mosq, &mid, sub);
+	ctx__io_kick(ctx, false);
+
+	int id = ctx__sub_find(ctx, sub);
+	if (rc == MOSQ_ERR_SUCCESS && id)
+		ctx__sub_release(ctx, id);
 
 	if (rc != MOSQ_ERR_SUCCESS) {
 		return mosq__pstatus(L, rc);
@@ -984,7 +1660,13 @@ static int ctx_unsubscribe_v5(lua_State *L){
 	}
 
 	rc = mosquitto_unsubscribe_v5(ctx->mosq, &mid, sub, proplist);
+	ctx__io_kick(ctx, false);
 	mosquitto_property_free_all(&proplist);	
+
+	int id = ctx__sub_find(ctx, sub);
+	if (rc == MOSQ_ERR_SUCCESS && id)
+		ctx__sub_release(ctx, id);
+
 	if (rc != MOSQ_ERR_SUCCESS) {
 		return mosq__pstatus(L, rc);
 	} else {
@@ -993,16 +1675,108 @@ static int ctx_unsubscribe_v5(lua_State *L){
 	}
 }
 
+/* true if the bindings have C side work that must be serviced from the loop */
+static bool ctx__has_service(ctx_t *ctx)
+{
+	return ctx->pool != NULL || ctx->publisher != NULL || ctx->spool != NULL ||
+		ctx->offline != NULL || ctx->bulk != NULL || ctx->conflate != NULL ||
+		ctx->ratelimit != NULL || ctx->timers != NULL || ctx->rpc != NULL ||
+		ctx->stream_tx != NULL || ctx->stream_rx != NULL ||
+		ctx->recorder != NULL || ctx->replay != NULL;
+}
+
+static int ctx__loop_timeout(ctx_t *ctx, int timeout)
+{
+	uint64_t next;
+
+	if (!ctx__has_service(ctx))
+		return timeout;
+
+	if (timeout < 0 || timeout > CTX_SERVICE_INTERVAL)
+		timeout = CTX_SERVICE_INTERVAL;
+
+	/* wake up in time for the next timer */
+	if (ctx->timers) {
+		next = timers__next(ctx->timers, mosq__now_ms());
+		if (next < (uint64_t) timeout)
+			timeout = next;
+	}
+	if (ctx->replay) {
+		next = replay__wait(ctx->replay, mosq__now_ms());
+		if (next < (uint64_t) timeout)
+			timeout = next;
+	}
+
+	return timeout;
+}
+
+/* errors mosquitto_loop_forever gives up on rather than reconnect */
+static bool ctx__loop_fatal(int rc)
+{
+	switch (rc) {
+		case MOSQ_ERR_NOMEM:
+		case MOSQ_ERR_PROTOCOL:
+		case MOSQ_ERR_INVAL:
+		case MOSQ_ERR_NOT_FOUND:
+		case MOSQ_ERR_TLS:
+		case MOSQ_ERR_PAYLOAD_SIZE:
+		case MOSQ_ERR_NOT_SUPPORTED:
+		case MOSQ_ERR_AUTH:
+		case MOSQ_ERR_ACL_DENIED:
+		case MOSQ_ERR_UNKNOWN:
+		case MOSQ_ERR_EAI:
+		case MOSQ_ERR_PROXY:
+			return true;
+		case MOSQ_ERR_ERRNO:
+			return errno == EPROTO;
+	}
+	return false;
+}
+
+/*
+ * Same as mosquitto_loop_forever, but gives the bindings a chance to service
+ * their own queues between network iterations.
+ */
+static int ctx__loop_forever(ctx_t *ctx, int timeout, int max_packets)
+{
+	int rc;
+
+	for (;;) {
+		do {
+			rc = mosquitto_loop(ctx->mosq, ctx__loop_timeout(ctx, timeout), max_packets);
+			ctx__service(ctx);
+		} while (rc == MOSQ_ERR_SUCCESS);
+
+		if (ctx__loop_fatal(rc))
+			return rc;
+
+		if (ctx->disconnecting)
+			return rc;
+
+		/* libmosquitto's default reconnect delay */
+		sleep(1);
+		ctx__service(ctx);
+		if (ctx->disconnecting)
+			return rc;
+		mosquitto_reconnect(ctx->mosq);
+	}
+}
+
 static int mosq_loop(lua_State *L, bool forever)
 {
 	ctx_t *ctx = ctx_check(L, 1);
 	int timeout = luaL_optinteger(L, 2, -1);
 	int max_packets = luaL_optinteger(L, 3, 1);
 	int rc;
+	/*
+	 * Always our own loop, the features needing service can be enabled
+	 * from callbacks while it runs. ctx__loop_timeout checks each time.
+	 */
 	if (forever) {
-		rc = mosquitto_loop_forever(ctx->mosq, timeout, max_packets);
+		rc = ctx__loop_forever(ctx, timeout, max_packets);
 	} else {
-		rc = mosquitto_loop(ctx->mosq, timeout, max_packets);
+		rc = mosquitto_loop(ctx->mosq, ctx__loop_timeout(ctx, timeout), max_packets);
+		ctx__service(ctx);
 	}
 	return mosq__pstatus(L, rc);
 }
@@ -1041,8 +1815,94 @@ static int ctx_loop_forever(lua_State *L)
 	return mosq_loop(L, true);
 }
 
+/* wake the loop_start thread, from any thread */
+static void ctx__loop_wake(ctx_t *ctx)
+{
+	ssize_t rc;
+
+	/* the pipe stays open until the client is destroyed */
+	if (!__atomic_load_n(&ctx->loop.running, __ATOMIC_ACQUIRE))
+		return;
+	rc = write(ctx->loop.wake[1], "", 1);
+	(void) rc;
+}
+
+/* wait up to timeout ms for traffic or a wake up */
+static void ctx__loop_wait(ctx_t *ctx, int timeout)
+{
+	struct pollfd fds[2];
+	char drain[64];
+	int n = 1;
+
+	fds[0].fd = ctx->loop.wake[0];
+	fds[0].events = POLLIN;
+	fds[1].fd = mosquitto_socket(ctx->mosq);
+	if (fds[1].fd >= 0) {
+		fds[1].events = POLLIN | (mosquitto_want_write(ctx->mosq) ? POLLOUT : 0);
+		n = 2;
+	}
+	if (poll(fds, n, timeout) > 0 && (fds[0].revents & POLLIN)) {
+		while (read(ctx->loop.wake[0], drain, sizeof(drain)) > 0)
+			;
+	}
+}
+
+/*
+ * The loop_start thread. Same as mosquitto_loop_forever, ending after a
+ * disconnect, but waits in poll so publishes through ctx__io_kick wake it,
+ * and drains the publisher handles. The rest of ctx__service needs the Lua
+ * thread.
+ */
+static void *ctx__loop_main(void *arg)
+{
+	ctx_t *ctx = arg;
+	bool more = false;
+	int rc;
+
+	while (!__atomic_load_n(&ctx->loop.stopping, __ATOMIC_ACQUIRE)) {
+		/* keepalives are due once a second at the most often */
+		if (!more)
+			ctx__loop_wait(ctx, 1000);
+		rc = mosquitto_loop(ctx->mosq, 0, 1);
+		more = ctx__publisher_drain(ctx);
+		if (rc == MOSQ_ERR_SUCCESS)
+			continue;
+		if (ctx__loop_fatal(rc) || __atomic_load_n(&ctx->disconnecting, __ATOMIC_ACQUIRE))
+			break;
+
+		/* libmosquitto's default reconnect delay, nothing to reconnect to before a connect */
+		more = false;
+		ctx__loop_wait(ctx, 1000);
+		if (!__atomic_load_n(&ctx->disconnecting, __ATOMIC_ACQUIRE) &&
+				!__atomic_load_n(&ctx->loop.stopping, __ATOMIC_ACQUIRE))
+			mosquitto_reconnect(ctx->mosq);
+	}
+	return NULL;
+}
+
+/* force stops the thread after its current iteration, else waits for a disconnect */
+static void ctx__loop_stop(ctx_t *ctx, bool force)
+{
+	if (!ctx->loop.running)
+		return;
+
+	if (force)
+		__atomic_store_n(&ctx->loop.stopping, true, __ATOMIC_RELEASE);
+	ctx__loop_wake(ctx);
+	pthread_join(ctx->loop.thread, NULL);
+	if (ctx->publisher)
+		publisher__wake_set(ctx->publisher, ctx->io.thread != NULL);
+	if (ctx->io.thread == NULL)
+		mosquitto_threaded_set(ctx->mosq, false);
+	__atomic_store_n(&ctx->loop.running, false, __ATOMIC_RELEASE);
+	ctx->loop.stopping = false;
+}
+
 /***
- * Start a loop thread
+ * Start a loop thread. Unlike mosquitto_loop_start, the thread is the
+ * bindings' own: it also publishes what was queued through publisher
+ * handles, and is woken up as soon as something is. Like it, the client is
+ * put in threaded mode and the thread ends by itself after disconnect.
  * @function loop_start
  * @see mosquitto_loop_start
  * @return[1] boolean true
@@ -1054,14 +1914,43 @@ static int ctx_loop_forever(lua_State *L)
 static int ctx_loop_start(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
+	int i, rc;
 
-	int rc = mosquitto_loop_start(ctx->mosq);
-	return mosq__pstatus(L, rc);
+	if (ctx->loop.running || ctx->io.thread)
+		return mosq__pstatus(L, MOSQ_ERR_INVAL);
+
+	if (ctx->loop.wake[0] < 0) {
+		if (pipe(ctx->loop.wake) < 0)
+			return mosq__pstatus(L, MOSQ_ERR_ERRNO);
+		for (i = 0; i < 2; i++) {
+			fcntl(ctx->loop.wake[i], F_SETFL, fcntl(ctx->loop.wake[i], F_GETFL) | O_NONBLOCK);
+			fcntl(ctx->loop.wake[i], F_SETFD, FD_CLOEXEC);
+		}
+	}
+
+	/* publishes from other threads only queue their packets for the loop */
+	mosquitto_threaded_set(ctx->mosq, true);
+	__atomic_store_n(&ctx->loop.running, true, __ATOMIC_RELEASE);
+	rc = pthread_create(&ctx->loop.thread, NULL, ctx__loop_main, ctx);
+	if (rc != 0) {
+		__atomic_store_n(&ctx->loop.running, false, __ATOMIC_RELEASE);
+		mosquitto_threaded_set(ctx->mosq, false);
+		errno = rc;
+		return mosq__pstatus(L, MOSQ_ERR_ERRNO);
+	}
+	if (ctx->publisher)
+		publisher__wake_set(ctx->publisher, true);
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
 }
 
 /***
- * Stop an existing loop thread
+ * Stop an existing loop thread. As with mosquitto_loop_stop, without force
+ * this waits for the thread to end after disconnect. Compatibility note:
+ * force lets the thread finish its current iteration instead of cancelling
+ * it, callbacks running in it complete.
  * @function loop_stop
+ * @tparam[opt=false] boolean force stop the thread without waiting for a
+ * disconnect
  * @see mosquitto_loop_stop
  * @return[1] boolean true
  * @return[2] nil
@@ -1072,10 +1961,13 @@ static int ctx_loop_start(lua_State *L)
 static int ctx_loop_stop(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
+
 	bool force = lua_toboolean(L, 2);
 
-	int rc = mosquitto_loop_stop(ctx->mosq, force);
-	return mosq__pstatus(L, rc);
+	if (!ctx->loop.running)
+		return mosq__pstatus(L, MOSQ_ERR_INVAL);
+	ctx__loop_stop(ctx, force);
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
 }
 
 /***
@@ -1157,6 +2049,7 @@ static int ctx_loop_misc(lua_State *L)
 	ctx_t *ctx = ctx_check(L, 1);
 
 	int rc = mosquitto_loop_misc(ctx->mosq);
+	ctx__service(ctx);
 	return mosq__pstatus(L, rc);
 }
 
@@ -1174,15 +2067,115 @@ static int ctx_want_write(lua_State *L)
 	return 1;
 }
 
-static void ctx_on_connect(
-	struct mosquitto *mosq,
-	void *obj,
-	int rc)
+/***
+ * Client statistics
+ * @function stats
+ * @treturn table with the fields messages (messages received) and expired
+ *   (dropped by drop_expired), and with a
+ *   spool open spooled (unacknowledged), spool_bytes, spool_written,
+ *   spool_acked, spool_replayed, spool_syncs and spool_compactions, with an
+ *   offline buffer offline_buffered, offline_bytes, offline_dropped,
+ *   offline_replaced and offline_flushed, after bulk publishes bulk_queued,
+ *   bulk_inflight, bulk_fed and bulk_dropped, when conflating
+ *   conflate_pending, conflate_replaced and conflate_flushed, with rate
+ *   limits rate_passed, rate_rejected, rate_queued, rate_delayed and
+ *   rate_delay_ms, with timers timers, timers_fired and timer_errors, with
+ *   requests rpc_pending, rpc_requests, rpc_replies, rpc_timeouts and
+ *   rpc_unmatched, with duplicate suppression dedup_window and dedup_dropped,
+ *   with load shedding shedding, shed_dropped, shed_episodes and inbound_lag,
+ *   with streams streams_out and streams_inflight, and when receiving streams_in,
+ *   streams_completed, streams_expired, streams_invalid and streams_bytes,
+ *   when recording recorded, recorded_bytes and record_failed, during a
+ *   replay replayed, replay_errors and replay_progress, with C handlers
+ *   native_handlers, native_handled (messages they consumed), rules_matched,
+ *   rules_published and rules_failed, when bound
+ *   with mosquitto.ffi ffi_queued, ffi_dropped, ffi_overflow and ffi_pending, when
+ *   interning topics intern_topics, intern_hits, intern_misses and
+ *   intern_evictions
+ */
+static int ctx_stats(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	lua_newtable(L);
+	lua_pushinteger(L, __atomic_load_n(&ctx->stats.messages, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "messages");
+	lua_pushinteger(L, __atomic_load_n(&ctx->stats.expired, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "expired");
+	if (ctx->spool)
+		spool__stats(L, ctx->spool);
+	if (ctx->offline)
+		offline__stats(L, ctx->offline);
+	if (ctx->bulk)
+		bulk__stats(L, ctx->bulk);
+	if (ctx->conflate)
+		conflate__stats(L, ctx->conflate);
+	if (ctx->ratelimit)
+		ratelimit__stats(L, ctx->ratelimit);
+	if (ctx->timers)
+		timers__stats(L, ctx->timers);
+	if (ctx->rpc)
+		rpc__stats(L, ctx->rpc);
+	if (ctx->dedup)
+		dedup__stats(L, ctx->dedup);
+	if (ctx->shed)
+		shed__stats(L, ctx->shed);
+	if (ctx->stream_tx || ctx->stream_rx)
+		stream__stats(L, ctx);
+	if (ctx->recorder)
+		recorder__stats(L, ctx->recorder);
+	if (ctx->replay)
+		replay__stats(L, ctx->replay);
+	if (ctx->native) {
+		native__stats(L, ctx->native);
+		lua_pushinteger(L, __atomic_load_n(&ctx->stats.rules_matched, __ATOMIC_RELAXED));
+		lua_setfield(L, -2, "rules_matched");
+		lua_pushinteger(L, __atomic_load_n(&ctx->stats.rules_published, __ATOMIC_RELAXED));
+		lua_setfield(L, -2, "rules_published");
+		lua_pushinteger(L, __atomic_load_n(&ctx->stats.rules_failed, __ATOMIC_RELAXED));
+		lua_setfield(L, -2, "rules_failed");
+	}
+	if (ctx->ffi)
+		ffi__stats(L, ctx->ffi);
+	if (ctx->intern)
+		intern__stats(L, ctx->intern);
+	return 1;
+}
+
+/***
+ * Drop messages that expired before they reached Lua. A message is expired
+ * once its message-expiry-interval, counted from when the client received
+ * it, plus the skew has passed. That's checked when callbacks deferred by
+ * an I/O pool are taken off the queue, so a backlog of stale messages is
+ * skipped without calling Lua, and with a negative skew on receipt too. Applies to the v5 message
+ * callbacks, subscription handlers and responses to requests, messages
+ * without the property never expire.
+ * @function drop_expired
+ * @tparam[opt=0] number skew ms allowed past the expiry, negative to drop
+ * messages about to expire as well. false to stop dropping
+ * @return boolean true
+ */
+static int ctx_drop_expired(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	if (lua_isboolean(L, 2) && !lua_toboolean(L, 2)) {
+		ctx->drop_expired = false;
+		return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+	}
+	ctx->expiry_skew = luaL_optinteger(L, 2, 0);
+	ctx->drop_expired = true;
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+static void ctx__connect(ctx_t *ctx, int rc)
 {
-	ctx_t *ctx = obj;
 	bool success = rc == 0;
 	const char *str = mosquitto_connack_string(rc);
 
+	if (ctx->on_connect == LUA_REFNIL)
+		return;
+
 	lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->on_connect);
 
 	lua_pushboolean(ctx->L, success);
@@ -1192,17 +2185,42 @@ static void ctx_on_connect(
 	lua_call(ctx->L, 3, 0);
 }
 
-static void ctx_on_connect_v5(
+static void ctx_on_connect(
 	struct mosquitto *mosq,
 	void *obj,
-	int reason_code,
-	int flags,
-	const mosquitto_property *props)
+	int rc)
 {
 	ctx_t *ctx = obj;
+
+	/* (re)established from whichever thread runs the network side */
+	if (rc == 0 && ctx->auto_sub)
+		mosquitto_subscribe(ctx->mosq, NULL, ctx->auto_sub, ctx->auto_sub_qos);
+	if (rc == 0 && ctx->offline)
+		offline__online(ctx);
+	if (rc == 0 && ctx->bulk)
+		bulk__feed(ctx);
+	if (rc == 0 && ctx->rpc)
+		rpc__subscribe(ctx);
+
+	if (ctx->on_connect == LUA_REFNIL)
+		return;
+
+	if (ctx__io_deferred(ctx)) {
+		ctx__io_defer(ctx, ctx_event__new(CALLBACK_ON_CONNECT, rc, 0, NULL));
+		return;
+	}
+
+	ctx__connect(ctx, rc);
+}
+
+static void ctx__connect_v5(ctx_t *ctx, int reason_code, int flags, const mosquitto_property *props)
+{
 	bool success = reason_code == MQTT_RC_SUCCESS;
 	const char *str = mosquitto_reason_string(reason_code);
 
+	if (ctx->on_connect_v5 == LUA_REFNIL)
+		return;
+
 	lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->on_connect_v5);
 
 	lua_pushboolean(ctx->L, success);
@@ -1214,6 +2232,33 @@ static void ctx_on_connect_v5(
 	lua_call(ctx->L, 5, 0);
 }
 
+static void ctx_on_connect_v5(
+	struct mosquitto *mosq,
+	void *obj,
+	int reason_code,
+	int flags,
+	const mosquitto_property *props)
+{
+	ctx_t *ctx = obj;
+	ctx_event_t *ev;
+
+	if (ctx->native)
+		native__connect(ctx->native, reason_code, flags, props);
+
+	if (ctx->on_connect_v5 == LUA_REFNIL)
+		return;
+
+	if (ctx__io_deferred(ctx)) {
+		ev = ctx_event__new(CALLBACK_ON_CONNECT_V5, reason_code, 0, props);
+		if (ev)
+			ev->flags = flags;
+		ctx__io_defer(ctx, ev);
+		return;
+	}
+
+	ctx__connect_v5(ctx, reason_code, flags, props);
+}
+
 
 static void ctx_on_disconnect(
 	struct mosquitto *mosq,
@@ -1224,6 +2269,11 @@ static void ctx_on_disconnect(
 	bool success = true;
 	char *str = "client-initiated disconnect";
 
+	if (ctx__io_deferred(ctx)) {
+		ctx__io_defer(ctx, ctx_event__new(CALLBACK_ON_DISCONNECT, rc, 0, NULL));
+		return;
+	}
+
 	if (rc) {
 		success = false;
 		str = "unexpected disconnect";
@@ -1248,6 +2298,11 @@ static void ctx_on_disconnect_v5(
 	bool success = true;
 	char *str = "client-initiated disconnect";
 
+	if (ctx__io_deferred(ctx)) {
+		ctx__io_defer(ctx, ctx_event__new(CALLBACK_ON_DISCONNECT_V5, rc, 0, props));
+		return;
+	}
+
 	if (rc) {
 		success = false;
 		str = "unexpected disconnect";
@@ -1263,29 +2318,52 @@ static void ctx_on_disconnect_v5(
 	lua_call(ctx->L, 4, 0);
 }
 
-static void ctx_on_publish(
-	struct mosquitto *mosq,
-	void *obj,
-	int mid)
+static void ctx__published(ctx_t *ctx, int mid)
 {
-	ctx_t *ctx = obj;
+	if (ctx->on_publish == LUA_REFNIL)
+		return;
 
 	lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->on_publish);
 	lua_pushinteger(ctx->L, mid);
 	lua_call(ctx->L, 1, 0);
 }
 
-static void ctx_on_publish_v5(
+static void ctx_on_publish(
 	struct mosquitto *mosq,
 	void *obj,
-	int mid,
-	int reason_code,
-	const mosquitto_property *props)
+	int mid)
 {
 	ctx_t *ctx = obj;
-	const char *str = mosquitto_reason_string(reason_code);
 
-	lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->on_publish_v5);
+	/* also installed for the spool, the bulk queue and streams, from the network side */
+	if (ctx->spool)
+		spool__ack(ctx->spool, mid);
+	if (ctx->bulk) {
+		bulk__ack(ctx->bulk, mid);
+		bulk__feed(ctx);
+	}
+	if (ctx->stream_credit)
+		stream_credit__ack(ctx->stream_credit, mid);
+
+	if (ctx->on_publish == LUA_REFNIL)
+		return;
+
+	if (ctx__io_deferred(ctx)) {
+		ctx__io_defer(ctx, ctx_event__new(CALLBACK_ON_PUBLISH, 0, mid, NULL));
+		return;
+	}
+
+	ctx__published(ctx, mid);
+}
+
+static void ctx__published_v5(ctx_t *ctx, int mid, int reason_code, const mosquitto_property *props)
+{
+	const char *str = mosquitto_reason_string(reason_code);
+
+	if (ctx->on_publish_v5 == LUA_REFNIL)
+		return;
+
+	lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->on_publish_v5);
 	lua_pushinteger(ctx->L, mid);
 	lua_pushinteger(ctx->L, reason_code);
 	lua_pushstring(ctx->L, str);
@@ -1294,18 +2372,40 @@ static void ctx_on_publish_v5(
 	lua_call(ctx->L, 4, 0);
 }
 
-static void ctx_on_message(
+static void ctx_on_publish_v5(
 	struct mosquitto *mosq,
 	void *obj,
-	const struct mosquitto_message *msg)
+	int mid,
+	int reason_code,
+	const mosquitto_property *props)
 {
 	ctx_t *ctx = obj;
 
+	if (ctx->native)
+		native__publish(ctx->native, mid, reason_code, props);
+
+	if (ctx->on_publish_v5 == LUA_REFNIL)
+		return;
+
+	if (ctx__io_deferred(ctx)) {
+		ctx__io_defer(ctx, ctx_event__new(CALLBACK_ON_PUBLISH_V5, reason_code, mid, props));
+		return;
+	}
+
+	ctx__published_v5(ctx, mid, reason_code, props);
+}
+
+/* Lua side of an incoming message, runs on the Lua thread */
+static void ctx__message(ctx_t *ctx, const struct mosquitto_message *msg)
+{
+	if (ctx->on_message == LUA_REFNIL)
+		return;
+
 	/* push registered Lua callback function onto the stack */
 	lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->on_message);
 	/* push function args */
 	lua_pushinteger(ctx->L, msg->mid);
-	lua_pushstring(ctx->L, msg->topic);
+	ctx__push_topic(ctx, msg->topic);
 	lua_pushlstring(ctx->L, msg->payload, msg->payloadlen);
 	lua_pushinteger(ctx->L, msg->qos);
 	lua_pushboolean(ctx->L, msg->retain);
@@ -1313,19 +2413,77 @@ static void ctx_on_message(
 	lua_call(ctx->L, 5, 0); /* args: mid, topic, payload, qos, retain */
 }
 
-static void ctx_on_message_v5(
-	struct mosquitto *mosq,
-	void *obj,
-	const struct mosquitto_message *msg,
-	const mosquitto_property *props)
+/* call the handlers bound to the message's subscription identifiers, true if there were any */
+static bool ctx__message_sub_handlers(ctx_t *ctx, const struct mosquitto_message *msg, const mosquitto_property *props)
 {
-	ctx_t *ctx = obj;
+	const mosquitto_property *prop;
+	uint32_t id;
+	int called = 0;
+
+	prop = mosquitto_property_read_varint(props, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, &id, false);
+	for (; prop; prop = mosquitto_property_read_varint(prop, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, &id, true)) {
+		if (id == 0 || id > (uint32_t) ctx->nsubs || ctx->subs[id - 1].filter == NULL)
+			continue;
+
+		/* one property table shared by all handlers of this message */
+		if (called++ == 0)
+			create_lua_stack_from_property_list(ctx->L, props);
+
+		lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->subs[id - 1].ref);
+		lua_pushinteger(ctx->L, msg->mid);
+		ctx__push_topic(ctx, msg->topic);
+		lua_pushlstring(ctx->L, msg->payload, msg->payloadlen);
+		lua_pushinteger(ctx->L, msg->qos);
+		lua_pushboolean(ctx->L, msg->retain);
+		lua_pushvalue(ctx->L, -7);
+
+		lua_call(ctx->L, 6, 0); /* args: mid, topic, payload, qos, retain, properties */
+	}
+
+	if (called)
+		lua_pop(ctx->L, 1);
+	return called > 0;
+}
+
+/* true if the message expired, received is the mosq__now_ms of its arrival */
+static bool ctx__expired(ctx_t *ctx, const mosquitto_property *props, uint64_t received)
+{
+	uint32_t interval;
+	int64_t left;
+
+	if (!mosquitto_property_read_int32(props, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, &interval, false))
+		return false;
+
+	left = (int64_t) received + (int64_t) interval * 1000 + ctx->expiry_skew - (int64_t) mosq__now_ms();
+	if (left >= 0)
+		return false;
+	__atomic_add_fetch(&ctx->stats.expired, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+static void ctx__message_v5(ctx_t *ctx, const struct mosquitto_message *msg, const mosquitto_property *props)
+{
+	if (ctx->rpc && rpc__is_reply(ctx->rpc, msg->topic)) {
+		rpc__reply(ctx, msg, props);
+		return;
+	}
+
+	if (ctx->stream_rx && stream_rx__is_chunk(ctx->stream_rx, msg->topic)) {
+		stream_rx__chunk(ctx, msg, props);
+		return;
+	}
+
+	if (ctx->nsubs && ctx__message_sub_handlers(ctx, msg, props))
+		return;
+
+	if (ctx->on_message_v5 == LUA_REFNIL)
+		return;
 
 	/* push registered Lua callback function onto the stack */
 	lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->on_message_v5);
 	/* push function args */
 	lua_pushinteger(ctx->L, msg->mid);
-	lua_pushstring(ctx->L, msg->topic);
+	ctx__push_topic(ctx, msg->topic);
 	lua_pushlstring(ctx->L, msg->payload, msg->payloadlen);
 	lua_pushinteger(ctx->L, msg->qos);
 	lua_pushboolean(ctx->L, msg->retain);
@@ -1334,183 +2492,9459 @@ static void ctx_on_message_v5(
 	lua_call(ctx->L, 6, 0); /* args: mid, topic, payload, qos, retain, properties */
 }
 
-static void ctx_on_subscribe(
-	struct mosquitto *mosq,
-	void *obj,
-	int mid,
-	int qos_count,
-	const int *granted_qos)
+/* network side of the v3 callback, past the checks */
+static void ctx__on_message(ctx_t *ctx, const struct mosquitto_message *msg)
+{
+	ctx_event_t *ev;
+
+	/* queued for the FFI by the v5 callback */
+	if (ctx->ffi)
+		return;
+
+	if (ctx->pool) {
+		worker_pool__dispatch(ctx->pool, msg->topic, msg->payload, msg->payloadlen, msg->qos, msg->retain);
+		ctx__service(ctx);
+		return;
+	}
+
+	if (ctx->on_message == LUA_REFNIL)
+		return;
+
+	if (ctx__io_deferred(ctx)) {
+		ev = ctx_event__new(CALLBACK_ON_MESSAGE, 0, 0, NULL);
+		if (ev && mosquitto_message_copy(&ev->msg, msg) != MOSQ_ERR_SUCCESS) {
+			free(ev);
+			ev = NULL;
+		}
+		if (ev)
+			ev->received = mosq__now_ms();
+		ctx__io_defer(ctx, ev);
+		return;
+	}
+
+	ctx__message(ctx, msg);
+}
+
+static void ctx_on_message(
+	struct mosquitto *mosq,
+	void *obj,
+	const struct mosquitto_message *msg)
+{
+	ctx_t *ctx = obj;
+
+	/* counted by the v5 callback when that one is in use as well */
+	if (!ctx->message_v5_set)
+		__atomic_add_fetch(&ctx->stats.messages, 1, __ATOMIC_RELAXED);
+
+	/* responses to requests and stream chunks go to the v5 callback */
+	if (ctx->rpc && rpc__is_reply(ctx->rpc, msg->topic))
+		return;
+	if (ctx->stream_rx && stream_rx__is_chunk(ctx->stream_rx, msg->topic))
+		return;
+
+	/* C handlers come first, the v5 callback runs them and then this one */
+	if (ctx->native && ctx->message_v5_set) {
+		ctx->native_msg = msg;
+		return;
+	}
+
+	if ((ctx->dedup || ctx->shed) && ctx__drop(ctx, msg, NULL, false))
+		return;
+
+	ctx__on_message(ctx, msg);
+}
+
+static void ctx_on_message_v5(
+	struct mosquitto *mosq,
+	void *obj,
+	const struct mosquitto_message *msg,
+	const mosquitto_property *props)
+{
+	ctx_t *ctx = obj;
+	ctx_event_t *ev;
+	bool v3 = ctx->native_msg == msg;
+	bool internal;
+
+	ctx->native_msg = NULL;
+	__atomic_add_fetch(&ctx->stats.messages, 1, __ATOMIC_RELAXED);
+
+	if (ctx->recorder)
+		recorder__write(ctx, msg);
+
+	/* first, it takes over the verdict of the v3 callback */
+	if ((ctx->dedup || ctx->shed) && ctx__drop(ctx, msg, props, true))
+		return;
+
+	internal = (ctx->rpc && rpc__is_reply(ctx->rpc, msg->topic)) ||
+		(ctx->stream_rx && stream_rx__is_chunk(ctx->stream_rx, msg->topic));
+
+	if (ctx->native && !internal && native__message(ctx->native, msg, props))
+		return;
+	/* the v3 callback put itself behind the C handlers */
+	if (v3)
+		ctx__on_message(ctx, msg);
+
+	/* just received, only a negative skew can find it expired already */
+	if (ctx->drop_expired && ctx->expiry_skew < 0 && ctx__expired(ctx, props, mosq__now_ms()))
+		return;
+
+	if (ctx->ffi && !internal) {
+		ffi__push(ctx->ffi, msg);
+		return;
+	}
+
+	/* messages are handed to the worker pool by ctx_on_message */
+	if (ctx->pool && !internal)
+		return;
+	/* enabled for the C handlers only */
+	if (!internal && ctx->on_message_v5 == LUA_REFNIL && !ctx->nsubs)
+		return;
+
+	if (ctx__io_deferred(ctx)) {
+		ev = ctx_event__new(CALLBACK_ON_MESSAGE_V5, 0, 0, props);
+		if (ev && mosquitto_message_copy(&ev->msg, msg) != MOSQ_ERR_SUCCESS) {
+			mosquitto_property_free_all(&ev->props);
+			free(ev);
+			ev = NULL;
+		}
+		if (ev)
+			ev->received = mosq__now_ms();
+		ctx__io_defer(ctx, ev);
+		return;
+	}
+
+	ctx__message_v5(ctx, msg, props);
+}
+
+static void ctx_on_subscribe(
+	struct mosquitto *mosq,
+	void *obj,
+	int mid,
+	int qos_count,
+	const int *granted_qos)
+{
+	ctx_t *ctx = obj;
+	ctx_event_t *ev;
+	int i;
+
+	if (ctx__io_deferred(ctx)) {
+		ev = ctx_event__new(CALLBACK_ON_SUBSCRIBE, 0, mid, NULL);
+		if (ev && qos_count > 0) {
+			ev->granted_qos = malloc(qos_count * sizeof(int));
+			if (ev->granted_qos) {
+				memcpy(ev->granted_qos, granted_qos, qos_count * sizeof(int));
+				ev->qos_count = qos_count;
+			}
+		}
+		ctx__io_defer(ctx, ev);
+		return;
+	}
+
+	lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->on_subscribe);
+	lua_pushinteger(ctx->L, mid);
+
+	for (i = 0; i < qos_count; i++) {
+		lua_pushinteger(ctx->L, granted_qos[i]);
+	}
+
+	lua_call(ctx->L, qos_count + 1, 0);
+}
+
+static void ctx_on_subscribe_v5(
+	struct mosquitto *mosq,
+	void *obj,
+	int mid,
+	int qos_count,
+	const int *granted_qos,
+	const mosquitto_property *props)
+{
+	ctx_t *ctx = obj;
+	ctx_event_t *ev;
+	int i;
+
+	if (ctx__io_deferred(ctx)) {
+		ev = ctx_event__new(CALLBACK_ON_SUBSCRIBE_V5, 0, mid, props);
+		if (ev && qos_count > 0) {
+			ev->granted_qos = malloc(qos_count * sizeof(int));
+			if (ev->granted_qos) {
+				memcpy(ev->granted_qos, granted_qos, qos_count * sizeof(int));
+				ev->qos_count = qos_count;
+			}
+		}
+		ctx__io_defer(ctx, ev);
+		return;
+	}
+
+	lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->on_subscribe_v5);
+	lua_pushinteger(ctx->L, mid);
+
+	create_lua_stack_from_property_list(ctx->L, props);
+
+	for (i = 0; i < qos_count; i++) {
+		lua_pushinteger(ctx->L, granted_qos[i]);
+	}
+
+	lua_call(ctx->L, qos_count + 2, 0);	
+}
+
+static void ctx_on_unsubscribe(
+	struct mosquitto *mosq,
+	void *obj,
+	int mid)
+{
+	ctx_t *ctx = obj;
+
+	if (ctx__io_deferred(ctx)) {
+		ctx__io_defer(ctx, ctx_event__new(CALLBACK_ON_UNSUBSCRIBE, 0, mid, NULL));
+		return;
+	}
+
+	lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->on_unsubscribe);
+	lua_pushinteger(ctx->L, mid);
+	lua_call(ctx->L, 1, 0);
+}
+
+static void ctx_on_unsubscribe_v5(
+	struct mosquitto *mosq,
+	void *obj,
+	int mid,
+	const mosquitto_property *props)
+{
+	ctx_t *ctx = obj;
+
+	if (ctx__io_deferred(ctx)) {
+		ctx__io_defer(ctx, ctx_event__new(CALLBACK_ON_UNSUBSCRIBE_V5, 0, mid, props));
+		return;
+	}
+
+	lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->on_unsubscribe_v5);
+	lua_pushinteger(ctx->L, mid);
+	create_lua_stack_from_property_list(ctx->L, props);
+	lua_call(ctx->L, 2, 0);	
+}
+
+static void ctx_on_log(
+	struct mosquitto *mosq,
+	void *obj,
+	int level,
+	const char *str)
+{
+	ctx_t *ctx = obj;
+	ctx_event_t *ev;
+
+	if (ctx__io_deferred(ctx)) {
+		ev = ctx_event__new(CALLBACK_ON_LOG, level, 0, NULL);
+		if (ev)
+			ev->str = strdup(str);
+		ctx__io_defer(ctx, ev);
+		return;
+	}
+
+	lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->on_log);
+
+	lua_pushinteger(ctx->L, level);
+	lua_pushstring(ctx->L, str);
+
+	lua_call(ctx->L, 2, 0);
+}
+
+static int callback_type_from_string(const char *);
+
+static int ctx_callback_set(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	int callback_type;
+
+	if (lua_isstring(L, 2)) {
+		callback_type = callback_type_from_string(lua_tostring(L, 2));
+	} else {
+		callback_type = luaL_checkinteger(L, 2);
+	}
+
+	if (!lua_isfunction(L, 3)) {
+		return luaL_argerror(L, 3, "expecting a callback function");
+	}
+
+	/* pop the function from the stack and store it in the registry */
+	int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	switch (callback_type) {
+		case CALLBACK_ON_CONNECT:
+			ctx->on_connect = ref;
+			mosquitto_connect_callback_set(ctx->mosq, ctx_on_connect);
+			break;
+			
+		case CALLBACK_ON_CONNECT_V5:
+			ctx->on_connect_v5 = ref;
+			mosquitto_connect_v5_callback_set(ctx->mosq, ctx_on_connect_v5);
+			break;
+
+		case CALLBACK_ON_DISCONNECT:
+			ctx->on_disconnect = ref;
+			mosquitto_disconnect_callback_set(ctx->mosq, ctx_on_disconnect);
+			break;
+
+		case CALLBACK_ON_DISCONNECT_V5:
+			ctx->on_disconnect_v5 = ref;
+			mosquitto_disconnect_v5_callback_set(ctx->mosq, ctx_on_disconnect_v5);
+			break;
+
+		case CALLBACK_ON_PUBLISH:
+			ctx->on_publish = ref;
+			mosquitto_publish_callback_set(ctx->mosq, ctx_on_publish);
+			break;
+
+		case CALLBACK_ON_PUBLISH_V5:
+			ctx->on_publish_v5 = ref;
+			mosquitto_publish_v5_callback_set(ctx->mosq, ctx_on_publish_v5);
+			break;
+
+		case CALLBACK_ON_MESSAGE:
+			ctx->on_message = ref;
+			mosquitto_message_callback_set(ctx->mosq, ctx_on_message);
+			break;
+
+		case CALLBACK_ON_MESSAGE_V5:
+			ctx->on_message_v5 = ref;
+			ctx__message_v5_enable(ctx);
+			break;			
+
+		case CALLBACK_ON_SUBSCRIBE:
+			ctx->on_subscribe = ref;
+			mosquitto_subscribe_callback_set(ctx->mosq, ctx_on_subscribe);
+			break;
+
+		case CALLBACK_ON_SUBSCRIBE_V5:
+			ctx->on_subscribe_v5 = ref;
+			mosquitto_subscribe_v5_callback_set(ctx->mosq, ctx_on_subscribe_v5);
+			break;
+
+		case CALLBACK_ON_UNSUBSCRIBE:
+			ctx->on_unsubscribe = ref;
+			mosquitto_unsubscribe_callback_set(ctx->mosq, ctx_on_unsubscribe);
+			break;
+
+		case CALLBACK_ON_UNSUBSCRIBE_V5:
+			ctx->on_unsubscribe_v5 = ref;
+			mosquitto_unsubscribe_v5_callback_set(ctx->mosq, ctx_on_unsubscribe_v5);
+			break;
+
+		case CALLBACK_ON_LOG:
+			ctx->on_log = ref;
+			mosquitto_log_callback_set(ctx->mosq, ctx_on_log);
+			break;
+
+		default:
+			luaL_unref(L, LUA_REGISTRYINDEX, ref);
+			luaL_argerror(L, 2, "not a proper callback type");
+			break;
+	}
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Worker pools
+ * @section worker_pools
+ */
+
+/* FNV-1a, used to spread topics over queues and tables */
+static uint32_t topic__hash(const char *topic)
+{
+	uint32_t h = 2166136261u;
+
+	while (*topic) {
+		h ^= (unsigned char) *topic++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static pubmsg_t *pubmsg__new(const char *topic, const void *payload, int payloadlen, int qos, bool retain)
+{
+	size_t topiclen = strlen(topic);
+	pubmsg_t *m = malloc(sizeof(pubmsg_t) + topiclen + 1 + payloadlen);
+
+	if (m == NULL)
+		return NULL;
+
+	m->next = NULL;
+	m->topic = (char *) (m + 1);
+	memcpy(m->topic, topic, topiclen + 1);
+	m->payload = m->topic + topiclen + 1;
+	if (payloadlen > 0)
+		memcpy(m->payload, payload, payloadlen);
+	m->payloadlen = payloadlen;
+	m->qos = qos;
+	m->retain = retain;
+	m->props = NULL;
+	return m;
+}
+
+static void pubmsg__free(pubmsg_t *m)
+{
+	mosquitto_property_free_all(&m->props);
+	free(m);
+}
+
+static void pubq__push(pubq_t *q, pubmsg_t *m)
+{
+	m->next = NULL;
+	if (q->tail)
+		q->tail->next = m;
+	else
+		q->head = m;
+	q->tail = m;
+	q->len++;
+}
+
+static pubmsg_t *pubq__pop(pubq_t *q)
+{
+	pubmsg_t *m = q->head;
+
+	if (m == NULL)
+		return NULL;
+
+	q->head = m->next;
+	if (q->head == NULL)
+		q->tail = NULL;
+	q->len--;
+	m->next = NULL;
+	return m;
+}
+
+static void pubq__clear(pubq_t *q)
+{
+	pubmsg_t *m;
+
+	while ((m = pubq__pop(q)) != NULL)
+		pubmsg__free(m);
+}
+
+/* string keyed open addressing table, keys are owned by the table */
+static strmap_slot_t *strmap__find(const strmap_t *m, const char *key)
+{
+	uint32_t hash;
+	size_t i;
+
+	if (m->len == 0)
+		return NULL;
+
+	hash = topic__hash(key);
+	for (i = hash & m->mask; m->slots[i].key; i = (i + 1) & m->mask) {
+		if (m->slots[i].hash == hash && strcmp(m->slots[i].key, key) == 0)
+			return &m->slots[i];
+	}
+	return NULL;
+}
+
+static int strmap__grow(strmap_t *m)
+{
+	strmap_slot_t *old = m->slots;
+	size_t n = old ? m->mask + 1 : 0, cap = n ? n * 2 : 16, i, j;
+
+	m->slots = calloc(cap, sizeof(strmap_slot_t));
+	if (m->slots == NULL) {
+		m->slots = old;
+		return MOSQ_ERR_NOMEM;
+	}
+	m->mask = cap - 1;
+
+	for (i = 0; i < n; i++) {
+		if (old[i].key == NULL)
+			continue;
+		for (j = old[i].hash & m->mask; m->slots[j].key; j = (j + 1) & m->mask);
+		m->slots[j] = old[i];
+	}
+	free(old);
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* slot of key, added with a NULL value if missing. Slots move on insert */
+static strmap_slot_t *strmap__insert(strmap_t *m, const char *key)
+{
+	strmap_slot_t *slot = strmap__find(m, key);
+	uint32_t hash;
+	size_t i;
+
+	if (slot)
+		return slot;
+
+	if (m->slots == NULL || (m->len + 1) * 2 > m->mask + 1) {
+		if (strmap__grow(m) != MOSQ_ERR_SUCCESS)
+			return NULL;
+	}
+
+	hash = topic__hash(key);
+	for (i = hash & m->mask; m->slots[i].key; i = (i + 1) & m->mask);
+	m->slots[i].key = strdup(key);
+	if (m->slots[i].key == NULL)
+		return NULL;
+	m->slots[i].hash = hash;
+	m->slots[i].value = NULL;
+	m->len++;
+	return &m->slots[i];
+}
+
+/* backward shift deletion, no tombstones */
+static void strmap__remove(strmap_t *m, strmap_slot_t *slot)
+{
+	size_t i = slot - m->slots, j = i, k;
+
+	free(slot->key);
+	for (;;) {
+		j = (j + 1) & m->mask;
+		if (m->slots[j].key == NULL)
+			break;
+		k = m->slots[j].hash & m->mask;
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		m->slots[i] = m->slots[j];
+		i = j;
+	}
+	m->slots[i].key = NULL;
+	m->slots[i].value = NULL;
+	m->len--;
+}
+
+/* values are the caller's to free beforehand */
+static void strmap__clear(strmap_t *m)
+{
+	size_t i;
+
+	for (i = 0; m->slots && i <= m->mask; i++)
+		free(m->slots[i].key);
+	free(m->slots);
+	m->slots = NULL;
+	m->mask = 0;
+	m->len = 0;
+}
+
+static void *worker__main(void *arg)
+{
+	worker_t *w = arg;
+	worker_pool_t *pool = w->pool;
+	lua_State *L = w->L;
+	pubmsg_t *m, *res;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (w->queue.head == NULL && !w->stopping)
+			pthread_cond_wait(&w->nonempty, &w->lock);
+		m = pubq__pop(&w->queue);
+		pthread_cond_signal(&w->nonfull);
+		pthread_mutex_unlock(&w->lock);
+
+		/* only happens once stopping and the queue is drained */
+		if (m == NULL)
+			break;
+
+		lua_rawgeti(L, LUA_REGISTRYINDEX, w->handler);
+		lua_pushstring(L, m->topic);
+		lua_pushlstring(L, m->payload, m->payloadlen);
+		lua_pushinteger(L, m->qos);
+		lua_pushboolean(L, m->retain);
+		lua_pushinteger(L, w->index);
+
+		if (lua_pcall(L, 5, 4, 0) != 0) {
+			__atomic_add_fetch(&pool->errors, 1, __ATOMIC_RELAXED);
+		} else if (lua_type(L, -4) == LUA_TSTRING) {
+			/* handler returned topic, payload, qos, retain: publish through the owning ctx */
+			size_t len = 0;
+			const char *payload = lua_isnil(L, -3) ? NULL : lua_tolstring(L, -3, &len);
+
+			res = pubmsg__new(lua_tostring(L, -4), payload, len, lua_tointeger(L, -2), lua_toboolean(L, -1));
+			if (res != NULL) {
+				pthread_mutex_lock(&pool->lock);
+				pubq__push(&pool->results, res);
+				pthread_mutex_unlock(&pool->lock);
+			} else {
+				__atomic_add_fetch(&pool->errors, 1, __ATOMIC_RELAXED);
+			}
+		}
+		lua_settop(L, 0);
+		pubmsg__free(m);
+		__atomic_add_fetch(&pool->processed, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+/* messages of one topic always end up on the same worker, which keeps them in order */
+static int worker_pool__dispatch(worker_pool_t *pool, const char *topic, const void *payload, int payloadlen, int qos, bool retain)
+{
+	worker_t *w;
+	pubmsg_t *m;
+
+	if (pool->workers == NULL)
+		return MOSQ_ERR_INVAL;
+
+	m = pubmsg__new(topic, payload, payloadlen, qos, retain);
+	if (m == NULL)
+		return MOSQ_ERR_NOMEM;
+
+	w = &pool->workers[topic__hash(topic) % pool->n];
+
+	pthread_mutex_lock(&w->lock);
+	while (pool->max_queue && w->queue.len >= pool->max_queue && !w->stopping)
+		pthread_cond_wait(&w->nonfull, &w->lock);
+	pubq__push(&w->queue, m);
+	pthread_cond_signal(&w->nonempty);
+	pthread_mutex_unlock(&w->lock);
+
+	__atomic_add_fetch(&pool->dispatched, 1, __ATOMIC_RELAXED);
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* publish what the workers handed back, called from the loop owning ctx */
+static void worker_pool__drain(worker_pool_t *pool, ctx_t *ctx)
+{
+	pubq_t q;
+	pubmsg_t *m;
+	int rc;
+
+	pthread_mutex_lock(&pool->lock);
+	q = pool->results;
+	memset(&pool->results, 0, sizeof(pubq_t));
+	pthread_mutex_unlock(&pool->lock);
+
+	if (q.head == NULL)
+		return;
+
+	while ((m = pubq__pop(&q)) != NULL) {
+		rc = ctx__publish(ctx, NULL, m->topic, m->payloadlen, m->payload, m->qos, m->retain, m->props, PRIORITY_NORMAL);
+		if (rc != MOSQ_ERR_SUCCESS)
+			__atomic_add_fetch(&pool->errors, 1, __ATOMIC_RELAXED);
+		pubmsg__free(m);
+	}
+	ctx__io_kick(ctx, false);
+}
+
+static void ctx__service(ctx_t *ctx)
+{
+	if (ctx->pool)
+		worker_pool__drain(ctx->pool, ctx);
+	if (ctx->spool)
+		spool__service(ctx->spool);
+	if (ctx->offline)
+		offline__flush(ctx);
+	if (ctx->bulk)
+		bulk__feed(ctx);
+	if (ctx->conflate)
+		conflate__flush(ctx, false);
+	if (ctx->ratelimit)
+		ratelimit__drain(ctx);
+	if (ctx->timers)
+		timers__service(ctx);
+	if (ctx->rpc)
+		rpc__service(ctx);
+	if (ctx->stream_tx)
+		stream_tx__feed(ctx);
+	if (ctx->stream_rx)
+		stream_rx__expire(ctx);
+	if (ctx->recorder)
+		recorder__flush(ctx);
+	if (ctx->replay)
+		replay__feed(ctx);
+	/* an I/O thread or the loop_start thread drains it for its clients */
+	if (ctx->io.thread == NULL && !ctx->loop.running)
+		ctx__publisher_drain(ctx);
+}
+
+static worker_pool_t * pool_check(lua_State *L, int i)
+{
+	return (worker_pool_t *) luaL_checkudata(L, i, MOSQ_META_POOL);
+}
+
+/***
+ * Create a pool of worker threads, each running its own Lua state.
+ * The script is loaded once per worker and must return the handler
+ * function, which is called as handler(topic, payload, qos, retain, worker).
+ * If the handler returns topic, payload[, qos, retain] the message is
+ * published through the ctx the pool is attached to.
+ * Messages are spread over the workers by topic, so messages of one topic
+ * are handled in order by the same worker.
+ * @function worker_pool
+ * @tparam number n number of worker threads
+ * @tparam string script path of the Lua file returning the handler
+ * @tparam[opt=0] number max_queue messages queued per worker before
+ * dispatching blocks, 0 for unbounded
+ * @return[1] a worker pool
+ * @raise If the script can't be loaded or threads can't be created
+ * @see ctx:worker_pool
+ */
+static int mosq_worker_pool(lua_State *L)
+{
+	int n = luaL_checkinteger(L, 1);
+	const char *script = luaL_checkstring(L, 2);
+	int max_queue = luaL_optinteger(L, 3, 0);
+	worker_pool_t *pool;
+	worker_t *w;
+	int i, err;
+
+	luaL_argcheck(L, n > 0, 1, "need at least one worker");
+	luaL_argcheck(L, max_queue >= 0, 3, "queue size can't be negative");
+
+	pool = (worker_pool_t *) lua_newuserdata(L, sizeof(worker_pool_t));
+	memset(pool, 0, sizeof(worker_pool_t));
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->max_queue = max_queue;
+
+	/* from here on __gc takes care of a partially set up pool */
+	luaL_getmetatable(L, MOSQ_META_POOL);
+	lua_setmetatable(L, -2);
+
+	pool->workers = calloc(n, sizeof(worker_t));
+	if (pool->workers == NULL) {
+		return luaL_error(L, strerror(ENOMEM));
+	}
+
+	for (i = 0; i < n; i++) {
+		w = &pool->workers[i];
+		w->pool = pool;
+		w->index = i + 1;
+		w->handler = LUA_NOREF;
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->nonempty, NULL);
+		pthread_cond_init(&w->nonfull, NULL);
+		pool->n = i + 1;
+
+		w->L = luaL_newstate();
+		if (w->L == NULL) {
+			return luaL_error(L, strerror(ENOMEM));
+		}
+		luaL_openlibs(w->L);
+
+		if (luaL_loadfile(w->L, script) || lua_pcall(w->L, 0, 1, 0)) {
+			return luaL_error(L, "%s", lua_tostring(w->L, -1));
+		}
+		if (!lua_isfunction(w->L, -1)) {
+			return luaL_error(L, "%s: worker script must return a handler function", script);
+		}
+		w->handler = luaL_ref(w->L, LUA_REGISTRYINDEX);
+	}
+
+	for (i = 0; i < n; i++) {
+		w = &pool->workers[i];
+		err = pthread_create(&w->thread, NULL, worker__main, w);
+		if (err != 0) {
+			return luaL_error(L, strerror(err));
+		}
+		w->started = true;
+	}
+
+	return 1;
+}
+
+/***
+ * Worker pool functions
+ * @section pool_functions
+ */
+
+/***
+ * Hand a message to the worker pool
+ * @function dispatch
+ * @tparam string topic
+ * @tparam string|buffer payload (may be nil)
+ * @tparam[opt=0] number qos
+ * @tparam[opt=false] boolean retain
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int pool_dispatch(lua_State *L)
+{
+	worker_pool_t *pool = pool_check(L, 1);
+	const char *topic;
+	size_t payloadlen = 0;
+	const void *payload = NULL;
+	int qos;
+	bool retain;
+
+	parse_basic_parameter_for_publish(L, &topic, &payload, &payloadlen, &qos, &retain);
+
+	int rc = worker_pool__dispatch(pool, topic, payload, payloadlen, qos, retain);
+	return mosq__pstatus(L, rc);
+}
+
+/***
+ * Worker pool statistics
+ * @function stats
+ * @treturn table with the fields workers, dispatched, processed, errors and queued
+ */
+static int pool_stats(lua_State *L)
+{
+	worker_pool_t *pool = pool_check(L, 1);
+	size_t queued = 0;
+	int i;
+
+	for (i = 0; pool->workers && i < pool->n; i++) {
+		pthread_mutex_lock(&pool->workers[i].lock);
+		queued += pool->workers[i].queue.len;
+		pthread_mutex_unlock(&pool->workers[i].lock);
+	}
+
+	lua_newtable(L);
+	lua_pushinteger(L, pool->n);
+	lua_setfield(L, -2, "workers");
+	lua_pushinteger(L, __atomic_load_n(&pool->dispatched, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "dispatched");
+	lua_pushinteger(L, __atomic_load_n(&pool->processed, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "processed");
+	lua_pushinteger(L, __atomic_load_n(&pool->errors, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "errors");
+	lua_pushinteger(L, queued);
+	lua_setfield(L, -2, "queued");
+	return 1;
+}
+
+/***
+ * Stop the workers, after they have handled what is already queued.
+ * This is called automatically by garbage collection, you shouldn't normally
+ * have to call this.
+ * @function close
+ * @return boolean true
+ */
+static int pool_close(lua_State *L)
+{
+	worker_pool_t *pool = pool_check(L, 1);
+	worker_t *w;
+	int i;
+
+	if (pool->workers == NULL)
+		return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+
+	for (i = 0; i < pool->n; i++) {
+		w = &pool->workers[i];
+		pthread_mutex_lock(&w->lock);
+		w->stopping = true;
+		pthread_cond_broadcast(&w->nonempty);
+		pthread_cond_broadcast(&w->nonfull);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	for (i = 0; i < pool->n; i++) {
+		w = &pool->workers[i];
+		if (w->started)
+			pthread_join(w->thread, NULL);
+		if (w->L)
+			lua_close(w->L);
+		pubq__clear(&w->queue);
+		pthread_cond_destroy(&w->nonfull);
+		pthread_cond_destroy(&w->nonempty);
+		pthread_mutex_destroy(&w->lock);
+	}
+
+	free(pool->workers);
+	pool->workers = NULL;
+	pubq__clear(&pool->results);
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Hand incoming messages to a worker pool instead of the ON_MESSAGE callbacks.
+ * Messages returned by the workers are published from this ctx's loop.
+ * @function worker_pool
+ * @tparam worker_pool pool the pool to attach, nil to detach
+ * @see mosquitto.worker_pool
+ * @return boolean true
+ */
+static int ctx_worker_pool(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->pool_ref);
+	ctx->pool = NULL;
+	ctx->pool_ref = LUA_NOREF;
+
+	if (!lua_isnoneornil(L, 2)) {
+		ctx->pool = pool_check(L, 2);
+		/* keep the pool alive as long as it's attached */
+		lua_pushvalue(L, 2);
+		ctx->pool_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		mosquitto_message_callback_set(ctx->mosq, ctx_on_message);
+	}
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * I/O pools
+ * @section io_pools
+ */
+
+static uint64_t mosq__now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static ctx_event_t *ctx_event__new(int type, int rc, int mid, const mosquitto_property *props)
+{
+	ctx_event_t *ev = calloc(1, sizeof(ctx_event_t));
+
+	if (ev == NULL)
+		return NULL;
+
+	ev->type = type;
+	ev->rc = rc;
+	ev->mid = mid;
+	if (props && mosquitto_property_copy_all(&ev->props, props) != MOSQ_ERR_SUCCESS) {
+		free(ev);
+		return NULL;
+	}
+	return ev;
+}
+
+static void ctx_event__free(ctx_event_t *ev)
+{
+	if (ev->type == CALLBACK_ON_MESSAGE || ev->type == CALLBACK_ON_MESSAGE_V5)
+		mosquitto_message_free_contents(&ev->msg);
+	mosquitto_property_free_all(&ev->props);
+	free(ev->granted_qos);
+	free(ev->str);
+	free(ev);
+}
+
+#ifdef LUA_MOSQUITTO_IO_POOL
+
+/* replay a recorded callback, on the Lua thread */
+static void ctx__io_deliver(ctx_t *ctx, ctx_event_t *ev)
+{
+	switch (ev->type) {
+		case CALLBACK_ON_CONNECT:
+			ctx__connect(ctx, ev->rc);
+			break;
+		case CALLBACK_ON_CONNECT_V5:
+			ctx__connect_v5(ctx, ev->rc, ev->flags, ev->props);
+			break;
+		case CALLBACK_ON_DISCONNECT:
+			ctx_on_disconnect(ctx->mosq, ctx, ev->rc);
+			break;
+		case CALLBACK_ON_DISCONNECT_V5:
+			ctx_on_disconnect_v5(ctx->mosq, ctx, ev->rc, ev->props);
+			break;
+		case CALLBACK_ON_PUBLISH:
+			ctx__published(ctx, ev->mid);
+			break;
+		case CALLBACK_ON_PUBLISH_V5:
+			ctx__published_v5(ctx, ev->mid, ev->rc, ev->props);
+			break;
+		case CALLBACK_ON_MESSAGE:
+			if (ctx->shed)
+				shed__lag(ctx->shed, ev->received);
+			ctx__message(ctx, &ev->msg);
+			break;
+		case CALLBACK_ON_MESSAGE_V5:
+			if (ctx->shed)
+				shed__lag(ctx->shed, ev->received);
+			/* may have waited in the queue long enough */
+			if (ctx->drop_expired && ctx__expired(ctx, ev->props, ev->received))
+				break;
+			ctx__message_v5(ctx, &ev->msg, ev->props);
+			break;
+		case CALLBACK_ON_SUBSCRIBE:
+			ctx_on_subscribe(ctx->mosq, ctx, ev->mid, ev->qos_count, ev->granted_qos);
+			break;
+		case CALLBACK_ON_SUBSCRIBE_V5:
+			ctx_on_subscribe_v5(ctx->mosq, ctx, ev->mid, ev->qos_count, ev->granted_qos, ev->props);
+			break;
+		case CALLBACK_ON_UNSUBSCRIBE:
+			ctx_on_unsubscribe(ctx->mosq, ctx, ev->mid);
+			break;
+		case CALLBACK_ON_UNSUBSCRIBE_V5:
+			ctx_on_unsubscribe_v5(ctx->mosq, ctx, ev->mid, ev->props);
+			break;
+		case CALLBACK_ON_LOG:
+			ctx_on_log(ctx->mosq, ctx, ev->rc, ev->str ? ev->str : "");
+			break;
+	}
+}
+
+
+/* epoll key of the thread's own wakeup eventfd */
+#define IO_KEY_WAKE		UINT64_MAX
+#define IO_MAX_EVENTS	64
+
+typedef struct {
+	ctx_t *ctx;
+	uint32_t gen;
+} io_slot_t;
+
+typedef struct io_thread {
+	struct io_pool *pool;
+	pthread_t thread;
+	bool started;
+	bool stopping;
+	int cpu;			/* -1 when not pinned */
+	int epfd;
+	int efd;			/* wakes the thread up */
+	pthread_mutex_t lock;	/* held while the thread services clients */
+	io_slot_t *slots;
+	int nslots;
+	int nclients;
+	pthread_mutex_t dirty_lock;
+	ctx_t *dirty;		/* clients touched by the Lua thread */
+} io_thread_t;
+
+typedef struct io_pool {
+	int n;
+	int max_packets;
+	io_thread_t *threads;
+	int efd;			/* readable while events wait for dispatch */
+	pthread_mutex_t lock;	/* protects the ready list */
+	ctx_t *ready_head;
+	ctx_t *ready_tail;
+	unsigned long events;
+	unsigned long reconnects;
+} io_pool_t;
+
+/* set on the I/O threads, their callbacks are recorded instead of run */
+static __thread bool io__in_thread = false;
+
+static bool ctx__io_deferred(ctx_t *ctx)
+{
+	return io__in_thread && ctx->io.thread != NULL;
+}
+
+static void io__wake(int efd)
+{
+	uint64_t one = 1;
+	ssize_t rc = write(efd, &one, sizeof(one));
+	(void) rc;
+}
+
+static void ctx__io_defer(ctx_t *ctx, ctx_event_t *ev)
+{
+	io_pool_t *pool = ctx->io.pool;
+	bool wake = false;
+
+	if (ev == NULL)
+		return;
+
+	pthread_mutex_lock(&ctx->io.lock);
+	if (ctx->io.tail)
+		ctx->io.tail->next = ev;
+	else
+		ctx->io.head = ev;
+	ctx->io.tail = ev;
+	if (ev->type == CALLBACK_ON_MESSAGE || ev->type == CALLBACK_ON_MESSAGE_V5)
+		ctx->io.depth++;
+	pthread_mutex_unlock(&ctx->io.lock);
+
+	pthread_mutex_lock(&pool->lock);
+	if (!ctx->io.ready) {
+		ctx->io.ready = true;
+		ctx->io.ready_next = NULL;
+		if (pool->ready_tail)
+			pool->ready_tail->io.ready_next = ctx;
+		else
+			pool->ready_head = ctx;
+		pool->ready_tail = ctx;
+		wake = true;
+	}
+	pool->events++;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (wake)
+		io__wake(pool->efd);
+}
+
+/* let the I/O thread know the client has something to write, or a new socket */
+static void ctx__io_kick(ctx_t *ctx, bool reset)
+{
+	io_thread_t *t = ctx->io.thread;
+
+	ctx__loop_wake(ctx);
+	if (t == NULL)
+		return;
+
+	pthread_mutex_lock(&t->dirty_lock);
+	ctx->io.kick_reset |= reset;
+	if (!ctx->io.dirty) {
+		ctx->io.dirty = true;
+		ctx->io.dirty_next = t->dirty;
+		t->dirty = ctx;
+	}
+	pthread_mutex_unlock(&t->dirty_lock);
+
+	io__wake(t->efd);
+}
+
+/* bring the epoll registration in line with the client's socket, under t->lock */
+static void io_thread__update(io_thread_t *t, ctx_t *ctx, uint64_t now)
+{
+	struct epoll_event ev;
+	int sock = mosquitto_socket(ctx->mosq);
+	uint32_t want;
+
+	/*
+	 * A closed socket drops out of epoll by itself, only registrations of
+	 * live sockets are ever removed, which keeps reused fd numbers safe.
+	 */
+	if (sock != ctx->io.fd || ctx->io.reset) {
+		ctx->io.fd = sock;
+		ctx->io.events = 0;
+		ctx->io.reset = false;
+	}
+
+	if (sock == -1) {
+		if (!ctx->disconnecting && now >= ctx->io.reconnect_at) {
+			ctx->io.reconnect_at = now + 1000;
+			ctx->io.reset = true;
+			t->pool->reconnects++;
+			mosquitto_reconnect(ctx->mosq);
+			io_thread__update(t, ctx, now);
+		}
+		return;
+	}
+
+	want = EPOLLIN | (mosquitto_want_write(ctx->mosq) ? EPOLLOUT : 0);
+	if (want == ctx->io.events)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = want;
+	ev.data.u64 = ctx->io.key;
+	if (epoll_ctl(t->epfd, ctx->io.events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, sock, &ev) != 0) {
+		if (errno == EEXIST)
+			epoll_ctl(t->epfd, EPOLL_CTL_MOD, sock, &ev);
+		else if (errno == ENOENT)
+			epoll_ctl(t->epfd, EPOLL_CTL_ADD, sock, &ev);
+	}
+	ctx->io.events = want;
+}
+
+static ctx_t *io_thread__lookup(io_thread_t *t, uint64_t key)
+{
+	uint32_t idx = (uint32_t) key;
+	uint32_t gen = (uint32_t) (key >> 32);
+
+	if (idx >= (uint32_t) t->nslots || t->slots[idx].gen != gen)
+		return NULL;
+	return t->slots[idx].ctx;
+}
+
+static void *io_thread__main(void *arg)
+{
+	io_thread_t *t = arg;
+	io_pool_t *pool = t->pool;
+	struct epoll_event events[IO_MAX_EVENTS];
+	uint64_t now, last_misc = 0, drain;
+	ctx_t *ctx, *dirty;
+	int i, n, rc;
+
+	io__in_thread = true;
+
+#ifdef CPU_SET
+	if (t->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(t->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+#endif
+
+	for (;;) {
+		n = epoll_wait(t->epfd, events, IO_MAX_EVENTS, 1000);
+
+		pthread_mutex_lock(&t->lock);
+		if (t->stopping) {
+			pthread_mutex_unlock(&t->lock);
+			break;
+		}
+		now = mosq__now_ms();
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.u64 == IO_KEY_WAKE) {
+				rc = read(t->efd, &drain, sizeof(drain));
+				continue;
+			}
+			ctx = io_thread__lookup(t, events[i].data.u64);
+			if (ctx == NULL)
+				continue;
+
+			rc = MOSQ_ERR_SUCCESS;
+			if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				rc = mosquitto_loop_read(ctx->mosq, pool->max_packets);
+			if (rc == MOSQ_ERR_SUCCESS && (events[i].events & EPOLLOUT))
+				rc = mosquitto_loop_write(ctx->mosq, pool->max_packets);
+			if (rc != MOSQ_ERR_SUCCESS)
+				ctx->io.reset = true;
+			io_thread__update(t, ctx, now);
+		}
+
+		pthread_mutex_lock(&t->dirty_lock);
+		dirty = t->dirty;
+		t->dirty = NULL;
+		for (ctx = dirty; ctx; ctx = ctx->io.dirty_next) {
+			ctx->io.dirty = false;
+			ctx->io.reset |= ctx->io.kick_reset;
+			ctx->io.kick_reset = false;
+		}
+		pthread_mutex_unlock(&t->dirty_lock);
+
+		for (ctx = dirty; ctx; ctx = ctx->io.dirty_next) {
+			ctx__publisher_drain(ctx);
+			io_thread__update(t, ctx, now);
+		}
+
+		/* keepalives and reconnects, once a second is plenty for both */
+		if (now - last_misc >= 1000) {
+			last_misc = now;
+			for (i = 0; i < t->nslots; i++) {
+				ctx = t->slots[i].ctx;
+				if (ctx == NULL)
+					continue;
+				if (ctx->io.fd != -1 && mosquitto_loop_misc(ctx->mosq) != MOSQ_ERR_SUCCESS)
+					ctx->io.reset = true;
+				/* leftovers beyond one batch */
+				ctx__publisher_drain(ctx);
+				io_thread__update(t, ctx, now);
+			}
+		}
+		pthread_mutex_unlock(&t->lock);
+	}
+
+	return NULL;
+}
+
+/* free what is still queued for the Lua thread and leave the ready list */
+static void ctx__io_discard(ctx_t *ctx, io_pool_t *pool)
+{
+	ctx_event_t *ev, *next;
+	ctx_t *c, *prev = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (ctx->io.ready) {
+		for (c = pool->ready_head; c; prev = c, c = c->io.ready_next) {
+			if (c != ctx)
+				continue;
+			if (prev)
+				prev->io.ready_next = c->io.ready_next;
+			else
+				pool->ready_head = c->io.ready_next;
+			if (pool->ready_tail == c)
+				pool->ready_tail = prev;
+			break;
+		}
+		ctx->io.ready = false;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_mutex_lock(&ctx->io.lock);
+	ev = ctx->io.head;
+	ctx->io.head = ctx->io.tail = NULL;
+	ctx->io.depth = 0;
+	pthread_mutex_unlock(&ctx->io.lock);
+
+	for (; ev; ev = next) {
+		next = ev->next;
+		ctx_event__free(ev);
+	}
+}
+
+static void ctx__io_detach(ctx_t *ctx)
+{
+	io_thread_t *t = ctx->io.thread;
+	ctx_t **pp;
+
+	if (t == NULL)
+		return;
+
+	if (ctx->publisher)
+		publisher__wake_set(ctx->publisher, false);
+
+	pthread_mutex_lock(&t->lock);
+	if (ctx->io.events && ctx->io.fd != -1 && mosquitto_socket(ctx->mosq) == ctx->io.fd)
+		epoll_ctl(t->epfd, EPOLL_CTL_DEL, ctx->io.fd, NULL);
+	t->slots[(uint32_t) ctx->io.key].ctx = NULL;
+	t->slots[(uint32_t) ctx->io.key].gen++;
+	t->nclients--;
+	pthread_mutex_unlock(&t->lock);
+
+	pthread_mutex_lock(&t->dirty_lock);
+	for (pp = &t->dirty; *pp; pp = &(*pp)->io.dirty_next) {
+		if (*pp == ctx) {
+			*pp = ctx->io.dirty_next;
+			break;
+		}
+	}
+	ctx->io.dirty = false;
+	pthread_mutex_unlock(&t->dirty_lock);
+
+	ctx__io_discard(ctx, ctx->io.pool);
+
+	luaL_unref(ctx->L, LUA_REGISTRYINDEX, ctx->io.ref);
+	ctx->io.ref = LUA_NOREF;
+	ctx->io.thread = NULL;
+	ctx->io.pool = NULL;
+	ctx->io.fd = -1;
+	ctx->io.events = 0;
+}
+
+static int ctx__io_attach(ctx_t *ctx, io_pool_t *pool)
+{
+	io_thread_t *t = &pool->threads[0];
+	io_slot_t *slots;
+	int i, idx = -1;
+
+	/* least loaded thread */
+	for (i = 1; i < pool->n; i++) {
+		if (pool->threads[i].nclients < t->nclients)
+			t = &pool->threads[i];
+	}
+
+	pthread_mutex_lock(&t->lock);
+	for (i = 0; i < t->nslots; i++) {
+		if (t->slots[i].ctx == NULL) {
+			idx = i;
+			break;
+		}
+	}
+	if (idx < 0) {
+		slots = realloc(t->slots, (t->nslots ? t->nslots * 2 : 16) * sizeof(io_slot_t));
+		if (slots == NULL) {
+			pthread_mutex_unlock(&t->lock);
+			return MOSQ_ERR_NOMEM;
+		}
+		memset(slots + t->nslots, 0, (t->nslots ? t->nslots : 16) * sizeof(io_slot_t));
+		idx = t->nslots;
+		t->nslots = t->nslots ? t->nslots * 2 : 16;
+		t->slots = slots;
+	}
+	t->slots[idx].ctx = ctx;
+	t->nclients++;
+
+	ctx->io.pool = pool;
+	ctx->io.thread = t;
+	ctx->io.key = ((uint64_t) t->slots[idx].gen << 32) | (uint32_t) idx;
+	ctx->io.fd = -1;
+	ctx->io.events = 0;
+	ctx->io.reset = false;
+	ctx->io.reconnect_at = 0;
+	pthread_mutex_unlock(&t->lock);
+
+	/* libmosquitto has to expect calls from both threads */
+	mosquitto_threaded_set(ctx->mosq, true);
+	if (ctx->publisher)
+		publisher__wake_set(ctx->publisher, true);
+	ctx__io_kick(ctx, true);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static io_pool_t * iopool_check(lua_State *L, int i)
+{
+	return (io_pool_t *) luaL_checkudata(L, i, MOSQ_META_IO);
+}
+
+/***
+ * Create a pool of I/O threads servicing the network side of many clients.
+ * Each thread runs an epoll loop over the sockets of the clients assigned to
+ * it. Callbacks are queued per client and run on the Lua thread by
+ * dispatch, so the Lua state is never entered from the I/O threads.
+ * Only available on Linux.
+ * @function io_pool
+ * @tparam[opt] number threads number of I/O threads, defaults to the number of online CPUs
+ * @tparam[opt] table options with the optional fields
+ * affinity (array of CPU numbers the threads are pinned to, round robin) and
+ * max_packets (passed to mosquitto_loop_read/write)
+ * @return[1] an I/O pool
+ * @raise If threads or descriptors can't be created
+ * @see ctx:io_pool
+ */
+static int mosq_io_pool(lua_State *L)
+{
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+	int n = luaL_optinteger(L, 1, online > 0 ? online : 1);
+	io_pool_t *pool;
+	io_thread_t *t;
+	struct epoll_event ev;
+	int i, err, ud, ncpus = 0;
+
+	luaL_argcheck(L, n > 0, 1, "need at least one thread");
+
+	pool = (io_pool_t *) lua_newuserdata(L, sizeof(io_pool_t));
+	ud = lua_gettop(L);
+	memset(pool, 0, sizeof(io_pool_t));
+	pool->efd = -1;
+	pool->max_packets = 1;
+	pthread_mutex_init(&pool->lock, NULL);
+
+	/* from here on __gc takes care of a partially set up pool */
+	luaL_getmetatable(L, MOSQ_META_IO);
+	lua_setmetatable(L, -2);
+
+	if (lua_table_on_stack(L, 2)) {
+		lua_getfield(L, 2, "max_packets");
+		pool->max_packets = luaL_optinteger(L, -1, 1);
+		lua_pop(L, 1);
+		lua_getfield(L, 2, "affinity");
+		if (lua_istable(L, -1))
+			ncpus = lua_rawlen(L, -1);
+	}
+
+	pool->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pool->threads = calloc(n, sizeof(io_thread_t));
+	if (pool->efd < 0 || pool->threads == NULL) {
+		return luaL_error(L, strerror(pool->efd < 0 ? errno : ENOMEM));
+	}
+
+	for (i = 0; i < n; i++) {
+		t = &pool->threads[i];
+		t->pool = pool;
+		t->cpu = -1;
+		t->efd = -1;
+		pthread_mutex_init(&t->lock, NULL);
+		pthread_mutex_init(&t->dirty_lock, NULL);
+		pool->n = i + 1;
+
+		if (ncpus > 0) {
+			lua_rawgeti(L, -1, i % ncpus + 1);
+			t->cpu = luaL_checkinteger(L, -1);
+			lua_pop(L, 1);
+		}
+
+		t->epfd = epoll_create1(EPOLL_CLOEXEC);
+		t->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (t->epfd < 0 || t->efd < 0) {
+			return luaL_error(L, strerror(errno));
+		}
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = IO_KEY_WAKE;
+		if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->efd, &ev) != 0) {
+			return luaL_error(L, strerror(errno));
+		}
+
+		err = pthread_create(&t->thread, NULL, io_thread__main, t);
+		if (err != 0) {
+			return luaL_error(L, strerror(err));
+		}
+		t->started = true;
+	}
+
+	lua_pushvalue(L, ud);
+	return 1;
+}
+
+/***
+ * I/O pool functions
+ * @section io_pool_functions
+ */
+
+/* lets iopool_dispatch find the client at idx from its ctx_t */
+static void io__remember(lua_State *L, int idx)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, MOSQ_IO_CLIENTS);
+	lua_pushlightuserdata(L, lua_touserdata(L, idx));
+	lua_pushvalue(L, idx);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
+/***
+ * Run the callbacks queued by the I/O threads.
+ * @function dispatch
+ * @tparam[opt=0] number timeout ms to wait for events when none are queued, -1 to wait forever
+ * @treturn number number of clients that had events
+ */
+static int iopool_dispatch(lua_State *L)
+{
+	io_pool_t *pool = iopool_check(L, 1);
+	int timeout = luaL_optinteger(L, 2, 0);
+	struct pollfd pfd;
+	uint64_t drain;
+	ctx_event_t *ev;
+	ctx_t *ctx;
+	int count = 0;
+	ssize_t rc;
+
+	if (pool->threads == NULL)
+		return luaL_error(L, "I/O pool is closed");
+
+	pthread_mutex_lock(&pool->lock);
+	ctx = pool->ready_head;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (timeout != 0 && ctx == NULL) {
+		pfd.fd = pool->efd;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, timeout);
+	}
+	rc = read(pool->efd, &drain, sizeof(drain));
+	(void) rc;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		ctx = pool->ready_head;
+		if (ctx) {
+			pool->ready_head = ctx->io.ready_next;
+			if (pool->ready_head == NULL)
+				pool->ready_tail = NULL;
+			ctx->io.ready = false;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		if (ctx == NULL)
+			break;
+
+		/*
+		 * Pinned on the stack until done, a callback may drop the last
+		 * reference to the client. Gone from the table once it's being
+		 * collected, and then detached by its __gc.
+		 */
+		lua_getfield(L, LUA_REGISTRYINDEX, MOSQ_IO_CLIENTS);
+		lua_pushlightuserdata(L, ctx);
+		lua_rawget(L, -2);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 2);
+			continue;
+		}
+		count++;
+
+		/* one at a time, a callback may detach or destroy the client */
+		while (ctx->io.pool == pool) {
+			pthread_mutex_lock(&ctx->io.lock);
+			ev = ctx->io.head;
+			if (ev) {
+				ctx->io.head = ev->next;
+				if (ctx->io.head == NULL)
+					ctx->io.tail = NULL;
+				if (ev->type == CALLBACK_ON_MESSAGE || ev->type == CALLBACK_ON_MESSAGE_V5)
+					ctx->io.depth--;
+			}
+			pthread_mutex_unlock(&ctx->io.lock);
+
+			if (ev == NULL)
+				break;
+			ctx__io_deliver(ctx, ev);
+			ctx_event__free(ev);
+		}
+		ctx__service(ctx);
+		lua_pop(L, 2);
+	}
+
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+/***
+ * Descriptor that becomes readable when callbacks are waiting for dispatch,
+ * for use with an external poll loop.
+ * @function fd
+ * @treturn number file descriptor
+ */
+static int iopool_fd(lua_State *L)
+{
+	io_pool_t *pool = iopool_check(L, 1);
+
+	lua_pushinteger(L, pool->efd);
+	return 1;
+}
+
+/***
+ * I/O pool statistics
+ * @function stats
+ * @treturn table with the fields threads, clients (array of clients per thread),
+ * events and reconnects
+ */
+static int iopool_stats(lua_State *L)
+{
+	io_pool_t *pool = iopool_check(L, 1);
+	int i;
+
+	lua_newtable(L);
+	lua_pushinteger(L, pool->n);
+	lua_setfield(L, -2, "threads");
+	lua_newtable(L);
+	for (i = 0; pool->threads && i < pool->n; i++) {
+		lua_pushinteger(L, pool->threads[i].nclients);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "clients");
+	pthread_mutex_lock(&pool->lock);
+	lua_pushinteger(L, pool->events);
+	lua_setfield(L, -2, "events");
+	pthread_mutex_unlock(&pool->lock);
+	lua_pushinteger(L, __atomic_load_n(&pool->reconnects, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "reconnects");
+	return 1;
+}
+
+/***
+ * Stop the I/O threads, clients still attached are detached.
+ * This is called automatically by garbage collection, you shouldn't normally
+ * have to call this.
+ * @function close
+ * @return boolean true
+ */
+static int iopool_close(lua_State *L)
+{
+	io_pool_t *pool = iopool_check(L, 1);
+	io_thread_t *t;
+	ctx_t *ctx;
+	int i, j;
+
+	if (pool->threads == NULL)
+		return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+
+	for (i = 0; i < pool->n; i++) {
+		t = &pool->threads[i];
+		pthread_mutex_lock(&t->lock);
+		t->stopping = true;
+		pthread_mutex_unlock(&t->lock);
+		if (t->efd >= 0)
+			io__wake(t->efd);
+	}
+
+	for (i = 0; i < pool->n; i++) {
+		t = &pool->threads[i];
+		if (t->started)
+			pthread_join(t->thread, NULL);
+
+		for (j = 0; j < t->nslots; j++) {
+			ctx = t->slots[j].ctx;
+			if (ctx == NULL)
+				continue;
+			ctx__io_discard(ctx, pool);
+			if (ctx->publisher)
+				publisher__wake_set(ctx->publisher, false);
+			ctx->io.thread = NULL;
+			ctx->io.pool = NULL;
+			ctx->io.dirty = false;
+			ctx->io.fd = -1;
+			ctx->io.events = 0;
+		}
+		free(t->slots);
+		if (t->epfd >= 0)
+			close(t->epfd);
+		if (t->efd >= 0)
+			close(t->efd);
+		pthread_mutex_destroy(&t->dirty_lock);
+		pthread_mutex_destroy(&t->lock);
+	}
+
+	free(pool->threads);
+	pool->threads = NULL;
+	if (pool->efd >= 0)
+		close(pool->efd);
+	pool->efd = -1;
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Let an I/O pool do the network side of this client.
+ * Don't call any of the loop functions on the client while attached,
+ * callbacks are run by the pool's dispatch instead. Lost connections are
+ * reconnected by the I/O thread.
+ * @function io_pool
+ * @tparam io_pool pool the pool to attach to, nil to detach
+ * @see mosquitto.io_pool
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int ctx_io_pool(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	io_pool_t *pool;
+	int rc;
+
+	ctx__io_detach(ctx);
+
+	if (lua_isnoneornil(L, 2))
+		return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+
+	pool = iopool_check(L, 2);
+	if (pool->threads == NULL)
+		return luaL_argerror(L, 2, "I/O pool is closed");
+	/* one thread drives the network side */
+	if (ctx->loop.running)
+		return luaL_error(L, "can't attach a client with a loop thread to an I/O pool");
+
+	rc = ctx__io_attach(ctx, pool);
+	if (rc == MOSQ_ERR_SUCCESS) {
+		lua_pushvalue(L, 2);
+		ctx->io.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		io__remember(L, 1);
+	}
+	return mosq__pstatus(L, rc);
+}
+
+#else /* LUA_MOSQUITTO_IO_POOL */
+
+static bool ctx__io_deferred(ctx_t *ctx)
+{
+	return false;
+}
+
+static void ctx__io_defer(ctx_t *ctx, ctx_event_t *ev)
+{
+	if (ev)
+		ctx_event__free(ev);
+}
+
+static void ctx__io_kick(ctx_t *ctx, bool reset)
+{
+	ctx__loop_wake(ctx);
+}
+
+static void ctx__io_detach(ctx_t *ctx)
+{
+}
+
+static int mosq_io_pool(lua_State *L)
+{
+	return mosq__pstatus(L, MOSQ_ERR_NOT_SUPPORTED);
+}
+
+static int ctx_io_pool(lua_State *L)
+{
+	return mosq__pstatus(L, MOSQ_ERR_NOT_SUPPORTED);
+}
+
+#endif /* LUA_MOSQUITTO_IO_POOL */
+
+/***
+ * Publisher handles
+ * @section publishers
+ */
+
+/*
+ * Multi producer, single consumer queue of pubmsg_t (Vyukov). Producers only
+ * swap the head, the owning loop is the single consumer working from the tail.
+ */
+static void mpsc__push(mpsc_t *q, pubmsg_t *m)
+{
+	pubmsg_t *prev;
+
+	__atomic_store_n(&m->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&q->head, m, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, m, __ATOMIC_RELEASE);
+}
+
+static pubmsg_t *mpsc__pop(mpsc_t *q)
+{
+	pubmsg_t *tail = q->tail;
+	pubmsg_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &q->stub) {
+		if (next == NULL)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	/* a producer is between swapping the head and linking its message */
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	mpsc__push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+static publisher_t *publisher__new(ctx_t *ctx)
+{
+	publisher_t *pub = calloc(1, sizeof(publisher_t));
+
+	if (pub == NULL)
+		return NULL;
+
+	pub->refs = 1;
+	pub->ctx = ctx;
+	pthread_mutex_init(&pub->lock, NULL);
+	pub->q.head = &pub->q.stub;
+	pub->q.tail = &pub->q.stub;
+	return pub;
+}
+
+static void publisher__unref(publisher_t *pub)
+{
+	pubmsg_t *m;
+
+	if (__atomic_sub_fetch(&pub->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	while ((m = mpsc__pop(&pub->q)) != NULL)
+		pubmsg__free(m);
+	pthread_mutex_destroy(&pub->lock);
+	free(pub);
+}
+
+/* the ctx is going away, handles still around can only fail from now on */
+static void publisher__close(publisher_t *pub)
+{
+	__atomic_store_n(&pub->closed, true, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&pub->lock);
+	pub->ctx = NULL;
+	pthread_mutex_unlock(&pub->lock);
+	publisher__unref(pub);
+}
+
+/* called with the I/O thread being attached or detached */
+static void publisher__wake_set(publisher_t *pub, bool wake)
+{
+	pthread_mutex_lock(&pub->lock);
+	__atomic_store_n(&pub->wake, wake, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&pub->lock);
+}
+
+static int publisher__push(publisher_t *pub, pubmsg_t *m)
+{
+	if (__atomic_load_n(&pub->closed, __ATOMIC_ACQUIRE)) {
+		pubmsg__free(m);
+		return MOSQ_ERR_NO_CONN;
+	}
+	mpsc__push(&pub->q, m);
+	__atomic_add_fetch(&pub->queued, 1, __ATOMIC_RELAXED);
+
+	/* an I/O thread only looks at clients it is told about */
+	if (__atomic_load_n(&pub->wake, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&pub->lock);
+		if (pub->ctx)
+			ctx__io_kick(pub->ctx, false);
+		pthread_mutex_unlock(&pub->lock);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/*
+ * Single consumer: the ctx's own loop, its loop_start thread or its I/O
+ * thread when attached to one. True if a whole batch was taken, more may wait.
+ */
+static bool ctx__publisher_drain(ctx_t *ctx)
+{
+	publisher_t *pub = ctx->publisher;
+	pubmsg_t *m;
+	int n, rc;
+
+	if (pub == NULL)
+		return false;
+
+	for (n = 0; n < PUBLISHER_BATCH && (m = mpsc__pop(&pub->q)) != NULL; n++) {
+		rc = ctx__publish(ctx, NULL, m->topic, m->payloadlen, m->payload, m->qos, m->retain, m->props, PRIORITY_NORMAL);
+		if (rc == MOSQ_ERR_SUCCESS)
+			__atomic_add_fetch(&pub->published, 1, __ATOMIC_RELAXED);
+		else
+			__atomic_add_fetch(&pub->dropped, 1, __ATOMIC_RELAXED);
+		pubmsg__free(m);
+	}
+	return n == PUBLISHER_BATCH;
+}
+
+static publisher_t * publisher_check(lua_State *L, int i)
+{
+	return *(publisher_t **) luaL_checkudata(L, i, MOSQ_META_PUB);
+}
+
+static int publisher__push_handle(lua_State *L, publisher_t *pub)
+{
+	publisher_t **ud = (publisher_t **) lua_newuserdata(L, sizeof(publisher_t *));
+
+	*ud = pub;
+	luaL_getmetatable(L, MOSQ_META_PUB);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+/***
+ * Adopt a publisher handle shared by another Lua state.
+ * @function publisher
+ * @tparam lightuserdata shared value returned by publisher:share()
+ * @return a publisher handle
+ * @see publisher:share
+ */
+static int mosq_publisher(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+
+	/* takes over the reference made by share() */
+	return publisher__push_handle(L, lua_touserdata(L, 1));
+}
+
+/***
+ * Publisher handle functions
+ * @section publisher_functions
+ */
+
+/***
+ * Queue a message for publishing by the owning ctx, may be called from any thread
+ * @function publish
+ * @tparam string topic
+ * @tparam string|buffer payload (may be nil)
+ * @tparam[opt=0] number qos 0, 1 or 2
+ * @tparam[opt=nil] boolean retain flag
+ * @tparam[opt=nil] table properties
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int publisher_publish(lua_State *L)
+{
+	publisher_t *pub = publisher_check(L, 1);
+	const char *topic;
+	size_t payloadlen = 0;
+	const void *payload = NULL;
+	int qos, rc;
+	bool retain;
+	mosquitto_property *proplist = NULL;
+	pubmsg_t *m;
+
+	parse_basic_parameter_for_publish(L, &topic, &payload, &payloadlen, &qos, &retain);
+
+	if (lua_table_on_stack(L, 6)) {
+		rc = create_property_list_from_lua_stack(L, 6, &proplist, CMD_PUBLISH);
+		if (rc != MOSQ_ERR_SUCCESS) {
+			return mosq__pstatus(L, rc);
+		}
+	}
+
+	m = pubmsg__new(topic, payload, payloadlen, qos, retain);
+	if (m == NULL) {
+		mosquitto_property_free_all(&proplist);
+		return mosq__pstatus(L, MOSQ_ERR_NOMEM);
+	}
+	m->props = proplist;
+
+	rc = publisher__push(pub, m);
+	return mosq__pstatus(L, rc);
+}
+
+/***
+ * Share the handle with another Lua state or thread.
+ * The returned value must be passed to mosquitto.publisher exactly once.
+ * @function share
+ * @treturn lightuserdata
+ * @see mosquitto.publisher
+ */
+static int publisher_share(lua_State *L)
+{
+	publisher_t *pub = publisher_check(L, 1);
+
+	__atomic_add_fetch(&pub->refs, 1, __ATOMIC_RELAXED);
+	lua_pushlightuserdata(L, pub);
+	return 1;
+}
+
+/***
+ * Publisher statistics
+ * @function stats
+ * @treturn table with the fields queued, published and dropped
+ */
+static int publisher_stats(lua_State *L)
+{
+	publisher_t *pub = publisher_check(L, 1);
+
+	lua_newtable(L);
+	lua_pushinteger(L, __atomic_load_n(&pub->queued, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "queued");
+	lua_pushinteger(L, __atomic_load_n(&pub->published, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "published");
+	lua_pushinteger(L, __atomic_load_n(&pub->dropped, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "dropped");
+	return 1;
+}
+
+static int publisher_gc(lua_State *L)
+{
+	publisher_t **ud = (publisher_t **) luaL_checkudata(L, 1, MOSQ_META_PUB);
+
+	if (*ud) {
+		publisher__unref(*ud);
+		*ud = NULL;
+	}
+	return 0;
+}
+
+/***
+ * Get a thread safe handle publishing through this ctx.
+ * Messages published through the handle are queued without locking and
+ * published in batches from this ctx's loop (or loop_start or I/O thread).
+ * @function publisher
+ * @return a publisher handle
+ * @raise For some out of memory states
+ */
+static int ctx_publisher(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	if (ctx->publisher == NULL) {
+		ctx->publisher = publisher__new(ctx);
+		if (ctx->publisher == NULL) {
+			return luaL_error(L, strerror(ENOMEM));
+		}
+		ctx->publisher->wake = ctx->io.thread != NULL || ctx->loop.running;
+	}
+
+	__atomic_add_fetch(&ctx->publisher->refs, 1, __ATOMIC_RELAXED);
+	return publisher__push_handle(L, ctx->publisher);
+}
+
+/***
+ * Shared subscription groups
+ * @section shared_groups
+ */
+
+typedef struct {
+	ctx_t *ctx;
+	int ref;
+	unsigned long last_messages;
+	uint64_t last_ms;
+	double rate;		/* messages per second at the last sample */
+	unsigned long rebalances;
+} group_member_t;
+
+typedef struct {
+	int n;
+	double lag;
+	group_member_t *members;
+} group_t;
+
+static group_t * group_check(lua_State *L, int i)
+{
+	return (group_t *) luaL_checkudata(L, i, MOSQ_META_GROUP);
+}
+
+/* opts.field as string, or the default */
+static const char *opt__string(lua_State *L, int opts, const char *field, const char *def)
+{
+	const char *value = def;
+
+	if (lua_table_on_stack(L, opts)) {
+		lua_getfield(L, opts, field);
+		value = luaL_optstring(L, -1, def);
+		lua_pop(L, 1);
+	}
+	return value;
+}
+
+static lua_Integer opt__integer(lua_State *L, int opts, const char *field, lua_Integer def)
+{
+	lua_Integer value = def;
+
+	if (lua_table_on_stack(L, opts)) {
+		lua_getfield(L, opts, field);
+		value = luaL_optinteger(L, -1, def);
+		lua_pop(L, 1);
+	}
+	return value;
+}
+
+static lua_Number opt__number(lua_State *L, int opts, const char *field, lua_Number def)
+{
+	lua_Number value = def;
+
+	if (lua_table_on_stack(L, opts)) {
+		lua_getfield(L, opts, field);
+		value = luaL_optnumber(L, -1, def);
+		lua_pop(L, 1);
+	}
+	return value;
+}
+
+/* take a rate sample for every member */
+static double group__sample(group_t *group)
+{
+	uint64_t now = mosq__now_ms();
+	unsigned long messages;
+	group_member_t *m;
+	double total = 0;
+	int i;
+
+	for (i = 0; i < group->n; i++) {
+		m = &group->members[i];
+		if (m->ctx == NULL)
+			continue;
+		if (now > m->last_ms) {
+			messages = __atomic_load_n(&m->ctx->stats.messages, __ATOMIC_RELAXED);
+			m->rate = (messages - m->last_messages) * 1000.0 / (now - m->last_ms);
+			m->last_messages = messages;
+			m->last_ms = now;
+		}
+		total += m->rate;
+	}
+	return group->n ? total / group->n : 0;
+}
+
+/***
+ * Create n clients sharing the load of one shared subscription.
+ * The clients connect straight away and (re)subscribe to the filter on every
+ * connect. Messages go to the handler as with ON_MESSAGE_V5, or to a worker
+ * pool if one is given in the options.
+ * @function shared_group
+ * @tparam number n number of member clients
+ * @tparam string filter shared subscription, eg "$share/group/sensors/#"
+ * @tparam[opt] function handler called as handler(mid, topic, payload, qos, retain, properties)
+ * @tparam[opt] table options with the optional fields id (client id prefix,
+ * members get the suffix 1..n), host, port, keepalive, qos, lag (members below
+ * this fraction of the mean rate get resubscribed by rebalance, default 0.5),
+ * io_pool and worker_pool (attached to every member)
+ * @return[1] a shared group
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ * @see ctx:io_pool
+ * @see ctx:worker_pool
+ */
+static int mosq_shared_group(lua_State *L)
+{
+	int n = luaL_checkinteger(L, 1);
+	const char *filter = luaL_checkstring(L, 2);
+	const char *prefix = opt__string(L, 4, "id", NULL);
+	const char *host = opt__string(L, 4, "host", "localhost");
+	int port = opt__integer(L, 4, "port", 1883);
+	int keepalive = opt__integer(L, 4, "keepalive", 60);
+	int qos = opt__integer(L, 4, "qos", 0);
+	group_t *group;
+	ctx_t *ctx;
+	int i, rc, ud;
+
+	luaL_argcheck(L, n > 0, 1, "need at least one member");
+	luaL_argcheck(L, strncmp(filter, "$share/", 7) == 0, 2, "expecting a $share/<group>/<filter> subscription");
+	luaL_argcheck(L, lua_isnoneornil(L, 3) || lua_isfunction(L, 3), 3, "expecting a handler function");
+
+#ifdef LUA_MOSQUITTO_IO_POOL
+	/* checked before any member exists, like ctx:io_pool does */
+	if (lua_table_on_stack(L, 4)) {
+		lua_getfield(L, 4, "io_pool");
+		if (!lua_isnil(L, -1) && iopool_check(L, -1)->threads == NULL)
+			return luaL_argerror(L, 4, "I/O pool is closed");
+		lua_pop(L, 1);
+	}
+#endif
+
+	group = (group_t *) lua_newuserdata(L, sizeof(group_t));
+	ud = lua_gettop(L);
+	memset(group, 0, sizeof(group_t));
+	group->lag = opt__number(L, 4, "lag", 0.5);
+
+	luaL_getmetatable(L, MOSQ_META_GROUP);
+	lua_setmetatable(L, -2);
+
+	group->members = calloc(n, sizeof(group_member_t));
+	if (group->members == NULL) {
+		return luaL_error(L, strerror(ENOMEM));
+	}
+
+	for (i = 0; i < n; i++) {
+		lua_pushcfunction(L, mosq_new);
+		if (prefix)
+			lua_pushfstring(L, "%s%d", prefix, i + 1);
+		else
+			lua_pushnil(L);
+		lua_call(L, 1, 1);
+
+		ctx = ctx_check(L, -1);
+		group->members[i].ctx = ctx;
+		group->members[i].last_ms = mosq__now_ms();
+		group->members[i].ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		group->n = i + 1;
+
+		ctx->auto_sub = strdup(filter);
+		if (ctx->auto_sub == NULL) {
+			return luaL_error(L, strerror(ENOMEM));
+		}
+		ctx->auto_sub_qos = qos;
+		mosquitto_int_option(ctx->mosq, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5);
+		mosquitto_connect_callback_set(ctx->mosq, ctx_on_connect);
+
+		if (lua_isfunction(L, 3)) {
+			lua_pushvalue(L, 3);
+			ctx->on_message_v5 = luaL_ref(L, LUA_REGISTRYINDEX);
+			ctx__message_v5_enable(ctx);
+		}
+
+		if (lua_table_on_stack(L, 4)) {
+			lua_getfield(L, 4, "worker_pool");
+			if (!lua_isnil(L, -1)) {
+				ctx->pool = pool_check(L, -1);
+				ctx->pool_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+				mosquitto_message_callback_set(ctx->mosq, ctx_on_message);
+			} else {
+				lua_pop(L, 1);
+			}
+
+#ifdef LUA_MOSQUITTO_IO_POOL
+			lua_getfield(L, 4, "io_pool");
+			if (!lua_isnil(L, -1)) {
+				rc = ctx__io_attach(ctx, iopool_check(L, -1));
+				if (rc != MOSQ_ERR_SUCCESS) {
+					return mosq__pstatus(L, rc);
+				}
+				ctx->io.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+				lua_rawgeti(L, LUA_REGISTRYINDEX, group->members[i].ref);
+				io__remember(L, lua_gettop(L));
+				lua_pop(L, 1);
+			} else {
+				lua_pop(L, 1);
+			}
+#endif
+		}
+
+		ctx->disconnecting = false;
+		rc = mosquitto_connect(ctx->mosq, host, port, keepalive);
+		if (rc != MOSQ_ERR_SUCCESS) {
+			return mosq__pstatus(L, rc);
+		}
+		ctx__io_kick(ctx, true);
+	}
+
+	lua_pushvalue(L, ud);
+	return 1;
+}
+
+/***
+ * Shared group functions
+ * @section group_functions
+ */
+
+/***
+ * The member clients
+ * @function members
+ * @treturn table array of mosquitto instances
+ */
+static int group_members(lua_State *L)
+{
+	group_t *group = group_check(L, 1);
+	int i;
+
+	lua_newtable(L);
+	for (i = 0; i < group->n; i++) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, group->members[i].ref);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+/***
+ * Per member throughput since the previous call of stats or rebalance
+ * @function stats
+ * @treturn table array of tables with the fields messages, rate (messages per
+ * second) and rebalances, plus the fields mean (mean rate) and skew (highest
+ * rate divided by the mean)
+ */
+static int group_stats(lua_State *L)
+{
+	group_t *group = group_check(L, 1);
+	double mean = group__sample(group);
+	double max = 0;
+	group_member_t *m;
+	int i;
+
+	lua_newtable(L);
+	for (i = 0; i < group->n; i++) {
+		m = &group->members[i];
+		if (m->rate > max)
+			max = m->rate;
+		lua_newtable(L);
+		lua_pushinteger(L, m->last_messages);
+		lua_setfield(L, -2, "messages");
+		lua_pushnumber(L, m->rate);
+		lua_setfield(L, -2, "rate");
+		lua_pushinteger(L, m->rebalances);
+		lua_setfield(L, -2, "rebalances");
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_pushnumber(L, mean);
+	lua_setfield(L, -2, "mean");
+	lua_pushnumber(L, mean > 0 ? max / mean : 0);
+	lua_setfield(L, -2, "skew");
+	return 1;
+}
+
+/***
+ * Resubscribe the members lagging behind the mean rate, so the broker
+ * places them anew in its distribution of the shared subscription.
+ * @function rebalance
+ * @treturn number number of members resubscribed
+ */
+static int group_rebalance(lua_State *L)
+{
+	group_t *group = group_check(L, 1);
+	double mean = group__sample(group);
+	group_member_t *m;
+	int i, count = 0;
+
+	for (i = 0; mean > 0 && i < group->n; i++) {
+		m = &group->members[i];
+		if (m->ctx == NULL || m->rate >= mean * group->lag)
+			continue;
+		if (mosquitto_unsubscribe(m->ctx->mosq, NULL, m->ctx->auto_sub) != MOSQ_ERR_SUCCESS)
+			continue;
+		mosquitto_subscribe(m->ctx->mosq, NULL, m->ctx->auto_sub, m->ctx->auto_sub_qos);
+		ctx__io_kick(m->ctx, false);
+		m->rebalances++;
+		count++;
+	}
+
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+/***
+ * Run the network loop of all members not attached to an I/O pool
+ * @function loop
+ * @tparam[opt=-1] number timeout how long in ms to wait for traffic (-1 for library default)
+ * @treturn number number of members with traffic
+ */
+static int group_loop(lua_State *L)
+{
+	group_t *group = group_check(L, 1);
+	int timeout = luaL_optinteger(L, 2, -1);
+	struct pollfd *pfds;
+	group_member_t **polled;
+	uint64_t now = mosq__now_ms();
+	ctx_t *ctx;
+	int i, n = 0, count = 0;
+
+	pfds = lua_newuserdata(L, group->n * (sizeof(struct pollfd) + sizeof(group_member_t *)));
+	polled = (group_member_t **) (pfds + group->n);
+
+	for (i = 0; i < group->n; i++) {
+		ctx = group->members[i].ctx;
+		if (ctx == NULL || ctx->io.thread != NULL)
+			continue;
+		if (mosquitto_socket(ctx->mosq) == -1) {
+			if (!ctx->disconnecting && now >= ctx->io.reconnect_at) {
+				ctx->io.reconnect_at = now + 1000;
+				mosquitto_reconnect(ctx->mosq);
+			}
+			continue;
+		}
+		pfds[n].fd = mosquitto_socket(ctx->mosq);
+		pfds[n].events = POLLIN | (mosquitto_want_write(ctx->mosq) ? POLLOUT : 0);
+		pfds[n].revents = 0;
+		polled[n++] = &group->members[i];
+	}
+
+	if (n > 0)
+		poll(pfds, n, timeout < 0 ? 1000 : timeout);
+
+	for (i = 0; i < n; i++) {
+		ctx = polled[i]->ctx;
+		if (pfds[i].revents & (POLLIN | POLLERR | POLLHUP))
+			mosquitto_loop_read(ctx->mosq, 1);
+		if (pfds[i].revents & POLLOUT)
+			mosquitto_loop_write(ctx->mosq, 1);
+		mosquitto_loop_misc(ctx->mosq);
+		ctx__service(ctx);
+		if (pfds[i].revents)
+			count++;
+	}
+
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+/***
+ * Disconnect all members and release them.
+ * This is called automatically by garbage collection, you shouldn't normally
+ * have to call this.
+ * @function close
+ * @return boolean true
+ */
+static int group_close(lua_State *L)
+{
+	group_t *group = group_check(L, 1);
+	int i;
+
+	for (i = 0; group->members && i < group->n; i++) {
+		/* members may already be finalized when the state is closed */
+		if (group->members[i].ctx && group->members[i].ctx->mosq) {
+			group->members[i].ctx->disconnecting = true;
+			mosquitto_disconnect(group->members[i].ctx->mosq);
+			ctx__io_kick(group->members[i].ctx, false);
+		}
+		luaL_unref(L, LUA_REGISTRYINDEX, group->members[i].ref);
+	}
+	free(group->members);
+	group->members = NULL;
+	group->n = 0;
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Topic matchers
+ * @section matchers
+ */
+
+typedef struct match_node {
+	char *level;
+	size_t len;
+	struct match_node *children;	/* exact levels */
+	struct match_node *next;		/* sibling */
+	struct match_node *plus;		/* '+' level */
+	int *ends;			/* filters ending at this node */
+	int nends;
+	int *hash_ends;		/* filters ending in '#' below this node */
+	int nhash;
+} match_node_t;
+
+typedef struct {
+	match_node_t root;
+	int count;
+} matcher_t;
+
+typedef void (*match_cb_t)(int index, void *arg);
+
+static int ints__push(int **arr, int *n, int value)
+{
+	int *p = realloc(*arr, (*n + 1) * sizeof(int));
+
+	if (p == NULL)
+		return MOSQ_ERR_NOMEM;
+	p[(*n)++] = value;
+	*arr = p;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static match_node_t *match_node__child(match_node_t *node, const char *level, size_t len, bool create)
+{
+	match_node_t *c;
+
+	for (c = node->children; c; c = c->next) {
+		if (c->len == len && memcmp(c->level, level, len) == 0)
+			return c;
+	}
+	if (!create)
+		return NULL;
+
+	c = calloc(1, sizeof(match_node_t));
+	if (c == NULL)
+		return NULL;
+	c->level = malloc(len + 1);
+	if (c->level == NULL) {
+		free(c);
+		return NULL;
+	}
+	memcpy(c->level, level, len);
+	c->level[len] = '\0';
+	c->len = len;
+	c->next = node->children;
+	node->children = c;
+	return c;
+}
+
+static void match_node__free(match_node_t *node)
+{
+	match_node_t *c, *next;
+
+	for (c = node->children; c; c = next) {
+		next = c->next;
+		match_node__free(c);
+		free(c);
+	}
+	if (node->plus) {
+		match_node__free(node->plus);
+		free(node->plus);
+	}
+	free(node->level);
+	free(node->ends);
+	free(node->hash_ends);
+}
+
+static matcher_t *matcher__new(void)
+{
+	return calloc(1, sizeof(matcher_t));
+}
+
+static void matcher__free(matcher_t *m)
+{
+	if (m == NULL)
+		return;
+	match_node__free(&m->root);
+	free(m);
+}
+
+/* add a subscription filter, reported as index by matcher__match */
+static int matcher__add(matcher_t *m, const char *filter, int index)
+{
+	match_node_t *node = &m->root;
+	const char *level = filter, *end;
+	size_t len;
+
+	if (mosquitto_sub_topic_check(filter) != MOSQ_ERR_SUCCESS)
+		return MOSQ_ERR_INVAL;
+
+	for (;;) {
+		end = strchr(level, '/');
+		len = end ? (size_t) (end - level) : strlen(level);
+
+		if (len == 1 && level[0] == '#')
+			return ints__push(&node->hash_ends, &node->nhash, index);
+
+		if (len == 1 && level[0] == '+') {
+			if (node->plus == NULL) {
+				node->plus = calloc(1, sizeof(match_node_t));
+				if (node->plus == NULL)
+					return MOSQ_ERR_NOMEM;
+			}
+			node = node->plus;
+		} else {
+			node = match_node__child(node, level, len, true);
+			if (node == NULL)
+				return MOSQ_ERR_NOMEM;
+		}
+
+		if (end == NULL)
+			break;
+		level = end + 1;
+	}
+
+	return ints__push(&node->ends, &node->nends, index);
+}
+
+typedef struct {
+	const char *topic;
+	match_cb_t cb;
+	void *arg;
+	int count;
+} match_state_t;
+
+/*
+ * Levels are split off the topic as the walk goes, level being NULL past
+ * the last one. The recursion only goes as deep as the filters, so topics
+ * of any depth are fine.
+ */
+static void match__walk(match_state_t *st, const match_node_t *node, const char *level)
+{
+	const match_node_t *c;
+	const char *end, *next;
+	/* wildcards never match $ topics at the root */
+	bool sys = level == st->topic && st->topic[0] == '$';
+	size_t len;
+	int k;
+
+	/* '#' also matches the parent level */
+	if (!sys) {
+		for (k = 0; k < node->nhash; k++, st->count++)
+			st->cb(node->hash_ends[k], st->arg);
+	}
+
+	if (level == NULL) {
+		for (k = 0; k < node->nends; k++, st->count++)
+			st->cb(node->ends[k], st->arg);
+		return;
+	}
+
+	end = strchr(level, '/');
+	len = end ? (size_t) (end - level) : strlen(level);
+	next = end ? end + 1 : NULL;
+
+	for (c = node->children; c; c = c->next) {
+		if (c->len == len && memcmp(c->level, level, len) == 0) {
+			match__walk(st, c, next);
+			break;
+		}
+	}
+
+	if (node->plus && !sys)
+		match__walk(st, node->plus, next);
+}
+
+/* call cb for every filter matching topic, returns the number of matches */
+static int matcher__match(const matcher_t *m, const char *topic, match_cb_t cb, void *arg)
+{
+	match_state_t st;
+
+	st.topic = topic;
+	st.cb = cb;
+	st.arg = arg;
+	st.count = 0;
+
+	match__walk(&st, &m->root, topic);
+	return st.count;
+}
+
+static void match__count_cb(int index, void *arg)
+{
+}
+
+/* true if any filter matches */
+static bool matcher__any(const matcher_t *m, const char *topic)
+{
+	return matcher__match(m, topic, match__count_cb, NULL) > 0;
+}
+
+static matcher_t * matcher_check(lua_State *L, int i)
+{
+	matcher_t **ud = (matcher_t **) luaL_checkudata(L, i, MOSQ_META_MATCHER);
+
+	if (*ud == NULL)
+		luaL_argerror(L, i, "matcher is freed");
+	return *ud;
+}
+
+/* array of filters at index into m, raises on bad filters */
+static void matcher__add_all(lua_State *L, int index, matcher_t *m)
+{
+	int i, n = lua_rawlen(L, index);
+
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, index, i);
+		if (lua_type(L, -1) != LUA_TSTRING) {
+			luaL_argerror(L, index, "expecting an array of topic filters");
+		}
+		if (matcher__add(m, lua_tostring(L, -1), ++m->count) != MOSQ_ERR_SUCCESS) {
+			luaL_error(L, "invalid topic filter '%s'", lua_tostring(L, -1));
+		}
+		lua_pop(L, 1);
+	}
+}
+
+/***
+ * Compile topic filters into a matcher, that matches a topic against all of
+ * them at once.
+ * @function matcher
+ * @tparam table filters array of subscription filters, eg {"a/+/c", "a/#"}
+ * @return a matcher
+ * @raise For invalid filters or out of memory
+ */
+static int mosq_matcher(lua_State *L)
+{
+	matcher_t **ud;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	ud = (matcher_t **) lua_newuserdata(L, sizeof(matcher_t *));
+	*ud = matcher__new();
+	luaL_getmetatable(L, MOSQ_META_MATCHER);
+	lua_setmetatable(L, -2);
+
+	if (*ud == NULL) {
+		return luaL_error(L, strerror(ENOMEM));
+	}
+
+	matcher__add_all(L, 1, *ud);
+	return 1;
+}
+
+/***
+ * Matcher functions
+ * @section matcher_functions
+ */
+
+typedef struct {
+	lua_State *L;
+	int n;
+} match_push_t;
+
+static void match__push_cb(int index, void *arg)
+{
+	match_push_t *mp = arg;
+	lua_State *L = mp->L;
+	int i;
+
+	/* keep the indexes sorted, the arrays are short */
+	lua_pushinteger(L, index);
+	for (i = mp->n; i > 0; i--) {
+		lua_rawgeti(L, -2, i);
+		if (lua_tointeger(L, -1) < index) {
+			lua_pop(L, 1);
+			break;
+		}
+		lua_rawseti(L, -3, i + 1);
+	}
+	lua_rawseti(L, -2, i + 1);
+	mp->n++;
+}
+
+static void matcher__push_matches(lua_State *L, matcher_t *m, const char *topic)
+{
+	match_push_t mp;
+
+	mp.L = L;
+	mp.n = 0;
+	lua_newtable(L);
+	matcher__match(m, topic, match__push_cb, &mp);
+}
+
+/***
+ * Filters matching a topic
+ * @function match
+ * @tparam string topic
+ * @treturn table sorted array of the indexes of the matching filters
+ */
+static int matcher_match(lua_State *L)
+{
+	matcher_t *m = matcher_check(L, 1);
+	const char *topic = luaL_checkstring(L, 2);
+
+	matcher__push_matches(L, m, topic);
+	return 1;
+}
+
+/***
+ * Filters matching each of a number of topics
+ * @function match_many
+ * @tparam table topics array of topics
+ * @treturn table array with the result of match for every topic
+ */
+static int matcher_match_many(lua_State *L)
+{
+	matcher_t *m = matcher_check(L, 1);
+	int i, n;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = lua_rawlen(L, 2);
+
+	lua_createtable(L, n, 0);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, 2, i);
+		if (lua_type(L, -1) != LUA_TSTRING) {
+			return luaL_argerror(L, 2, "expecting an array of topics");
+		}
+		matcher__push_matches(L, m, lua_tostring(L, -1));
+		lua_rawseti(L, -3, i);
+		lua_pop(L, 1);
+	}
+	return 1;
+}
+
+/***
+ * Add more filters
+ * @function add
+ * @tparam string|table filter one filter or an array of them
+ * @treturn number index of the last filter added
+ * @raise For invalid filters or out of memory
+ */
+static int matcher_add(lua_State *L)
+{
+	matcher_t *m = matcher_check(L, 1);
+
+	if (lua_istable(L, 2)) {
+		matcher__add_all(L, 2, m);
+	} else {
+		const char *filter = luaL_checkstring(L, 2);
+		if (matcher__add(m, filter, ++m->count) != MOSQ_ERR_SUCCESS) {
+			m->count--;
+			return luaL_error(L, "invalid topic filter '%s'", filter);
+		}
+	}
+
+	lua_pushinteger(L, m->count);
+	return 1;
+}
+
+static int matcher_gc(lua_State *L)
+{
+	matcher_t **ud = (matcher_t **) luaL_checkudata(L, 1, MOSQ_META_MATCHER);
+
+	matcher__free(*ud);
+	*ud = NULL;
+	return 0;
+}
+
+/***
+ * Spools
+ * @section spools
+ */
+
+/*
+ * A spool is a memory mapped, append only log of QoS>0 publishes. Records are
+ * tombstoned in place once the broker acknowledged them, whatever is left
+ * gets published again when the spool is opened. Host byte order, spools
+ * aren't meant to be moved between machines.
+ *
+ * file:	magic[8] version:u32 reserved:u32
+ * record:	len:u32 check:u32 type:u8 qos:u8 retain:u8 pad:u8
+ *			topiclen:u32 payloadlen:u32 propslen:u32 topic payload props
+ *
+ * len counts everything after the record header, check covers qos up to the
+ * end of the record so that torn writes are caught when the log is scanned.
+ */
+#define SPOOL_MAGIC			"LMQSPOOL"
+#define SPOOL_VERSION		1
+#define SPOOL_HEADER		16
+#define SPOOL_REC_HEADER	12
+#define SPOOL_REC_PUB		1
+#define SPOOL_REC_DONE		2
+#define SPOOL_CHUNK			(1 << 20)
+/* compact once the log is this big and mostly acknowledged */
+#define SPOOL_COMPACT_MIN	(8 << 20)
+/* mids are 16 bit */
+#define SPOOL_MIDS			65536
+
+typedef struct spool {
+	char *path;
+	int fd;
+	unsigned char *map;
+	size_t cap;			/* file and mapping size */
+	size_t end;			/* append offset */
+	bool dirty;			/* appended or tombstoned since the last sync */
+	size_t sync_from;	/* lowest offset touched since the last sync */
+	uint64_t dirty_at;
+	size_t unsynced;
+	int sync_ms;
+	size_t sync_bytes;
+	pthread_mutex_t lock;	/* appends come from the Lua thread, acks from the network side */
+	uint64_t *mids;		/* record of each inflight mid */
+	uint32_t *acks;		/* seq of the last ack seen for each mid */
+	uint32_t seq;
+	size_t live;		/* records not acknowledged yet */
+	size_t live_bytes;
+	unsigned long written;
+	unsigned long acked;
+	unsigned long replayed;
+	unsigned long syncs;
+	unsigned long compactions;
+} spool_t;
+
+static uint32_t spool__check(const unsigned char *p, size_t n)
+{
+	uint32_t h = 2166136261u;
+
+	while (n--) {
+		h ^= *p++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static int spool__write_all(int fd, const void *buf, size_t n)
+{
+	const char *p = buf;
+	ssize_t w;
+
+	while (n > 0) {
+		w = write(fd, p, n);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w < 0)
+			return -1;
+		p += w;
+		n -= w;
+	}
+	return 0;
+}
+
+/* map the first cap bytes of fd, growing the file as needed, NULL on failure */
+static unsigned char *spool__map(int fd, size_t cap)
+{
+	struct stat st;
+	void *p;
+
+	if (fstat(fd, &st) != 0)
+		return NULL;
+	if ((size_t) st.st_size < cap) {
+#ifdef __linux__
+		/* allocate now, a full disk would otherwise SIGBUS on a store to the map */
+		errno = posix_fallocate(fd, st.st_size, cap - st.st_size);
+		if (errno != 0)
+			return NULL;
+#else
+		if (ftruncate(fd, cap) != 0)
+			return NULL;
+#endif
+	}
+
+	p = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static void spool__remap(spool_t *sp, unsigned char *map, size_t cap)
+{
+	if (sp->map)
+		munmap(sp->map, sp->cap);
+	sp->map = map;
+	sp->cap = cap;
+}
+
+/* size of the valid record at off, 0 at the end of the log */
+static size_t spool__record(const spool_t *sp, size_t off)
+{
+	uint32_t len, check;
+	const unsigned char *p = sp->map + off;
+
+	if (off + SPOOL_REC_HEADER > sp->cap)
+		return 0;
+	memcpy(&len, p, 4);
+	memcpy(&check, p + 4, 4);
+	if (len < 12 || len > sp->cap - off - SPOOL_REC_HEADER)
+		return 0;
+	if (p[8] != SPOOL_REC_PUB && p[8] != SPOOL_REC_DONE)
+		return 0;
+	if (spool__check(p + 9, len + 3) != check)
+		return 0;
+	return SPOOL_REC_HEADER + len;
+}
+
+/* encode props into out, or only size them when out is NULL */
+static size_t spool__props_encode(const mosquitto_property *props, unsigned char *out)
+{
+	const mosquitto_property *prop;
+	const char *name;
+	char *s1, *s2;
+	void *bin;
+	uint8_t u8;
+	uint16_t u16, l1, l2;
+	uint32_t u32;
+	int identifier, type;
+	size_t n = 0;
+
+	for (prop = props; prop; prop = mosquitto_property_next(prop)) {
+		identifier = mosquitto_property_identifier(prop);
+		name = mosquitto_property_identifier_to_string(identifier);
+		if (name == NULL || mosquitto_string_to_property_info(name, &identifier, &type) != MOSQ_ERR_SUCCESS)
+			continue;
+
+		if (out)
+			out[n] = identifier;
+		n++;
+
+		switch (type) {
+			case MQTT_PROP_TYPE_BYTE:
+				mosquitto_property_read_byte(prop, identifier, &u8, false);
+				if (out)
+					out[n] = u8;
+				n += 1;
+				break;
+			case MQTT_PROP_TYPE_INT16:
+				mosquitto_property_read_int16(prop, identifier, &u16, false);
+				if (out)
+					memcpy(out + n, &u16, 2);
+				n += 2;
+				break;
+			case MQTT_PROP_TYPE_INT32:
+				mosquitto_property_read_int32(prop, identifier, &u32, false);
+				if (out)
+					memcpy(out + n, &u32, 4);
+				n += 4;
+				break;
+			case MQTT_PROP_TYPE_VARINT:
+				mosquitto_property_read_varint(prop, identifier, &u32, false);
+				if (out)
+					memcpy(out + n, &u32, 4);
+				n += 4;
+				break;
+			case MQTT_PROP_TYPE_BINARY:
+				bin = NULL;
+				u16 = 0;
+				mosquitto_property_read_binary(prop, identifier, &bin, &u16, false);
+				if (out) {
+					memcpy(out + n, &u16, 2);
+					memcpy(out + n + 2, bin, u16);
+				}
+				n += 2 + u16;
+				free(bin);
+				break;
+			case MQTT_PROP_TYPE_STRING:
+				s1 = NULL;
+				mosquitto_property_read_string(prop, identifier, &s1, false);
+				l1 = s1 ? strlen(s1) : 0;
+				if (out) {
+					memcpy(out + n, &l1, 2);
+					memcpy(out + n + 2, s1, l1);
+				}
+				n += 2 + l1;
+				free(s1);
+				break;
+			case MQTT_PROP_TYPE_STRING_PAIR:
+				s1 = s2 = NULL;
+				mosquitto_property_read_string_pair(prop, identifier, &s1, &s2, false);
+				l1 = s1 ? strlen(s1) : 0;
+				l2 = s2 ? strlen(s2) : 0;
+				if (out) {
+					memcpy(out + n, &l1, 2);
+					memcpy(out + n + 2, s1, l1);
+					memcpy(out + n + 2 + l1, &l2, 2);
+					memcpy(out + n + 4 + l1, s2, l2);
+				}
+				n += 4 + l1 + l2;
+				free(s1);
+				free(s2);
+				break;
+		}
+	}
+	return n;
+}
+
+static int spool__props_decode(const unsigned char *p, size_t n, mosquitto_property **props)
+{
+	const unsigned char *end = p + n;
+	char *s1, *s2;
+	uint16_t l1, l2;
+	uint32_t u32;
+	int identifier, type, rc = MOSQ_ERR_SUCCESS;
+
+	while (p < end && rc == MOSQ_ERR_SUCCESS) {
+		identifier = *p++;
+		if (mosquitto_string_to_property_info(mosquitto_property_identifier_to_string(identifier), &identifier, &type) != MOSQ_ERR_SUCCESS)
+			return MOSQ_ERR_MALFORMED_PACKET;
+
+		switch (type) {
+			case MQTT_PROP_TYPE_BYTE:
+				rc = mosquitto_property_add_byte(props, identifier, *p);
+				p += 1;
+				break;
+			case MQTT_PROP_TYPE_INT16:
+				memcpy(&l1, p, 2);
+				rc = mosquitto_property_add_int16(props, identifier, l1);
+				p += 2;
+				break;
+			case MQTT_PROP_TYPE_INT32:
+			case MQTT_PROP_TYPE_VARINT:
+				memcpy(&u32, p, 4);
+				if (type == MQTT_PROP_TYPE_INT32)
+					rc = mosquitto_property_add_int32(props, identifier, u32);
+				else
+					rc = mosquitto_property_add_varint(props, identifier, u32);
+				p += 4;
+				break;
+			case MQTT_PROP_TYPE_BINARY:
+				memcpy(&l1, p, 2);
+				rc = mosquitto_property_add_binary(props, identifier, p + 2, l1);
+				p += 2 + l1;
+				break;
+			case MQTT_PROP_TYPE_STRING:
+			case MQTT_PROP_TYPE_STRING_PAIR:
+				memcpy(&l1, p, 2);
+				s1 = strndup((const char *) p + 2, l1);
+				p += 2 + l1;
+				s2 = NULL;
+				if (type == MQTT_PROP_TYPE_STRING_PAIR) {
+					memcpy(&l2, p, 2);
+					s2 = strndup((const char *) p + 2, l2);
+					p += 2 + l2;
+				}
+				if (s1 == NULL || (type == MQTT_PROP_TYPE_STRING_PAIR && s2 == NULL))
+					rc = MOSQ_ERR_NOMEM;
+				else if (type == MQTT_PROP_TYPE_STRING)
+					rc = mosquitto_property_add_string(props, identifier, s1);
+				else
+					rc = mosquitto_property_add_string_pair(props, identifier, s1, s2);
+				free(s1);
+				free(s2);
+				break;
+			default:
+				return MOSQ_ERR_MALFORMED_PACKET;
+		}
+	}
+	if (rc != MOSQ_ERR_SUCCESS)
+		mosquitto_property_free_all(props);
+	return rc;
+}
+
+static void spool__touch(spool_t *sp, size_t off, size_t n)
+{
+	if (!sp->dirty) {
+		sp->dirty = true;
+		sp->dirty_at = mosq__now_ms();
+		sp->sync_from = off;
+	} else if (off < sp->sync_from) {
+		sp->sync_from = off;
+	}
+	sp->unsynced += n;
+}
+
+static int spool__sync(spool_t *sp)
+{
+	size_t from;
+	long page = sysconf(_SC_PAGESIZE);
+
+	if (!sp->dirty)
+		return 0;
+	from = sp->sync_from - sp->sync_from % page;
+	if (msync(sp->map + from, sp->end - from, MS_SYNC) != 0)
+		return -1;
+	sp->dirty = false;
+	sp->unsynced = 0;
+	sp->syncs++;
+	return 0;
+}
+
+/* group commit, sync once enough was written or the oldest write waited long enough */
+static void spool__sync_due(spool_t *sp)
+{
+	if (sp->dirty && (sp->unsynced >= sp->sync_bytes || mosq__now_ms() - sp->dirty_at >= (uint64_t) sp->sync_ms))
+		spool__sync(sp);
+}
+
+/* offset of the new record, 0 if it couldn't be written */
+static size_t spool__append(spool_t *sp, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *props)
+{
+	uint32_t topiclen = strlen(topic), plen = payloadlen, propslen = spool__props_encode(props, NULL), len, check;
+	size_t off = sp->end, cap;
+	unsigned char *p;
+
+	len = 12 + topiclen + plen + propslen;
+	if (off + SPOOL_REC_HEADER + len > sp->cap) {
+		for (cap = sp->cap; cap < off + SPOOL_REC_HEADER + len; cap *= 2);
+		p = spool__map(sp->fd, cap);
+		if (p == NULL)
+			return 0;
+		spool__remap(sp, p, cap);
+	}
+
+	p = sp->map + off;
+	memcpy(p, &len, 4);
+	p[8] = SPOOL_REC_PUB;
+	p[9] = qos;
+	p[10] = retain;
+	p[11] = 0;
+	memcpy(p + 12, &topiclen, 4);
+	memcpy(p + 16, &plen, 4);
+	memcpy(p + 20, &propslen, 4);
+	memcpy(p + 24, topic, topiclen);
+	if (plen)
+		memcpy(p + 24 + topiclen, payload, plen);
+	spool__props_encode(props, p + 24 + topiclen + plen);
+	check = spool__check(p + 9, len + 3);
+	memcpy(p + 4, &check, 4);
+
+	sp->end += SPOOL_REC_HEADER + len;
+	sp->live++;
+	sp->live_bytes += SPOOL_REC_HEADER + len;
+	sp->written++;
+	spool__touch(sp, off, SPOOL_REC_HEADER + len);
+	if (sp->sync_ms == 0)
+		spool__sync(sp);
+	else
+		spool__sync_due(sp);
+	return off;
+}
+
+static void spool__tombstone(spool_t *sp, size_t off)
+{
+	uint32_t len;
+
+	if (sp->map[off + 8] != SPOOL_REC_PUB)
+		return;
+	memcpy(&len, sp->map + off, 4);
+	sp->map[off + 8] = SPOOL_REC_DONE;
+	sp->live--;
+	sp->live_bytes -= SPOOL_REC_HEADER + len;
+	sp->acked++;
+	spool__touch(sp, off, 1);
+}
+
+/* bind a record to the mid libmosquitto gave it, seq as sampled before publishing */
+static void spool__track(spool_t *sp, int mid, size_t off, uint32_t seq)
+{
+	/* the ack overtook us, the network side runs on another thread */
+	if ((int32_t) (sp->acks[mid] - seq) > 0) {
+		spool__tombstone(sp, off);
+		return;
+	}
+	/* a mid still in use after 65535 more publishes stays in the log until the next replay */
+	sp->mids[mid] = off;
+}
+
+/* broker acknowledged mid, on the network side */
+static void spool__ack(spool_t *sp, int mid)
+{
+	size_t off;
+
+	if (mid <= 0 || mid >= SPOOL_MIDS)
+		return;
+
+	pthread_mutex_lock(&sp->lock);
+	sp->acks[mid] = ++sp->seq;
+	off = sp->mids[mid];
+	if (off) {
+		sp->mids[mid] = 0;
+		spool__tombstone(sp, off);
+	}
+	pthread_mutex_unlock(&sp->lock);
+}
+
+/*
+ * Spool and publish. The lock isn't held while publishing, libmosquitto may
+ * run callbacks from inside mosquitto_publish_v5.
+ */
+static int spool__publish(ctx_t *ctx, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *props)
+{
+	spool_t *sp = ctx->spool;
+	size_t off;
+	uint32_t seq;
+	int m = 0, rc;
+
+	pthread_mutex_lock(&sp->lock);
+	off = spool__append(sp, topic, payloadlen, payload, qos, retain, props);
+	seq = sp->seq;
+	pthread_mutex_unlock(&sp->lock);
+
+	if (off == 0)
+		return MOSQ_ERR_ERRNO;
+
+	rc = mosquitto_publish_v5(ctx->mosq, &m, topic, payloadlen, payload, qos, retain, props);
+
+	pthread_mutex_lock(&sp->lock);
+	if (rc == MOSQ_ERR_SUCCESS && m > 0 && m < SPOOL_MIDS)
+		spool__track(sp, m, off, seq);
+	else if (rc != MOSQ_ERR_SUCCESS)
+		spool__tombstone(sp, off);
+	pthread_mutex_unlock(&sp->lock);
+
+	if (mid)
+		*mid = m;
+	return rc;
+}
+
+/* publish every live record again, returns how many */
+static int spool__replay(ctx_t *ctx)
+{
+	spool_t *sp = ctx->spool;
+	mosquitto_property *props;
+	unsigned char *rec;
+	uint32_t topiclen, plen, propslen;
+	size_t off, n;
+	uint32_t seq;
+	int count = 0, mid, rc, qos;
+	bool retain;
+
+	pthread_mutex_lock(&sp->lock);
+	memset(sp->mids, 0, SPOOL_MIDS * sizeof(uint64_t));
+	for (off = SPOOL_HEADER; off < sp->end; off += n) {
+		n = spool__record(sp, off);
+		if (n == 0)
+			break;
+		if (sp->map[off + 8] != SPOOL_REC_PUB)
+			continue;
+
+		/* the map moves when the log grows, publish from a copy */
+		rec = malloc(n);
+		if (rec == NULL)
+			break;
+		memcpy(rec, sp->map + off, n);
+		seq = sp->seq;
+		pthread_mutex_unlock(&sp->lock);
+
+		memcpy(&topiclen, rec + 12, 4);
+		memcpy(&plen, rec + 16, 4);
+		memcpy(&propslen, rec + 20, 4);
+		qos = rec[9];
+		retain = rec[10];
+		props = NULL;
+		rc = spool__props_decode(rec + 24 + topiclen + plen, propslen, &props);
+		if (rc == MOSQ_ERR_SUCCESS) {
+			/* topic isn't terminated in the record */
+			memmove(rec, rec + 24, topiclen);
+			rec[topiclen] = '\0';
+			mid = 0;
+			rc = mosquitto_publish_v5(ctx->mosq, &mid, (char *) rec, plen, rec + 24 + topiclen, qos, retain, props);
+		}
+		mosquitto_property_free_all(&props);
+		free(rec);
+
+		pthread_mutex_lock(&sp->lock);
+		/* records that can't be published now stay for the next run */
+		if (rc == MOSQ_ERR_SUCCESS) {
+			if (mid > 0 && mid < SPOOL_MIDS)
+				spool__track(sp, mid, off, seq);
+			sp->replayed++;
+			count++;
+		}
+	}
+	pthread_mutex_unlock(&sp->lock);
+	return count;
+}
+
+typedef struct {
+	uint64_t from;
+	uint64_t to;
+} spool_reloc_t;
+
+static int spool__reloc_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = ((const spool_reloc_t *) b)->from;
+
+	return x < y ? -1 : x > y;
+}
+
+/* rewrite the live records into a fresh file that replaces the log */
+static int spool__compact(spool_t *sp)
+{
+	static const char suffix[] = ".tmp";
+	spool_reloc_t *relocs = NULL, *r;
+	unsigned char header[SPOOL_HEADER], *map = NULL;
+	uint32_t version = SPOOL_VERSION;
+	size_t off, n, to = SPOOL_HEADER, nrelocs = 0, cap = 0, i;
+	char *tmp, *slash;
+	int fd = -1, dfd;
+
+	tmp = malloc(strlen(sp->path) + sizeof(suffix));
+	if (tmp == NULL)
+		return -1;
+	strcpy(tmp, sp->path);
+	strcat(tmp, suffix);
+
+	if (sp->live) {
+		relocs = malloc(sp->live * sizeof(spool_reloc_t));
+		if (relocs == NULL)
+			goto fail;
+	}
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		goto fail;
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, SPOOL_MAGIC, 8);
+	memcpy(header + 8, &version, 4);
+	if (spool__write_all(fd, header, sizeof(header)) != 0)
+		goto fail;
+
+	for (off = SPOOL_HEADER; off < sp->end && nrelocs < sp->live; off += n) {
+		n = spool__record(sp, off);
+		if (n == 0)
+			break;
+		if (sp->map[off + 8] != SPOOL_REC_PUB)
+			continue;
+		if (spool__write_all(fd, sp->map + off, n) != 0)
+			goto fail;
+		relocs[nrelocs].from = off;
+		relocs[nrelocs].to = to;
+		nrelocs++;
+		to += n;
+	}
+
+	for (cap = SPOOL_CHUNK; cap < to; cap *= 2);
+	map = spool__map(fd, cap);
+	if (map == NULL || fsync(fd) != 0 || rename(tmp, sp->path) != 0)
+		goto fail;
+
+	/* make the rename itself durable */
+	slash = strrchr(tmp, '/');
+	if (slash)
+		slash[1] = '\0';
+	dfd = open(slash ? tmp : ".", O_RDONLY | O_CLOEXEC);
+	if (dfd >= 0) {
+		fsync(dfd);
+		close(dfd);
+	}
+
+	spool__remap(sp, map, cap);
+	close(sp->fd);
+	sp->fd = fd;
+
+	/* relocs are in log order, so sorted by offset */
+	for (i = 0; i < SPOOL_MIDS; i++) {
+		if (sp->mids[i] == 0)
+			continue;
+		r = bsearch(&sp->mids[i], relocs, nrelocs, sizeof(spool_reloc_t), spool__reloc_cmp);
+		sp->mids[i] = r ? r->to : 0;
+	}
+
+	sp->end = to;
+	sp->live = nrelocs;
+	sp->live_bytes = to - SPOOL_HEADER;
+	sp->dirty = false;
+	sp->unsynced = 0;
+	sp->compactions++;
+	free(relocs);
+	free(tmp);
+	return 0;
+
+fail:
+	if (map)
+		munmap(map, cap);
+	if (fd >= 0) {
+		close(fd);
+		unlink(tmp);
+	}
+	free(relocs);
+	free(tmp);
+	return -1;
+}
+
+static void spool__service(spool_t *sp)
+{
+	pthread_mutex_lock(&sp->lock);
+	spool__sync_due(sp);
+	if (sp->end >= SPOOL_COMPACT_MIN && sp->live_bytes < (sp->end - SPOOL_HEADER) / 4)
+		spool__compact(sp);
+	pthread_mutex_unlock(&sp->lock);
+}
+
+static void spool__free(spool_t *sp)
+{
+	if (sp->map)
+		munmap(sp->map, sp->cap);
+	if (sp->fd >= 0)
+		close(sp->fd);
+	pthread_mutex_destroy(&sp->lock);
+	free(sp->mids);
+	free(sp->acks);
+	free(sp->path);
+	free(sp);
+}
+
+static void spool__close(spool_t *sp)
+{
+	spool__sync(sp);
+	spool__free(sp);
+}
+
+/* add the spool counters to the table on top of the stack */
+static void spool__stats(lua_State *L, spool_t *sp)
+{
+	pthread_mutex_lock(&sp->lock);
+	lua_pushinteger(L, sp->live);
+	lua_setfield(L, -2, "spooled");
+	lua_pushinteger(L, sp->end);
+	lua_setfield(L, -2, "spool_bytes");
+	lua_pushinteger(L, sp->written);
+	lua_setfield(L, -2, "spool_written");
+	lua_pushinteger(L, sp->acked);
+	lua_setfield(L, -2, "spool_acked");
+	lua_pushinteger(L, sp->replayed);
+	lua_setfield(L, -2, "spool_replayed");
+	lua_pushinteger(L, sp->syncs);
+	lua_setfield(L, -2, "spool_syncs");
+	lua_pushinteger(L, sp->compactions);
+	lua_setfield(L, -2, "spool_compactions");
+	pthread_mutex_unlock(&sp->lock);
+}
+
+/* open or create the log at path and find its end, NULL with errno set on failure */
+static spool_t *spool__open(const char *path, int sync_ms, size_t sync_bytes)
+{
+	spool_t *sp = calloc(1, sizeof(spool_t));
+	uint32_t version = SPOOL_VERSION;
+	struct stat st;
+	size_t off, n, cap;
+	int err;
+
+	if (sp == NULL)
+		return NULL;
+	sp->fd = -1;
+	sp->sync_ms = sync_ms;
+	sp->sync_bytes = sync_bytes;
+	pthread_mutex_init(&sp->lock, NULL);
+	sp->path = strdup(path);
+	sp->mids = calloc(SPOOL_MIDS, sizeof(uint64_t));
+	sp->acks = calloc(SPOOL_MIDS, sizeof(uint32_t));
+	if (sp->path == NULL || sp->mids == NULL || sp->acks == NULL) {
+		errno = ENOMEM;
+		goto fail;
+	}
+
+	sp->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (sp->fd < 0 || fstat(sp->fd, &st) != 0)
+		goto fail;
+
+	for (cap = SPOOL_CHUNK; cap < (size_t) st.st_size; cap *= 2);
+	sp->map = spool__map(sp->fd, cap);
+	if (sp->map == NULL)
+		goto fail;
+	sp->cap = cap;
+
+	if (st.st_size == 0) {
+		memcpy(sp->map, SPOOL_MAGIC, 8);
+		memcpy(sp->map + 8, &version, 4);
+		sp->end = SPOOL_HEADER;
+		spool__touch(sp, 0, SPOOL_HEADER);
+		spool__sync(sp);
+		return sp;
+	}
+
+	memcpy(&version, sp->map + 8, 4);
+	if (st.st_size < SPOOL_HEADER || memcmp(sp->map, SPOOL_MAGIC, 8) != 0 || version != SPOOL_VERSION) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	for (off = SPOOL_HEADER; (n = spool__record(sp, off)) != 0; off += n) {
+		if (sp->map[off + 8] == SPOOL_REC_PUB) {
+			sp->live++;
+			sp->live_bytes += n;
+		}
+	}
+	sp->end = off;
+
+	/* a torn tail must not be mistaken for records once appends resume */
+	for (n = off; n < sp->cap && sp->map[n] == 0; n++);
+	if (n < sp->cap) {
+		n = off - off % sysconf(_SC_PAGESIZE);
+		memset(sp->map + off, 0, sp->cap - off);
+		msync(sp->map + n, sp->cap - n, MS_SYNC);
+	}
+	return sp;
+
+fail:
+	err = errno;
+	spool__free(sp);
+	errno = err;
+	return NULL;
+}
+
+/***
+ * Keep QoS 1 and 2 publishes in a file until the broker acknowledged them.
+ * Whatever a previous run left unacknowledged is published again right away,
+ * libmosquitto sends it once connected. Set the protocol version first,
+ * messages with properties need v5.
+ * @function spool
+ * @tparam string path spool file, created if missing, nil closes the spool
+ * @tparam[opt] table options
+ *   sync_ms (50) and sync_bytes (65536) batch writes until either is reached
+ *   before syncing them to disk, sync_ms 0 syncs on every publish
+ * @treturn[1] number messages replayed
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int ctx_spool(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *path = luaL_optstring(L, 2, NULL);
+	int sync_ms = opt__integer(L, 3, "sync_ms", 50);
+	lua_Integer sync_bytes = opt__integer(L, 3, "sync_bytes", 65536);
+	spool_t *sp;
+
+	if (sync_ms < 0)
+		return luaL_argerror(L, 3, "sync_ms must not be negative");
+	if (sync_bytes < 0)
+		return luaL_argerror(L, 3, "sync_bytes must not be negative");
+
+	/* the I/O thread acknowledges and drains publishers into the spool */
+	if (ctx->io.thread)
+		return luaL_error(L, "can't change the spool of a client attached to an I/O pool");
+
+	if (ctx->spool) {
+		spool__close(ctx->spool);
+		ctx->spool = NULL;
+	}
+	if (path == NULL)
+		return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+
+	sp = spool__open(path, sync_ms, sync_bytes);
+	if (sp == NULL) {
+		if (errno == EINVAL)
+			return luaL_error(L, "'%s' is not a spool", path);
+		return mosq__pstatus(L, MOSQ_ERR_ERRNO);
+	}
+
+	ctx->spool = sp;
+	mosquitto_publish_callback_set(ctx->mosq, ctx_on_publish);
+
+	lua_pushinteger(L, spool__replay(ctx));
+	return 1;
+}
+
+/***
+ * Offline buffers
+ * @section offline_buffers
+ */
+
+enum offline_policy {
+	OFFLINE_DROP_OLDEST,
+	OFFLINE_DROP_NEWEST,
+	OFFLINE_LATEST,
+};
+
+static const char *const offline_policies[] = { "drop_oldest", "drop_newest", "latest", NULL };
+
+/* messages flushed per loop iteration once connected again */
+#define OFFLINE_BATCH	256
+
+typedef struct offline {
+	pthread_mutex_t lock;	/* pushed from the Lua thread, flushed from either side */
+	pubmsg_t **ring;
+	size_t mask;		/* ring size - 1 */
+	uint64_t head;		/* absolute positions */
+	uint64_t tail;
+	size_t bytes;
+	size_t max_bytes;
+	size_t max_messages;
+	int policy;
+	strmap_t topics;	/* latest policy, topic -> position + 1 */
+	bool online;		/* CONNACK seen since the last MOSQ_ERR_NO_CONN */
+	bool flushing;		/* one flusher at a time keeps the order */
+	unsigned long dropped;
+	unsigned long replaced;
+	unsigned long flushed;
+} offline_t;
+
+static size_t offline__size(const pubmsg_t *m)
+{
+	return strlen(m->topic) + m->payloadlen;
+}
+
+static int offline__reserve(offline_t *o)
+{
+	pubmsg_t **ring;
+	size_t n = o->ring ? o->mask + 1 : 0, cap = n ? n * 2 : 64;
+	uint64_t i;
+
+	if (o->ring && o->tail - o->head <= o->mask)
+		return MOSQ_ERR_SUCCESS;
+
+	ring = malloc(cap * sizeof(pubmsg_t *));
+	if (ring == NULL)
+		return MOSQ_ERR_NOMEM;
+	for (i = o->head; i != o->tail; i++)
+		ring[i & (cap - 1)] = o->ring[i & o->mask];
+	free(o->ring);
+	o->ring = ring;
+	o->mask = cap - 1;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static pubmsg_t *offline__pop(offline_t *o)
+{
+	strmap_slot_t *slot;
+	pubmsg_t *m;
+
+	if (o->head == o->tail)
+		return NULL;
+
+	m = o->ring[o->head & o->mask];
+	if (o->policy == OFFLINE_LATEST) {
+		slot = strmap__find(&o->topics, m->topic);
+		if (slot && (uintptr_t) slot->value == (uintptr_t) (o->head + 1))
+			strmap__remove(&o->topics, slot);
+	}
+	o->head++;
+	o->bytes -= offline__size(m);
+	return m;
+}
+
+/* takes m, which may end up dropped */
+static void offline__push(offline_t *o, pubmsg_t *m)
+{
+	strmap_slot_t *slot = NULL;
+	size_t size = offline__size(m);
+	pubmsg_t **old;
+
+	if (o->policy == OFFLINE_LATEST) {
+		slot = strmap__insert(&o->topics, m->topic);
+		if (slot && slot->value) {
+			/* newer value of a queued topic, keeps the old one's place */
+			old = &o->ring[((uintptr_t) slot->value - 1) & o->mask];
+			o->bytes += size - offline__size(*old);
+			pubmsg__free(*old);
+			*old = m;
+			o->replaced++;
+			return;
+		}
+	}
+
+	if (o->policy == OFFLINE_DROP_NEWEST && o->head != o->tail &&
+			(o->tail - o->head >= o->max_messages || o->bytes + size > o->max_bytes)) {
+		pubmsg__free(m);
+		o->dropped++;
+		return;
+	}
+
+	while (o->head != o->tail && (o->tail - o->head >= o->max_messages || o->bytes + size > o->max_bytes)) {
+		pubmsg__free(offline__pop(o));
+		o->dropped++;
+		/* popping may have moved the slot */
+		if (o->policy == OFFLINE_LATEST)
+			slot = strmap__find(&o->topics, m->topic);
+	}
+
+	if (size > o->max_bytes || offline__reserve(o) != MOSQ_ERR_SUCCESS || (o->policy == OFFLINE_LATEST && slot == NULL)) {
+		if (slot)
+			strmap__remove(&o->topics, slot);
+		pubmsg__free(m);
+		o->dropped++;
+		return;
+	}
+
+	if (slot)
+		slot->value = (void *) (uintptr_t) (o->tail + 1);
+	o->ring[o->tail++ & o->mask] = m;
+	o->bytes += size;
+}
+
+/* back at the head after a failed flush */
+static void offline__unpop(offline_t *o, pubmsg_t *m)
+{
+	strmap_slot_t *slot = NULL;
+
+	if (o->policy == OFFLINE_LATEST) {
+		slot = strmap__insert(&o->topics, m->topic);
+		if (slot == NULL || slot->value) {
+			/* superseded while it was out */
+			pubmsg__free(m);
+			o->replaced++;
+			return;
+		}
+	}
+	if (offline__reserve(o) != MOSQ_ERR_SUCCESS) {
+		if (slot)
+			strmap__remove(&o->topics, slot);
+		pubmsg__free(m);
+		o->dropped++;
+		return;
+	}
+	o->head--;
+	o->ring[o->head & o->mask] = m;
+	o->bytes += offline__size(m);
+	if (slot)
+		slot->value = (void *) (uintptr_t) (o->head + 1);
+}
+
+static void offline__free(offline_t *o)
+{
+	pubmsg_t *m;
+
+	while ((m = offline__pop(o)) != NULL)
+		pubmsg__free(m);
+	strmap__clear(&o->topics);
+	pthread_mutex_destroy(&o->lock);
+	free(o->ring);
+	free(o);
+}
+
+/* messages are waiting, new ones must not overtake them */
+static bool offline__pending(offline_t *o)
+{
+	bool pending;
+
+	pthread_mutex_lock(&o->lock);
+	pending = o->head != o->tail || o->flushing;
+	pthread_mutex_unlock(&o->lock);
+	return pending;
+}
+
+/* copy a publish into the buffer, no_conn when it was just refused for that */
+static void offline__buffer(offline_t *o, bool no_conn, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *props)
+{
+	pubmsg_t *m = pubmsg__new(topic, payload, payloadlen, qos, retain);
+
+	if (m && props && mosquitto_property_copy_all(&m->props, props) != MOSQ_ERR_SUCCESS) {
+		pubmsg__free(m);
+		m = NULL;
+	}
+
+	pthread_mutex_lock(&o->lock);
+	if (no_conn)
+		o->online = false;
+	if (m)
+		offline__push(o, m);
+	else
+		o->dropped++;
+	pthread_mutex_unlock(&o->lock);
+}
+
+/*
+ * Publish up to a batch of buffered messages, from the Lua thread or from the
+ * connect callback. The lock isn't held while publishing, libmosquitto may
+ * run callbacks from inside mosquitto_publish_v5.
+ */
+static void offline__flush(ctx_t *ctx)
+{
+	offline_t *o = ctx->offline;
+	pubmsg_t *m;
+	int n, rc;
+
+	pthread_mutex_lock(&o->lock);
+	if (!o->online || o->flushing || o->head == o->tail) {
+		pthread_mutex_unlock(&o->lock);
+		return;
+	}
+	o->flushing = true;
+
+	for (n = 0; n < OFFLINE_BATCH && (m = offline__pop(o)) != NULL; n++) {
+		pthread_mutex_unlock(&o->lock);
+		rc = ctx__publish_now(ctx, NULL, m->topic, m->payloadlen, m->payload, m->qos, m->retain, m->props);
+		pthread_mutex_lock(&o->lock);
+
+		if (rc == MOSQ_ERR_NO_CONN) {
+			o->online = false;
+			offline__unpop(o, m);
+			break;
+		}
+		if (rc == MOSQ_ERR_SUCCESS)
+			o->flushed++;
+		else
+			o->dropped++;
+		pubmsg__free(m);
+	}
+
+	o->flushing = false;
+	pthread_mutex_unlock(&o->lock);
+	ctx__io_kick(ctx, false);
+}
+
+static void offline__online(ctx_t *ctx)
+{
+	pthread_mutex_lock(&ctx->offline->lock);
+	ctx->offline->online = true;
+	pthread_mutex_unlock(&ctx->offline->lock);
+	offline__flush(ctx);
+}
+
+/* add the buffer counters to the table on top of the stack */
+static void offline__stats(lua_State *L, offline_t *o)
+{
+	pthread_mutex_lock(&o->lock);
+	lua_pushinteger(L, o->tail - o->head);
+	lua_setfield(L, -2, "offline_buffered");
+	lua_pushinteger(L, o->bytes);
+	lua_setfield(L, -2, "offline_bytes");
+	lua_pushinteger(L, o->dropped);
+	lua_setfield(L, -2, "offline_dropped");
+	lua_pushinteger(L, o->replaced);
+	lua_setfield(L, -2, "offline_replaced");
+	lua_pushinteger(L, o->flushed);
+	lua_setfield(L, -2, "offline_flushed");
+	pthread_mutex_unlock(&o->lock);
+}
+
+/***
+ * Buffer publishes in C while the client is disconnected, instead of
+ * failing them with MOSQ_ERR_NO_CONN. The buffer is flushed in order once
+ * the broker accepted the next connection, publish returns mid 0 for
+ * buffered messages. QoS 1 and 2 are queued by libmosquitto itself, so
+ * this mostly concerns QoS 0.
+ * @function offline_buffer
+ * @tparam[opt] table options, nil drops the buffer and its messages
+ *   max_messages (1000), max_bytes (1048576) counting topics and payloads,
+ *   policy "drop_oldest" (default), "drop_newest", or "latest" which keeps
+ *   only the newest message of every topic
+ * @return boolean true
+ * @raise For invalid options or out of memory
+ */
+static int ctx_offline_buffer(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lua_Integer max_messages = opt__integer(L, 2, "max_messages", 1000);
+	lua_Integer max_bytes = opt__integer(L, 2, "max_bytes", 1048576);
+	const char *policy = opt__string(L, 2, "policy", "drop_oldest");
+	offline_t *o;
+	int i;
+
+	for (i = 0; offline_policies[i]; i++) {
+		if (strcmp(policy, offline_policies[i]) == 0)
+			break;
+	}
+	if (offline_policies[i] == NULL)
+		return luaL_argerror(L, 2, "policy must be drop_oldest, drop_newest or latest");
+	if (max_messages < 1 || max_bytes < 1)
+		return luaL_argerror(L, 2, "limits must be positive");
+
+	/* the I/O thread flushes from the connect callback */
+	if (ctx->io.thread)
+		return luaL_error(L, "can't change the offline buffer of a client attached to an I/O pool");
+
+	if (ctx->offline) {
+		offline__free(ctx->offline);
+		ctx->offline = NULL;
+	}
+	if (!lua_table_on_stack(L, 2))
+		return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+
+	o = calloc(1, sizeof(offline_t));
+	if (o == NULL)
+		return luaL_error(L, strerror(ENOMEM));
+	pthread_mutex_init(&o->lock, NULL);
+	o->max_messages = max_messages;
+	o->max_bytes = max_bytes;
+	o->policy = i;
+	/* until told otherwise, publish reports whether we are */
+	o->online = true;
+
+	ctx->offline = o;
+	mosquitto_connect_callback_set(ctx->mosq, ctx_on_connect);
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Bulk queues
+ * @section bulk_queues
+ */
+
+/*
+ * Publishes handed to libmosquitto and not yet completed, by mid. The
+ * owner's lock is held around every call. A slot is taken before
+ * publishing, and settled after publishing, because the completion may
+ * come first.
+ */
+typedef struct inflight {
+	int count;
+	uint8_t *mids;		/* bit per mid in flight */
+	uint32_t *acks;		/* seq of the last completion seen for each mid */
+	uint32_t seq;
+} inflight_t;
+
+/* mids are 16 bit */
+#define INFLIGHT_MIDS	65536
+
+static bool inflight__init(inflight_t *f)
+{
+	f->count = 0;
+	f->seq = 0;
+	f->mids = calloc(INFLIGHT_MIDS / 8, 1);
+	f->acks = calloc(INFLIGHT_MIDS, sizeof(uint32_t));
+	if (f->mids == NULL || f->acks == NULL) {
+		free(f->mids);
+		free(f->acks);
+		return false;
+	}
+	return true;
+}
+
+static void inflight__clear(inflight_t *f)
+{
+	free(f->mids);
+	free(f->acks);
+}
+
+/* a slot for the next publish, the seq to settle it with */
+static uint32_t inflight__take(inflight_t *f)
+{
+	f->count++;
+	return f->seq;
+}
+
+/* the publish of a taken slot returned, sent or not */
+static void inflight__settle(inflight_t *f, bool sent, int mid, uint32_t seq)
+{
+	/* already completed, QoS 0 may be written from within the publish */
+	if (!sent || mid <= 0 || mid >= INFLIGHT_MIDS || (int32_t) (f->acks[mid] - seq) > 0)
+		f->count--;
+	else
+		f->mids[mid / 8] |= 1 << (mid % 8);
+}
+
+/* a publish completed, on the network side */
+static void inflight__ack(inflight_t *f, int mid)
+{
+	if (mid <= 0 || mid >= INFLIGHT_MIDS)
+		return;
+
+	f->acks[mid] = ++f->seq;
+	if (f->mids[mid / 8] & (1 << (mid % 8))) {
+		f->mids[mid / 8] &= ~(1 << (mid % 8));
+		f->count--;
+	}
+}
+
+/* libmosquitto dropped whatever was in flight */
+static void inflight__reset(inflight_t *f)
+{
+	memset(f->mids, 0, INFLIGHT_MIDS / 8);
+	f->count = 0;
+}
+
+typedef struct bulk {
+	pthread_mutex_t lock;	/* pushed from the Lua thread, fed from either side */
+	pubq_t q;
+	size_t max_messages;	/* 0 for no limit */
+	int max_inflight;
+	inflight_t inflight;
+	bool feeding;		/* one feeder at a time keeps the order */
+	unsigned long fed;
+	unsigned long dropped;
+} bulk_t;
+
+static bulk_t *bulk__new(void)
+{
+	bulk_t *b = calloc(1, sizeof(bulk_t));
+
+	if (b == NULL)
+		return NULL;
+	if (!inflight__init(&b->inflight)) {
+		free(b);
+		return NULL;
+	}
+	pthread_mutex_init(&b->lock, NULL);
+	b->max_inflight = 10;
+	return b;
+}
+
+static void bulk__free(bulk_t *b)
+{
+	pubq__clear(&b->q);
+	pthread_mutex_destroy(&b->lock);
+	inflight__clear(&b->inflight);
+	free(b);
+}
+
+static void bulk__ack(bulk_t *b, int mid)
+{
+	pthread_mutex_lock(&b->lock);
+	inflight__ack(&b->inflight, mid);
+	pthread_mutex_unlock(&b->lock);
+}
+
+static void bulk__reset(bulk_t *b)
+{
+	pthread_mutex_lock(&b->lock);
+	inflight__reset(&b->inflight);
+	pthread_mutex_unlock(&b->lock);
+}
+
+/*
+ * Hand queued bulk messages to libmosquitto while nothing else waits to be
+ * written and there's credit left. The lock isn't held while publishing,
+ * libmosquitto may run callbacks from inside mosquitto_publish_v5.
+ */
+static void bulk__feed(ctx_t *ctx)
+{
+	bulk_t *b = ctx->bulk;
+	pubmsg_t *m;
+	uint32_t seq;
+	int mid, rc;
+
+	pthread_mutex_lock(&b->lock);
+	if (b->feeding) {
+		pthread_mutex_unlock(&b->lock);
+		return;
+	}
+	b->feeding = true;
+	pthread_mutex_unlock(&b->lock);
+
+	/* control and normal traffic still being written goes first */
+	while (!mosquitto_want_write(ctx->mosq)) {
+		pthread_mutex_lock(&b->lock);
+		if (b->inflight.count >= b->max_inflight || b->q.head == NULL ||
+				(ctx->ratelimit && !ratelimit__bulk(ctx, b->q.head->topic))) {
+			pthread_mutex_unlock(&b->lock);
+			break;
+		}
+		m = pubq__pop(&b->q);
+		seq = inflight__take(&b->inflight);
+		pthread_mutex_unlock(&b->lock);
+
+		mid = 0;
+		rc = ctx__publish_now(ctx, &mid, m->topic, m->payloadlen, m->payload, m->qos, m->retain, m->props);
+
+		pthread_mutex_lock(&b->lock);
+		inflight__settle(&b->inflight, rc == MOSQ_ERR_SUCCESS, mid, seq);
+		if (rc == MOSQ_ERR_NO_CONN) {
+			/* back to the front, fed again once connected */
+			m->next = b->q.head;
+			b->q.head = m;
+			if (b->q.tail == NULL)
+				b->q.tail = m;
+			b->q.len++;
+			pthread_mutex_unlock(&b->lock);
+			break;
+		}
+		if (rc != MOSQ_ERR_SUCCESS)
+			b->dropped++;
+		else
+			b->fed++;
+		pthread_mutex_unlock(&b->lock);
+		pubmsg__free(m);
+	}
+
+	pthread_mutex_lock(&b->lock);
+	b->feeding = false;
+	pthread_mutex_unlock(&b->lock);
+	ctx__io_kick(ctx, false);
+}
+
+static int bulk__push(ctx_t *ctx, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *props)
+{
+	bulk_t *b = ctx->bulk;
+	pubmsg_t *m;
+
+	if (b == NULL) {
+		b = bulk__new();
+		if (b == NULL)
+			return MOSQ_ERR_NOMEM;
+		/* read by the publish callback, possibly on another thread */
+		__atomic_store_n(&ctx->bulk, b, __ATOMIC_RELEASE);
+		mosquitto_publish_callback_set(ctx->mosq, ctx_on_publish);
+	}
+
+	pthread_mutex_lock(&b->lock);
+	if (b->max_messages && b->q.len >= b->max_messages) {
+		b->dropped++;
+		pthread_mutex_unlock(&b->lock);
+		errno = ENOBUFS;
+		return MOSQ_ERR_ERRNO;
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	m = pubmsg__new(topic, payload, payloadlen, qos, retain);
+	if (m == NULL)
+		return MOSQ_ERR_NOMEM;
+	if (props && mosquitto_property_copy_all(&m->props, props) != MOSQ_ERR_SUCCESS) {
+		pubmsg__free(m);
+		return MOSQ_ERR_NOMEM;
+	}
+
+	pthread_mutex_lock(&b->lock);
+	pubq__push(&b->q, m);
+	pthread_mutex_unlock(&b->lock);
+
+	if (mid)
+		*mid = 0;
+	bulk__feed(ctx);
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* add the queue counters to the table on top of the stack */
+static void bulk__stats(lua_State *L, bulk_t *b)
+{
+	pthread_mutex_lock(&b->lock);
+	lua_pushinteger(L, b->q.len);
+	lua_setfield(L, -2, "bulk_queued");
+	lua_pushinteger(L, b->inflight.count);
+	lua_setfield(L, -2, "bulk_inflight");
+	lua_pushinteger(L, b->fed);
+	lua_setfield(L, -2, "bulk_fed");
+	lua_pushinteger(L, b->dropped);
+	lua_setfield(L, -2, "bulk_dropped");
+	pthread_mutex_unlock(&b->lock);
+}
+
+/***
+ * Limits of the queue holding PRIORITY_BULK publishes.
+ * Bulk messages are handed to libmosquitto only while it has nothing else
+ * to write and fewer than max_inflight of them are unacknowledged, keep
+ * that below the broker's receive maximum to leave room for other traffic.
+ * @function bulk_options
+ * @tparam table options max_inflight (10), max_messages (0, no limit)
+ * @return boolean true
+ * @raise For invalid options or out of memory
+ */
+static int ctx_bulk_options(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lua_Integer max_inflight, max_messages;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	max_inflight = opt__integer(L, 2, "max_inflight", 10);
+	max_messages = opt__integer(L, 2, "max_messages", 0);
+	if (max_inflight < 1 || max_inflight > UINT16_MAX)
+		return luaL_argerror(L, 2, "max_inflight must be between 1 and 65535");
+	if (max_messages < 0)
+		return luaL_argerror(L, 2, "max_messages must not be negative");
+
+	if (ctx->bulk == NULL) {
+		bulk_t *b = bulk__new();
+		if (b == NULL)
+			return luaL_error(L, strerror(ENOMEM));
+		__atomic_store_n(&ctx->bulk, b, __ATOMIC_RELEASE);
+		mosquitto_publish_callback_set(ctx->mosq, ctx_on_publish);
+	}
+
+	pthread_mutex_lock(&ctx->bulk->lock);
+	ctx->bulk->max_inflight = max_inflight;
+	ctx->bulk->max_messages = max_messages;
+	pthread_mutex_unlock(&ctx->bulk->lock);
+
+	bulk__feed(ctx);
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Conflation
+ * @section conflation
+ */
+
+typedef struct conflate {
+	pthread_mutex_t lock;	/* publishers may run on an I/O thread */
+	strmap_t topics;	/* topic -> newest pubmsg_t */
+	matcher_t *filters;	/* NULL conflates every topic */
+	uint64_t interval;
+	uint64_t next_flush;
+	unsigned long replaced;
+	unsigned long flushed;
+} conflate_t;
+
+static void conflate__drop(strmap_t *topics)
+{
+	size_t i;
+
+	for (i = 0; topics->slots && i <= topics->mask; i++) {
+		if (topics->slots[i].key)
+			pubmsg__free(topics->slots[i].value);
+	}
+	strmap__clear(topics);
+}
+
+static void conflate__free(conflate_t *c)
+{
+	conflate__drop(&c->topics);
+	matcher__free(c->filters);
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+}
+
+/* keep the publish for the next flush, false if it isn't conflated */
+static bool conflate__take(conflate_t *c, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *props)
+{
+	strmap_slot_t *slot;
+	pubmsg_t *m;
+
+	if (c->filters && !matcher__any(c->filters, topic))
+		return false;
+
+	m = pubmsg__new(topic, payload, payloadlen, qos, retain);
+	if (m && props && mosquitto_property_copy_all(&m->props, props) != MOSQ_ERR_SUCCESS) {
+		pubmsg__free(m);
+		m = NULL;
+	}
+	if (m == NULL)
+		return false;
+
+	pthread_mutex_lock(&c->lock);
+	slot = strmap__insert(&c->topics, topic);
+	if (slot == NULL) {
+		pthread_mutex_unlock(&c->lock);
+		pubmsg__free(m);
+		return false;
+	}
+	if (slot->value) {
+		pubmsg__free(slot->value);
+		c->replaced++;
+	}
+	slot->value = m;
+	pthread_mutex_unlock(&c->lock);
+	return true;
+}
+
+/* publish the newest message of every topic once the interval is up */
+static void conflate__flush(ctx_t *ctx, bool force)
+{
+	conflate_t *c = ctx->conflate;
+	uint64_t now = mosq__now_ms();
+	strmap_t topics;
+	pubmsg_t *m;
+	size_t i;
+
+	pthread_mutex_lock(&c->lock);
+	if (!force && now < c->next_flush) {
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+	c->next_flush = now + c->interval;
+	topics = c->topics;
+	memset(&c->topics, 0, sizeof(strmap_t));
+	c->flushed += topics.len;
+	pthread_mutex_unlock(&c->lock);
+
+	/* unlocked, the publishes may end up in callbacks. They keep their place
+	 * behind the offline buffer and the rate limits, only conflation is skipped */
+	for (i = 0; topics.slots && i <= topics.mask; i++) {
+		m = topics.slots[i].value;
+		if (topics.slots[i].key == NULL)
+			continue;
+		ctx__publish_limited(ctx, NULL, m->topic, m->payloadlen, m->payload, m->qos, m->retain, m->props, PRIORITY_NORMAL);
+	}
+	conflate__drop(&topics);
+	ctx__io_kick(ctx, false);
+}
+
+/* add the conflation counters to the table on top of the stack */
+static void conflate__stats(lua_State *L, conflate_t *c)
+{
+	pthread_mutex_lock(&c->lock);
+	lua_pushinteger(L, c->topics.len);
+	lua_setfield(L, -2, "conflate_pending");
+	lua_pushinteger(L, c->replaced);
+	lua_setfield(L, -2, "conflate_replaced");
+	lua_pushinteger(L, c->flushed);
+	lua_setfield(L, -2, "conflate_flushed");
+	pthread_mutex_unlock(&c->lock);
+}
+
+/***
+ * Conflate outgoing messages: publishes to the same topic overwrite each
+ * other, only the newest one per topic is sent every interval. Applies to
+ * PRIORITY_NORMAL publishes, publish returns mid 0 for those.
+ * @function conflate
+ * @tparam[opt] table options, nil flushes what is pending and stops
+ *   interval in ms (1000), filters array of topic filters limiting which
+ *   topics are conflated (all of them)
+ * @return boolean true
+ * @raise For invalid options or out of memory
+ */
+static int ctx_conflate(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lua_Integer interval = opt__integer(L, 2, "interval", 1000);
+	conflate_t *c;
+
+	if (interval < 1)
+		return luaL_argerror(L, 2, "interval must be positive");
+
+	/* I/O threads drain publishers into the map */
+	if (ctx->io.thread)
+		return luaL_error(L, "can't change conflation of a client attached to an I/O pool");
+
+	if (ctx->conflate) {
+		conflate__flush(ctx, true);
+		conflate__free(ctx->conflate);
+		ctx->conflate = NULL;
+	}
+	if (!lua_table_on_stack(L, 2))
+		return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+
+	c = calloc(1, sizeof(conflate_t));
+	if (c == NULL)
+		return luaL_error(L, strerror(ENOMEM));
+	pthread_mutex_init(&c->lock, NULL);
+	c->interval = interval;
+	c->next_flush = mosq__now_ms() + interval;
+
+	/* owned by ctx before anything can raise */
+	ctx->conflate = c;
+
+	lua_getfield(L, 2, "filters");
+	if (!lua_isnil(L, -1)) {
+		luaL_argcheck(L, lua_istable(L, -1), 2, "filters must be an array of topic filters");
+		c->filters = matcher__new();
+		if (c->filters == NULL)
+			return luaL_error(L, strerror(ENOMEM));
+		matcher__add_all(L, lua_gettop(L), c->filters);
+	}
+	lua_pop(L, 1);
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Rate limits
+ * @section rate_limits
+ */
+
+enum rate_policy {
+	RATE_REJECT,
+	RATE_QUEUE,
+	RATE_DELAY,
+};
+
+static const char *const rate_policies[] = { "reject", "queue", "delay", NULL };
+
+typedef struct {
+	double tokens;
+	double rate;		/* tokens per ms */
+	double burst;
+	uint64_t last;
+} bucket_t;
+
+typedef struct {
+	char *prefix;
+	size_t len;
+	bucket_t bucket;
+} rate_prefix_t;
+
+typedef struct ratelimit {
+	pthread_mutex_t lock;	/* publishers may run on an I/O thread */
+	int policy;
+	bucket_t client;	/* rate 0 when only prefixes are limited */
+	rate_prefix_t *prefixes;
+	int nprefixes;
+	pubq_t q;
+	size_t max_queue;
+	bool draining;		/* one drainer at a time keeps the order */
+	pthread_t owner;	/* the Lua thread, the only one RATE_DELAY sleeps */
+	unsigned long passed;
+	unsigned long rejected;
+	unsigned long delayed;
+	unsigned long delay_ms;
+} ratelimit_t;
+
+static void bucket__refill(bucket_t *b, uint64_t now)
+{
+	if (b->rate == 0)
+		return;
+	b->tokens += (now - b->last) * b->rate;
+	if (b->tokens > b->burst)
+		b->tokens = b->burst;
+	b->last = now;
+}
+
+/* ms until the bucket holds a whole token */
+static uint64_t bucket__wait(const bucket_t *b)
+{
+	if (b->rate == 0 || b->tokens >= 1)
+		return 0;
+	return (uint64_t) ((1 - b->tokens) / b->rate) + 1;
+}
+
+/* longest matching prefix */
+static rate_prefix_t *ratelimit__prefix(ratelimit_t *r, const char *topic)
+{
+	rate_prefix_t *best = NULL;
+	int i;
+
+	for (i = 0; i < r->nprefixes; i++) {
+		if ((best == NULL || r->prefixes[i].len > best->len) &&
+				strncmp(topic, r->prefixes[i].prefix, r->prefixes[i].len) == 0)
+			best = &r->prefixes[i];
+	}
+	return best;
+}
+
+/* ms until topic may go, 0 after taking its tokens. Under lock */
+static uint64_t ratelimit__take(ratelimit_t *r, const char *topic, bool force)
+{
+	rate_prefix_t *p = ratelimit__prefix(r, topic);
+	uint64_t now = mosq__now_ms(), wait, pwait = 0;
+
+	bucket__refill(&r->client, now);
+	wait = bucket__wait(&r->client);
+	if (p) {
+		bucket__refill(&p->bucket, now);
+		pwait = bucket__wait(&p->bucket);
+	}
+	if (pwait > wait)
+		wait = pwait;
+	if (wait && !force)
+		return wait;
+
+	/* forced through, the debt is paid off by later publishes */
+	if (r->client.rate)
+		r->client.tokens -= 1;
+	if (p && p->bucket.rate)
+		p->bucket.tokens -= 1;
+	r->passed++;
+	return 0;
+}
+
+static void ratelimit__free(ratelimit_t *r)
+{
+	int i;
+
+	for (i = 0; i < r->nprefixes; i++)
+		free(r->prefixes[i].prefix);
+	free(r->prefixes);
+	pubq__clear(&r->q);
+	pthread_mutex_destroy(&r->lock);
+	free(r);
+}
+
+/*
+ * Whether a publish may go now. If not, *rc tells the caller what to
+ * return: it was queued, or rejected with EAGAIN. Control traffic always
+ * goes, but takes its tokens all the same.
+ */
+static bool ratelimit__admit(ctx_t *ctx, int *rc, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *props, int priority)
+{
+	ratelimit_t *r = ctx->ratelimit;
+	pubmsg_t *m;
+	uint64_t wait;
+	int policy = r->policy;
+
+	/*
+	 * Sleeping would stall every client of the I/O thread, or the keepalives
+	 * and reads of the loop_start thread draining publishers.
+	 */
+	if (policy == RATE_DELAY && (ctx__io_deferred(ctx) || !pthread_equal(pthread_self(), r->owner)))
+		policy = RATE_QUEUE;
+
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		/* queued messages go first */
+		if (priority != PRIORITY_CONTROL && (r->q.head || r->draining))
+			break;
+		wait = ratelimit__take(r, topic, priority == PRIORITY_CONTROL);
+		if (wait == 0) {
+			pthread_mutex_unlock(&r->lock);
+			return true;
+		}
+		if (policy != RATE_DELAY)
+			break;
+
+		r->delayed++;
+		r->delay_ms += wait;
+		pthread_mutex_unlock(&r->lock);
+		usleep(wait * 1000);
+		pthread_mutex_lock(&r->lock);
+	}
+
+	if (policy == RATE_REJECT || r->q.len >= r->max_queue) {
+		r->rejected++;
+		pthread_mutex_unlock(&r->lock);
+		errno = EAGAIN;
+		*rc = MOSQ_ERR_ERRNO;
+		return false;
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	m = pubmsg__new(topic, payload, payloadlen, qos, retain);
+	if (m && props && mosquitto_property_copy_all(&m->props, props) != MOSQ_ERR_SUCCESS) {
+		pubmsg__free(m);
+		m = NULL;
+	}
+	if (m == NULL) {
+		*rc = MOSQ_ERR_NOMEM;
+		return false;
+	}
+
+	pthread_mutex_lock(&r->lock);
+	pubq__push(&r->q, m);
+	pthread_mutex_unlock(&r->lock);
+
+	if (mid)
+		*mid = 0;
+	*rc = MOSQ_ERR_SUCCESS;
+	return false;
+}
+
+/*
+ * Send queued messages as tokens come in. The lock isn't held while
+ * publishing, libmosquitto may run callbacks from inside the publish.
+ */
+static void ratelimit__drain(ctx_t *ctx)
+{
+	ratelimit_t *r = ctx->ratelimit;
+	pubmsg_t *m;
+
+	pthread_mutex_lock(&r->lock);
+	if (r->draining || r->q.head == NULL) {
+		pthread_mutex_unlock(&r->lock);
+		return;
+	}
+	r->draining = true;
+
+	while (r->q.head && ratelimit__take(r, r->q.head->topic, false) == 0) {
+		m = pubq__pop(&r->q);
+		pthread_mutex_unlock(&r->lock);
+		ctx__publish_send(ctx, NULL, m->topic, m->payloadlen, m->payload, m->qos, m->retain, m->props, PRIORITY_NORMAL);
+		pubmsg__free(m);
+		pthread_mutex_lock(&r->lock);
+	}
+
+	r->draining = false;
+	pthread_mutex_unlock(&r->lock);
+	ctx__io_kick(ctx, false);
+}
+
+/*
+ * Whether the bulk message on topic may be fed now, taking its tokens if
+ * so. Normal messages waiting for tokens go first. Called with the bulk
+ * lock held, never the other way round.
+ */
+static bool ratelimit__bulk(ctx_t *ctx, const char *topic)
+{
+	ratelimit_t *r = ctx->ratelimit;
+	bool ok;
+
+	pthread_mutex_lock(&r->lock);
+	ok = r->q.head == NULL && !r->draining && ratelimit__take(r, topic, false) == 0;
+	pthread_mutex_unlock(&r->lock);
+	return ok;
+}
+
+/* add the rate limit counters to the table on top of the stack */
+static void ratelimit__stats(lua_State *L, ratelimit_t *r)
+{
+	pthread_mutex_lock(&r->lock);
+	lua_pushinteger(L, r->passed);
+	lua_setfield(L, -2, "rate_passed");
+	lua_pushinteger(L, r->rejected);
+	lua_setfield(L, -2, "rate_rejected");
+	lua_pushinteger(L, r->q.len);
+	lua_setfield(L, -2, "rate_queued");
+	lua_pushinteger(L, r->delayed);
+	lua_setfield(L, -2, "rate_delayed");
+	lua_pushinteger(L, r->delay_ms);
+	lua_setfield(L, -2, "rate_delay_ms");
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* rate and burst fields of the table at index, a rate of 0 doesn't limit */
+static void bucket__init(lua_State *L, int index, bucket_t *b)
+{
+	lua_Number rate = opt__number(L, index, "rate", 0);
+	lua_Number burst = opt__number(L, index, "burst", rate > 1 ? rate : 1);
+
+	luaL_argcheck(L, rate >= 0, 2, "rate must not be negative");
+	luaL_argcheck(L, burst >= 1, 2, "burst must be at least 1");
+	b->rate = rate / 1000;
+	b->burst = burst;
+	b->tokens = burst;
+	b->last = mosq__now_ms();
+}
+
+/***
+ * Limit the publish rate with token buckets, one for the client and one per
+ * topic prefix. A publish takes a token from the client bucket and from the
+ * bucket of the longest matching prefix. PRIORITY_CONTROL publishes are
+ * never held back but still take their tokens. Bulk publishes take theirs
+ * as they leave the bulk queue, and stay there while tokens are short.
+ * @function rate_limit
+ * @tparam[opt] table options, nil removes the limits and drops what is queued
+ *   rate in messages per second and burst (rate) for the whole client,
+ *   prefixes maps topic prefixes to tables with their own rate and burst,
+ *   policy for publishes over the limit "reject" (default) fails them with
+ *   EAGAIN, "queue" keeps up to max_queue (10000) of them to send later and
+ *   "delay" sleeps until the publish may go, queueing instead for
+ *   publishes made off the Lua thread or through an I/O pool
+ * @return boolean true
+ * @raise For invalid options or out of memory
+ */
+static int ctx_rate_limit(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *policy = opt__string(L, 2, "policy", "reject");
+	lua_Integer max_queue = opt__integer(L, 2, "max_queue", 10000);
+	ratelimit_t *r;
+	rate_prefix_t *p;
+	int i;
+
+	for (i = 0; rate_policies[i]; i++) {
+		if (strcmp(policy, rate_policies[i]) == 0)
+			break;
+	}
+	if (rate_policies[i] == NULL)
+		return luaL_argerror(L, 2, "policy must be reject, queue or delay");
+	if (max_queue < 0)
+		return luaL_argerror(L, 2, "max_queue must not be negative");
+
+	/* I/O threads drain publishers through the limits */
+	if (ctx->io.thread)
+		return luaL_error(L, "can't change the rate limits of a client attached to an I/O pool");
+
+	if (ctx->ratelimit) {
+		ratelimit__free(ctx->ratelimit);
+		ctx->ratelimit = NULL;
+	}
+	if (!lua_table_on_stack(L, 2))
+		return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+
+	r = calloc(1, sizeof(ratelimit_t));
+	if (r == NULL)
+		return luaL_error(L, strerror(ENOMEM));
+	pthread_mutex_init(&r->lock, NULL);
+	r->policy = i;
+	r->max_queue = max_queue;
+	r->owner = pthread_self();
+
+	/* owned by ctx before anything can raise */
+	ctx->ratelimit = r;
+	bucket__init(L, 2, &r->client);
+
+	lua_getfield(L, 2, "prefixes");
+	if (!lua_isnil(L, -1)) {
+		luaL_argcheck(L, lua_istable(L, -1), 2, "prefixes must map topic prefixes to limits");
+		lua_pushnil(L);
+		while (lua_next(L, -2) != 0) {
+			if (lua_type(L, -2) != LUA_TSTRING || !lua_istable(L, -1))
+				return luaL_argerror(L, 2, "prefixes must map topic prefixes to limits");
+			p = realloc(r->prefixes, (r->nprefixes + 1) * sizeof(rate_prefix_t));
+			if (p == NULL)
+				return luaL_error(L, strerror(ENOMEM));
+			r->prefixes = p;
+			p = &r->prefixes[r->nprefixes];
+			p->prefix = strdup(lua_tostring(L, -2));
+			if (p->prefix == NULL)
+				return luaL_error(L, strerror(ENOMEM));
+			p->len = strlen(p->prefix);
+			r->nprefixes++;
+			bucket__init(L, lua_gettop(L), &p->bucket);
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Timers
+ * @section timers
+ */
+
+typedef struct {
+	lua_Integer id;
+	uint64_t due;
+	uint64_t interval;	/* 0 for a one shot publish_at */
+	int idx;			/* position in the heap */
+	int fn;				/* payload function, or LUA_NOREF */
+	char *topic;
+	void *payload;
+	int payloadlen;
+	int qos;
+	bool retain;
+} ptimer_t;
+
+typedef struct timers {
+	ptimer_t **heap;	/* min-heap on due */
+	int len;
+	int cap;
+	lua_Integer next_id;
+	pthread_t owner;	/* the thread the timers were added from */
+	unsigned long fired;
+	unsigned long errors;
+} timers_t;
+
+static void timers__swap(timers_t *t, int a, int b)
+{
+	ptimer_t *tmp = t->heap[a];
+
+	t->heap[a] = t->heap[b];
+	t->heap[b] = tmp;
+	t->heap[a]->idx = a;
+	t->heap[b]->idx = b;
+}
+
+static void timers__up(timers_t *t, int i)
+{
+	while (i > 0 && t->heap[(i - 1) / 2]->due > t->heap[i]->due) {
+		timers__swap(t, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void timers__down(timers_t *t, int i)
+{
+	int least, l, r;
+
+	for (;;) {
+		least = i;
+		l = 2 * i + 1;
+		r = l + 1;
+		if (l < t->len && t->heap[l]->due < t->heap[least]->due)
+			least = l;
+		if (r < t->len && t->heap[r]->due < t->heap[least]->due)
+			least = r;
+		if (least == i)
+			return;
+		timers__swap(t, i, least);
+		i = least;
+	}
+}
+
+static int timers__push(timers_t *t, ptimer_t *tm)
+{
+	ptimer_t **heap;
+
+	if (t->len == t->cap) {
+		heap = realloc(t->heap, (t->cap ? t->cap * 2 : 16) * sizeof(ptimer_t *));
+		if (heap == NULL)
+			return MOSQ_ERR_NOMEM;
+		t->heap = heap;
+		t->cap = t->cap ? t->cap * 2 : 16;
+	}
+	tm->idx = t->len;
+	t->heap[t->len++] = tm;
+	timers__up(t, tm->idx);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void timers__remove(timers_t *t, ptimer_t *tm)
+{
+	int i = tm->idx;
+
+	t->len--;
+	if (i != t->len) {
+		timers__swap(t, i, t->len);
+		timers__down(t, i);
+		timers__up(t, i);
+	}
+}
+
+static void timer__free(lua_State *L, ptimer_t *tm)
+{
+	luaL_unref(L, LUA_REGISTRYINDEX, tm->fn);
+	free(tm->topic);
+	free(tm->payload);
+	free(tm);
+}
+
+static void timers__free(lua_State *L, timers_t *t)
+{
+	int i;
+
+	for (i = 0; i < t->len; i++)
+		timer__free(L, t->heap[i]);
+	free(t->heap);
+	free(t);
+}
+
+/* ms until the next timer is due */
+static uint64_t timers__next(timers_t *t, uint64_t now)
+{
+	if (t->len == 0)
+		return UINT64_MAX;
+	return t->heap[0]->due > now ? t->heap[0]->due - now : 0;
+}
+
+/*
+ * Publish what is due. Only the thread owning the timers services them, a
+ * loop_start thread may get here from the message callback.
+ */
+static void timers__service(ctx_t *ctx)
+{
+	timers_t *t = ctx->timers;
+	lua_State *L = ctx->L;
+	uint64_t now = mosq__now_ms();
+	ptimer_t *tm;
+	const char *topic;
+	const void *payload;
+	size_t payloadlen;
+	int qos, rc;
+	bool retain;
+
+	if (!pthread_equal(pthread_self(), t->owner))
+		return;
+
+	while (t->len && t->heap[0]->due <= now) {
+		tm = t->heap[0];
+
+		/* reschedule first, the payload function may cancel the timer */
+		if (tm->interval) {
+			tm->due += tm->interval;
+			/* skip missed beats rather than burst to catch up */
+			if (tm->due <= now)
+				tm->due = now + tm->interval;
+			timers__down(t, 0);
+		} else {
+			timers__remove(t, tm);
+		}
+		t->fired++;
+
+		if (tm->fn == LUA_NOREF) {
+			rc = ctx__publish(ctx, NULL, tm->topic, tm->payloadlen, tm->payload, tm->qos, tm->retain, NULL, PRIORITY_NORMAL);
+			if (rc != MOSQ_ERR_SUCCESS)
+				t->errors++;
+			if (tm->interval == 0)
+				timer__free(L, tm);
+			continue;
+		}
+
+		/* the stack keeps topic alive whatever the function does */
+		lua_pushstring(L, tm->topic);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, tm->fn);
+		lua_pushvalue(L, -2);
+		lua_pushinteger(L, tm->id);
+		qos = tm->qos;
+		retain = tm->retain;
+		if (tm->interval == 0)
+			timer__free(L, tm);
+		lua_call(L, 2, 1); /* args: topic, id */
+
+		/* nil skips this beat */
+		if (!lua_isnil(L, -1)) {
+			payload = lua_tolstring(L, -1, &payloadlen);
+			topic = lua_tostring(L, -2);
+			rc = payload ? ctx__publish(ctx, NULL, topic, payloadlen, payload, qos, retain, NULL, PRIORITY_NORMAL) : MOSQ_ERR_INVAL;
+			if (rc != MOSQ_ERR_SUCCESS)
+				t->errors++;
+		}
+		lua_pop(L, 2);
+
+		/* a callback may have destroyed the client */
+		if (ctx->timers != t)
+			return;
+	}
+	ctx__io_kick(ctx, false);
+}
+
+static void timers__stats(lua_State *L, timers_t *t)
+{
+	lua_pushinteger(L, t->len);
+	lua_setfield(L, -2, "timers");
+	lua_pushinteger(L, t->fired);
+	lua_setfield(L, -2, "timers_fired");
+	lua_pushinteger(L, t->errors);
+	lua_setfield(L, -2, "timer_errors");
+}
+
+/* arguments from index on: topic, payload or function, qos, retain */
+static int ctx__timer_add(lua_State *L, ctx_t *ctx, uint64_t due, uint64_t interval, int index)
+{
+	const char *topic = luaL_checkstring(L, index);
+	int qos = luaL_optinteger(L, index + 2, 0);
+	bool retain = lua_toboolean(L, index + 3);
+	const char *payload = NULL;
+	size_t payloadlen = 0;
+	ptimer_t *tm;
+	timers_t *t;
+
+	if (!lua_isfunction(L, index + 1) && !lua_isnil(L, index + 1))
+		payload = luaL_checklstring(L, index + 1, &payloadlen);
+	luaL_argcheck(L, qos >= 0 && qos <= 2, index + 2, "qos must be 0, 1 or 2");
+
+	if (ctx->timers == NULL) {
+		t = calloc(1, sizeof(timers_t));
+		if (t == NULL)
+			return luaL_error(L, strerror(ENOMEM));
+		t->owner = pthread_self();
+		ctx->timers = t;
+	}
+	t = ctx->timers;
+
+	tm = calloc(1, sizeof(ptimer_t));
+	if (tm == NULL)
+		return luaL_error(L, strerror(ENOMEM));
+	tm->fn = LUA_NOREF;
+	tm->topic = strdup(topic);
+	if (payloadlen) {
+		tm->payload = malloc(payloadlen);
+		if (tm->payload)
+			memcpy(tm->payload, payload, payloadlen);
+	}
+	tm->id = ++t->next_id;
+	tm->due = due;
+	tm->interval = interval;
+	tm->payloadlen = payloadlen;
+	tm->qos = qos;
+	tm->retain = retain;
+	if (lua_isfunction(L, index + 1)) {
+		lua_pushvalue(L, index + 1);
+		tm->fn = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	if (tm->topic == NULL || (payloadlen && tm->payload == NULL) || timers__push(t, tm) != MOSQ_ERR_SUCCESS) {
+		timer__free(L, tm);
+		return luaL_error(L, strerror(ENOMEM));
+	}
+
+	lua_pushinteger(L, tm->id);
+	return 1;
+}
+
+/***
+ * Publish every interval ms from the loop, without a Lua timer per message.
+ * Timers are serviced by loop, loop_forever, loop_misc and io pool dispatch,
+ * not by a loop_start thread. A static payload is published without entering
+ * Lua, a function is called as fn(topic, id) and returns the payload, or nil
+ * to skip this time.
+ * @function publish_every
+ * @tparam number interval ms between publishes, the first one is an
+ * interval from now
+ * @tparam string topic
+ * @tparam string|function payload (may be nil)
+ * @tparam[opt=0] number qos 0, 1 or 2
+ * @tparam[opt=nil] boolean retain flag
+ * @treturn number timer id for cancel_timer
+ * @raise For invalid arguments or out of memory
+ */
+static int ctx_publish_every(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lua_Integer interval = luaL_checkinteger(L, 2);
+
+	luaL_argcheck(L, interval > 0, 2, "interval must be positive");
+	return ctx__timer_add(L, ctx, mosq__now_ms() + interval, interval, 3);
+}
+
+/***
+ * Publish once at a wall clock time, see publish_every.
+ * @function publish_at
+ * @tparam number time in seconds since the epoch, as os.time(), fractions
+ * allowed. A time in the past publishes on the next loop
+ * @tparam string topic
+ * @tparam string|function payload (may be nil)
+ * @tparam[opt=0] number qos 0, 1 or 2
+ * @tparam[opt=nil] boolean retain flag
+ * @treturn number timer id for cancel_timer
+ * @raise For invalid arguments or out of memory
+ */
+static int ctx_publish_at(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lua_Number at = luaL_checknumber(L, 2) * 1000;
+	uint64_t now = mosq__now_ms();
+	struct timespec ts;
+	lua_Number wall;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	wall = (lua_Number) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	return ctx__timer_add(L, ctx, at > wall ? now + (uint64_t) (at - wall) : now, 0, 3);
+}
+
+/***
+ * Cancel a publish_every or publish_at timer
+ * @function cancel_timer
+ * @tparam number id as returned when the timer was added
+ * @treturn boolean true if the timer was pending
+ */
+static int ctx_cancel_timer(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lua_Integer id = luaL_checkinteger(L, 2);
+	timers_t *t = ctx->timers;
+	ptimer_t *tm;
+	int i;
+
+	for (i = 0; t && i < t->len; i++) {
+		tm = t->heap[i];
+		if (tm->id == id) {
+			timers__remove(t, tm);
+			timer__free(L, tm);
+			lua_pushboolean(L, true);
+			return 1;
+		}
+	}
+	lua_pushboolean(L, false);
+	return 1;
+}
+
+/***
+ * Requests
+ * @section requests
+ */
+
+#define RPC_WHEEL_SLOTS	256
+#define RPC_WHEEL_TICK	10	/* ms, one turn of the wheel is 2.56s */
+
+typedef struct rpc_call {
+	struct rpc_call *prev;	/* wheel slot list */
+	struct rpc_call *next;
+	char id[17];			/* correlation data, hex */
+	uint64_t deadline;
+	int ref;				/* callback, or the yielded coroutine */
+	bool thread;
+} rpc_call_t;
+
+typedef struct rpc {
+	char *topic;			/* response topic of this client */
+	strmap_t pending;		/* correlation id -> rpc_call_t */
+	rpc_call_t *wheel[RPC_WHEEL_SLOTS];
+	uint64_t tick;			/* last tick serviced */
+	uint64_t next_id;
+	pthread_t owner;		/* the thread running Lua for this client */
+	unsigned long requests;
+	unsigned long replies;
+	unsigned long timeouts;
+	unsigned long unmatched;
+} rpc_t;
+
+static bool rpc__is_reply(rpc_t *r, const char *topic)
+{
+	return strcmp(topic, r->topic) == 0;
+}
+
+static void rpc__subscribe(ctx_t *ctx)
+{
+	mosquitto_subscribe_v5(ctx->mosq, NULL, ctx->rpc->topic, 1, MQTT_SUB_OPT_NO_LOCAL, NULL);
+}
+
+static void rpc__wheel_add(rpc_t *r, rpc_call_t *c)
+{
+	rpc_call_t **slot = &r->wheel[(c->deadline / RPC_WHEEL_TICK) % RPC_WHEEL_SLOTS];
+
+	c->prev = NULL;
+	c->next = *slot;
+	if (*slot)
+		(*slot)->prev = c;
+	*slot = c;
+}
+
+static void rpc__wheel_remove(rpc_t *r, rpc_call_t *c)
+{
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		r->wheel[(c->deadline / RPC_WHEEL_TICK) % RPC_WHEEL_SLOTS] = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+}
+
+/* take the call out of the map and the wheel, NULL if it's unknown */
+static rpc_call_t *rpc__take(rpc_t *r, const char *id)
+{
+	strmap_slot_t *slot = strmap__find(&r->pending, id);
+	rpc_call_t *c;
+
+	if (slot == NULL)
+		return NULL;
+	c = slot->value;
+	strmap__remove(&r->pending, slot);
+	rpc__wheel_remove(r, c);
+	return c;
+}
+
+/*
+ * Hand the results on top of the Lua stack to the caller and release the
+ * call. A coroutine is resumed, its errors are raised like those of
+ * callbacks.
+ */
+static void rpc__finish(ctx_t *ctx, rpc_call_t *c, int nargs)
+{
+	lua_State *L = ctx->L, *co;
+	int status;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, c->ref);
+	if (!c->thread) {
+		free(c);
+		lua_insert(L, -nargs - 1);
+		lua_call(L, nargs, 0);
+		return;
+	}
+	free(c);
+
+	co = lua_tothread(L, -1);
+	lua_pop(L, 1);
+	lua_xmove(L, co, nargs);
+#if LUA_VERSION_NUM >= 504
+	int nres;
+	status = lua_resume(co, L, nargs, &nres);
+#elif LUA_VERSION_NUM >= 502
+	status = lua_resume(co, L, nargs);
+#else
+	status = lua_resume(co, nargs);
+#endif
+	if (status > LUA_YIELD) {
+		lua_xmove(co, L, 1);
+		lua_error(L);
+	}
+	/* whatever it yielded or returned goes nowhere */
+	lua_settop(co, 0);
+}
+
+/* inner half of a message on the response topic */
+static void rpc__reply(ctx_t *ctx, const struct mosquitto_message *msg, const mosquitto_property *props)
+{
+	rpc_t *r = ctx->rpc;
+	rpc_call_t *c = NULL;
+	void *data = NULL;
+	uint16_t len = 0;
+	char id[17];
+
+	if (mosquitto_property_read_binary(props, MQTT_PROP_CORRELATION_DATA, &data, &len, false) && len == 16) {
+		memcpy(id, data, 16);
+		id[16] = '\0';
+		c = rpc__take(r, id);
+	}
+	free(data);
+
+	if (c == NULL) {
+		/* late, after the timeout, or not ours */
+		r->unmatched++;
+		return;
+	}
+	r->replies++;
+
+	lua_pushlstring(ctx->L, msg->payload, msg->payloadlen);
+	create_lua_stack_from_property_list(ctx->L, props);
+	rpc__finish(ctx, c, 2);
+}
+
+/* time out the calls past their deadline, on the thread running Lua */
+static void rpc__service(ctx_t *ctx)
+{
+	rpc_t *r = ctx->rpc;
+	uint64_t now = mosq__now_ms(), tick = now / RPC_WHEEL_TICK;
+	rpc_call_t *c, *next;
+	int turns = 0;
+
+	/* the tick belongs to the owner, other threads leave it alone */
+	if (!pthread_equal(pthread_self(), r->owner))
+		return;
+	if (r->pending.len == 0) {
+		r->tick = tick;
+		return;
+	}
+
+	for (; r->tick <= tick && turns < RPC_WHEEL_SLOTS; r->tick++, turns++) {
+		for (c = r->wheel[r->tick % RPC_WHEEL_SLOTS]; c; c = next) {
+			next = c->next;
+			if (c->deadline > now)
+				continue;
+
+			rpc__take(r, c->id);
+			r->timeouts++;
+			lua_pushnil(ctx->L);
+			lua_pushinteger(ctx->L, ETIMEDOUT);
+			lua_pushstring(ctx->L, strerror(ETIMEDOUT));
+			rpc__finish(ctx, c, 3);
+
+			/* a callback may have destroyed the client */
+			if (ctx->rpc != r)
+				return;
+			/* or answered other calls, start over on this slot */
+			next = r->wheel[r->tick % RPC_WHEEL_SLOTS];
+		}
+	}
+	/* the slot of now may get more calls due this tick */
+	r->tick = tick;
+}
+
+static void rpc__stats(lua_State *L, rpc_t *r)
+{
+	lua_pushinteger(L, r->pending.len);
+	lua_setfield(L, -2, "rpc_pending");
+	lua_pushinteger(L, r->requests);
+	lua_setfield(L, -2, "rpc_requests");
+	lua_pushinteger(L, r->replies);
+	lua_setfield(L, -2, "rpc_replies");
+	lua_pushinteger(L, r->timeouts);
+	lua_setfield(L, -2, "rpc_timeouts");
+	lua_pushinteger(L, r->unmatched);
+	lua_setfield(L, -2, "rpc_unmatched");
+}
+
+/* pending calls are dropped without a word */
+static void rpc__free(lua_State *L, rpc_t *r)
+{
+	size_t i;
+	rpc_call_t *c;
+
+	for (i = 0; r->pending.slots && i <= r->pending.mask; i++) {
+		c = r->pending.slots[i].value;
+		if (c == NULL)
+			continue;
+		luaL_unref(L, LUA_REGISTRYINDEX, c->ref);
+		free(c);
+	}
+	strmap__clear(&r->pending);
+	free(r->topic);
+	free(r);
+}
+
+static rpc_t *rpc__new(ctx_t *ctx)
+{
+	rpc_t *r = calloc(1, sizeof(rpc_t));
+	char topic[64];
+	struct timespec ts;
+
+	if (r == NULL)
+		return NULL;
+
+	/* unique enough among the clients of a broker */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	snprintf(topic, sizeof(topic), "lmq/rpc/%08x%08x",
+		(uint32_t) getpid() ^ (uint32_t) (uintptr_t) ctx, (uint32_t) ts.tv_sec ^ (uint32_t) ts.tv_nsec);
+	r->topic = strdup(topic);
+	if (r->topic == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->owner = pthread_self();
+	r->tick = mosq__now_ms() / RPC_WHEEL_TICK;
+	return r;
+}
+
+/***
+ * Send a request and match the response in C. The message carries this
+ * client's response topic, subscribed to on the first request and on every
+ * connect, and a correlation id generated for it. Responders publish their
+ * reply to the response topic with the correlation data copied over.
+ * Timeouts are serviced by loop, loop_forever, loop_misc and io pool
+ * dispatch.
+ * @function request
+ * @tparam string topic
+ * @tparam string|buffer payload (may be nil)
+ * @tparam number timeout in ms
+ * @tparam[opt] function callback called as callback(payload, properties)
+ * with the response, or callback(nil, errno, description) on timeout.
+ * Without a callback the calling coroutine yields and is resumed with the
+ * same values
+ * @tparam[opt=1] number qos 0, 1 or 2
+ * @tparam[opt] table properties of the request
+ * @treturn[1] string the correlation id, with a callback
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For invalid arguments, out of memory or a missing callback outside
+ * a coroutine
+ */
+static int ctx_request(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *topic = luaL_checkstring(L, 2);
+	size_t payloadlen = 0;
+	const void *payload = lua_isnoneornil(L, 3) ? NULL : buffer__payload(L, 3, &payloadlen);
+	lua_Integer timeout = luaL_checkinteger(L, 4);
+	int qos = luaL_optinteger(L, 6, 1);
+	mosquitto_property *props = NULL;
+	strmap_slot_t *slot;
+	rpc_call_t *c;
+	rpc_t *r;
+	char id[17];
+	bool thread = lua_isnoneornil(L, 5);
+	int rc;
+
+	luaL_argcheck(L, timeout > 0, 4, "timeout must be positive");
+	if (!thread)
+		luaL_checktype(L, 5, LUA_TFUNCTION);
+	if (thread && lua_pushthread(L))
+		return luaL_argerror(L, 5, "callback required outside of a coroutine");
+	if (thread)
+		lua_pop(L, 1);
+
+	if (ctx->rpc == NULL) {
+		ctx->rpc = rpc__new(ctx);
+		if (ctx->rpc == NULL)
+			return luaL_error(L, strerror(ENOMEM));
+		/* replies are told apart by their properties */
+		if (!ctx->message_v5_set)
+			ctx__message_v5_enable(ctx);
+		mosquitto_connect_callback_set(ctx->mosq, ctx_on_connect);
+		rpc__subscribe(ctx);
+	}
+	r = ctx->rpc;
+
+	if (lua_table_on_stack(L, 7)) {
+		rc = create_property_list_from_lua_stack(L, 7, &props, CMD_PUBLISH);
+		if (rc != MOSQ_ERR_SUCCESS)
+			return mosq__pstatus(L, rc);
+	}
+
+	c = calloc(1, sizeof(rpc_call_t));
+	if (c == NULL) {
+		mosquitto_property_free_all(&props);
+		return luaL_error(L, strerror(ENOMEM));
+	}
+	snprintf(c->id, sizeof(c->id), "%016llx", (unsigned long long) ++r->next_id);
+	/* c is gone once the reply is in */
+	memcpy(id, c->id, sizeof(id));
+	rc = mosquitto_property_add_string(&props, MQTT_PROP_RESPONSE_TOPIC, r->topic);
+	if (rc == MOSQ_ERR_SUCCESS)
+		rc = mosquitto_property_add_binary(&props, MQTT_PROP_CORRELATION_DATA, c->id, 16);
+	slot = rc == MOSQ_ERR_SUCCESS ? strmap__insert(&r->pending, c->id) : NULL;
+	if (slot == NULL) {
+		free(c);
+		mosquitto_property_free_all(&props);
+		return mosq__pstatus(L, MOSQ_ERR_NOMEM);
+	}
+	slot->value = c;
+	c->deadline = mosq__now_ms() + timeout;
+	c->thread = thread;
+	if (thread)
+		lua_pushthread(L);
+	else
+		lua_pushvalue(L, 5);
+	c->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	rpc__wheel_add(r, c);
+
+	/* requests are never conflated away, but queue like any other message */
+	rc = ctx__publish_limited(ctx, NULL, topic, payloadlen, payload, qos, false, props, PRIORITY_NORMAL);
+	ctx__io_kick(ctx, false);
+	mosquitto_property_free_all(&props);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		c = rpc__take(r, id);
+		luaL_unref(L, LUA_REGISTRYINDEX, c->ref);
+		free(c);
+		return mosq__pstatus(L, rc);
+	}
+	r->requests++;
+
+	if (thread)
+		return lua_yield(L, 0);
+	lua_pushstring(L, id);
+	return 1;
+}
+
+/***
+ * Duplicate suppression
+ * @section dedup
+ */
+
+/* default time keys are remembered, redeliveries follow a reconnect */
+#define DEDUP_WINDOW_MS	30000
+
+typedef struct {
+	uint64_t key;
+	uint64_t at;
+} dedup_entry_t;
+
+typedef struct dedup {
+	uint64_t *set;			/* open addressing, 0 is empty */
+	size_t mask;
+	dedup_entry_t *ring;	/* keys in order of arrival, for expiry */
+	size_t max;
+	size_t head;
+	size_t len;
+	uint64_t window;		/* ms, 0 for count only */
+	char *property;			/* user property holding the message id */
+	unsigned long dropped;
+} dedup_t;
+
+static uint64_t fnv64__add(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+static uint64_t dedup__key(dedup_t *d, const struct mosquitto_message *msg, const mosquitto_property *props)
+{
+	const mosquitto_property *prop;
+	uint64_t h = 14695981039346656037ull;
+	char *name, *value;
+
+	if (d->property && props) {
+		prop = mosquitto_property_read_string_pair(props, MQTT_PROP_USER_PROPERTY, &name, &value, false);
+		while (prop) {
+			if (strcmp(name, d->property) == 0) {
+				h = fnv64__add(h, value, strlen(value));
+				free(name);
+				free(value);
+				return h ? h : 1;
+			}
+			free(name);
+			free(value);
+			prop = mosquitto_property_read_string_pair(prop, MQTT_PROP_USER_PROPERTY, &name, &value, true);
+		}
+	}
+
+	h = fnv64__add(h, msg->topic, strlen(msg->topic) + 1);
+	h = fnv64__add(h, msg->payload, msg->payloadlen);
+	return h ? h : 1;
+}
+
+static size_t dedup__find(dedup_t *d, uint64_t key)
+{
+	size_t i;
+
+	for (i = key & d->mask; d->set[i] && d->set[i] != key; i = (i + 1) & d->mask);
+	return i;
+}
+
+/* backward shift deletion, as for strmap */
+static void dedup__remove(dedup_t *d, uint64_t key)
+{
+	size_t i = dedup__find(d, key), j = i, k;
+
+	if (d->set[i] == 0)
+		return;
+	for (;;) {
+		j = (j + 1) & d->mask;
+		if (d->set[j] == 0)
+			break;
+		k = d->set[j] & d->mask;
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		d->set[i] = d->set[j];
+		i = j;
+	}
+	d->set[i] = 0;
+}
+
+/* true if the message was seen within the window, remembers it if not */
+static bool dedup__seen(dedup_t *d, const struct mosquitto_message *msg, const mosquitto_property *props)
+{
+	uint64_t key = dedup__key(d, msg, props), now = mosq__now_ms();
+	dedup_entry_t *e;
+	size_t i;
+
+	/* forget what fell out of the window */
+	while (d->len && (d->len == d->max || (d->window && now - d->ring[d->head].at > d->window))) {
+		dedup__remove(d, d->ring[d->head].key);
+		d->head = (d->head + 1) % d->max;
+		d->len--;
+	}
+
+	i = dedup__find(d, key);
+	if (d->set[i]) {
+		d->dropped++;
+		return true;
+	}
+	d->set[i] = key;
+	e = &d->ring[(d->head + d->len++) % d->max];
+	e->key = key;
+	e->at = now;
+	return false;
+}
+
+static void dedup__free(dedup_t *d)
+{
+	free(d->set);
+	free(d->ring);
+	free(d->property);
+	free(d);
+}
+
+static void dedup__stats(lua_State *L, dedup_t *d)
+{
+	lua_pushinteger(L, d->len);
+	lua_setfield(L, -2, "dedup_window");
+	lua_pushinteger(L, d->dropped);
+	lua_setfield(L, -2, "dedup_dropped");
+}
+
+/***
+ * Discard redelivered QoS 1 and 2 messages before any callback, for example
+ * after a reconnect. Messages are told apart by a hash of topic and payload,
+ * or by the value of a user property. The last count messages are
+ * remembered for at most time ms, long enough for a redelivery but short
+ * enough to let through a repeated message, such as a heartbeat, later on.
+ * @function dedup
+ * @tparam[opt] table options, nil stops discarding:
+ *   count (10000) messages remembered, time (30000) ms they are remembered
+ *   for, 0 for as long as they fit, property name of the user property carrying
+ *   the message id. Messages without it, and all messages when on_message
+ *   is set as well as v5 callbacks, are hashed
+ * @return boolean true
+ * @raise For invalid options or out of memory
+ */
+static int ctx_dedup(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lua_Integer count = opt__integer(L, 2, "count", 10000);
+	lua_Integer window = opt__integer(L, 2, "time", DEDUP_WINDOW_MS);
+	const char *property = opt__string(L, 2, "property", NULL);
+	dedup_t *d;
+	size_t cap;
+
+	luaL_argcheck(L, count > 0, 2, "count must be positive");
+	luaL_argcheck(L, window >= 0, 2, "time must not be negative");
+
+	/* the I/O thread checks messages as they come in */
+	if (ctx->io.thread)
+		return luaL_error(L, "can't change duplicate suppression of a client attached to an I/O pool");
+
+	if (ctx->dedup) {
+		dedup__free(ctx->dedup);
+		ctx->dedup = NULL;
+		ctx->drop_msg = NULL;
+	}
+	if (!lua_table_on_stack(L, 2))
+		return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+
+	/* at most half full */
+	for (cap = 16; cap < (size_t) count * 2; cap *= 2);
+
+	d = calloc(1, sizeof(dedup_t));
+	if (d == NULL)
+		return luaL_error(L, strerror(ENOMEM));
+	d->set = calloc(cap, sizeof(uint64_t));
+	d->ring = malloc(count * sizeof(dedup_entry_t));
+	d->property = property ? strdup(property) : NULL;
+	if (d->set == NULL || d->ring == NULL || (property && d->property == NULL)) {
+		dedup__free(d);
+		return luaL_error(L, strerror(ENOMEM));
+	}
+	d->mask = cap - 1;
+	d->max = count;
+	d->window = window;
+	ctx->dedup = d;
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Load shedding
+ * @section load_shedding
+ */
+
+typedef struct shed {
+	matcher_t *filters;		/* low priority traffic */
+	unsigned long depth_high;
+	unsigned long depth_low;
+	uint64_t lag_high;		/* ms, 0 to ignore lag */
+	uint64_t lag_low;
+	uint64_t lag;			/* age of the last message handed to Lua */
+	unsigned long msg_size;	/* running average on the wire, in bytes */
+	bool active;
+	unsigned long dropped;
+	unsigned long episodes;
+} shed_t;
+
+/* messages received but not handed to Lua yet */
+static unsigned long ctx__inbound_depth(ctx_t *ctx)
+{
+	unsigned long depth = __atomic_load_n(&ctx->io.depth, __ATOMIC_RELAXED);
+	int fd, pending;
+
+	if (ctx->pool)
+		depth += __atomic_load_n(&ctx->pool->dispatched, __ATOMIC_RELAXED) -
+			__atomic_load_n(&ctx->pool->processed, __ATOMIC_RELAXED);
+
+	/*
+	 * loop and loop_start hand messages to Lua as they are read, their
+	 * backlog is still in the socket. Counted in messages of average size.
+	 */
+	if (ctx->io.thread == NULL && ctx->pool == NULL) {
+		fd = mosquitto_socket(ctx->mosq);
+		if (fd >= 0 && ioctl(fd, FIONREAD, &pending) == 0 && pending > 0)
+			depth += pending / ctx->shed->msg_size;
+	}
+	return depth;
+}
+
+/* called on the Lua thread as a deferred message is delivered */
+static void shed__lag(shed_t *s, uint64_t received)
+{
+	__atomic_store_n(&s->lag, mosq__now_ms() - received, __ATOMIC_RELAXED);
+}
+
+/* true to drop msg, updates the watermark state on the network thread */
+static bool shed__drop(ctx_t *ctx, const struct mosquitto_message *msg)
+{
+	shed_t *s = ctx->shed;
+	/* topic, payload and a fixed header of a few bytes */
+	long size = strlen(msg->topic) + msg->payloadlen + 5;
+	unsigned long depth;
+	uint64_t lag;
+
+	s->msg_size += (size - (long) s->msg_size) / 8;
+	if (s->msg_size == 0)
+		s->msg_size = 1;
+	depth = ctx__inbound_depth(ctx);
+	/* an empty queue has nothing lagging behind */
+	lag = depth ? __atomic_load_n(&s->lag, __ATOMIC_RELAXED) : 0;
+
+	if (!s->active && (depth >= s->depth_high || (s->lag_high && lag >= s->lag_high))) {
+		s->active = true;
+		s->episodes++;
+	} else if (s->active && depth <= s->depth_low && (s->lag_high == 0 || lag <= s->lag_low)) {
+		s->active = false;
+	}
+
+	if (!s->active || msg->qos != 0 || !matcher__any(s->filters, msg->topic))
+		return false;
+	s->dropped++;
+	return true;
+}
+
+/*
+ * Whether to drop msg before any callback. libmosquitto calls the v3
+ * callback right before the v5 one for the same message, the second one
+ * goes with the first verdict.
+ */
+static bool ctx__drop(ctx_t *ctx, const struct mosquitto_message *msg, const mosquitto_property *props, bool v5)
+{
+	bool drop = false;
+
+	if (v5 && ctx->drop_msg == msg) {
+		ctx->drop_msg = NULL;
+		return ctx->drop_verdict;
+	}
+
+	if (ctx->shed && shed__drop(ctx, msg))
+		drop = true;
+	/* only QoS 1 and 2 are redelivered, repeated QoS 0 messages go through */
+	else if (ctx->dedup && msg->qos && dedup__seen(ctx->dedup, msg, props))
+		drop = true;
+
+	if (!v5 && ctx->message_v5_set) {
+		ctx->drop_msg = msg;
+		ctx->drop_verdict = drop;
+	}
+	return drop;
+}
+
+static void shed__free(shed_t *s)
+{
+	if (s->filters)
+		matcher__free(s->filters);
+	free(s);
+}
+
+static void shed__stats(lua_State *L, shed_t *s)
+{
+	lua_pushboolean(L, s->active);
+	lua_setfield(L, -2, "shedding");
+	lua_pushinteger(L, s->dropped);
+	lua_setfield(L, -2, "shed_dropped");
+	lua_pushinteger(L, s->episodes);
+	lua_setfield(L, -2, "shed_episodes");
+	lua_pushinteger(L, __atomic_load_n(&s->lag, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "inbound_lag");
+}
+
+/***
+ * Shed low priority QoS 0 messages while inbound traffic backs up, before
+ * they become Lua objects. Shedding starts when the messages received but
+ * not yet handed to Lua, deferred by an I/O pool or queued for a worker
+ * pool, reach depth_high or when the age of the last message handed to Lua
+ * reaches lag_high, and stops once both are down to their low watermarks.
+ * Clients run by loop or loop_start hand messages over as they are read,
+ * their depth is what waits in the socket in messages of average size, and
+ * they have no lag.
+ * @function shed
+ * @tparam[opt] table options, nil stops shedding:
+ *   filters array of topic filters of the low priority traffic,
+ *   depth_high (1000) and depth_low (depth_high / 10) in messages,
+ *   lag_high (0, not checked) and lag_low (lag_high / 5) in ms
+ * @return boolean true
+ * @raise For invalid options or out of memory
+ */
+static int ctx_shed(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lua_Integer depth_high = opt__integer(L, 2, "depth_high", 1000);
+	lua_Integer depth_low = opt__integer(L, 2, "depth_low", depth_high / 10);
+	lua_Integer lag_high = opt__integer(L, 2, "lag_high", 0);
+	lua_Integer lag_low = opt__integer(L, 2, "lag_low", lag_high / 5);
+	shed_t *s;
+
+	luaL_argcheck(L, depth_high > 0 && depth_low >= 0 && depth_low < depth_high, 2, "depth_low must be below depth_high");
+	luaL_argcheck(L, lag_high >= 0 && lag_low >= 0 && (lag_high == 0 || lag_low < lag_high), 2, "lag_low must be below lag_high");
+
+	/* the I/O thread sheds as messages come in */
+	if (ctx->io.thread)
+		return luaL_error(L, "can't change load shedding of a client attached to an I/O pool");
+
+	if (ctx->shed) {
+		shed__free(ctx->shed);
+		ctx->shed = NULL;
+		ctx->drop_msg = NULL;
+	}
+	if (!lua_table_on_stack(L, 2))
+		return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+
+	s = calloc(1, sizeof(shed_t));
+	if (s == NULL)
+		return luaL_error(L, strerror(ENOMEM));
+	s->depth_high = depth_high;
+	s->depth_low = depth_low;
+	s->lag_high = lag_high;
+	s->lag_low = lag_low;
+	s->msg_size = 64;
+
+	/* owned by ctx before anything can raise */
+	ctx->shed = s;
+	s->filters = matcher__new();
+	if (s->filters == NULL)
+		return luaL_error(L, strerror(ENOMEM));
+
+	lua_getfield(L, 2, "filters");
+	luaL_argcheck(L, lua_istable(L, -1), 2, "filters must be an array of topic filters");
+	matcher__add_all(L, lua_gettop(L), s->filters);
+	lua_pop(L, 1);
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Streams
+ * @section streams
+ */
+
+#define STREAM_CHUNK	65536
+#define STREAM_BURST	16		/* chunks per service pass and stream */
+#define STREAM_INFLIGHT	16		/* chunks of all streams not yet completed */
+
+/* user properties carried by every chunk */
+#define STREAM_PROP_ID		"stream-id"
+#define STREAM_PROP_SEQ		"stream-seq"
+#define STREAM_PROP_OFFSET	"stream-offset"
+#define STREAM_PROP_LAST	"stream-last"	/* total size, on the last chunk */
+
+typedef struct stream_tx {
+	struct stream_tx *next;
+	char id[17];
+	char *topic;
+	int qos;
+	size_t chunk;
+	uint64_t seq;
+	uint64_t offset;
+	int fd;
+	unsigned char *map;		/* file source */
+	size_t size;
+	int reader;				/* function source, or LUA_NOREF */
+	char *buf;				/* last chunk read, until it's published */
+	size_t buflen;
+	int buffered;			/* 0 nothing read, 1 a chunk, 2 the end */
+	int done;				/* completion callback, or LUA_NOREF */
+	pthread_t owner;
+} stream_tx_t;
+
+/* chunks are acknowledged on the network side */
+typedef struct stream_credit {
+	pthread_mutex_t lock;
+	inflight_t inflight;
+} stream_credit_t;
+
+typedef struct {
+	char *topic;
+	char *path;
+	int fd;
+	uint8_t *seen;			/* bitmap of the chunks written */
+	size_t seen_cap;		/* in chunks */
+	uint64_t nseen;
+	int64_t last;			/* seq of the last chunk, -1 until it's in */
+	uint64_t size;
+	uint64_t updated;
+} stream_in_t;
+
+typedef struct stream_rx {
+	matcher_t *filters;		/* topics reserved for streams */
+	char *dir;
+	uint64_t timeout;
+	uint64_t next_expire;
+	int callback;
+	strmap_t streams;		/* stream id -> stream_in_t */
+	pthread_t owner;
+	unsigned long completed;
+	unsigned long expired;
+	unsigned long invalid;
+	unsigned long bytes;
+} stream_rx_t;
+
+static void stream_tx__free(lua_State *L, stream_tx_t *tx)
+{
+	if (tx->map)
+		munmap(tx->map, tx->size);
+	if (tx->fd >= 0)
+		close(tx->fd);
+	luaL_unref(L, LUA_REGISTRYINDEX, tx->reader);
+	luaL_unref(L, LUA_REGISTRYINDEX, tx->done);
+	free(tx->buf);
+	free(tx->topic);
+	free(tx);
+}
+
+static stream_credit_t *stream_credit__new(void)
+{
+	stream_credit_t *c = calloc(1, sizeof(stream_credit_t));
+
+	if (c == NULL)
+		return NULL;
+	if (!inflight__init(&c->inflight)) {
+		free(c);
+		return NULL;
+	}
+	pthread_mutex_init(&c->lock, NULL);
+	return c;
+}
+
+static void stream_credit__free(stream_credit_t *c)
+{
+	pthread_mutex_destroy(&c->lock);
+	inflight__clear(&c->inflight);
+	free(c);
+}
+
+static void stream_credit__ack(stream_credit_t *c, int mid)
+{
+	pthread_mutex_lock(&c->lock);
+	inflight__ack(&c->inflight, mid);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void stream_credit__reset(stream_credit_t *c)
+{
+	pthread_mutex_lock(&c->lock);
+	inflight__reset(&c->inflight);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* unfinished streams are dropped without a word */
+static void stream_tx__free_all(ctx_t *ctx)
+{
+	stream_tx_t *tx;
+
+	while ((tx = ctx->stream_tx) != NULL) {
+		ctx->stream_tx = tx->next;
+		stream_tx__free(ctx->L, tx);
+	}
+}
+
+/* publish one chunk, not through the offline buffer, chunks are held back here */
+static int stream_tx__send(ctx_t *ctx, stream_tx_t *tx, const void *data, size_t len, bool last)
+{
+	stream_credit_t *c = ctx->stream_credit;
+	mosquitto_property *props = NULL;
+	char seq[24], offset[24], size[24];
+	uint32_t taken;
+	int mid = 0;
+	int rc;
+
+	snprintf(seq, sizeof(seq), "%llu", (unsigned long long) tx->seq);
+	snprintf(offset, sizeof(offset), "%llu", (unsigned long long) tx->offset);
+	snprintf(size, sizeof(size), "%llu", (unsigned long long) (tx->offset + len));
+
+	rc = mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, STREAM_PROP_ID, tx->id);
+	if (rc == MOSQ_ERR_SUCCESS)
+		rc = mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, STREAM_PROP_SEQ, seq);
+	if (rc == MOSQ_ERR_SUCCESS)
+		rc = mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, STREAM_PROP_OFFSET, offset);
+	if (rc == MOSQ_ERR_SUCCESS && last)
+		rc = mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, STREAM_PROP_LAST, size);
+	if (rc == MOSQ_ERR_SUCCESS) {
+		pthread_mutex_lock(&c->lock);
+		taken = inflight__take(&c->inflight);
+		pthread_mutex_unlock(&c->lock);
+		rc = ctx__publish_now(ctx, &mid, tx->topic, len, data, tx->qos, false, props);
+		pthread_mutex_lock(&c->lock);
+		inflight__settle(&c->inflight, rc == MOSQ_ERR_SUCCESS, mid, taken);
+		pthread_mutex_unlock(&c->lock);
+	}
+	mosquitto_property_free_all(&props);
+	return rc;
+}
+
+/* true while fewer than STREAM_INFLIGHT chunks wait for completion */
+static bool stream_tx__credit(ctx_t *ctx)
+{
+	stream_credit_t *c = ctx->stream_credit;
+	bool ok;
+
+	pthread_mutex_lock(&c->lock);
+	ok = c->inflight.count < STREAM_INFLIGHT;
+	pthread_mutex_unlock(&c->lock);
+	return ok;
+}
+
+/* the next chunk of tx, false if the reader failed */
+static bool stream_tx__next(ctx_t *ctx, stream_tx_t *tx, const void **data, size_t *len, bool *last)
+{
+	lua_State *L = ctx->L;
+	const char *s;
+	size_t n;
+
+	if (tx->reader == LUA_NOREF) {
+		*data = tx->map ? tx->map + tx->offset : NULL;
+		*len = tx->size - tx->offset < tx->chunk ? tx->size - tx->offset : tx->chunk;
+		*last = tx->offset + *len == tx->size;
+		return true;
+	}
+
+	/* kept until published, the reader can't be asked twice */
+	if (!tx->buffered) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, tx->reader);
+		lua_call(L, 0, 1);
+		s = lua_tolstring(L, -1, &n);
+		if (s == NULL && !lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			return false;
+		}
+		free(tx->buf);
+		tx->buf = NULL;
+		tx->buflen = 0;
+		if (s && n) {
+			tx->buf = malloc(n);
+			if (tx->buf == NULL) {
+				lua_pop(L, 1);
+				return false;
+			}
+			memcpy(tx->buf, s, n);
+			tx->buflen = n;
+		}
+		/* nil ends the stream with an empty last chunk */
+		tx->buffered = s != NULL ? 1 : 2;
+		lua_pop(L, 1);
+	}
+	*data = tx->buf;
+	*len = tx->buflen;
+	*last = tx->buffered == 2;
+	return true;
+}
+
+/* unlink tx from the client and tell the done callback */
+static void stream_tx__finish(ctx_t *ctx, stream_tx_t *tx, int rc)
+{
+	lua_State *L = ctx->L;
+	stream_tx_t **p;
+	int done = tx->done;
+
+	for (p = &ctx->stream_tx; *p != tx; p = &(*p)->next);
+	*p = tx->next;
+
+	if (done == LUA_NOREF) {
+		stream_tx__free(L, tx);
+		return;
+	}
+	tx->done = LUA_NOREF;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, done);
+	luaL_unref(L, LUA_REGISTRYINDEX, done);
+	lua_pushstring(L, tx->id);
+	stream_tx__free(L, tx);
+	if (rc == MOSQ_ERR_SUCCESS) {
+		lua_pushboolean(L, true);
+		lua_call(L, 2, 0);
+	} else {
+		lua_pushnil(L);
+		lua_pushinteger(L, rc);
+		lua_pushstring(L, mosquitto_strerror(rc));
+		lua_call(L, 4, 0);
+	}
+}
+
+/* send what the connection takes of every outgoing stream */
+static void stream_tx__feed(ctx_t *ctx)
+{
+	stream_tx_t *tx, *next;
+	const void *data;
+	size_t len;
+	bool last;
+	int i, rc;
+
+	for (tx = ctx->stream_tx; tx; tx = next) {
+		next = tx->next;
+		if (!pthread_equal(pthread_self(), tx->owner))
+			continue;
+
+		for (i = 0; i < STREAM_BURST && !mosquitto_want_write(ctx->mosq) && stream_tx__credit(ctx); i++) {
+			if (!stream_tx__next(ctx, tx, &data, &len, &last)) {
+				stream_tx__finish(ctx, tx, MOSQ_ERR_INVAL);
+				break;
+			}
+			rc = stream_tx__send(ctx, tx, data, len, last);
+			/* the same chunk again once connected */
+			if (rc == MOSQ_ERR_NO_CONN)
+				break;
+			if (rc != MOSQ_ERR_SUCCESS || last) {
+				stream_tx__finish(ctx, tx, rc);
+				break;
+			}
+			tx->seq++;
+			tx->offset += len;
+			tx->buffered = 0;
+		}
+		/* a callback may have destroyed the client */
+		if (ctx->stream_tx == NULL)
+			break;
+	}
+	ctx__io_kick(ctx, false);
+}
+
+/***
+ * Publish a payload of any size as a stream of chunks, each one a message on
+ * topic with the user properties stream-id, stream-seq, stream-offset and,
+ * on the last one, stream-last holding the total size. Chunks are sent from
+ * the loop as the connection takes them, a file is mapped rather than read
+ * into Lua. No more than 16 chunks of all the client's streams wait for
+ * completion at a time. Sending pauses while disconnected and resumes after
+ * a reconnect, a stream cut short can be resumed with the same id and a
+ * first chunk.
+ * @function publish_stream
+ * @tparam string topic
+ * @tparam string|function source path of a file, or a function returning
+ * the next piece of the payload and nil at the end
+ * @tparam[opt] table options chunk (65536) size of the chunks of a file, qos
+ * (1), id of the stream (generated), first (0) chunk to send of a file, done
+ * function called as done(id, true) once the last chunk is queued, or
+ * done(id, nil, code, description) on failure
+ * @treturn[1] string the stream id
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For invalid arguments or out of memory
+ */
+static int ctx_publish_stream(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *topic = luaL_checkstring(L, 2);
+	lua_Integer chunk = opt__integer(L, 4, "chunk", STREAM_CHUNK);
+	lua_Integer qos = opt__integer(L, 4, "qos", 1);
+	lua_Integer first = opt__integer(L, 4, "first", 0);
+	const char *id = opt__string(L, 4, "id", NULL);
+	stream_tx_t *tx, **p;
+	struct stat st;
+	static uint32_t streams;
+	uint32_t n;
+
+	luaL_argcheck(L, lua_isfunction(L, 3) || lua_isstring(L, 3), 3, "file path or reader function expected");
+	luaL_argcheck(L, chunk > 0 && chunk <= 256 * 1024 * 1024, 4, "chunk out of range");
+	luaL_argcheck(L, qos >= 0 && qos <= 2, 4, "qos must be 0, 1 or 2");
+	luaL_argcheck(L, first >= 0, 4, "first must not be negative");
+	luaL_argcheck(L, id == NULL || strlen(id) <= 16, 4, "id is at most 16 characters");
+
+	if (ctx->stream_credit == NULL) {
+		stream_credit_t *c = stream_credit__new();
+		if (c == NULL)
+			return luaL_error(L, strerror(ENOMEM));
+		/* read by the publish callback, possibly on another thread */
+		__atomic_store_n(&ctx->stream_credit, c, __ATOMIC_RELEASE);
+		mosquitto_publish_callback_set(ctx->mosq, ctx_on_publish);
+	}
+
+	tx = calloc(1, sizeof(stream_tx_t));
+	if (tx == NULL)
+		return luaL_error(L, strerror(ENOMEM));
+	tx->fd = -1;
+	tx->reader = LUA_NOREF;
+	tx->done = LUA_NOREF;
+	tx->qos = qos;
+	tx->chunk = chunk;
+	tx->owner = pthread_self();
+	tx->topic = strdup(topic);
+	if (tx->topic == NULL) {
+		stream_tx__free(L, tx);
+		return luaL_error(L, strerror(ENOMEM));
+	}
+	if (id) {
+		strcpy(tx->id, id);
+	} else {
+		n = __atomic_add_fetch(&streams, 1, __ATOMIC_RELAXED);
+		snprintf(tx->id, sizeof(tx->id), "%08x%08x", (uint32_t) getpid() ^ (uint32_t) (uintptr_t) ctx, n);
+	}
+
+	if (lua_isfunction(L, 3)) {
+		lua_pushvalue(L, 3);
+		tx->reader = luaL_ref(L, LUA_REGISTRYINDEX);
+	} else {
+		tx->fd = open(lua_tostring(L, 3), O_RDONLY | O_CLOEXEC);
+		if (tx->fd < 0 || fstat(tx->fd, &st) < 0) {
+			stream_tx__free(L, tx);
+			return mosq__pstatus(L, MOSQ_ERR_ERRNO);
+		}
+		tx->size = st.st_size;
+		if (tx->size) {
+			tx->map = mmap(NULL, tx->size, PROT_READ, MAP_SHARED, tx->fd, 0);
+			if (tx->map == MAP_FAILED) {
+				tx->map = NULL;
+				stream_tx__free(L, tx);
+				return mosq__pstatus(L, MOSQ_ERR_ERRNO);
+			}
+			madvise(tx->map, tx->size, MADV_SEQUENTIAL);
+		}
+		/* compared by division, first * chunk may not fit */
+		if ((uint64_t) first > tx->size / chunk) {
+			stream_tx__free(L, tx);
+			return luaL_argerror(L, 4, "first is past the end of the file");
+		}
+		tx->seq = first;
+		tx->offset = (uint64_t) first * chunk;
+	}
+
+	if (lua_table_on_stack(L, 4)) {
+		lua_getfield(L, 4, "done");
+		if (lua_isfunction(L, -1))
+			tx->done = luaL_ref(L, LUA_REGISTRYINDEX);
+		else
+			lua_pop(L, 1);
+	}
+
+	/* streams go in turn, in the order they were started */
+	for (p = &ctx->stream_tx; *p; p = &(*p)->next);
+	*p = tx;
+
+	lua_pushstring(L, tx->id);
+	return 1;
+}
+
+static void stream_in__free(stream_in_t *in, bool unlink_file)
+{
+	if (in->fd >= 0)
+		close(in->fd);
+	if (unlink_file)
+		unlink(in->path);
+	free(in->seen);
+	free(in->topic);
+	free(in->path);
+	free(in);
+}
+
+static void stream_rx__free(lua_State *L, stream_rx_t *rx)
+{
+	size_t i;
+
+	/* incomplete streams are gone with their files */
+	for (i = 0; rx->streams.slots && i <= rx->streams.mask; i++) {
+		if (rx->streams.slots[i].value)
+			stream_in__free(rx->streams.slots[i].value, true);
+	}
+	strmap__clear(&rx->streams);
+	if (rx->filters)
+		matcher__free(rx->filters);
+	luaL_unref(L, LUA_REGISTRYINDEX, rx->callback);
+	free(rx->dir);
+	free(rx);
+}
+
+static bool stream_rx__is_chunk(stream_rx_t *rx, const char *topic)
+{
+	return matcher__any(rx->filters, topic);
+}
+
+static stream_in_t *stream_in__new(stream_rx_t *rx, const char *topic)
+{
+	stream_in_t *in = calloc(1, sizeof(stream_in_t));
+	size_t len = strlen(rx->dir) + sizeof("/lmq-stream-XXXXXX");
+
+	if (in == NULL)
+		return NULL;
+	in->fd = -1;
+	in->last = -1;
+	in->topic = strdup(topic);
+	in->path = malloc(len);
+	if (in->topic == NULL || in->path == NULL) {
+		stream_in__free(in, false);
+		return NULL;
+	}
+	snprintf(in->path, len, "%s/lmq-stream-XXXXXX", rx->dir);
+	in->fd = mkstemp(in->path);
+	if (in->fd < 0) {
+		stream_in__free(in, false);
+		return NULL;
+	}
+	return in;
+}
+
+/* true if a chunk past seq was written */
+static bool stream_in__seen_after(stream_in_t *in, uint64_t seq)
+{
+	uint64_t i;
+
+	for (i = seq + 1; i < in->seen_cap; i++) {
+		if (in->seen[i / 8] & (1 << (i % 8)))
+			return true;
+	}
+	return false;
+}
+
+/* write all of data at offset */
+static bool stream__pwrite(int fd, const char *data, size_t len, uint64_t offset)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, data, len, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		data += n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
+
+/*
+ * Write a chunk to the file of its stream, straight from the message
+ * buffer. Chunks may come in any order and more than once.
+ */
+static void stream_rx__chunk(ctx_t *ctx, const struct mosquitto_message *msg, const mosquitto_property *props)
+{
+	stream_rx_t *rx = ctx->stream_rx;
+	const mosquitto_property *prop;
+	char *name, *value, *id = NULL;
+	unsigned long long seq = 0, offset = 0, size = 0;
+	int found = 0;
+	bool last = false;
+	strmap_slot_t *slot;
+	stream_in_t *in;
+	uint8_t *seen;
+	size_t cap;
+	lua_State *L = ctx->L;
+
+	prop = mosquitto_property_read_string_pair(props, MQTT_PROP_USER_PROPERTY, &name, &value, false);
+	for (; prop; prop = mosquitto_property_read_string_pair(prop, MQTT_PROP_USER_PROPERTY, &name, &value, true)) {
+		if (strcmp(name, STREAM_PROP_ID) == 0 && id == NULL) {
+			id = value;
+			value = NULL;
+			found |= 1;
+		} else if (strcmp(name, STREAM_PROP_SEQ) == 0) {
+			seq = strtoull(value, NULL, 10);
+			found |= 2;
+		} else if (strcmp(name, STREAM_PROP_OFFSET) == 0) {
+			offset = strtoull(value, NULL, 10);
+			found |= 4;
+		} else if (strcmp(name, STREAM_PROP_LAST) == 0) {
+			size = strtoull(value, NULL, 10);
+			last = true;
+		}
+		free(name);
+		free(value);
+	}
+
+	/* a bitmap per stream, an absurd seq is as good as broken */
+	if (found != 7 || seq >= (1ull << 32)) {
+		rx->invalid++;
+		free(id);
+		return;
+	}
+
+	slot = strmap__insert(&rx->streams, id);
+	free(id);
+	if (slot == NULL) {
+		rx->invalid++;
+		return;
+	}
+	if (slot->value == NULL) {
+		slot->value = stream_in__new(rx, msg->topic);
+		if (slot->value == NULL) {
+			strmap__remove(&rx->streams, slot);
+			rx->invalid++;
+			return;
+		}
+	}
+	in = slot->value;
+
+	/* nothing comes after the last chunk, nseen only counts up to it */
+	if (in->last >= 0 && (seq > (uint64_t) in->last || (last && seq != (uint64_t) in->last))) {
+		rx->invalid++;
+		return;
+	}
+	if (last && in->last < 0 && stream_in__seen_after(in, seq))
+		goto fail;
+
+	if (seq >= in->seen_cap) {
+		for (cap = in->seen_cap ? in->seen_cap : 64; cap <= seq; cap *= 2);
+		seen = realloc(in->seen, cap / 8);
+		if (seen == NULL)
+			goto fail;
+		memset(seen + in->seen_cap / 8, 0, (cap - in->seen_cap) / 8);
+		in->seen = seen;
+		in->seen_cap = cap;
+	}
+	if (!(in->seen[seq / 8] & (1 << (seq % 8)))) {
+		if (!stream__pwrite(in->fd, msg->payload, msg->payloadlen, offset))
+			goto fail;
+		in->seen[seq / 8] |= 1 << (seq % 8);
+		in->nseen++;
+		rx->bytes += msg->payloadlen;
+	}
+	if (last) {
+		in->last = seq;
+		in->size = size;
+	}
+	in->updated = mosq__now_ms();
+
+	if (in->last < 0 || in->nseen != (uint64_t) in->last + 1)
+		return;
+
+	/* complete, the file is the callback's now */
+	if (ftruncate(in->fd, in->size) < 0)
+		goto fail;
+	close(in->fd);
+	in->fd = -1;
+	lua_pushstring(L, slot->key);
+	strmap__remove(&rx->streams, slot);
+	rx->completed++;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, rx->callback);
+	lua_pushstring(L, in->topic);
+	lua_pushstring(L, in->path);
+	lua_pushinteger(L, in->size);
+	lua_pushvalue(L, -5);
+	stream_in__free(in, false);
+	lua_call(L, 4, 0); /* args: topic, path, size, id */
+	lua_pop(L, 1);
+	return;
+
+fail:
+	rx->invalid++;
+	strmap__remove(&rx->streams, slot);
+	stream_in__free(in, true);
+}
+
+/* drop streams that stalled, once a second */
+static void stream_rx__expire(ctx_t *ctx)
+{
+	stream_rx_t *rx = ctx->stream_rx;
+	uint64_t now = mosq__now_ms();
+	stream_in_t *in;
+	size_t i;
+
+	if (now < rx->next_expire || !pthread_equal(pthread_self(), rx->owner))
+		return;
+	rx->next_expire = now + 1000;
+
+	for (i = 0; rx->streams.slots && i <= rx->streams.mask; i++) {
+		in = rx->streams.slots[i].value;
+		/* removal shifts the next slots back, look at this one again */
+		while (in && now - in->updated > rx->timeout) {
+			strmap__remove(&rx->streams, &rx->streams.slots[i]);
+			stream_in__free(in, true);
+			rx->expired++;
+			in = rx->streams.slots[i].value;
+		}
+	}
+}
+
+static void stream__stats(lua_State *L, ctx_t *ctx)
+{
+	stream_rx_t *rx = ctx->stream_rx;
+	stream_tx_t *tx;
+	int n = 0;
+
+	for (tx = ctx->stream_tx; tx; tx = tx->next)
+		n++;
+	lua_pushinteger(L, n);
+	lua_setfield(L, -2, "streams_out");
+	if (ctx->stream_credit) {
+		pthread_mutex_lock(&ctx->stream_credit->lock);
+		lua_pushinteger(L, ctx->stream_credit->inflight.count);
+		pthread_mutex_unlock(&ctx->stream_credit->lock);
+		lua_setfield(L, -2, "streams_inflight");
+	}
+	if (rx == NULL)
+		return;
+	lua_pushinteger(L, rx->streams.len);
+	lua_setfield(L, -2, "streams_in");
+	lua_pushinteger(L, rx->completed);
+	lua_setfield(L, -2, "streams_completed");
+	lua_pushinteger(L, rx->expired);
+	lua_setfield(L, -2, "streams_expired");
+	lua_pushinteger(L, rx->invalid);
+	lua_setfield(L, -2, "streams_invalid");
+	lua_pushinteger(L, rx->bytes);
+	lua_setfield(L, -2, "streams_bytes");
+}
+
+/***
+ * Reassemble streams sent by publish_stream into files. Messages on the
+ * filters are taken as chunks and written to a temporary file from C, they
+ * reach no other callback. Incomplete streams survive reconnects, and are
+ * dropped with their file once no chunk came in for timeout ms.
+ * @function stream_receive
+ * @tparam[opt] table options, nil stops receiving and drops incomplete
+ * streams: filters array of topic filters streams are published on,
+ * callback function called as callback(topic, path, size, id) with each
+ * complete stream, the file at path is the callback's to remove,
+ * dir ("/tmp") for the files, timeout (60000)
+ * @return boolean true
+ * @raise For invalid options or out of memory
+ */
+static int ctx_stream_receive(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *dir = opt__string(L, 2, "dir", "/tmp");
+	lua_Integer timeout = opt__integer(L, 2, "timeout", 60000);
+	stream_rx_t *rx;
+
+	luaL_argcheck(L, timeout > 0, 2, "timeout must be positive");
+
+	/* the I/O thread sorts chunks out as they come in */
+	if (ctx->io.thread)
+		return luaL_error(L, "can't change stream reception of a client attached to an I/O pool");
+
+	if (ctx->stream_rx) {
+		stream_rx__free(L, ctx->stream_rx);
+		ctx->stream_rx = NULL;
+	}
+	if (!lua_table_on_stack(L, 2))
+		return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+
+	lua_getfield(L, 2, "callback");
+	luaL_argcheck(L, lua_isfunction(L, -1), 2, "callback function expected");
+	lua_pop(L, 1);
+
+	rx = calloc(1, sizeof(stream_rx_t));
+	if (rx == NULL)
+		return luaL_error(L, strerror(ENOMEM));
+	rx->callback = LUA_NOREF;
+	rx->timeout = timeout;
+	rx->owner = pthread_self();
+
+	/* owned by ctx before anything can raise */
+	ctx->stream_rx = rx;
+	rx->dir = strdup(dir);
+	rx->filters = matcher__new();
+	if (rx->dir == NULL || rx->filters == NULL)
+		return luaL_error(L, strerror(ENOMEM));
+	lua_getfield(L, 2, "callback");
+	rx->callback = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	lua_getfield(L, 2, "filters");
+	luaL_argcheck(L, lua_istable(L, -1), 2, "filters must be an array of topic filters");
+	matcher__add_all(L, lua_gettop(L), rx->filters);
+	lua_pop(L, 1);
+
+	/* chunks are told apart by their properties */
+	if (!ctx->message_v5_set)
+		ctx__message_v5_enable(ctx);
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Buffers
+ * @section buffers
+ */
+
+typedef struct {
+	unsigned char *data;
+	size_t len;
+	void *base;			/* mapping or allocation to release, NULL for a slice */
+	size_t maplen;		/* length of a mapping, 0 for malloc */
+	bool writable;
+	int parent;			/* slices keep what they point into alive */
+} buffer_t;
+
+static buffer_t *buffer_check(lua_State *L, int i)
+{
+	return (buffer_t *) luaL_checkudata(L, i, MOSQ_META_BUFFER);
+}
+
+/* the buffer at index i, NULL if it isn't one */
+static buffer_t *buffer__test(lua_State *L, int i)
+{
+	buffer_t *b = lua_touserdata(L, i);
+
+	if (b == NULL || !lua_getmetatable(L, i))
+		return NULL;
+	luaL_getmetatable(L, MOSQ_META_BUFFER);
+	if (!lua_rawequal(L, -1, -2))
+		b = NULL;
+	lua_pop(L, 2);
+	return b;
+}
+
+/* bytes of the string or buffer at index i, as lua_tolstring */
+static const void *buffer__payload(lua_State *L, int i, size_t *len)
+{
+	buffer_t *b = buffer__test(L, i);
+
+	if (b == NULL)
+		return lua_tolstring(L, i, len);
+	*len = b->len;
+	return b->data;
+}
+
+static buffer_t *buffer__new(lua_State *L)
+{
+	buffer_t *b = (buffer_t *) lua_newuserdata(L, sizeof(buffer_t));
+
+	memset(b, 0, sizeof(buffer_t));
+	b->parent = LUA_NOREF;
+	luaL_getmetatable(L, MOSQ_META_BUFFER);
+	lua_setmetatable(L, -2);
+	return b;
+}
+
+/* string.sub style positions i and j to an offset and length into b */
+static void buffer__range(lua_State *L, buffer_t *b, int index, size_t *offset, size_t *len)
+{
+	lua_Integer i = luaL_optinteger(L, index, 1);
+	lua_Integer j = luaL_optinteger(L, index + 1, -1);
+	lua_Integer n = b->len;
+
+	if (i < 0)
+		i = i < -n ? 1 : n + i + 1;
+	else if (i == 0)
+		i = 1;
+	if (j < 0)
+		j = n + j + 1;
+	else if (j > n)
+		j = n;
+
+	*offset = i - 1;
+	*len = i > j ? 0 : j - i + 1;
+	if (*offset > (size_t) n)
+		*offset = n;
+}
+
+/***
+ * Create a mutable byte buffer, to be filled by native code or
+ * buffer:write, and published without becoming a Lua string. Every function
+ * taking a payload accepts a buffer.
+ * @function buffer
+ * @tparam number|string size of the zero filled buffer, or a string to copy
+ * @return[1] a buffer
+ * @raise For out of memory
+ */
+static int mosq_buffer(lua_State *L)
+{
+	size_t len;
+	const char *s = NULL;
+	buffer_t *b;
+
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		s = lua_tolstring(L, 1, &len);
+	} else {
+		lua_Integer size = luaL_checkinteger(L, 1);
+		luaL_argcheck(L, size >= 0, 1, "size must not be negative");
+		len = size;
+	}
+
+	b = buffer__new(L);
+	b->base = calloc(len ? len : 1, 1);
+	if (b->base == NULL)
+		return luaL_error(L, strerror(ENOMEM));
+	b->data = b->base;
+	b->len = len;
+	b->writable = true;
+	if (s)
+		memcpy(b->data, s, len);
+	return 1;
+}
+
+/***
+ * Map a region of a file read-only, to publish it without reading it into
+ * Lua.
+ * @function map
+ * @tparam string path
+ * @tparam[opt=0] number offset in bytes
+ * @tparam[opt] number length, to the end of the file by default
+ * @return[1] a buffer
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ */
+static int mosq_map(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	lua_Integer offset = luaL_optinteger(L, 2, 0);
+	lua_Integer length = luaL_optinteger(L, 3, -1);
+	long page = sysconf(_SC_PAGESIZE);
+	struct stat st;
+	buffer_t *b;
+	size_t skew;
+	void *map;
+	int fd;
+
+	luaL_argcheck(L, offset >= 0, 2, "offset must not be negative");
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		if (fd >= 0)
+			close(fd);
+		return mosq__pstatus(L, MOSQ_ERR_ERRNO);
+	}
+	if (offset > st.st_size || (length >= 0 && offset + length > st.st_size)) {
+		close(fd);
+		errno = EINVAL;
+		return mosq__pstatus(L, MOSQ_ERR_ERRNO);
+	}
+	if (length < 0)
+		length = st.st_size - offset;
+
+	b = buffer__new(L);
+	if (length == 0) {
+		close(fd);
+		return 1;
+	}
+
+	/* mappings start on a page */
+	skew = offset % page;
+	map = mmap(NULL, length + skew, PROT_READ, MAP_SHARED, fd, offset - skew);
+	close(fd);
+	if (map == MAP_FAILED) {
+		lua_pop(L, 1);
+		return mosq__pstatus(L, MOSQ_ERR_ERRNO);
+	}
+	b->base = map;
+	b->maplen = length + skew;
+	b->data = (unsigned char *) map + skew;
+	b->len = length;
+	return 1;
+}
+
+static int buffer_gc(lua_State *L)
+{
+	buffer_t *b = buffer_check(L, 1);
+
+	if (b->maplen)
+		munmap(b->base, b->maplen);
+	else
+		free(b->base);
+	luaL_unref(L, LUA_REGISTRYINDEX, b->parent);
+	b->base = NULL;
+	b->maplen = 0;
+	b->parent = LUA_NOREF;
+	b->data = NULL;
+	b->len = 0;
+	return 0;
+}
+
+static int buffer_len(lua_State *L)
+{
+	buffer_t *b = buffer_check(L, 1);
+
+	lua_pushinteger(L, b->len);
+	return 1;
+}
+
+/***
+ * A buffer sharing the bytes i to j, string.sub style, of this one
+ * @function slice
+ * @tparam[opt=1] number i
+ * @tparam[opt=-1] number j
+ * @return a buffer
+ */
+static int buffer_slice(lua_State *L)
+{
+	buffer_t *b = buffer_check(L, 1), *s;
+	size_t offset, len;
+
+	buffer__range(L, b, 2, &offset, &len);
+	s = buffer__new(L);
+	s->data = b->data + offset;
+	s->len = len;
+	s->writable = b->writable;
+	lua_pushvalue(L, 1);
+	s->parent = luaL_ref(L, LUA_REGISTRYINDEX);
+	return 1;
+}
+
+/***
+ * Copy the bytes i to j, string.sub style, into a string
+ * @function sub
+ * @tparam[opt=1] number i
+ * @tparam[opt=-1] number j
+ * @treturn string
+ */
+static int buffer_sub(lua_State *L)
+{
+	buffer_t *b = buffer_check(L, 1);
+	size_t offset, len;
+
+	buffer__range(L, b, 2, &offset, &len);
+	lua_pushlstring(L, (const char *) b->data + offset, len);
+	return 1;
+}
+
+/***
+ * Copy a string into the buffer
+ * @function write
+ * @tparam number i position to write at, from 1
+ * @tparam string data
+ * @return boolean true
+ * @raise If the buffer is a file mapping or data doesn't fit
+ */
+static int buffer_write(lua_State *L)
+{
+	buffer_t *b = buffer_check(L, 1);
+	lua_Integer i = luaL_checkinteger(L, 2);
+	size_t len;
+	const char *s = luaL_checklstring(L, 3, &len);
+
+	luaL_argcheck(L, b->writable, 1, "buffer is read-only");
+	luaL_argcheck(L, i >= 1 && (size_t) i - 1 <= b->len && len <= b->len - (i - 1), 2, "out of the buffer");
+	memcpy(b->data + i - 1, s, len);
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Recording
+ * @section recording
+ */
+
+/*
+ * A log is a sequence of records, each starting with its type. A session
+ * starts on every open, with the magic, a version and the wall clock time
+ * in ms. Messages carry the ms since the previous message of the session
+ * and refer to their topic by an id defined by an earlier topic record,
+ * until the dictionary is full. Numbers are LEB128 varints.
+ */
+#define REC_MAGIC		"LMQREC"
+#define REC_VERSION		1
+#define REC_SESSION		0	/* magic, version, varint wall clock ms */
+#define REC_TOPIC		1	/* varint id, varint length, topic */
+#define REC_MESSAGE		2	/* varint delta, varint topic id, flags, varint length, payload */
+#define REC_LITERAL		3	/* varint delta, varint length, topic, flags, varint length, payload */
+#define REC_TOPICS_MAX	65536
+#define REC_FLUSH_MS	1000
+#define REPLAY_BURST	256		/* messages per service pass at speed 0 */
+
+typedef struct recorder {
+	pthread_mutex_t lock;	/* written by the network thread, flushed from the loop */
+	FILE *f;
+	matcher_t *filters;
+	strmap_t topics;		/* topic -> id + 1 */
+	uint32_t ntopics;
+	uint64_t last;			/* mosq__now_ms of the previous message */
+	uint64_t next_flush;
+	bool failed;
+	unsigned long recorded;
+	unsigned long bytes;
+} recorder_t;
+
+static void rec__varint(FILE *f, uint64_t v)
+{
+	do {
+		putc((v & 0x7f) | (v > 0x7f ? 0x80 : 0), f);
+		v >>= 7;
+	} while (v);
+}
+
+static void rec__write(recorder_t *r, const struct mosquitto_message *msg)
+{
+	strmap_slot_t *slot = NULL;
+	uint64_t now;
+	size_t len = strlen(msg->topic);
+	int flags = msg->qos | (msg->retain ? 4 : 0);
+
+	if (!matcher__any(r->filters, msg->topic))
+		return;
+
+	pthread_mutex_lock(&r->lock);
+	if (r->failed) {
+		pthread_mutex_unlock(&r->lock);
+		return;
+	}
+	now = mosq__now_ms();
+
+	slot = strmap__find(&r->topics, msg->topic);
+	if (slot == NULL && r->ntopics < REC_TOPICS_MAX) {
+		slot = strmap__insert(&r->topics, msg->topic);
+		if (slot) {
+			slot->value = (void *) (uintptr_t) ++r->ntopics;
+			putc(REC_TOPIC, r->f);
+			rec__varint(r->f, r->ntopics - 1);
+			rec__varint(r->f, len);
+			fwrite(msg->topic, 1, len, r->f);
+		}
+	}
+
+	if (slot) {
+		putc(REC_MESSAGE, r->f);
+		rec__varint(r->f, now - r->last);
+		rec__varint(r->f, (uintptr_t) slot->value - 1);
+	} else {
+		putc(REC_LITERAL, r->f);
+		rec__varint(r->f, now - r->last);
+		rec__varint(r->f, len);
+		fwrite(msg->topic, 1, len, r->f);
+	}
+	putc(flags, r->f);
+	rec__varint(r->f, msg->payloadlen);
+	fwrite(msg->payload, 1, msg->payloadlen, r->f);
+	r->last = now;
+
+	/* a full disk stops the recording, not the client */
+	if (ferror(r->f))
+		r->failed = true;
+	r->recorded++;
+	r->bytes += msg->payloadlen;
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* called on the network thread for every incoming message */
+static void recorder__write(ctx_t *ctx, const struct mosquitto_message *msg)
+{
+	/* ctx_record may be swapping it on the Lua thread */
+	pthread_rwlock_rdlock(&ctx->record_lock);
+	if (ctx->recorder)
+		rec__write(ctx->recorder, msg);
+	pthread_rwlock_unlock(&ctx->record_lock);
+}
+
+static void recorder__flush(ctx_t *ctx)
+{
+	uint64_t now = mosq__now_ms();
+	recorder_t *r;
+
+	pthread_rwlock_rdlock(&ctx->record_lock);
+	r = ctx->recorder;
+	if (r && now >= r->next_flush) {
+		pthread_mutex_lock(&r->lock);
+		r->next_flush = now + REC_FLUSH_MS;
+		if (fflush(r->f) != 0)
+			r->failed = true;
+		pthread_mutex_unlock(&r->lock);
+	}
+	pthread_rwlock_unlock(&ctx->record_lock);
+}
+
+static int recorder__close(recorder_t *r)
+{
+	int rc = r->failed ? EOF : 0;
+
+	if (fclose(r->f) != 0)
+		rc = EOF;
+	if (r->filters)
+		matcher__free(r->filters);
+	strmap__clear(&r->topics);
+	pthread_mutex_destroy(&r->lock);
+	free(r);
+	return rc;
+}
+
+static void recorder__stats(lua_State *L, recorder_t *r)
+{
+	pthread_mutex_lock(&r->lock);
+	lua_pushinteger(L, r->recorded);
+	lua_setfield(L, -2, "recorded");
+	lua_pushinteger(L, r->bytes);
+	lua_setfield(L, -2, "recorded_bytes");
+	lua_pushboolean(L, r->failed);
+	lua_setfield(L, -2, "record_failed");
+	pthread_mutex_unlock(&r->lock);
+}
+
+/***
+ * Append every incoming message matching the filters to a compact binary
+ * log, written from C on the network thread before any other handling. The
+ * log keeps topics in a dictionary and the time between messages, for
+ * mosquitto.replay. Enables the v5 message callback.
+ * @function record
+ * @tparam[opt] string path of the log, appended to. nil stops recording,
+ * a running recording is closed once the new log is open
+ * @tparam[opt="#"] string|table filter topic filter or array of them
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For invalid filters or out of memory
+ */
+static int ctx_record(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *path = luaL_optstring(L, 2, NULL);
+	struct timespec ts;
+	recorder_t *r = NULL, *old;
+	matcher_t **filters;
+	int rc = 0;
+
+	if (!lua_isnoneornil(L, 3) && !lua_istable(L, 3))
+		luaL_checkstring(L, 3);
+
+	/* the I/O thread records as messages come in */
+	if (ctx->io.thread)
+		return luaL_error(L, "can't change recording of a client attached to an I/O pool");
+
+	if (path) {
+		/* collected with its userdata if the filters raise */
+		filters = (matcher_t **) lua_newuserdata(L, sizeof(matcher_t *));
+		*filters = matcher__new();
+		luaL_getmetatable(L, MOSQ_META_MATCHER);
+		lua_setmetatable(L, -2);
+		if (*filters == NULL)
+			return luaL_error(L, strerror(ENOMEM));
+		if (lua_istable(L, 3)) {
+			matcher__add_all(L, 3, *filters);
+		} else if (matcher__add(*filters, luaL_optstring(L, 3, "#"), 1) != MOSQ_ERR_SUCCESS) {
+			return luaL_argerror(L, 3, "invalid topic filter");
+		}
+
+		r = calloc(1, sizeof(recorder_t));
+		if (r == NULL)
+			return luaL_error(L, strerror(ENOMEM));
+		r->f = fopen(path, "ab");
+		if (r->f == NULL) {
+			free(r);
+			return mosq__pstatus(L, MOSQ_ERR_ERRNO);
+		}
+		r->filters = *filters;
+		*filters = NULL;
+		pthread_mutex_init(&r->lock, NULL);
+		setvbuf(r->f, NULL, _IOFBF, 1 << 20);
+		r->last = mosq__now_ms();
+		r->next_flush = r->last + REC_FLUSH_MS;
+
+		/* the session header goes ahead of any message */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		putc(REC_SESSION, r->f);
+		fwrite(REC_MAGIC, 1, strlen(REC_MAGIC), r->f);
+		putc(REC_VERSION, r->f);
+		rec__varint(r->f, (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+	}
+
+	/* the network side only touches the recorder under the read lock */
+	pthread_rwlock_wrlock(&ctx->record_lock);
+	old = ctx->recorder;
+	ctx->recorder = r;
+	pthread_rwlock_unlock(&ctx->record_lock);
+	if (old)
+		rc = recorder__close(old);
+	if (r == NULL)
+		return mosq__pstatus(L, rc ? MOSQ_ERR_ERRNO : MOSQ_ERR_SUCCESS);
+
+	if (!ctx->message_v5_set)
+		ctx__message_v5_enable(ctx);
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+typedef struct replay {
+	unsigned char *map;
+	size_t size;
+	size_t pos;
+	char **topics;			/* dictionary of the current session */
+	uint32_t ntopics;
+	double speed;			/* 0 for as fast as the connection takes it */
+	uint64_t start;			/* mosq__now_ms the replay started */
+	uint64_t at;			/* log time of the pending message, ms */
+	bool pending;			/* read, not published yet */
+	const char *topic;
+	char *literal;			/* topic not in the dictionary */
+	int flags;
+	const void *payload;
+	size_t len;
+	int done;				/* callback, or LUA_NOREF */
+	pthread_t owner;
+	unsigned long replayed;
+	unsigned long errors;
+} replay_t;
+
+static bool rep__varint(replay_t *p, uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while (p->pos < p->size && shift < 64) {
+		*v |= (uint64_t) (p->map[p->pos] & 0x7f) << shift;
+		if (!(p->map[p->pos++] & 0x80))
+			return true;
+		shift += 7;
+	}
+	return false;
+}
+
+static void replay__free(lua_State *L, replay_t *p)
+{
+	uint32_t i;
+
+	for (i = 0; i < p->ntopics; i++)
+		free(p->topics[i]);
+	free(p->topics);
+	free(p->literal);
+	if (p->map)
+		munmap(p->map, p->size);
+	luaL_unref(L, LUA_REGISTRYINDEX, p->done);
+	free(p);
+}
+
+/*
+ * Read up to the next message, handling sessions and topics on the way.
+ * Returns false at the end of the log or on a truncated record.
+ */
+static bool replay__next(replay_t *p, const char **topic, int *flags, const void **payload, size_t *len, uint64_t *delta)
+{
+	uint64_t id, n;
+	char **topics;
+	int type;
+
+	while (p->pos < p->size) {
+		type = p->map[p->pos++];
+		switch (type) {
+			case REC_SESSION:
+				if (p->size - p->pos < strlen(REC_MAGIC) + 1 || memcmp(p->map + p->pos, REC_MAGIC, strlen(REC_MAGIC)) != 0)
+					return false;
+				p->pos += strlen(REC_MAGIC) + 1;
+				if (!rep__varint(p, &n))
+					return false;
+				/* ids start over */
+				while (p->ntopics)
+					free(p->topics[--p->ntopics]);
+				break;
+			case REC_TOPIC:
+				if (!rep__varint(p, &id) || !rep__varint(p, &n) || n > p->size - p->pos || id != p->ntopics)
+					return false;
+				topics = realloc(p->topics, (p->ntopics + 1) * sizeof(char *));
+				if (topics == NULL)
+					return false;
+				p->topics = topics;
+				p->topics[p->ntopics] = strndup((const char *) p->map + p->pos, n);
+				if (p->topics[p->ntopics] == NULL)
+					return false;
+				p->ntopics++;
+				p->pos += n;
+				break;
+			case REC_MESSAGE:
+			case REC_LITERAL:
+				if (!rep__varint(p, delta))
+					return false;
+				if (type == REC_MESSAGE) {
+					if (!rep__varint(p, &id) || id >= p->ntopics)
+						return false;
+					*topic = p->topics[id];
+				} else {
+					/* copied to terminate it */
+					if (!rep__varint(p, &n) || n > p->size - p->pos)
+						return false;
+					free(p->literal);
+					p->literal = strndup((const char *) p->map + p->pos, n);
+					if (p->literal == NULL)
+						return false;
+					*topic = p->literal;
+					p->pos += n;
+				}
+				if (p->pos >= p->size)
+					return false;
+				*flags = p->map[p->pos++];
+				if (!rep__varint(p, &n) || n > p->size - p->pos)
+					return false;
+				*payload = p->map + p->pos;
+				*len = n;
+				p->pos += n;
+				return true;
+			default:
+				return false;
+		}
+	}
+	return false;
+}
+
+/* publish what is due, the whole log goes at its original pace times speed */
+static void replay__feed(ctx_t *ctx)
+{
+	replay_t *p = ctx->replay;
+	lua_State *L = ctx->L;
+	uint64_t now = mosq__now_ms(), delta;
+	const char *topic;
+	const void *payload;
+	size_t len;
+	int flags, rc, done, n = 0;
+
+	if (!pthread_equal(pthread_self(), p->owner))
+		return;
+
+	for (;;) {
+		/* the message read last time around */
+		if (p->pending) {
+			if (p->speed > 0 && (now - p->start) * p->speed < p->at)
+				break;
+			if (p->speed == 0 && (mosquitto_want_write(ctx->mosq) || ++n > REPLAY_BURST))
+				break;
+			rc = ctx__publish(ctx, NULL, p->topic, p->len, p->payload, p->flags & 3, p->flags & 4, NULL, PRIORITY_NORMAL);
+			/* waits for the connection */
+			if (rc == MOSQ_ERR_NO_CONN)
+				break;
+			if (rc == MOSQ_ERR_SUCCESS)
+				p->replayed++;
+			else
+				p->errors++;
+			p->pending = false;
+		}
+		if (!replay__next(p, &topic, &flags, &payload, &len, &delta))
+			goto done;
+		p->topic = topic;
+		p->flags = flags;
+		p->payload = payload;
+		p->len = len;
+		p->at += delta;
+		p->pending = true;
+	}
+	ctx__io_kick(ctx, false);
+	return;
+
+done:
+	ctx__io_kick(ctx, false);
+	done = p->done;
+	p->done = LUA_NOREF;
+	lua_pushinteger(L, p->replayed);
+	replay__free(L, p);
+	ctx->replay = NULL;
+	if (done == LUA_NOREF) {
+		lua_pop(L, 1);
+		return;
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, done);
+	luaL_unref(L, LUA_REGISTRYINDEX, done);
+	lua_insert(L, -2);
+	lua_call(L, 1, 0); /* args: replayed */
+}
+
+/* ms until the next message is due */
+static uint64_t replay__wait(replay_t *p, uint64_t now)
+{
+	uint64_t elapsed = (now - p->start) * p->speed;
+
+	if (!p->pending || p->speed == 0 || elapsed >= p->at)
+		return 0;
+	return (p->at - elapsed) / p->speed;
+}
+
+static void replay__stats(lua_State *L, replay_t *p)
+{
+	lua_pushinteger(L, p->replayed);
+	lua_setfield(L, -2, "replayed");
+	lua_pushinteger(L, p->errors);
+	lua_setfield(L, -2, "replay_errors");
+	lua_pushnumber(L, p->size ? (double) p->pos / p->size : 1);
+	lua_setfield(L, -2, "replay_progress");
+}
+
+/***
+ * Republish a log written by client:record through client, from its loop.
+ * Messages keep their topic, payload, qos and retain flag and go at the
+ * pace they were recorded at, times speed. A client replays one log at a
+ * time, starting another one or passing a nil path stops the current one.
+ * @function replay
+ * @tparam string path of the log, nil to stop replaying
+ * @param client the client to publish through
+ * @tparam[opt] table options speed (1) factor applied to the original pace,
+ * 0 to publish as fast as the connection takes it, done function called as
+ * done(replayed) at the end of the log
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ */
+static int mosq_replay(lua_State *L)
+{
+	const char *path = luaL_optstring(L, 1, NULL);
+	ctx_t *ctx = ctx_check(L, 2);
+	lua_Number speed = opt__number(L, 3, "speed", 1);
+	struct stat st;
+	replay_t *p;
+	int fd;
+
+	luaL_argcheck(L, speed >= 0, 3, "speed must not be negative");
+
+	if (ctx->replay) {
+		replay__free(L, ctx->replay);
+		ctx->replay = NULL;
+	}
+	if (path == NULL)
+		return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+
+	p = calloc(1, sizeof(replay_t));
+	if (p == NULL)
+		return luaL_error(L, strerror(ENOMEM));
+	p->done = LUA_NOREF;
+	p->speed = speed;
+	p->owner = pthread_self();
+	p->start = mosq__now_ms();
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		if (fd >= 0)
+			close(fd);
+		replay__free(L, p);
+		return mosq__pstatus(L, MOSQ_ERR_ERRNO);
+	}
+	p->size = st.st_size;
+	if (p->size) {
+		p->map = mmap(NULL, p->size, PROT_READ, MAP_SHARED, fd, 0);
+		if (p->map == MAP_FAILED) {
+			p->map = NULL;
+			close(fd);
+			replay__free(L, p);
+			return mosq__pstatus(L, MOSQ_ERR_ERRNO);
+		}
+		madvise(p->map, p->size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	if (lua_table_on_stack(L, 3)) {
+		lua_getfield(L, 3, "done");
+		if (lua_isfunction(L, -1))
+			p->done = luaL_ref(L, LUA_REGISTRYINDEX);
+		else
+			lua_pop(L, 1);
+	}
+	ctx->replay = p;
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Swarms
+ * @section swarms
+ */
+
+#define SWARM_ACK_SLOTS	64
+#define SWARM_BUCKETS	32		/* log2 of the latency in us */
+#define SWARM_STALL		1000	/* ms behind schedule before the arrivals restart from now */
+
+enum swarm_profiles {
+	SWARM_CONSTANT,
+	SWARM_POISSON,
+	SWARM_BURSTY,
+};
+
+typedef struct {
+	uint64_t count;
+	uint64_t sum;		/* us */
+	uint64_t max;
+	uint64_t buckets[SWARM_BUCKETS];
+} swarm_latency_t;
+
+typedef struct swarm_member {
+	struct swarm_thread *thread;
+	struct mosquitto *mosq;
+	char *topic;
+	double next;		/* ms the next publish is due */
+	uint64_t connect_at;	/* ms, 0 once the connect went out */
+	uint64_t retry_at;
+	bool connected;
+	uint64_t sent[SWARM_ACK_SLOTS];	/* us the publish went out, by mid */
+} swarm_member_t;
+
+typedef struct swarm_thread {
+	struct swarm *swarm;
+	pthread_t thread;
+	bool started;
+	swarm_member_t *members;
+	int n;
+	struct pollfd *pfds;
+	swarm_member_t **polled;
+	unsigned int seed;
+	char *payload;
+	/* written by the thread, read unlocked by stats */
+	unsigned long connected;
+	unsigned long published;
+	unsigned long acked;
+	unsigned long received;
+	unsigned long errors;
+	swarm_latency_t ack;
+	swarm_latency_t e2e;
+} swarm_thread_t;
+
+typedef struct swarm {
+	swarm_thread_t *threads;
+	int nthreads;
+	int clients;
+	bool stopping;
+	char *host;
+	int port;
+	int keepalive;
+	int qos;
+	bool echo;
+	int profile;
+	int burst;
+	size_t payload_size;
+	double rate;		/* publishes per ms and client */
+	uint64_t start;
+} swarm_t;
+
+static swarm_t * swarm_check(lua_State *L, int i)
+{
+	return (swarm_t *) luaL_checkudata(L, i, MOSQ_META_SWARM);
+}
+
+static uint64_t swarm__now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void swarm__latency(swarm_latency_t *l, uint64_t us)
+{
+	int b = 0;
+
+	while (b < SWARM_BUCKETS - 1 && (us >> (b + 1)))
+		b++;
+	l->buckets[b]++;
+	l->sum += us;
+	if (us > l->max)
+		l->max = us;
+	l->count++;
+}
+
+/* ms to the next arrival of a client */
+static double swarm__interval(swarm_thread_t *t)
+{
+	swarm_t *s = t->swarm;
+	double u;
+
+	switch (s->profile) {
+	case SWARM_POISSON:
+		/* exponential gaps, u in (0, 1] */
+		u = (rand_r(&t->seed) + 1.0) / ((double) RAND_MAX + 1.0);
+		return -log(u) / s->rate;
+	case SWARM_BURSTY:
+		return s->burst / s->rate;
+	default:
+		return 1 / s->rate;
+	}
+}
+
+static void swarm__on_connect(struct mosquitto *mosq, void *obj, int rc)
+{
+	swarm_member_t *m = obj;
+	swarm_thread_t *t = m->thread;
+
+	if (rc != 0) {
+		t->errors++;
+		return;
+	}
+	m->connected = true;
+	__atomic_add_fetch(&t->connected, 1, __ATOMIC_RELAXED);
+	m->next = mosq__now_ms() + swarm__interval(t);
+	if (t->swarm->echo)
+		mosquitto_subscribe(mosq, NULL, m->topic, t->swarm->qos);
+}
+
+static void swarm__on_disconnect(struct mosquitto *mosq, void *obj, int rc)
+{
+	swarm_member_t *m = obj;
+
+	(void) mosq;
+	if (!m->connected)
+		return;
+	m->connected = false;
+	__atomic_sub_fetch(&m->thread->connected, 1, __ATOMIC_RELAXED);
+	if (rc != 0)
+		m->thread->errors++;
+	m->retry_at = mosq__now_ms() + 1000;
+}
+
+static void swarm__on_publish(struct mosquitto *mosq, void *obj, int mid)
+{
+	swarm_member_t *m = obj;
+	uint64_t *sent = &m->sent[mid % SWARM_ACK_SLOTS];
+
+	(void) mosq;
+	m->thread->acked++;
+	if (*sent) {
+		swarm__latency(&m->thread->ack, swarm__now_us() - *sent);
+		*sent = 0;
+	}
+}
+
+static void swarm__on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+{
+	swarm_member_t *m = obj;
+	uint64_t at, now;
+
+	(void) mosq;
+	m->thread->received++;
+	if (msg->payloadlen < (int) sizeof(at))
+		return;
+	memcpy(&at, msg->payload, sizeof(at));
+	now = swarm__now_us();
+	if (at <= now)
+		swarm__latency(&m->thread->e2e, now - at);
+}
+
+static void swarm__publish(swarm_thread_t *t, swarm_member_t *m)
+{
+	swarm_t *s = t->swarm;
+	uint64_t now = swarm__now_us();
+	int mid, rc;
+
+	if (s->payload_size >= sizeof(now))
+		memcpy(t->payload, &now, sizeof(now));
+	rc = mosquitto_publish(m->mosq, &mid, m->topic, s->payload_size, t->payload, s->qos, false);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		t->errors++;
+		return;
+	}
+	m->sent[mid % SWARM_ACK_SLOTS] = now;
+	t->published++;
+}
+
+static void *swarm__main(void *arg)
+{
+	swarm_thread_t *t = arg;
+	swarm_t *s = t->swarm;
+	uint64_t now, next_misc = 0;
+	swarm_member_t *m;
+	int i, j, n, wait, fd, burst;
+
+	while (!__atomic_load_n(&s->stopping, __ATOMIC_ACQUIRE)) {
+		now = mosq__now_ms();
+		wait = CTX_SERVICE_INTERVAL;
+		n = 0;
+
+		for (i = 0; i < t->n; i++) {
+			m = &t->members[i];
+			if (m->connect_at) {
+				if (now < m->connect_at) {
+					if ((int) (m->connect_at - now) < wait)
+						wait = m->connect_at - now;
+					continue;
+				}
+				m->connect_at = 0;
+				m->retry_at = now + 1000;
+				if (mosquitto_connect_async(m->mosq, s->host, s->port, s->keepalive) != MOSQ_ERR_SUCCESS)
+					t->errors++;
+			}
+			fd = mosquitto_socket(m->mosq);
+			if (fd < 0) {
+				if (now >= m->retry_at) {
+					m->retry_at = now + 1000;
+					mosquitto_reconnect_async(m->mosq);
+				}
+				continue;
+			}
+			if (m->connected) {
+				if (now - m->next > SWARM_STALL)
+					m->next = now;
+				while (m->next <= now) {
+					burst = s->profile == SWARM_BURSTY ? s->burst : 1;
+					for (j = 0; j < burst; j++)
+						swarm__publish(t, m);
+					m->next += swarm__interval(t);
+				}
+				if ((int) (m->next - now) < wait)
+					wait = m->next - now;
+			}
+			t->pfds[n].fd = fd;
+			t->pfds[n].events = POLLIN;
+			if (mosquitto_want_write(m->mosq))
+				t->pfds[n].events |= POLLOUT;
+			t->pfds[n].revents = 0;
+			t->polled[n++] = m;
+		}
+
+		if (poll(t->pfds, n, wait) < 0 && errno != EINTR)
+			break;
+
+		for (i = 0; i < n; i++) {
+			m = t->polled[i];
+			if (t->pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+				mosquitto_loop_read(m->mosq, 1);
+			if (t->pfds[i].revents & POLLOUT)
+				mosquitto_loop_write(m->mosq, 1);
+		}
+
+		now = mosq__now_ms();
+		if (now >= next_misc) {
+			for (i = 0; i < t->n; i++)
+				mosquitto_loop_misc(t->members[i].mosq);
+			next_misc = now + CTX_SERVICE_INTERVAL;
+		}
+	}
+
+	for (i = 0; i < t->n; i++) {
+		mosquitto_disconnect(t->members[i].mosq);
+		mosquitto_loop_write(t->members[i].mosq, 1);
+	}
+	return NULL;
+}
+
+static void swarm__free(swarm_t *s)
+{
+	swarm_thread_t *t;
+	int i, j;
+
+	__atomic_store_n(&s->stopping, true, __ATOMIC_RELEASE);
+	for (i = 0; s->threads && i < s->nthreads; i++) {
+		t = &s->threads[i];
+		if (t->started)
+			pthread_join(t->thread, NULL);
+		t->started = false;
+		for (j = 0; t->members && j < t->n; j++) {
+			if (t->members[j].mosq)
+				mosquitto_destroy(t->members[j].mosq);
+			free(t->members[j].topic);
+		}
+		free(t->members);
+		free(t->pfds);
+		free(t->polled);
+		free(t->payload);
+	}
+	free(s->threads);
+	s->threads = NULL;
+	s->nthreads = 0;
+	free(s->host);
+	s->host = NULL;
+}
+
+/* topics[i % #topics + 1] or the pattern, with %d replaced by the client number */
+static char *swarm__topic(lua_State *L, int topics, int i)
+{
+	const char *pattern;
+	char *topic;
+
+	if (lua_istable(L, topics)) {
+		lua_rawgeti(L, topics, i % lua_rawlen(L, topics) + 1);
+		pattern = luaL_checkstring(L, -1);
+	} else {
+		lua_pushvalue(L, topics);
+		pattern = lua_tostring(L, -1);
+	}
+	lua_pushfstring(L, "%d", i + 1);
+	luaL_gsub(L, pattern, "%d", lua_tostring(L, -1));
+	topic = strdup(lua_tostring(L, -1));
+	lua_pop(L, 3);
+	return topic;
+}
+
+/***
+ * Start a load generator: n bare clients spread over a few threads of their
+ * own, connecting at connect_rate and publishing at publish_rate each, with
+ * no Lua involved past this call. Publish latency is the time to the
+ * PUBACK/PUBCOMP, or to the write for QoS 0. With echo every client also
+ * subscribes to its topic, and the round trip is taken from a timestamp in
+ * the first 8 bytes of the payload.
+ * @function swarm
+ * @tparam table options with the fields clients (1), host, port, keepalive,
+ * id (client id prefix, clients get the suffix 1..n, random ids otherwise),
+ * connect_rate (connects per second, 0 for all at once), publish_rate
+ * (messages per second and client, 1), payload_size (64), topics (pattern
+ * with %d standing for the client number, or a list cycled through,
+ * "swarm/%d"), qos, profile ("constant", "poisson" or "bursty"), burst
+ * (messages per burst, 10), threads (1) and echo
+ * @return a swarm
+ * @raise For some out of memory or illegal states
+ * @see swarm:stats
+ */
+static int mosq_swarm(lua_State *L)
+{
+	static const char *const profiles[] = {"constant", "poisson", "bursty", NULL};
+	int clients = opt__integer(L, 1, "clients", 1);
+	int nthreads = opt__integer(L, 1, "threads", 1);
+	const char *prefix = opt__string(L, 1, "id", NULL);
+	lua_Number connect_rate = opt__number(L, 1, "connect_rate", 0);
+	lua_Number publish_rate = opt__number(L, 1, "publish_rate", 1);
+	lua_Integer payload_size = opt__integer(L, 1, "payload_size", 64);
+	swarm_thread_t *t;
+	swarm_member_t *m;
+	uint64_t now;
+	int i, err, topics, per;
+	swarm_t *s;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	luaL_argcheck(L, clients > 0, 1, "need at least one client");
+	luaL_argcheck(L, nthreads > 0, 1, "need at least one thread");
+	luaL_argcheck(L, publish_rate > 0, 1, "publish_rate must be positive");
+	luaL_argcheck(L, connect_rate >= 0, 1, "connect_rate must not be negative");
+	luaL_argcheck(L, payload_size >= 0, 1, "payload_size must not be negative");
+	if (nthreads > clients)
+		nthreads = clients;
+
+	lua_getfield(L, 1, "topics");
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_pushstring(L, "swarm/%d");
+	}
+	topics = lua_gettop(L);
+	luaL_argcheck(L, lua_type(L, topics) == LUA_TSTRING ||
+		(lua_istable(L, topics) && lua_rawlen(L, topics) > 0), 1, "topics must be a pattern or a list");
+
+	s = (swarm_t *) lua_newuserdata(L, sizeof(swarm_t));
+	memset(s, 0, sizeof(swarm_t));
+	luaL_getmetatable(L, MOSQ_META_SWARM);
+	lua_setmetatable(L, -2);
+
+	lua_getfield(L, 1, "profile");
+	s->profile = luaL_checkoption(L, -1, "constant", profiles);
+	lua_pop(L, 1);
+	s->clients = clients;
+	s->port = opt__integer(L, 1, "port", 1883);
+	s->keepalive = opt__integer(L, 1, "keepalive", 60);
+	s->qos = opt__integer(L, 1, "qos", 0);
+	s->burst = opt__integer(L, 1, "burst", 10);
+	s->payload_size = payload_size;
+	s->rate = publish_rate / 1000;
+	lua_getfield(L, 1, "echo");
+	s->echo = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	luaL_argcheck(L, s->burst > 0, 1, "burst must be positive");
+	s->host = strdup(opt__string(L, 1, "host", "localhost"));
+	s->threads = calloc(nthreads, sizeof(swarm_thread_t));
+	if (s->host == NULL || s->threads == NULL)
+		return luaL_error(L, strerror(ENOMEM));
+	s->nthreads = nthreads;
+	s->start = now = mosq__now_ms();
+
+	for (i = 0; i < clients; i++) {
+		t = &s->threads[i % nthreads];
+		if (t->members == NULL) {
+			per = (clients - i % nthreads + nthreads - 1) / nthreads;
+			t->swarm = s;
+			t->seed = (unsigned int) (now ^ (uintptr_t) t);
+			t->members = calloc(per, sizeof(swarm_member_t));
+			t->pfds = calloc(per, sizeof(struct pollfd));
+			t->polled = calloc(per, sizeof(swarm_member_t *));
+			t->payload = calloc(1, payload_size + 1);
+			if (t->members == NULL || t->pfds == NULL || t->polled == NULL || t->payload == NULL)
+				return luaL_error(L, strerror(ENOMEM));
+		}
+		m = &t->members[t->n++];
+		m->thread = t;
+		if (prefix)
+			lua_pushfstring(L, "%s%d", prefix, i + 1);
+		else
+			lua_pushnil(L);
+		m->mosq = mosquitto_new(lua_tostring(L, -1), true, m);
+		lua_pop(L, 1);
+		m->topic = swarm__topic(L, topics, i);
+		if (m->mosq == NULL || m->topic == NULL)
+			return luaL_error(L, strerror(errno ? errno : ENOMEM));
+		mosquitto_connect_callback_set(m->mosq, swarm__on_connect);
+		mosquitto_disconnect_callback_set(m->mosq, swarm__on_disconnect);
+		mosquitto_publish_callback_set(m->mosq, swarm__on_publish);
+		if (s->echo)
+			mosquitto_message_callback_set(m->mosq, swarm__on_message);
+		/* 0 is taken as connected already */
+		m->connect_at = now + (connect_rate > 0 ? (uint64_t) (i * 1000 / connect_rate) : 0) + 1;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		t = &s->threads[i];
+		err = pthread_create(&t->thread, NULL, swarm__main, t);
+		if (err != 0)
+			return luaL_error(L, strerror(err));
+		t->started = true;
+	}
+	return 1;
+}
+
+/***
+ * Swarm functions
+ * @section swarm_functions
+ */
+
+/* approximate quantile q, as the upper bound of its bucket in ms */
+static double swarm__quantile(swarm_latency_t *l, double q)
+{
+	uint64_t want = l->count * q, seen = 0;
+	int b;
+
+	if (l->count == 0)
+		return 0;
+	for (b = 0; b < SWARM_BUCKETS; b++) {
+		seen += l->buckets[b];
+		if (seen > want)
+			break;
+	}
+	if (b == SWARM_BUCKETS)
+		b--;
+	return ((uint64_t) 2 << b) / 1000.0;
+}
+
+static void swarm__push_latency(lua_State *L, swarm_latency_t *l, const char *field)
+{
+	lua_newtable(L);
+	lua_pushinteger(L, l->count);
+	lua_setfield(L, -2, "count");
+	lua_pushnumber(L, l->count ? l->sum / 1000.0 / l->count : 0);
+	lua_setfield(L, -2, "mean");
+	lua_pushnumber(L, l->max / 1000.0);
+	lua_setfield(L, -2, "max");
+	lua_pushnumber(L, swarm__quantile(l, 0.5));
+	lua_setfield(L, -2, "p50");
+	lua_pushnumber(L, swarm__quantile(l, 0.9));
+	lua_setfield(L, -2, "p90");
+	lua_pushnumber(L, swarm__quantile(l, 0.99));
+	lua_setfield(L, -2, "p99");
+	lua_setfield(L, -2, field);
+}
+
+/***
+ * Aggregate counters of all the clients of a swarm, read on the fly.
+ * Latencies are in ms, the percentiles rounded up to a power of 2 us.
+ * @function stats
+ * @treturn table clients, connected, published, acked, received, errors,
+ * elapsed (s), rate (published per second), latency and, with echo,
+ * roundtrip, both tables of count, mean, max, p50, p90 and p99
+ */
+static int swarm_stats(lua_State *L)
+{
+	swarm_t *s = swarm_check(L, 1);
+	unsigned long connected = 0, published = 0, acked = 0, received = 0, errors = 0;
+	swarm_latency_t ack, e2e;
+	swarm_thread_t *t;
+	double elapsed;
+	int i, b;
+
+	memset(&ack, 0, sizeof(ack));
+	memset(&e2e, 0, sizeof(e2e));
+	for (i = 0; i < s->nthreads; i++) {
+		t = &s->threads[i];
+		connected += __atomic_load_n(&t->connected, __ATOMIC_RELAXED);
+		published += t->published;
+		acked += t->acked;
+		received += t->received;
+		errors += t->errors;
+		for (b = 0; b < SWARM_BUCKETS; b++) {
+			ack.buckets[b] += t->ack.buckets[b];
+			e2e.buckets[b] += t->e2e.buckets[b];
+		}
+		ack.count += t->ack.count;
+		ack.sum += t->ack.sum;
+		if (t->ack.max > ack.max)
+			ack.max = t->ack.max;
+		e2e.count += t->e2e.count;
+		e2e.sum += t->e2e.sum;
+		if (t->e2e.max > e2e.max)
+			e2e.max = t->e2e.max;
+	}
+	elapsed = (mosq__now_ms() - s->start) / 1000.0;
+
+	lua_newtable(L);
+	lua_pushinteger(L, s->clients);
+	lua_setfield(L, -2, "clients");
+	lua_pushinteger(L, connected);
+	lua_setfield(L, -2, "connected");
+	lua_pushinteger(L, published);
+	lua_setfield(L, -2, "published");
+	lua_pushinteger(L, acked);
+	lua_setfield(L, -2, "acked");
+	lua_pushinteger(L, received);
+	lua_setfield(L, -2, "received");
+	lua_pushinteger(L, errors);
+	lua_setfield(L, -2, "errors");
+	lua_pushnumber(L, elapsed);
+	lua_setfield(L, -2, "elapsed");
+	lua_pushnumber(L, elapsed > 0 ? published / elapsed : 0);
+	lua_setfield(L, -2, "rate");
+	swarm__push_latency(L, &ack, "latency");
+	if (s->echo)
+		swarm__push_latency(L, &e2e, "roundtrip");
+	return 1;
+}
+
+/***
+ * Disconnect all the clients of a swarm and stop its threads.
+ * @function stop
+ * @return true
+ */
+static int swarm_stop(lua_State *L)
+{
+	swarm_t *s = swarm_check(L, 1);
+
+	swarm__free(s);
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Native handlers
+ * @section native_handlers
+ */
+
+enum native_types {
+	NATIVE_MESSAGE,
+	NATIVE_PUBLISH,
+	NATIVE_CONNECT,
+};
+
+typedef struct native_handler {
+	struct native_handler *next;
+	int id;
+	int type;	/* one of native_types */
+	char *filter;
+	union {
+		lmq_message_fn message;
+		lmq_publish_fn publish;
+		lmq_connect_fn connect;
+	} fn;
+	void *udata;
+	lmq_free_fn release;
+} native_handler_t;
+
+typedef struct native {
+	pthread_mutex_t lock;	/* handlers run on the network side */
+	native_handler_t *head;
+	int last_id;
+	int n;
+	unsigned long handled;
+} native_t;
+
+/* true if a handler consumed msg */
+static bool native__message(native_t *n, const struct mosquitto_message *msg, const mosquitto_property *props)
+{
+	native_handler_t *h;
+	bool match, handled = false;
+
+	pthread_mutex_lock(&n->lock);
+	for (h = n->head; h && !handled; h = h->next) {
+		if (h->type != NATIVE_MESSAGE)
+			continue;
+		match = true;
+		if (h->filter && mosquitto_topic_matches_sub(h->filter, msg->topic, &match) != MOSQ_ERR_SUCCESS)
+			continue;
+		if (match && h->fn.message(h->udata, msg, props) == LMQ_HANDLED)
+			handled = true;
+	}
+	if (handled)
+		n->handled++;
+	pthread_mutex_unlock(&n->lock);
+	return handled;
+}
+
+static void native__publish(native_t *n, int mid, int reason_code, const mosquitto_property *props)
+{
+	native_handler_t *h;
+
+	pthread_mutex_lock(&n->lock);
+	for (h = n->head; h; h = h->next) {
+		if (h->type == NATIVE_PUBLISH)
+			h->fn.publish(h->udata, mid, reason_code, props);
+	}
+	pthread_mutex_unlock(&n->lock);
+}
+
+static void native__connect(native_t *n, int reason_code, int flags, const mosquitto_property *props)
+{
+	native_handler_t *h;
+
+	pthread_mutex_lock(&n->lock);
+	for (h = n->head; h; h = h->next) {
+		if (h->type == NATIVE_CONNECT)
+			h->fn.connect(h->udata, reason_code, flags, props);
+	}
+	pthread_mutex_unlock(&n->lock);
+}
+
+/* install the v5 callbacks the handlers hang off */
+static void native__enable(ctx_t *ctx)
+{
+	ctx__message_v5_enable(ctx);
+	mosquitto_publish_v5_callback_set(ctx->mosq, ctx_on_publish_v5);
+	mosquitto_connect_v5_callback_set(ctx->mosq, ctx_on_connect_v5);
+}
+
+static void native__handler_free(native_handler_t *h)
+{
+	if (h->release)
+		h->release(h->udata);
+	free(h->filter);
+	free(h);
+}
+
+static void native__free(native_t *n)
+{
+	native_handler_t *h;
+
+	while ((h = n->head) != NULL) {
+		n->head = h->next;
+		native__handler_free(h);
+	}
+	pthread_mutex_destroy(&n->lock);
+	free(n);
+}
+
+static void native__stats(lua_State *L, native_t *n)
+{
+	lua_pushinteger(L, n->n);
+	lua_setfield(L, -2, "native_handlers");
+	lua_pushinteger(L, n->handled);
+	lua_setfield(L, -2, "native_handled");
+}
+
+/* a new handler appended to the client's list, NULL if out of memory */
+static native_handler_t *native__add(lmq_ctx_t *c, int type, const char *filter, void *udata, lmq_free_fn release)
+{
+	ctx_t *ctx = (ctx_t *) c;
+	native_handler_t *h, **tail;
+	native_t *n = ctx->native;
+
+	if (n == NULL) {
+		n = calloc(1, sizeof(native_t));
+		if (n == NULL)
+			return NULL;
+		pthread_mutex_init(&n->lock, NULL);
+	}
+	h = calloc(1, sizeof(native_handler_t));
+	if (h == NULL || (filter && (h->filter = strdup(filter)) == NULL)) {
+		free(h);
+		if (ctx->native == NULL)
+			native__free(n);
+		return NULL;
+	}
+	h->type = type;
+	h->udata = udata;
+	h->release = release;
+
+	pthread_mutex_lock(&n->lock);
+	for (tail = &n->head; *tail; tail = &(*tail)->next)
+		;
+	h->id = ++n->last_id;
+	*tail = h;
+	n->n++;
+	pthread_mutex_unlock(&n->lock);
+
+	if (ctx->native == NULL) {
+		ctx->native = n;
+		native__enable(ctx);
+	}
+	return h;
+}
+
+static lmq_ctx_t *native_check(lua_State *L, int idx)
+{
+	return (lmq_ctx_t *) ctx_check(L, idx);
+}
+
+static struct mosquitto *native_mosquitto(lmq_ctx_t *c)
+{
+	return ((ctx_t *) c)->mosq;
+}
+
+static int native_on_message(lmq_ctx_t *c, const char *filter, lmq_message_fn fn, void *udata, lmq_free_fn release)
+{
+	native_handler_t *h;
+
+	if (fn == NULL || (filter && mosquitto_sub_topic_check(filter) != MOSQ_ERR_SUCCESS))
+		return -MOSQ_ERR_INVAL;
+	h = native__add(c, NATIVE_MESSAGE, filter, udata, release);
+	if (h == NULL)
+		return -MOSQ_ERR_NOMEM;
+	h->fn.message = fn;
+	return h->id;
+}
+
+static int native_on_publish(lmq_ctx_t *c, lmq_publish_fn fn, void *udata, lmq_free_fn release)
+{
+	native_handler_t *h;
+
+	if (fn == NULL)
+		return -MOSQ_ERR_INVAL;
+	h = native__add(c, NATIVE_PUBLISH, NULL, udata, release);
+	if (h == NULL)
+		return -MOSQ_ERR_NOMEM;
+	h->fn.publish = fn;
+	return h->id;
+}
+
+static int native_on_connect(lmq_ctx_t *c, lmq_connect_fn fn, void *udata, lmq_free_fn release)
+{
+	native_handler_t *h;
+
+	if (fn == NULL)
+		return -MOSQ_ERR_INVAL;
+	h = native__add(c, NATIVE_CONNECT, NULL, udata, release);
+	if (h == NULL)
+		return -MOSQ_ERR_NOMEM;
+	h->fn.connect = fn;
+	return h->id;
+}
+
+static int native_remove(lmq_ctx_t *c, int id)
+{
+	native_t *n = ((ctx_t *) c)->native;
+	native_handler_t *h = NULL, **p;
+
+	if (n == NULL)
+		return MOSQ_ERR_NOT_FOUND;
+
+	pthread_mutex_lock(&n->lock);
+	for (p = &n->head; *p; p = &(*p)->next) {
+		if ((*p)->id == id) {
+			h = *p;
+			*p = h->next;
+			n->n--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&n->lock);
+
+	if (h == NULL)
+		return MOSQ_ERR_NOT_FOUND;
+	native__handler_free(h);
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* left in the registry as LUA_MOSQUITTO_API */
+static const struct lmq_api native_api = {
+	LUA_MOSQUITTO_API_VERSION,
+	sizeof(struct lmq_api),
+	native_check,
+	native_mosquitto,
+	native_on_message,
+	native_on_publish,
+	native_on_connect,
+	native_remove,
+};
+
+/***
+ * Rules
+ * @section rules
+ */
+
+enum rule_ops {
+	RULE_EQ,
+	RULE_NE,
+	RULE_LT,
+	RULE_LE,
+	RULE_GT,
+	RULE_GE,
+	RULE_EXISTS,
+};
+
+typedef struct {
+	char *path;
+	int op;		/* one of rule_ops */
+	int type;	/* LUA_TNUMBER, LUA_TSTRING or LUA_TBOOLEAN */
+	double num;
+	char *str;
+	size_t len;
+	bool boolean;
+} rule_cond_t;
+
+typedef struct {
+	char *name;
+	char *path;
+} rule_field_t;
+
+typedef struct rule {
+	ctx_t *ctx;
+	char *match;
+	char *topic;		/* template */
+	rule_cond_t *where;
+	int nwhere;
+	char *pick;			/* project = path */
+	rule_field_t *fields;	/* project = {name = path} */
+	int nfields;
+	int qos;
+	bool retain;
+	bool consume;
+} rule_t;
+
+/* a growing output buffer, failed once out of memory */
+typedef struct {
+	char *p;
+	size_t len;
+	size_t size;
+	bool failed;
+} rule_buf_t;
+
+static void rule_buf__add(rule_buf_t *b, const char *s, size_t n)
+{
+	size_t size;
+	char *p;
+
+	if (b->failed)
+		return;
+	if (b->len + n + 1 > b->size) {
+		size = b->size ? b->size : 128;
+		while (size < b->len + n + 1)
+			size *= 2;
+		p = realloc(b->p, size);
+		if (p == NULL) {
+			b->failed = true;
+			return;
+		}
+		b->p = p;
+		b->size = size;
+	}
+	memcpy(b->p + b->len, s, n);
+	b->len += n;
+	b->p[b->len] = '\0';
+}
+
+static const char *json__ws(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+		p++;
+	return p;
+}
+
+/* past the closing quote of the string opening at p */
+static const char *json__string(const char *p, const char *end)
+{
+	for (p++; p < end; p++) {
+		if (*p == '\\')
+			p++;
+		else if (*p == '"')
+			return p + 1;
+	}
+	return NULL;
+}
+
+/* past the value starting at p, NULL if it's cut short */
+static const char *json__value(const char *p, const char *end)
+{
+	int depth = 0;
+
+	if (p >= end)
+		return NULL;
+	if (*p == '"')
+		return json__string(p, end);
+	if (*p != '{' && *p != '[') {
+		while (p < end && *p != ',' && *p != '}' && *p != ']' &&
+				*p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+			p++;
+		return p;
+	}
+	for (; p < end; p++) {
+		if (*p == '"') {
+			p = json__string(p, end);
+			if (p == NULL)
+				return NULL;
+			p--;
+		} else if (*p == '{' || *p == '[') {
+			depth++;
+		} else if ((*p == '}' || *p == ']') && --depth == 0) {
+			return p + 1;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * The value at path, dot separated object keys and array indices, in the
+ * JSON text from p to end. Keys are compared as they are written, escapes
+ * included.
+ */
+static bool json__find(const char *p, const char *end, const char *path, const char **value, const char **value_end)
+{
+	const char *seg, *key;
+	size_t len;
+	long i;
+
+	p = json__ws(p, end);
+	while (*path) {
+		seg = path;
+		len = strcspn(path, ".");
+		path += len;
+		if (*path == '.')
+			path++;
+		if (p >= end)
+			return false;
+
+		if (*p == '{') {
+			p = json__ws(p + 1, end);
+			for (;;) {
+				if (p >= end || *p != '"')
+					return false;
+				key = p + 1;
+				p = json__string(p, end);
+				if (p == NULL)
+					return false;
+				if ((size_t) (p - 1 - key) == len && memcmp(key, seg, len) == 0) {
+					p = json__ws(p, end);
+					if (p >= end || *p != ':')
+						return false;
+					p = json__ws(p + 1, end);
+					break;
+				}
+				p = json__ws(p, end);
+				if (p >= end || *p != ':')
+					return false;
+				p = json__value(json__ws(p + 1, end), end);
+				if (p == NULL)
+					return false;
+				p = json__ws(p, end);
+				if (p >= end || *p != ',')
+					return false;
+				p = json__ws(p + 1, end);
+			}
+		} else if (*p == '[') {
+			for (i = 0; len > 0; seg++, len--) {
+				if (*seg < '0' || *seg > '9' || i > 100000000)
+					return false;
+				i = i * 10 + *seg - '0';
+			}
+			p = json__ws(p + 1, end);
+			while (i-- > 0) {
+				p = json__value(p, end);
+				if (p == NULL)
+					return false;
+				p = json__ws(p, end);
+				if (p >= end || *p != ',')
+					return false;
+				p = json__ws(p + 1, end);
+			}
+			if (p >= end || *p == ']')
+				return false;
+		} else {
+			return false;
+		}
+	}
+	*value_end = json__value(p, end);
+	*value = p;
+	return *value_end != NULL;
+}
+
+static bool rule__cond(rule_cond_t *c, const struct mosquitto_message *msg)
+{
+	const char *v, *end;
+	char num[64], *stop;
+	size_t len;
+	double d;
+	int cmp;
+
+	if (!json__find(msg->payload, (const char *) msg->payload + msg->payloadlen, c->path, &v, &end))
+		return false;
+	len = end - v;
+
+	switch (c->type) {
+	case LUA_TNUMBER:
+		if (len == 0 || len >= sizeof(num) || *v == '"')
+			return false;
+		memcpy(num, v, len);
+		num[len] = '\0';
+		d = strtod(num, &stop);
+		if (*stop)
+			return false;
+		cmp = d < c->num ? -1 : d > c->num;
+		break;
+	case LUA_TSTRING:
+		if (len < 2 || *v != '"')
+			return false;
+		v++;
+		len -= 2;
+		cmp = memcmp(v, c->str, len < c->len ? len : c->len);
+		if (cmp == 0)
+			cmp = len < c->len ? -1 : len > c->len;
+		break;
+	case LUA_TBOOLEAN:
+		cmp = !((c->boolean && len == 4 && memcmp(v, "true", 4) == 0) ||
+			(!c->boolean && len == 5 && memcmp(v, "false", 5) == 0));
+		break;
+	default:
+		return c->op == RULE_EXISTS;
+	}
+
+	switch (c->op) {
+	case RULE_EQ: return cmp == 0;
+	case RULE_NE: return cmp != 0;
+	case RULE_LT: return cmp < 0;
+	case RULE_LE: return cmp <= 0;
+	case RULE_GT: return cmp > 0;
+	case RULE_GE: return cmp >= 0;
+	default: return true;
+	}
+}
+
+/* the republish topic, {n} being the nth level of the topic and {topic} all of it */
+static void rule__topic(rule_t *r, const char *topic, rule_buf_t *b)
+{
+	const char *t = r->topic, *close, *level;
+	size_t len;
+	long n;
+
+	while (*t) {
+		close = *t == '{' ? strchr(t, '}') : NULL;
+		if (close == NULL) {
+			len = strcspn(t + 1, "{") + 1;
+			rule_buf__add(b, t, len);
+			t += len;
+			continue;
+		}
+		if (close - t == 6 && memcmp(t, "{topic}", 7) == 0) {
+			rule_buf__add(b, topic, strlen(topic));
+		} else {
+			n = strtol(t + 1, NULL, 10);
+			for (level = topic; n > 1 && level; n--) {
+				level = strchr(level, '/');
+				if (level)
+					level++;
+			}
+			if (n == 1 && level)
+				rule_buf__add(b, level, strcspn(level, "/"));
+		}
+		t = close + 1;
+	}
+}
+
+/* false if the template has a placeholder rule__topic doesn't know */
+static bool rule__check_topic(const char *t)
+{
+	const char *close;
+
+	for (t = strchr(t, '{'); t; t = strchr(close, '{')) {
+		close = strchr(t, '}');
+		if (close == NULL)
+			return false;
+		if (close - t == 6 && memcmp(t, "{topic}", 7) == 0)
+			continue;
+		if (close - t < 2 || t[1] == '0' || strspn(t + 1, "0123456789") != (size_t) (close - t - 1))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * The projected payload, the raw value of each field and null for missing
+ * ones. False if the picked path is missing, an empty payload would delete
+ * a retained message.
+ */
+static bool rule__project(rule_t *r, const struct mosquitto_message *msg, rule_buf_t *b)
+{
+	const char *p = msg->payload, *end = p + msg->payloadlen;
+	const char *v, *v_end;
+	int i;
+
+	if (r->pick) {
+		if (!json__find(p, end, r->pick, &v, &v_end))
+			return false;
+		/* a string goes out as its contents */
+		if (v_end - v >= 2 && *v == '"')
+			rule_buf__add(b, v + 1, v_end - v - 2);
+		else
+			rule_buf__add(b, v, v_end - v);
+		return true;
+	}
+
+	rule_buf__add(b, "{", 1);
+	for (i = 0; i < r->nfields; i++) {
+		if (i)
+			rule_buf__add(b, ",", 1);
+		rule_buf__add(b, "\"", 1);
+		rule_buf__add(b, r->fields[i].name, strlen(r->fields[i].name));
+		rule_buf__add(b, "\":", 2);
+		if (json__find(p, end, r->fields[i].path, &v, &v_end))
+			rule_buf__add(b, v, v_end - v);
+		else
+			rule_buf__add(b, "null", 4);
+	}
+	rule_buf__add(b, "}", 1);
+	return true;
+}
+
+static int rule__message(void *udata, const struct mosquitto_message *msg, const mosquitto_property *props)
+{
+	rule_t *r = udata;
+	ctx_t *ctx = r->ctx;
+	rule_buf_t topic = {NULL, 0, 0, false};
+	rule_buf_t payload = {NULL, 0, 0, false};
+	bool loop;
+	int i, rc;
+
+	(void) props;
+	for (i = 0; i < r->nwhere; i++) {
+		if (!rule__cond(&r->where[i], msg))
+			return LMQ_PASS;
+	}
+	/* a missing pick fails like a condition */
+	if ((r->pick || r->fields) && !rule__project(r, msg, &payload)) {
+		free(payload.p);
+		return LMQ_PASS;
+	}
+	__atomic_add_fetch(&ctx->stats.rules_matched, 1, __ATOMIC_RELAXED);
+
+	rule__topic(r, msg->topic, &topic);
+	/* a derived message matching the rule again would go round forever */
+	if (topic.failed || payload.failed || topic.p == NULL ||
+			mosquitto_topic_matches_sub(r->match, topic.p, &loop) != MOSQ_ERR_SUCCESS || loop) {
+		rc = MOSQ_ERR_INVAL;
+	} else if (r->pick || r->fields) {
+		rc = mosquitto_publish_v5(ctx->mosq, NULL, topic.p, payload.len, payload.p, r->qos, r->retain, NULL);
+	} else {
+		rc = mosquitto_publish_v5(ctx->mosq, NULL, topic.p, msg->payloadlen, msg->payload, r->qos, r->retain, NULL);
+	}
+	free(topic.p);
+	free(payload.p);
+
+	if (rc == MOSQ_ERR_SUCCESS) {
+		__atomic_add_fetch(&ctx->stats.rules_published, 1, __ATOMIC_RELAXED);
+		ctx__io_kick(ctx, false);
+	} else {
+		__atomic_add_fetch(&ctx->stats.rules_failed, 1, __ATOMIC_RELAXED);
+	}
+	return r->consume ? LMQ_HANDLED : LMQ_PASS;
+}
+
+static void rule__free(void *udata)
+{
+	rule_t *r = udata;
+	int i;
+
+	for (i = 0; i < r->nwhere; i++) {
+		free(r->where[i].path);
+		free(r->where[i].str);
+	}
+	for (i = 0; i < r->nfields; i++) {
+		free(r->fields[i].name);
+		free(r->fields[i].path);
+	}
+	free(r->where);
+	free(r->fields);
+	free(r->pick);
+	free(r->match);
+	free(r->topic);
+	free(r);
+}
+
+/* compile the condition {path, op, value} at the top of the stack, an error message on failure */
+static const char *rule__compile_cond(lua_State *L, rule_t *r)
+{
+	static const char *const ops[] = {"==", "~=", "<", "<=", ">", ">=", "exists", NULL};
+	rule_cond_t *c = &r->where[r->nwhere++];
+	const char *str, *err = NULL;
+
+	lua_rawgeti(L, -1, 1);
+	lua_rawgeti(L, -2, 2);
+	lua_rawgeti(L, -3, 3);
+	str = lua_isnil(L, -2) ? "exists" : lua_tostring(L, -2);
+	for (c->op = 0; str && ops[c->op] && strcmp(ops[c->op], str); c->op++)
+		;
+	c->type = lua_type(L, -1);
+
+	if (lua_type(L, -3) != LUA_TSTRING || str == NULL || ops[c->op] == NULL) {
+		err = "expecting a condition {path, op, value}";
+	} else if (c->type == LUA_TNUMBER) {
+		c->num = lua_tonumber(L, -1);
+	} else if (c->type == LUA_TSTRING) {
+		str = lua_tolstring(L, -1, &c->len);
+		c->str = malloc(c->len + 1);
+		if (c->str)
+			memcpy(c->str, str, c->len + 1);
+		else
+			err = strerror(ENOMEM);
+	} else if (c->type == LUA_TBOOLEAN) {
+		c->boolean = lua_toboolean(L, -1);
+		if (c->op != RULE_EQ && c->op != RULE_NE)
+			err = "booleans only compare with == and ~=";
+	} else if (c->op != RULE_EXISTS) {
+		err = "expecting a number, string or boolean to compare with";
+	}
+	if (err == NULL) {
+		c->path = strdup(lua_tostring(L, -3));
+		if (c->path == NULL)
+			err = strerror(ENOMEM);
+	}
+	lua_pop(L, 3);
+	return err;
+}
+
+/***
+ * Add a rule deriving messages from the client's incoming ones, without
+ * calling Lua. The rule runs on the network side for every message
+ * matching its filter (the client still needs to subscribe to it) that
+ * passes all conditions, and publishes a message built from it.
+ * @function rule
+ * @tparam table rule with the fields match (topic filter, required),
+ * where (a condition {path, op, value} or a list of them, op being one of
+ * "==", "~=", "<", "<=", ">", ">=" and "exists", a missing value fails
+ * every condition), project (a path whose value, a string without its
+ * quotes, becomes the payload, a missing one failing like a condition,
+ * or a table of names and paths making a JSON object with null for
+ * missing paths, the payload is passed on as is without it), republish
+ * (topic, "{n}" standing for the nth level of the topic and "{topic}"
+ * for all of it, no other braces, required), qos, retain and consume
+ * (true keeps the messages the rule published for from the Lua
+ * callbacks). Paths are dot separated object keys and array indices into
+ * a JSON payload.
+ * Derived messages matching the rule again are not published.
+ * @treturn number rule id for remove_rule
+ * @raise For invalid rules or out of memory
+ * @usage client:rule{match = "sensors/+/raw", where = {"temp", ">", -40},
+ *     project = {t = "temp", ts = "time"}, republish = "sensors/{2}/temp"}
+ */
+static int ctx_rule(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *match = opt__string(L, 2, "match", NULL);
+	const char *topic = opt__string(L, 2, "republish", NULL);
+	int qos = opt__integer(L, 2, "qos", 0);
+	const char *err = NULL;
+	rule_field_t *f;
+	bool list;
+	rule_t *r;
+	int i, n;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	luaL_argcheck(L, match && mosquitto_sub_topic_check(match) == MOSQ_ERR_SUCCESS, 2, "expecting a valid match filter");
+	luaL_argcheck(L, topic && *topic, 2, "expecting a republish topic");
+	luaL_argcheck(L, rule__check_topic(topic), 2, "republish only knows the placeholders {topic} and {n}, n > 0");
+	luaL_argcheck(L, qos >= 0 && qos <= 2, 2, "qos must be 0, 1 or 2");
+
+	/* owned by the handler once added, nothing below may raise before that */
+	r = calloc(1, sizeof(rule_t));
+	if (r == NULL)
+		return luaL_error(L, strerror(ENOMEM));
+	r->ctx = ctx;
+	r->qos = qos;
+	r->match = strdup(match);
+	r->topic = strdup(topic);
+	lua_getfield(L, 2, "retain");
+	r->retain = lua_toboolean(L, -1);
+	lua_getfield(L, 2, "consume");
+	r->consume = lua_toboolean(L, -1);
+	lua_pop(L, 2);
+	if (r->match == NULL || r->topic == NULL)
+		err = strerror(ENOMEM);
+
+	lua_getfield(L, 2, "where");
+	if (err == NULL && lua_istable(L, -1)) {
+		lua_rawgeti(L, -1, 1);
+		list = lua_istable(L, -1);
+		lua_pop(L, 1);
+		n = list ? (int) lua_rawlen(L, -1) : 1;
+		r->where = calloc(n ? n : 1, sizeof(rule_cond_t));
+		if (r->where == NULL)
+			err = strerror(ENOMEM);
+		for (i = 1; i <= n && err == NULL; i++) {
+			if (list)
+				lua_rawgeti(L, -1, i);
+			else
+				lua_pushvalue(L, -1);
+			err = lua_istable(L, -1) ? rule__compile_cond(L, r) : "expecting a condition {path, op, value}";
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 2, "project");
+	if (err == NULL && lua_type(L, -1) == LUA_TSTRING) {
+		r->pick = strdup(lua_tostring(L, -1));
+		if (r->pick == NULL)
+			err = strerror(ENOMEM);
+	} else if (err == NULL && lua_istable(L, -1)) {
+		lua_pushnil(L);
+		while (err == NULL && lua_next(L, -2)) {
+			if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TSTRING) {
+				err = "project maps names to paths";
+			} else if ((f = realloc(r->fields, (r->nfields + 1) * sizeof(rule_field_t))) == NULL) {
+				err = strerror(ENOMEM);
+			} else {
+				r->fields = f;
+				f = &r->fields[r->nfields++];
+				f->name = strdup(lua_tostring(L, -2));
+				f->path = strdup(lua_tostring(L, -1));
+				if (f->name == NULL || f->path == NULL)
+					err = strerror(ENOMEM);
+			}
+			lua_pop(L, 1);
+		}
+		/* lua_next left the key behind */
+		if (err)
+			lua_pop(L, 1);
+		else if (r->nfields == 0)
+			err = "project needs at least one field";
+	}
+	lua_pop(L, 1);
+
+	if (err) {
+		rule__free(r);
+		return luaL_argerror(L, 2, err);
+	}
+
+	i = native_on_message((lmq_ctx_t *) ctx, r->match, rule__message, r, rule__free);
+	if (i < 0) {
+		rule__free(r);
+		return mosq__pstatus(L, -i);
+	}
+	lua_pushinteger(L, i);
+	return 1;
+}
+
+/***
+ * Remove a rule added with client:rule.
+ * @function remove_rule
+ * @tparam number id as returned by rule
+ * @treturn boolean true if the rule was there
+ */
+static int ctx_remove_rule(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	int id = luaL_checkinteger(L, 2);
+
+	lua_pushboolean(L, native_remove((lmq_ctx_t *) ctx, id) == MOSQ_ERR_SUCCESS);
+	return 1;
+}
+
+/***
+ * Topic interning
+ * @section topic_interning
+ */
+
+typedef struct intern_entry {
+	struct intern_entry *prev;	/* least recently used side */
+	struct intern_entry *next;
+	const char *key;	/* owned by the map */
+	int ref;			/* the pinned Lua string */
+	int id;
+} intern_entry_t;
+
+typedef struct intern {
+	strmap_t map;
+	intern_entry_t *head;	/* most recently used */
+	intern_entry_t *tail;
+	intern_entry_t **by_id;	/* id - 1 */
+	int *free_ids;		/* ids of entries lost to a failed insert */
+	int nfree;
+	int max;
+	bool ids;			/* callbacks get the id instead of the topic */
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+} intern_t;
+
+static void intern__unlink(intern_t *t, intern_entry_t *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		t->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		t->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void intern__front(intern_t *t, intern_entry_t *e)
+{
+	e->next = t->head;
+	if (t->head)
+		t->head->prev = e;
+	t->head = e;
+	if (t->tail == NULL)
+		t->tail = e;
+}
+
+/* the entry of topic, added and pinned if new, NULL if out of memory */
+static intern_entry_t *intern__get(lua_State *L, intern_t *t, const char *topic)
+{
+	strmap_slot_t *slot = strmap__find(&t->map, topic);
+	intern_entry_t *e;
+
+	if (slot) {
+		e = slot->value;
+		t->hits++;
+		if (e != t->head) {
+			intern__unlink(t, e);
+			intern__front(t, e);
+		}
+		return e;
+	}
+	t->misses++;
+
+	/* full, the least recently used entry makes room and hands over its id */
+	if ((int) t->map.len >= t->max) {
+		e = t->tail;
+		intern__unlink(t, e);
+		luaL_unref(L, LUA_REGISTRYINDEX, e->ref);
+		strmap__remove(&t->map, strmap__find(&t->map, e->key));
+		t->evictions++;
+	} else {
+		e = calloc(1, sizeof(intern_entry_t));
+		if (e == NULL)
+			return NULL;
+		e->id = t->nfree ? t->free_ids[--t->nfree] : (int) t->map.len + 1;
+	}
+
+	slot = strmap__insert(&t->map, topic);
+	if (slot == NULL) {
+		t->by_id[e->id - 1] = NULL;
+		t->free_ids[t->nfree++] = e->id;
+		free(e);
+		return NULL;
+	}
+	slot->value = e;
+	e->key = slot->key;
+	lua_pushstring(L, topic);
+	e->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	t->by_id[e->id - 1] = e;
+	intern__front(t, e);
+	return e;
+}
+
+static void intern__free(lua_State *L, intern_t *t)
+{
+	intern_entry_t *e;
+
+	while ((e = t->head) != NULL) {
+		intern__unlink(t, e);
+		luaL_unref(L, LUA_REGISTRYINDEX, e->ref);
+		free(e);
+	}
+	strmap__clear(&t->map);
+	free(t->by_id);
+	free(t->free_ids);
+	free(t);
+}
+
+static void intern__stats(lua_State *L, intern_t *t)
+{
+	lua_pushinteger(L, t->map.len);
+	lua_setfield(L, -2, "intern_topics");
+	lua_pushinteger(L, t->hits);
+	lua_setfield(L, -2, "intern_hits");
+	lua_pushinteger(L, t->misses);
+	lua_setfield(L, -2, "intern_misses");
+	lua_pushinteger(L, t->evictions);
+	lua_setfield(L, -2, "intern_evictions");
+}
+
+/* push the topic of a message for a Lua callback, interned or as its id if enabled */
+static void ctx__push_topic(ctx_t *ctx, const char *topic)
+{
+	intern_entry_t *e;
+
+	if (ctx->intern == NULL || (e = intern__get(ctx->L, ctx->intern, topic)) == NULL) {
+		lua_pushstring(ctx->L, topic);
+		return;
+	}
+	if (ctx->intern->ids)
+		lua_pushinteger(ctx->L, e->id);
+	else
+		lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, e->ref);
+}
+
+/***
+ * Intern the topics of incoming messages. The message callbacks and
+ * subscription handlers then get the same pinned Lua string for a topic
+ * seen before, rather than a new one per message, or a small integer id in
+ * 1..max to index arrays with. Once max topics are interned the least
+ * recently used one is dropped and its id goes to the next new topic.
+ * @function intern_topics
+ * @tparam[opt] table options max (1024) topics kept and ids (false), false
+ * to stop interning
+ * @return boolean true
+ * @raise For invalid arguments or out of memory
+ * @see topic
+ * @see topic_id
+ */
+static int ctx_intern_topics(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lua_Integer max = opt__integer(L, 2, "max", 1024);
+	intern_t *t = NULL;
+
+	/* a bad argument leaves the current table in place */
+	if (!lua_isboolean(L, 2) || lua_toboolean(L, 2)) {
+		luaL_argcheck(L, max > 0 && max <= 1 << 24, 2, "max must be in 1..16777216");
+
+		t = calloc(1, sizeof(intern_t));
+		if (t == NULL || (t->by_id = calloc(max, sizeof(intern_entry_t *))) == NULL ||
+				(t->free_ids = calloc(max, sizeof(int))) == NULL) {
+			if (t)
+				free(t->by_id);
+			free(t);
+			return luaL_error(L, strerror(ENOMEM));
+		}
+		t->max = max;
+		if (lua_table_on_stack(L, 2)) {
+			lua_getfield(L, 2, "ids");
+			t->ids = lua_toboolean(L, -1);
+			lua_pop(L, 1);
+		}
+	}
+
+	if (ctx->intern)
+		intern__free(L, ctx->intern);
+	ctx->intern = t;
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * The topic interned under an id.
+ * @function topic
+ * @tparam number id as passed to a callback
+ * @treturn string topic, nil if the id isn't in use
+ * @see intern_topics
+ */
+static int ctx_topic(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lua_Integer id = luaL_checkinteger(L, 2);
+	intern_t *t = ctx->intern;
+
+	if (t == NULL || id < 1 || id > t->max || t->by_id[id - 1] == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, t->by_id[id - 1]->ref);
+	return 1;
+}
+
+/***
+ * The id of a topic, interning it if it's new, to set up arrays indexed by
+ * id ahead of the messages.
+ * @function topic_id
+ * @tparam string topic
+ * @treturn number id, nil if interning is off
+ * @see intern_topics
+ */
+static int ctx_topic_id(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *topic = luaL_checkstring(L, 2);
+	intern_entry_t *e;
+
+	if (ctx->intern == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+	e = intern__get(L, ctx->intern, topic);
+	if (e == NULL)
+		return luaL_error(L, strerror(ENOMEM));
+	lua_pushinteger(L, e->id);
+	return 1;
+}
+
+/***
+ * LuaJIT FFI
+ * @section ffi
+ */
+
+typedef struct ffi_queue {
+	pthread_mutex_t lock;	/* filled on the network side */
+	struct mosquitto_message *ring;
+	size_t size;
+	size_t head;
+	size_t len;
+	struct mosquitto_message current;	/* handed out by next, until the next call */
+	size_t limit;		/* QoS 0 messages past it are dropped */
+	unsigned long queued;
+	unsigned long dropped;
+	unsigned long overflow;	/* QoS 1 and 2 messages queued past the limit */
+} ffi_queue_t;
+
+/* the Lua side of mosquitto.ffi, run once with the API, ffi__bind and the declarations */
+static const char ffi__chunk[] =
+	"local api, bind, cdef = ...\n"
+	"local ffi = require 'ffi'\n"
+	"if not pcall(ffi.typeof, 'struct lmq_ffi') then ffi.cdef(cdef) end\n"
+	"api = ffi.cast('const struct lmq_ffi *', api)\n"
+	"local M = {}\n"
+	"function M.bind(client, size)\n"
+	"	local ctx = ffi.cast('void *', bind(client, size))\n"
+	"	local mid = ffi.new('int[1]')\n"
+	"	local q = {client = client}\n"
+	"	function q.next()\n"
+	"		local m = api.next(ctx)\n"
+	"		if m ~= nil then return m end\n"
+	"	end\n"
+	"	function q.publish(topic, payload, len, qos, retain)\n"
+	"		local rc = api.publish(ctx, mid, topic, len or #payload, payload, qos or 0, retain or false)\n"
+	"		if rc ~= 0 then return nil, rc end\n"
+	"		return mid[0]\n"
+	"	end\n"
+	"	return q\n"
+	"end\n"
+	"return M\n";
+
+static const char ffi__cdef[] =
+	"struct mosquitto_message { int mid; char *topic; void *payload; int payloadlen; int qos; bool retain; };\n"
+	"struct lmq_ffi {\n"
+	"	int version;\n"
+	"	const struct mosquitto_message *(*next)(void *ctx);\n"
+	"	int (*publish)(void *ctx, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain);\n"
+	"};\n";
+
+/* double the ring, under q->lock */
+static bool ffi__grow(ffi_queue_t *q)
+{
+	struct mosquitto_message *ring = malloc(q->size * 2 * sizeof(struct mosquitto_message));
+	size_t i;
+
+	if (ring == NULL)
+		return false;
+	for (i = 0; i < q->len; i++)
+		ring[i] = q->ring[(q->head + i) % q->size];
+	free(q->ring);
+	q->ring = ring;
+	q->head = 0;
+	q->size *= 2;
+	return true;
+}
+
+/*
+ * Copy of msg for next, false if it was dropped. Past the limit only QoS 0
+ * messages are dropped, the broker considers QoS 1 and 2 ones delivered
+ * by now so the queue grows for them.
+ */
+static bool ffi__push(ffi_queue_t *q, const struct mosquitto_message *msg)
+{
+	bool queued = false;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->len >= q->limit && msg->qos == 0)
+		goto done;
+	if (q->len == q->size && !ffi__grow(q))
+		goto done;
+	if (mosquitto_message_copy(&q->ring[(q->head + q->len) % q->size], msg) != MOSQ_ERR_SUCCESS)
+		goto done;
+	if (q->len >= q->limit)
+		q->overflow++;
+	q->len++;
+	q->queued++;
+	queued = true;
+done:
+	if (!queued)
+		q->dropped++;
+	pthread_mutex_unlock(&q->lock);
+	return queued;
+}
+
+static void ffi__free(ffi_queue_t *q)
+{
+	while (q->len) {
+		mosquitto_message_free_contents(&q->ring[q->head]);
+		q->head = (q->head + 1) % q->size;
+		q->len--;
+	}
+	mosquitto_message_free_contents(&q->current);
+	pthread_mutex_destroy(&q->lock);
+	free(q->ring);
+	free(q);
+}
+
+static void ffi__stats(lua_State *L, ffi_queue_t *q)
 {
-	ctx_t *ctx = obj;
-	int i;
+	pthread_mutex_lock(&q->lock);
+	lua_pushinteger(L, q->queued);
+	lua_setfield(L, -2, "ffi_queued");
+	lua_pushinteger(L, q->dropped);
+	lua_setfield(L, -2, "ffi_dropped");
+	lua_pushinteger(L, q->overflow);
+	lua_setfield(L, -2, "ffi_overflow");
+	lua_pushinteger(L, q->len);
+	lua_setfield(L, -2, "ffi_pending");
+	pthread_mutex_unlock(&q->lock);
+}
 
-	lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->on_subscribe);
-	lua_pushinteger(ctx->L, mid);
+/* the oldest queued message, NULL when there's none */
+static const struct mosquitto_message *ffi_next(void *c)
+{
+	ffi_queue_t *q = ((ctx_t *) c)->ffi;
 
-	for (i = 0; i < qos_count; i++) {
-		lua_pushinteger(ctx->L, granted_qos[i]);
+	if (q == NULL)
+		return NULL;
+
+	/* the Lua thread is the only one touching current */
+	mosquitto_message_free_contents(&q->current);
+	pthread_mutex_lock(&q->lock);
+	if (q->len == 0) {
+		pthread_mutex_unlock(&q->lock);
+		return NULL;
 	}
+	q->current = q->ring[q->head];
+	q->head = (q->head + 1) % q->size;
+	q->len--;
+	pthread_mutex_unlock(&q->lock);
+	return &q->current;
+}
 
-	lua_call(ctx->L, qos_count + 1, 0);
+/* callbacks libmosquitto may run right away from within a publish */
+static bool ffi__reentrant(ctx_t *ctx)
+{
+	return ctx->on_publish != LUA_REFNIL || ctx->on_publish_v5 != LUA_REFNIL ||
+		ctx->on_disconnect != LUA_REFNIL || ctx->on_disconnect_v5 != LUA_REFNIL ||
+		ctx->on_log != LUA_REFNIL;
 }
 
-static void ctx_on_subscribe_v5(
-	struct mosquitto *mosq,
-	void *obj,
-	int mid,
-	int qos_count,
-	const int *granted_qos,
-	const mosquitto_property *props)
+static int ffi_publish(void *c, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain)
 {
-	ctx_t *ctx = obj;
-	int i;
+	ctx_t *ctx = c;
 
-	lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->on_subscribe_v5);
-	lua_pushinteger(ctx->L, mid);
+	if (ctx->mosq == NULL || topic == NULL || payloadlen < 0 || (payloadlen && payload == NULL))
+		return MOSQ_ERR_INVAL;
+	/* LuaJIT doesn't allow calling back into Lua from within an FFI call */
+	if (ffi__reentrant(ctx))
+		return MOSQ_ERR_NOT_SUPPORTED;
+	return ctx__publish(ctx, mid, topic, payloadlen, payload, qos, retain, NULL, PRIORITY_NORMAL);
+}
 
-	create_lua_stack_from_property_list(ctx->L, props);
+/* cast to the struct lmq_ffi of ffi__cdef */
+static const struct {
+	int version;
+	const struct mosquitto_message *(*next)(void *ctx);
+	int (*publish)(void *ctx, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain);
+} ffi_api = {
+	1,
+	ffi_next,
+	ffi_publish,
+};
 
-	for (i = 0; i < qos_count; i++) {
-		lua_pushinteger(ctx->L, granted_qos[i]);
+/* queue the client's messages for next, returns the client as a light userdata */
+static int ffi__bind(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lua_Integer size = luaL_optinteger(L, 2, 1024);
+	ffi_queue_t *q;
+
+	luaL_argcheck(L, size > 0, 2, "queue size must be positive");
+	if (ctx->io.thread)
+		return luaL_error(L, "can't bind a client attached to an I/O pool");
+	if (ctx->ffi)
+		return luaL_error(L, "client already bound");
+
+	q = calloc(1, sizeof(ffi_queue_t));
+	if (q == NULL || (q->ring = calloc(size, sizeof(struct mosquitto_message))) == NULL) {
+		free(q);
+		return luaL_error(L, strerror(ENOMEM));
 	}
+	pthread_mutex_init(&q->lock, NULL);
+	q->size = size;
+	q->limit = size;
+	ctx->ffi = q;
+	ctx__message_v5_enable(ctx);
 
-	lua_call(ctx->L, qos_count + 2, 0);	
+	lua_pushlightuserdata(L, ctx);
+	return 1;
 }
 
-static void ctx_on_unsubscribe(
-	struct mosquitto *mosq,
-	void *obj,
-	int mid)
+/***
+ * FFI interface for LuaJIT. A bound client queues its messages instead of
+ * calling ON_MESSAGE and ON_MESSAGE_V5; q.next() hands them out as cdata
+ * `struct mosquitto_message` views, valid until the next call, and
+ * q.publish(topic, payload[, len, qos, retain]) publishes a string or a
+ * pointer and length. Both are plain FFI calls the JIT compiles through.
+ * q.publish fails with ERR_NOT_SUPPORTED while the client has an
+ * ON_PUBLISH, ON_DISCONNECT or ON_LOG callback (or their v5 versions),
+ * since libmosquitto may run them from within the publish and LuaJIT
+ * can't call back into Lua from an FFI call.
+ * Run the loop as usual to fill the queue. Once size messages wait, QoS 0
+ * ones are dropped, QoS 1 and 2 ones were acknowledged already and are
+ * queued anyway, counted as ffi_overflow in the client's stats.
+ * Subscription handlers and requests aren't affected.
+ * @function ffi
+ * @treturn table with bind(client[, size=1024]) returning q
+ * @raise without LuaJIT's ffi module, or if the client is already bound
+ * or attached to an I/O pool
+ * @usage local mffi = mosquitto.ffi()
+ * local q = mffi.bind(client)
+ * client:loop()
+ * local m = q.next()
+ * while m do
+ *     handle(ffi.string(m.topic), m.payload, m.payloadlen)
+ *     m = q.next()
+ * end
+ */
+static int mosq_ffi(lua_State *L)
 {
-	ctx_t *ctx = obj;
+	lua_getfield(L, LUA_REGISTRYINDEX, MOSQ_META_FFI);
+	if (!lua_isnil(L, -1))
+		return 1;
+	lua_pop(L, 1);
 
-	lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->on_unsubscribe);
-	lua_pushinteger(ctx->L, mid);
-	lua_call(ctx->L, 1, 0);
+	if (luaL_loadbuffer(L, ffi__chunk, sizeof(ffi__chunk) - 1, "=mosquitto.ffi") != 0)
+		return lua_error(L);
+	lua_pushlightuserdata(L, (void *) &ffi_api);
+	lua_pushcfunction(L, ffi__bind);
+	lua_pushstring(L, ffi__cdef);
+	lua_call(L, 3, 1);
+
+	lua_pushvalue(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, MOSQ_META_FFI);
+	return 1;
 }
 
-static void ctx_on_unsubscribe_v5(
-	struct mosquitto *mosq,
-	void *obj,
-	int mid,
-	const mosquitto_property *props)
-{
-	ctx_t *ctx = obj;
+/***
+ * Relays
+ * @section relays
+ */
 
-	lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->on_unsubscribe_v5);
-	lua_pushinteger(ctx->L, mid);
-	create_lua_stack_from_property_list(ctx->L, props);
-	lua_call(ctx->L, 2, 0);	
+typedef struct {
+	char *from;
+	size_t from_len;
+	char *to;
+} relay_remap_t;
+
+typedef struct relay {
+	ctx_t *src;
+	ctx_t *dst;
+	int src_ref;
+	int dst_ref;
+	int ref;		/* the relay itself, until stop */
+	int ids[4];		/* C handlers, 0 once removed */
+	char *filter;
+	int sub_qos;
+	int qos;		/* -1 keeps the message's */
+	bool retain;
+	bool properties;
+	relay_remap_t *remap;
+	int nremap;
+	pthread_mutex_t lock;	/* taken on both network sides */
+	uint8_t pending[65536 / 8];	/* mids awaiting their ack on dst */
+	unsigned long inflight;
+	unsigned long high;
+	unsigned long low;
+	bool paused;
+	unsigned long relayed;
+	unsigned long errors;
+	unsigned long pauses;
+} relay_t;
+
+static relay_t * relay_check(lua_State *L, int i)
+{
+	return (relay_t *) luaL_checkudata(L, i, MOSQ_META_RELAY);
 }
 
-static void ctx_on_log(
-	struct mosquitto *mosq,
-	void *obj,
-	int level,
-	const char *str)
+/* the publish properties of a message, a topic alias or subscription identifier can't be passed on */
+static mosquitto_property *relay__props(const mosquitto_property *props)
 {
-	ctx_t *ctx = obj;
-
-	lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->on_log);
+	mosquitto_property *out = NULL;
+	const mosquitto_property *p;
+	char *name, *value;
+	uint32_t i32;
+	uint16_t len;
+	uint8_t byte;
+	void *bin;
+
+	if (mosquitto_property_read_byte(props, MQTT_PROP_PAYLOAD_FORMAT_INDICATOR, &byte, false))
+		mosquitto_property_add_byte(&out, MQTT_PROP_PAYLOAD_FORMAT_INDICATOR, byte);
+	if (mosquitto_property_read_int32(props, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, &i32, false))
+		mosquitto_property_add_int32(&out, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, i32);
+	if (mosquitto_property_read_string(props, MQTT_PROP_CONTENT_TYPE, &value, false)) {
+		mosquitto_property_add_string(&out, MQTT_PROP_CONTENT_TYPE, value);
+		free(value);
+	}
+	if (mosquitto_property_read_string(props, MQTT_PROP_RESPONSE_TOPIC, &value, false)) {
+		mosquitto_property_add_string(&out, MQTT_PROP_RESPONSE_TOPIC, value);
+		free(value);
+	}
+	if (mosquitto_property_read_binary(props, MQTT_PROP_CORRELATION_DATA, &bin, &len, false)) {
+		mosquitto_property_add_binary(&out, MQTT_PROP_CORRELATION_DATA, bin, len);
+		free(bin);
+	}
+	p = mosquitto_property_read_string_pair(props, MQTT_PROP_USER_PROPERTY, &name, &value, false);
+	while (p) {
+		mosquitto_property_add_string_pair(&out, MQTT_PROP_USER_PROPERTY, name, value);
+		free(name);
+		free(value);
+		p = mosquitto_property_read_string_pair(p, MQTT_PROP_USER_PROPERTY, &name, &value, true);
+	}
+	return out;
+}
 
-	lua_pushinteger(ctx->L, level);
-	lua_pushstring(ctx->L, str);
+/* the destination topic, in buf if it fits, NULL if out of memory */
+static char *relay__topic(relay_t *r, const char *topic, char *buf, size_t size)
+{
+	relay_remap_t *m = NULL;
+	size_t len, tail;
+	char *out = buf;
+	int i;
 
-	lua_call(ctx->L, 2, 0);
+	for (i = 0; i < r->nremap; i++) {
+		if ((m == NULL || r->remap[i].from_len > m->from_len) &&
+				strncmp(topic, r->remap[i].from, r->remap[i].from_len) == 0)
+			m = &r->remap[i];
+	}
+	if (m == NULL)
+		return (char *) topic;
+
+	len = strlen(m->to);
+	tail = strlen(topic + m->from_len);
+	if (len + tail + 1 > size && (out = malloc(len + tail + 1)) == NULL)
+		return NULL;
+	memcpy(out, m->to, len);
+	memcpy(out + len, topic + m->from_len, tail + 1);
+	return out;
 }
 
-static int callback_type_from_string(const char *);
-
-static int ctx_callback_set(lua_State *L)
+static int relay__message(void *udata, const struct mosquitto_message *msg, const mosquitto_property *props)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	int callback_type;
+	relay_t *r = udata;
+	mosquitto_property *out = NULL;
+	int qos = r->qos < 0 ? msg->qos : r->qos;
+	char buf[256], *topic;
+	int mid, rc;
 
-	if (lua_isstring(L, 2)) {
-		callback_type = callback_type_from_string(lua_tostring(L, 2));
-	} else {
-		callback_type = luaL_checkinteger(L, 2);
+	topic = relay__topic(r, msg->topic, buf, sizeof(buf));
+	if (topic == NULL) {
+		__atomic_add_fetch(&r->errors, 1, __ATOMIC_RELAXED);
+		return LMQ_HANDLED;
+	}
+	if (r->properties && props)
+		out = relay__props(props);
+
+	rc = mosquitto_publish_v5(r->dst->mosq, &mid, topic, msg->payloadlen, msg->payload, qos, r->retain && msg->retain, out);
+	/* no properties over MQTT 3.1.1 */
+	if (rc == MOSQ_ERR_NOT_SUPPORTED && out) {
+		r->properties = false;
+		rc = mosquitto_publish_v5(r->dst->mosq, &mid, topic, msg->payloadlen, msg->payload, qos, r->retain && msg->retain, NULL);
 	}
+	mosquitto_property_free_all(&out);
+	if (topic != buf && topic != msg->topic)
+		free(topic);
 
-	if (!lua_isfunction(L, 3)) {
-		return luaL_argerror(L, 3, "expecting a callback function");
+	if (rc != MOSQ_ERR_SUCCESS) {
+		__atomic_add_fetch(&r->errors, 1, __ATOMIC_RELAXED);
+		return LMQ_HANDLED;
 	}
+	ctx__io_kick(r->dst, false);
 
-	/* pop the function from the stack and store it in the registry */
-	int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	pthread_mutex_lock(&r->lock);
+	r->relayed++;
+	if (qos > 0 && !(r->pending[(mid & 0xffff) / 8] & (1 << (mid & 7)))) {
+		r->pending[(mid & 0xffff) / 8] |= 1 << (mid & 7);
+		r->inflight++;
+	}
+	/* shed at the broker rather than queue here */
+	if (!r->paused && r->inflight >= r->high) {
+		r->paused = true;
+		r->pauses++;
+		mosquitto_unsubscribe(r->src->mosq, NULL, r->filter);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return LMQ_HANDLED;
+}
 
-	switch (callback_type) {
-		case CALLBACK_ON_CONNECT:
-			ctx->on_connect = ref;
-			mosquitto_connect_callback_set(ctx->mosq, ctx_on_connect);
-			break;
-			
-		case CALLBACK_ON_CONNECT_V5:
-			ctx->on_connect_v5 = ref;
-			mosquitto_connect_v5_callback_set(ctx->mosq, ctx_on_connect_v5);
-			break;
+static void relay__resume(relay_t *r)
+{
+	int rc;
 
-		case CALLBACK_ON_DISCONNECT:
-			ctx->on_disconnect = ref;
-			mosquitto_disconnect_callback_set(ctx->mosq, ctx_on_disconnect);
-			break;
+	if (r->paused && r->inflight <= r->low) {
+		r->paused = false;
+		/* the subscription is new again, without the option the broker resends every retained message */
+		rc = mosquitto_subscribe_v5(r->src->mosq, NULL, r->filter, r->sub_qos, MQTT_SUB_OPT_SEND_RETAIN_NEVER, NULL);
+		/* no subscription options over MQTT 3.1.1 */
+		if (rc == MOSQ_ERR_NOT_SUPPORTED || rc == MOSQ_ERR_INVAL)
+			mosquitto_subscribe(r->src->mosq, NULL, r->filter, r->sub_qos);
+		ctx__io_kick(r->src, false);
+	}
+}
 
-		case CALLBACK_ON_DISCONNECT_V5:
-			ctx->on_disconnect_v5 = ref;
-			mosquitto_disconnect_v5_callback_set(ctx->mosq, ctx_on_disconnect_v5);
-			break;
+static void relay__ack(void *udata, int mid, int reason_code, const mosquitto_property *props)
+{
+	relay_t *r = udata;
+
+	(void) reason_code;
+	(void) props;
+	pthread_mutex_lock(&r->lock);
+	if (r->pending[(mid & 0xffff) / 8] & (1 << (mid & 7))) {
+		r->pending[(mid & 0xffff) / 8] &= ~(1 << (mid & 7));
+		r->inflight--;
+		relay__resume(r);
+	}
+	pthread_mutex_unlock(&r->lock);
+}
 
-		case CALLBACK_ON_PUBLISH:
-			ctx->on_publish = ref;
-			mosquitto_publish_callback_set(ctx->mosq, ctx_on_publish);
-			break;
+static void relay__src_connect(void *udata, int reason_code, int flags, const mosquitto_property *props)
+{
+	relay_t *r = udata;
+
+	(void) flags;
+	(void) props;
+	pthread_mutex_lock(&r->lock);
+	if (reason_code == 0 && !r->paused)
+		mosquitto_subscribe(r->src->mosq, NULL, r->filter, r->sub_qos);
+	pthread_mutex_unlock(&r->lock);
+}
 
-		case CALLBACK_ON_PUBLISH_V5:
-			ctx->on_publish_v5 = ref;
-			mosquitto_publish_v5_callback_set(ctx->mosq, ctx_on_publish_v5);
-			break;
+static void relay__dst_connect(void *udata, int reason_code, int flags, const mosquitto_property *props)
+{
+	relay_t *r = udata;
+
+	(void) props;
+	/* without a session the messages in flight are gone */
+	if (reason_code != 0 || (flags & 1))
+		return;
+	pthread_mutex_lock(&r->lock);
+	memset(r->pending, 0, sizeof(r->pending));
+	r->inflight = 0;
+	relay__resume(r);
+	pthread_mutex_unlock(&r->lock);
+}
 
-		case CALLBACK_ON_MESSAGE:
-			ctx->on_message = ref;
-			mosquitto_message_callback_set(ctx->mosq, ctx_on_message);
-			break;
+/***
+ * Forward the messages matching filter from one client to another, in C
+ * on the network side of both. Relayed messages don't reach the Lua
+ * callbacks of src. Once high QoS 1 and 2 messages wait for their ack on
+ * dst, src unsubscribes from filter until they are down to low, rather
+ * than queueing in the client's memory. Messages published under filter
+ * while paused are not relayed, and over MQTT v5 the retained ones aren't
+ * sent again on resume.
+ * @function relay
+ * @param src client to subscribe to filter on, now and on every connect
+ * @param dst client to publish to
+ * @tparam table options with the fields filter (required), remap (table of
+ * topic prefixes and their replacements, the longest match wins), qos (of
+ * the subscription and the publishes, default the subscription at 1 and
+ * the message's own qos), retain (true, pass on the retain flag),
+ * properties (false, pass on the MQTT v5 publish properties), high (1000)
+ * and low (high / 2)
+ * @return a relay, which runs until stopped even if it isn't kept
+ * @raise For some out of memory or illegal states
+ * @usage mosquitto.relay(site, cloud, {filter = "plant/#", remap = {["plant/"] = "sites/42/"}})
+ */
+static int mosq_relay(lua_State *L)
+{
+	ctx_t *src = ctx_check(L, 1);
+	ctx_t *dst = ctx_check(L, 2);
+	const char *filter = opt__string(L, 3, "filter", NULL);
+	int qos = opt__integer(L, 3, "qos", -1);
+	lua_Integer high = opt__integer(L, 3, "high", 1000);
+	lua_Integer low = opt__integer(L, 3, "low", high / 2);
+	relay_remap_t *m;
+	relay_t *r;
+
+	luaL_argcheck(L, src != dst, 2, "expecting another client");
+	luaL_argcheck(L, filter && mosquitto_sub_topic_check(filter) == MOSQ_ERR_SUCCESS, 3, "expecting a valid filter");
+	luaL_argcheck(L, qos >= -1 && qos <= 2, 3, "qos must be 0, 1 or 2");
+	luaL_argcheck(L, high > 0 && low >= 0 && low < high, 3, "expecting 0 <= low < high");
+
+	r = (relay_t *) lua_newuserdata(L, sizeof(relay_t));
+	memset(r, 0, sizeof(relay_t));
+	r->src_ref = LUA_NOREF;
+	r->dst_ref = LUA_NOREF;
+	r->ref = LUA_NOREF;
+	pthread_mutex_init(&r->lock, NULL);
+	luaL_getmetatable(L, MOSQ_META_RELAY);
+	lua_setmetatable(L, -2);
 
-		case CALLBACK_ON_MESSAGE_V5:
-			ctx->on_message_v5 = ref;
-			mosquitto_message_v5_callback_set(ctx->mosq, ctx_on_message_v5);
-			break;			
+	r->src = src;
+	r->dst = dst;
+	r->qos = qos;
+	r->sub_qos = qos < 0 ? 1 : qos;
+	r->high = high;
+	r->low = low;
+	lua_getfield(L, 3, "retain");
+	r->retain = lua_isnil(L, -1) || lua_toboolean(L, -1);
+	lua_getfield(L, 3, "properties");
+	r->properties = lua_toboolean(L, -1);
+	lua_pop(L, 2);
+	r->filter = strdup(filter);
+	if (r->filter == NULL)
+		return luaL_error(L, strerror(ENOMEM));
+
+	lua_getfield(L, 3, "remap");
+	if (lua_istable(L, -1)) {
+		lua_pushnil(L);
+		while (lua_next(L, -2)) {
+			if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TSTRING)
+				return luaL_argerror(L, 3, "remap maps topic prefixes to strings");
+			m = realloc(r->remap, (r->nremap + 1) * sizeof(relay_remap_t));
+			if (m == NULL)
+				return luaL_error(L, strerror(ENOMEM));
+			r->remap = m;
+			m = &r->remap[r->nremap];
+			m->from = strdup(lua_tostring(L, -2));
+			m->to = strdup(lua_tostring(L, -1));
+			r->nremap++;
+			if (m->from == NULL || m->to == NULL)
+				return luaL_error(L, strerror(ENOMEM));
+			m->from_len = strlen(m->from);
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+
+	/* both clients stay around for as long as the relay */
+	lua_pushvalue(L, 1);
+	r->src_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushvalue(L, 2);
+	r->dst_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	r->ids[0] = native_on_message((lmq_ctx_t *) src, filter, relay__message, r, NULL);
+	r->ids[1] = native_on_connect((lmq_ctx_t *) src, relay__src_connect, r, NULL);
+	r->ids[2] = native_on_publish((lmq_ctx_t *) dst, relay__ack, r, NULL);
+	r->ids[3] = native_on_connect((lmq_ctx_t *) dst, relay__dst_connect, r, NULL);
+	if (r->ids[0] < 0 || r->ids[1] < 0 || r->ids[2] < 0 || r->ids[3] < 0)
+		return luaL_error(L, strerror(ENOMEM));
+
+	/* relays until stopped, whether the result is kept or not */
+	lua_pushvalue(L, -1);
+	r->ref = luaL_ref(L, LUA_REGISTRYINDEX);
 
-		case CALLBACK_ON_SUBSCRIBE:
-			ctx->on_subscribe = ref;
-			mosquitto_subscribe_callback_set(ctx->mosq, ctx_on_subscribe);
-			break;
+	/* an already connected src subscribes straight away, otherwise on connect */
+	mosquitto_subscribe(src->mosq, NULL, r->filter, r->sub_qos);
+	ctx__io_kick(src, false);
+	return 1;
+}
 
-		case CALLBACK_ON_SUBSCRIBE_V5:
-			ctx->on_subscribe_v5 = ref;
-			mosquitto_subscribe_v5_callback_set(ctx->mosq, ctx_on_subscribe_v5);
-			break;
+/***
+ * Relay functions
+ * @section relay_functions
+ */
 
-		case CALLBACK_ON_UNSUBSCRIBE:
-			ctx->on_unsubscribe = ref;
-			mosquitto_unsubscribe_callback_set(ctx->mosq, ctx_on_unsubscribe);
-			break;
+/***
+ * Counters of a relay.
+ * @function stats
+ * @treturn table relayed, errors (messages that couldn't be published),
+ * inflight, paused and pauses
+ */
+static int relay_stats(lua_State *L)
+{
+	relay_t *r = relay_check(L, 1);
 
-		case CALLBACK_ON_UNSUBSCRIBE_V5:
-			ctx->on_unsubscribe_v5 = ref;
-			mosquitto_unsubscribe_v5_callback_set(ctx->mosq, ctx_on_unsubscribe_v5);
-			break;
+	pthread_mutex_lock(&r->lock);
+	lua_newtable(L);
+	lua_pushinteger(L, r->relayed);
+	lua_setfield(L, -2, "relayed");
+	lua_pushinteger(L, __atomic_load_n(&r->errors, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "errors");
+	lua_pushinteger(L, r->inflight);
+	lua_setfield(L, -2, "inflight");
+	lua_pushboolean(L, r->paused);
+	lua_setfield(L, -2, "paused");
+	lua_pushinteger(L, r->pauses);
+	lua_setfield(L, -2, "pauses");
+	pthread_mutex_unlock(&r->lock);
+	return 1;
+}
 
-		case CALLBACK_ON_LOG:
-			ctx->on_log = ref;
-			mosquitto_log_callback_set(ctx->mosq, ctx_on_log);
-			break;
+/***
+ * Stop relaying and unsubscribe src from the filter.
+ * @function stop
+ * @return true
+ */
+static int relay_stop(lua_State *L)
+{
+	relay_t *r = relay_check(L, 1);
+	int i;
 
-		default:
-			luaL_unref(L, LUA_REGISTRYINDEX, ref);
-			luaL_argerror(L, 2, "not a proper callback type");
-			break;
+	if (r->src == NULL)
+		return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+
+	/* the clients may already be destroyed, along with the handlers */
+	if (r->ids[0] > 0)
+		native_remove((lmq_ctx_t *) r->src, r->ids[0]);
+	if (r->ids[1] > 0)
+		native_remove((lmq_ctx_t *) r->src, r->ids[1]);
+	if (r->ids[2] > 0)
+		native_remove((lmq_ctx_t *) r->dst, r->ids[2]);
+	if (r->ids[3] > 0)
+		native_remove((lmq_ctx_t *) r->dst, r->ids[3]);
+	if (r->src->mosq && r->filter) {
+		mosquitto_unsubscribe(r->src->mosq, NULL, r->filter);
+		ctx__io_kick(r->src, false);
 	}
-
+	luaL_unref(L, LUA_REGISTRYINDEX, r->src_ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, r->dst_ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, r->ref);
+	r->ref = LUA_NOREF;
+	r->src = NULL;
+	r->dst = NULL;
+
+	for (i = 0; i < r->nremap; i++) {
+		free(r->remap[i].from);
+		free(r->remap[i].to);
+	}
+	free(r->remap);
+	r->remap = NULL;
+	r->nremap = 0;
+	free(r->filter);
+	r->filter = NULL;
+	pthread_mutex_destroy(&r->lock);
 	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
 }
 
@@ -1629,6 +12063,10 @@ static const struct define D[] = {
 	{"MQTT_SUB_OPT_SEND_RETAIN_NEW",		MQTT_SUB_OPT_SEND_RETAIN_NEW},
 	{"MQTT_SUB_OPT_SEND_RETAIN_NEVER",		MQTT_SUB_OPT_SEND_RETAIN_NEVER},
 
+	{"PRIORITY_CONTROL",	PRIORITY_CONTROL},
+	{"PRIORITY_NORMAL",		PRIORITY_NORMAL},
+	{"PRIORITY_BULK",		PRIORITY_BULK},
+
 	{NULL,			0}
 };
 
@@ -1889,7 +12327,7 @@ static void parse_basic_parameter_for_publish(lua_State *L, const char **topic,
 	*topic = luaL_checkstring(L, 2);
 
 	if (!lua_isnil(L, 3)) {
-		*payload = lua_tolstring(L, 3, payloadlen);
+		*payload = buffer__payload(L, 3, payloadlen);
 	};
 
 	*qos = luaL_optinteger(L, 4, 0);
@@ -1903,6 +12341,17 @@ static const struct luaL_Reg R[] = {
 	{"__gc",	mosq_cleanup},
 	{"new",		mosq_new},
 	{"topic_matches_sub",mosq_topic_matches_sub},
+	{"worker_pool",	mosq_worker_pool},
+	{"io_pool",		mosq_io_pool},
+	{"publisher",	mosq_publisher},
+	{"shared_group",	mosq_shared_group},
+	{"matcher",		mosq_matcher},
+	{"buffer",		mosq_buffer},
+	{"map",			mosq_map},
+	{"replay",		mosq_replay},
+	{"swarm",		mosq_swarm},
+	{"ffi",			mosq_ffi},
+	{"relay",		mosq_relay},
 	{NULL,		NULL}
 };
 
@@ -1942,6 +12391,30 @@ static const struct luaL_Reg ctx_M[] = {
 	{"loop_write",			ctx_loop_write},
 	{"loop_misc",			ctx_loop_misc},
 	{"want_write",		ctx_want_write},
+	{"stats",			ctx_stats},
+	{"worker_pool",		ctx_worker_pool},
+	{"io_pool",			ctx_io_pool},
+	{"publisher",		ctx_publisher},
+	{"spool",			ctx_spool},
+	{"offline_buffer",	ctx_offline_buffer},
+	{"bulk_options",	ctx_bulk_options},
+	{"conflate",		ctx_conflate},
+	{"rate_limit",		ctx_rate_limit},
+	{"publish_every",	ctx_publish_every},
+	{"publish_at",		ctx_publish_at},
+	{"cancel_timer",	ctx_cancel_timer},
+	{"request",		ctx_request},
+	{"drop_expired",	ctx_drop_expired},
+	{"dedup",		ctx_dedup},
+	{"shed",		ctx_shed},
+	{"publish_stream",	ctx_publish_stream},
+	{"stream_receive",	ctx_stream_receive},
+	{"record",		ctx_record},
+	{"rule",		ctx_rule},
+	{"remove_rule",		ctx_remove_rule},
+	{"intern_topics",	ctx_intern_topics},
+	{"topic",		ctx_topic},
+	{"topic_id",		ctx_topic_id},
 	{"callback_set",	ctx_callback_set},
 	{"__newindex",		ctx_callback_set},
 
@@ -1961,6 +12434,75 @@ static const struct luaL_Reg ctx_M[] = {
 	{NULL,		NULL}
 };
 
+static const struct luaL_Reg pool_M[] = {
+	{"dispatch",		pool_dispatch},
+	{"stats",			pool_stats},
+	{"close",			pool_close},
+	{"__gc",			pool_close},
+	{NULL,		NULL}
+};
+
+static const struct luaL_Reg group_M[] = {
+	{"members",			group_members},
+	{"stats",			group_stats},
+	{"rebalance",		group_rebalance},
+	{"loop",			group_loop},
+	{"close",			group_close},
+	{"__gc",			group_close},
+	{NULL,		NULL}
+};
+
+static const struct luaL_Reg buffer_M[] = {
+	{"len",				buffer_len},
+	{"slice",			buffer_slice},
+	{"sub",				buffer_sub},
+	{"write",			buffer_write},
+	{"__len",			buffer_len},
+	{"__gc",			buffer_gc},
+	{NULL,		NULL}
+};
+
+static const struct luaL_Reg swarm_M[] = {
+	{"stats",			swarm_stats},
+	{"stop",			swarm_stop},
+	{"__gc",			swarm_stop},
+	{NULL,		NULL}
+};
+
+static const struct luaL_Reg relay_M[] = {
+	{"stats",			relay_stats},
+	{"stop",			relay_stop},
+	{"__gc",			relay_stop},
+	{NULL,		NULL}
+};
+
+static const struct luaL_Reg matcher_M[] = {
+	{"match",			matcher_match},
+	{"match_many",		matcher_match_many},
+	{"add",				matcher_add},
+	{"__gc",			matcher_gc},
+	{NULL,		NULL}
+};
+
+static const struct luaL_Reg pub_M[] = {
+	{"publish",			publisher_publish},
+	{"share",			publisher_share},
+	{"stats",			publisher_stats},
+	{"__gc",			publisher_gc},
+	{NULL,		NULL}
+};
+
+#ifdef LUA_MOSQUITTO_IO_POOL
+static const struct luaL_Reg io_M[] = {
+	{"dispatch",		iopool_dispatch},
+	{"fd",				iopool_fd},
+	{"stats",			iopool_stats},
+	{"close",			iopool_close},
+	{"__gc",			iopool_close},
+	{NULL,		NULL}
+};
+#endif
+
 int luaopen_mosquitto(lua_State *L)
 {
 	mosquitto_lib_init();
@@ -1978,6 +12520,59 @@ int luaopen_mosquitto(lua_State *L)
 	lua_setfield(L, -2, "__index");
 	luaL_setfuncs(L, ctx_M, 0);
 
+	luaL_newmetatable(L, MOSQ_META_POOL);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, pool_M, 0);
+
+	luaL_newmetatable(L, MOSQ_META_PUB);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, pub_M, 0);
+
+	luaL_newmetatable(L, MOSQ_META_GROUP);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, group_M, 0);
+
+	luaL_newmetatable(L, MOSQ_META_MATCHER);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, matcher_M, 0);
+
+	luaL_newmetatable(L, MOSQ_META_BUFFER);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, buffer_M, 0);
+
+	luaL_newmetatable(L, MOSQ_META_SWARM);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, swarm_M, 0);
+
+	luaL_newmetatable(L, MOSQ_META_RELAY);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, relay_M, 0);
+
+#ifdef LUA_MOSQUITTO_IO_POOL
+	luaL_newmetatable(L, MOSQ_META_IO);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, io_M, 0);
+
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_pushstring(L, "v");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, MOSQ_IO_CLIENTS);
+#endif
+
+	/* for native modules, see lua-mosquitto.h */
+	lua_pushlightuserdata(L, (void *) &native_api);
+	lua_setfield(L, LUA_REGISTRYINDEX, LUA_MOSQUITTO_API);
+
 	luaL_newlib(L, R);
 
 	/* register callback defs into mosquitto table */
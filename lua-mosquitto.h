@@ -0,0 +1,112 @@
+/*
+
+  lua-mosquitto.h - C API of the Lua bindings to libmosquitto
+
+  Copyright (c) 2014 Bart Van Der Meerssche <bart@flukso.net>
+                     Natanael Copa <ncopa@alpinelinux.org>
+                     Karl Palsson <karlp@remake.is>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+/*
+ * Lets other native Lua modules hook C handlers into a client created by
+ * mosquitto.new, so messages, publish acks and connects reach them without
+ * a detour through Lua.
+ *
+ * Lua modules are usually loaded with RTLD_LOCAL, so the API is a table of
+ * function pointers the module leaves in the registry when it's required:
+ *
+ *	const struct lmq_api *api = lmq_api(L);
+ *	lmq_ctx_t *ctx;
+ *
+ *	if (api == NULL)
+ *		return luaL_error(L, "require 'mosquitto' first");
+ *	ctx = api->check(L, 1);
+ *	api->on_message(ctx, "sensors/#", decode, state, free);
+ *
+ * Handlers run on whichever thread drives the client's network side (the
+ * loop, loop_start or an I/O pool thread), before anything is queued for
+ * Lua. They are called with a lock of the client held and must neither
+ * touch the Lua state nor add or remove handlers. Calls into libmosquitto
+ * through api->mosquitto(ctx), eg to publish, are fine.
+ */
+
+#ifndef LUA_MOSQUITTO_H
+#define LUA_MOSQUITTO_H
+
+#include <lua.h>
+#include <mosquitto.h>
+
+/* bumped when existing members change, new ones are appended */
+#define LUA_MOSQUITTO_API_VERSION	1
+
+/* registry field of the light userdata pointing to the struct lmq_api */
+#define LUA_MOSQUITTO_API	"mosquitto.api"
+
+/* return values of message handlers */
+#define LMQ_PASS	0	/* on to the next handlers and the Lua callbacks */
+#define LMQ_HANDLED	1	/* consumed, nothing else sees the message */
+
+typedef struct lmq_ctx lmq_ctx_t;
+
+/* msg and props are only valid during the call, props may be NULL */
+typedef int (*lmq_message_fn)(void *udata, const struct mosquitto_message *msg, const mosquitto_property *props);
+typedef void (*lmq_publish_fn)(void *udata, int mid, int reason_code, const mosquitto_property *props);
+typedef void (*lmq_connect_fn)(void *udata, int reason_code, int flags, const mosquitto_property *props);
+/* called for udata once its handler is removed or the client destroyed */
+typedef void (*lmq_free_fn)(void *udata);
+
+struct lmq_api {
+	int version;
+	size_t size;	/* sizeof(struct lmq_api) of the module */
+
+	/* the client at idx, raises a Lua error if it isn't one */
+	lmq_ctx_t *(*check)(lua_State *L, int idx);
+	struct mosquitto *(*mosquitto)(lmq_ctx_t *ctx);
+
+	/*
+	 * Add a handler, called in the order added. A message handler only
+	 * gets messages matching filter, all messages if filter is NULL.
+	 * Return a handler id > 0, or a negated MOSQ_ERR_* code.
+	 */
+	int (*on_message)(lmq_ctx_t *ctx, const char *filter, lmq_message_fn fn, void *udata, lmq_free_fn release);
+	int (*on_publish)(lmq_ctx_t *ctx, lmq_publish_fn fn, void *udata, lmq_free_fn release);
+	int (*on_connect)(lmq_ctx_t *ctx, lmq_connect_fn fn, void *udata, lmq_free_fn release);
+
+	/* MOSQ_ERR_SUCCESS, or MOSQ_ERR_NOT_FOUND for an unknown id */
+	int (*remove)(lmq_ctx_t *ctx, int id);
+};
+
+/* the API of the loaded mosquitto module, NULL if not loaded or too old */
+static inline const struct lmq_api *lmq_api(lua_State *L)
+{
+	const struct lmq_api *api;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_MOSQUITTO_API);
+	api = (const struct lmq_api *) lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (api == NULL || api->version != LUA_MOSQUITTO_API_VERSION)
+		return NULL;
+	return api;
+}
+
+#endif /* LUA_MOSQUITTO_H */
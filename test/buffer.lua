@@ -0,0 +1,72 @@
+#!/usr/bin/env lua
+
+-- checks that buffer ranges follow string.sub and that slices share bytes
+
+local mosq = require "mosquitto"
+
+local failed = 0
+
+local function check(cond, what)
+	if not cond then
+		print("FAIL " .. what)
+		failed = failed + 1
+	end
+end
+
+local s = "hello"
+local b = mosq.buffer(s)
+
+check(b:len() == #s, "len")
+check(b:sub() == s, "sub()")
+check(b:slice():sub() == s, "slice()")
+
+-- every range, in and out of bounds, as string.sub does it
+for i = -8, 8 do
+	check(b:sub(i) == s:sub(i), string.format("sub(%d)", i))
+	check(b:slice(i):sub() == s:sub(i), string.format("slice(%d)", i))
+	for j = -8, 8 do
+		local want = s:sub(i, j)
+		check(b:sub(i, j) == want, string.format("sub(%d, %d)", i, j))
+		local sl = b:slice(i, j)
+		check(sl:len() == #want, string.format("slice(%d, %d):len()", i, j))
+		check(sl:sub() == want, string.format("slice(%d, %d)", i, j))
+	end
+end
+
+-- slices of slices
+local mid = b:slice(2, 4)
+check(mid:sub() == "ell", "slice(2, 4)")
+check(mid:slice(2):sub() == "ll", "slice(2, 4):slice(2)")
+check(mid:slice(-1):sub() == "l", "slice(2, 4):slice(-1)")
+check(mid:slice(5):sub() == "", "slice(2, 4):slice(5)")
+
+-- slices share their bytes with the buffer they were taken from
+mid:write(1, "E")
+check(b:sub() == "hEllo", "write through a slice")
+b:write(4, "L")
+check(mid:sub() == "ElL", "write seen by a slice")
+check(mid:write(3, "x"), "write at the end of a slice")
+check(b:sub() == "hElxo", "write at the end of a slice")
+
+-- writes stay within their buffer
+check(not pcall(mid.write, mid, 3, "xy"), "write past the end of a slice")
+check(not pcall(mid.write, mid, 0, "x"), "write at 0")
+check(not pcall(b.write, b, 7, ""), "write after the end")
+check(pcall(b.write, b, 6, ""), "empty write just after the end")
+
+-- a slice keeps its buffer alive
+local tail = mosq.buffer("0123456789"):slice(-3)
+collectgarbage()
+collectgarbage()
+check(tail:sub() == "789", "slice outliving its buffer")
+
+-- sized buffers are zero filled
+check(mosq.buffer(4):sub() == "\0\0\0\0", "buffer(4)")
+check(mosq.buffer(0):len() == 0, "buffer(0)")
+check(not pcall(mosq.buffer, -1), "buffer(-1)")
+
+if failed > 0 then
+	print(failed .. " failed")
+	os.exit(1)
+end
+print("ok")
@@ -0,0 +1,112 @@
+#!/usr/bin/env lua
+
+-- checks that bulk publishes make way for normal ones and respect their limits
+
+if not arg[1] then
+	print(string.format("Usage: %s <host>", arg[0]))
+	os.exit(1)
+end
+
+local mosq = require "mosquitto"
+
+local MOSQ_HOST      = arg[1]
+local MOSQ_PORT      = 1883
+local MOSQ_KEEPALIVE = 60
+local TIMEOUT        = 5 -- seconds
+
+local PREFIX       = "lmq-test/bulk/" .. os.time() .. "/"
+local N            = 50
+local MAX_INFLIGHT = 2
+
+local failed = 0
+
+local function check(cond, what)
+	if not cond then
+		print("FAIL " .. what)
+		failed = failed + 1
+	end
+end
+
+local function run(clients, done)
+	local deadline = os.time() + TIMEOUT
+	while not done() and os.time() < deadline do
+		for _, c in ipairs(clients) do
+			c:loop(10)
+		end
+	end
+	return done()
+end
+
+mosq.init()
+
+local received = {}
+local sub = mosq.new(nil, true)
+local subscribed = false
+sub.ON_CONNECT = function() sub:subscribe(PREFIX .. "#", 1) end
+sub.ON_SUBSCRIBE = function() subscribed = true end
+sub.ON_MESSAGE = function(mid, topic, payload) table.insert(received, payload) end
+sub:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE)
+check(run({sub}, function() return subscribed end), "timed out subscribing")
+
+local pub = mosq.new(nil, true)
+local connected = false
+pub.ON_CONNECT = function() connected = true end
+pub:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE)
+check(run({pub}, function() return connected end), "timed out connecting")
+
+check(pub:bulk_options{max_inflight = MAX_INFLIGHT}, "bulk_options")
+for i = 1, N do
+	check(pub:publish(PREFIX .. "bulk", "bulk " .. i, 1, false, mosq.PRIORITY_BULK) == 0,
+		"bulk publishes return mid 0")
+end
+local stats = pub:stats()
+check(stats.bulk_inflight <= MAX_INFLIGHT, "more than max_inflight bulk messages unacknowledged")
+check(stats.bulk_queued == N - stats.bulk_inflight, "bulk_queued")
+
+-- overtakes everything bulk but what is already in flight
+check(pub:publish(PREFIX .. "normal", "normal", 1, false), "normal publish")
+
+local most = 0
+check(run({sub, pub}, function()
+	local s = pub:stats()
+	most = math.max(most, s.bulk_inflight)
+	return #received == N + 1 and s.bulk_queued == 0 and s.bulk_inflight == 0
+end), "timed out")
+check(most <= MAX_INFLIGHT, "more than max_inflight bulk messages unacknowledged")
+
+local at
+local n = 0
+for i, payload in ipairs(received) do
+	if payload == "normal" then
+		at = i
+	else
+		n = n + 1
+		check(payload == "bulk " .. n, string.format("bulk message %d out of order: %s", n, payload))
+	end
+end
+check(at and at <= MAX_INFLIGHT + 1, "normal message at " .. tostring(at) .. ", behind the bulk queue")
+check(pub:stats().bulk_fed == N, "bulk_fed")
+
+-- a full bulk queue refuses more. QoS 0 stays queued while disconnected,
+-- libmosquitto would take QoS 1 and 2 off the queue
+local off = mosq.new(nil, true)
+check(off:bulk_options{max_messages = 3}, "bulk_options max_messages")
+for i = 1, 3 do
+	check(off:publish(PREFIX .. "off", "bulk " .. i, 0, false, mosq.PRIORITY_BULK) == 0, "queued while disconnected")
+end
+local ok, err = off:publish(PREFIX .. "off", "bulk 4", 0, false, mosq.PRIORITY_BULK)
+check(ok == nil and err ~= nil, "publish past max_messages")
+stats = off:stats()
+check(stats.bulk_queued == 3 and stats.bulk_dropped == 1, "max_messages stats")
+off:destroy()
+
+check(not pcall(pub.publish, pub, PREFIX .. "x", "x", 0, false, 7), "invalid priority accepted")
+
+pub:disconnect()
+sub:disconnect()
+
+if failed > 0 then
+	print(failed .. " failed")
+	os.exit(1)
+end
+print("ok")
@@ -0,0 +1,155 @@
+#!/usr/bin/env lua
+
+-- checks that dedup drops repeated QoS 1 messages within its window only
+
+if not arg[1] then
+	print(string.format("Usage: %s <host>", arg[0]))
+	os.exit(1)
+end
+
+local mosq = require "mosquitto"
+
+local MOSQ_HOST      = arg[1]
+local MOSQ_PORT      = 1883
+local MOSQ_KEEPALIVE = 60
+local TIMEOUT        = 5 -- seconds
+
+local PREFIX = "lmq-test/dedup/" .. os.time() .. "/"
+
+local failed = 0
+
+local function check(cond, what)
+	if not cond then
+		print("FAIL " .. what)
+		failed = failed + 1
+	end
+end
+
+local function run(clients, done)
+	local deadline = os.time() + TIMEOUT
+	while not done() and os.time() < deadline do
+		for _, c in ipairs(clients) do
+			c:loop(10)
+		end
+	end
+	return done()
+end
+
+local function same(got, want, what)
+	local ok = #got == #want
+	for i = 1, #want do
+		ok = ok and got[i] == want[i]
+	end
+	check(ok, string.format("%s: got {%s}, want {%s}", what,
+		table.concat(got, ", "), table.concat(want, ", ")))
+end
+
+mosq.init()
+
+local pending = 0
+local function subscriber(filter, v5)
+	local c = mosq.new(nil, true)
+	c.received = {}
+	local function record(topic, payload)
+		table.insert(c.received, topic:sub(#PREFIX + 1) .. "=" .. payload)
+	end
+	if v5 then
+		c:option(mosq.OPT_PROTOCOL_VERSION, mosq.MQTT_PROTOCOL_V5)
+		c.ON_MESSAGE_V5 = function(mid, topic, payload) record(topic, payload) end
+	else
+		c.ON_MESSAGE = function(mid, topic, payload) record(topic, payload) end
+	end
+	c.ON_CONNECT = function() c:subscribe(PREFIX .. filter, 1) end
+	c.ON_SUBSCRIBE = function() pending = pending - 1 end
+	pending = pending + 1
+	c:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE)
+	return c
+end
+
+-- by topic and payload, for a second
+local hashed = subscriber("hash/#")
+hashed:dedup({time = 1000})
+
+-- by message id, kept as long as it fits
+local byid = subscriber("prop/#", true)
+byid:dedup({property = "msg-id", time = 0})
+
+check(not pcall(hashed.dedup, hashed, {count = 0}), "count of 0 rejected")
+check(not pcall(hashed.dedup, hashed, {time = -1}), "negative time rejected")
+hashed:dedup({time = 1000})
+
+local pub = mosq.new(nil, true)
+pub:option(mosq.OPT_PROTOCOL_VERSION, mosq.MQTT_PROTOCOL_V5)
+local connected = false
+pub.ON_CONNECT = function() connected = true end
+pub:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE)
+
+local clients = {pub, hashed, byid}
+check(run(clients, function() return connected and pending == 0 end), "timed out connecting")
+
+-- publishes the messages, then waits for the end marker to come in
+local function scenario(sub, messages, marker)
+	for _, m in ipairs(messages) do
+		pub:publish_v5(PREFIX .. m[1], m[2], m[3] or 1, false, m[4])
+	end
+	pub:publish(PREFIX .. marker, "end", 1)
+	check(run(clients, function()
+		return sub.received[#sub.received] == marker .. "=end"
+	end), "timed out waiting for " .. marker)
+	local got = sub.received
+	sub.received = {}
+	return got
+end
+
+same(scenario(hashed, {
+	{"hash/a", "x"},
+	{"hash/a", "x"},
+	{"hash/a", "y"},
+	{"hash/b", "x"},
+	{"hash/a", "y"},
+	{"hash/q0", "x", 0},
+	{"hash/q0", "x", 0},
+}, "hash/end"), {"hash/a=x", "hash/a=y", "hash/b=x", "hash/q0=x", "hash/q0=x", "hash/end=end"},
+	"QoS 1 repeats dropped, QoS 0 passed")
+local stats = hashed:stats()
+check(stats.dedup_dropped == 2, "dedup_dropped")
+check(stats.dedup_window == 4, "dedup_window")
+
+-- past the window the same message is new again
+local later = os.time() + 2
+run(clients, function() return os.time() >= later end)
+same(scenario(hashed, {
+	{"hash/a", "x"},
+	{"hash/a", "x"},
+}, "hash/end2"), {"hash/a=x", "hash/end2=end"}, "repeat after the window")
+stats = hashed:stats()
+check(stats.dedup_dropped == 3, "dedup_dropped after the window")
+check(stats.dedup_window == 2, "dedup_window after the window")
+
+-- the id decides, whatever the topic and payload
+same(scenario(byid, {
+	{"prop/a", "one", 1, {["user-property"] = {["msg-id"] = "1"}}},
+	{"prop/b", "two", 1, {["user-property"] = {["msg-id"] = "1"}}},
+	{"prop/a", "one", 1, {["user-property"] = {["msg-id"] = "2"}}},
+	{"prop/a", "one", 1, {["user-property"] = {other = "1"}}},
+	{"prop/a", "one"},
+}, "prop/end"), {"prop/a=one", "prop/a=one", "prop/a=one", "prop/end=end"}, "dropped by message id")
+check(byid:stats().dedup_dropped == 2, "dedup_dropped by message id")
+
+-- nil stops discarding
+hashed:dedup(nil)
+same(scenario(hashed, {
+	{"hash/a", "x"},
+	{"hash/a", "x"},
+}, "hash/end3"), {"hash/a=x", "hash/a=x", "hash/end3=end"}, "nothing dropped once stopped")
+check(hashed:stats().dedup_dropped == nil, "no dedup stats once stopped")
+
+pub:disconnect()
+hashed:disconnect()
+byid:disconnect()
+
+if failed > 0 then
+	print(failed .. " failed")
+	os.exit(1)
+end
+print("ok")
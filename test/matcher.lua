@@ -0,0 +1,106 @@
+#!/usr/bin/env lua
+
+-- checks mosquitto.matcher against the MQTT topic matching rules
+
+local mosq = require "mosquitto"
+
+local function same(a, b)
+	if #a ~= #b then return false end
+	for i = 1, #a do
+		if a[i] ~= b[i] then return false end
+	end
+	return true
+end
+
+local function show(t)
+	return "{" .. table.concat(t, ", ") .. "}"
+end
+
+local filters = {
+	"a/b/c",		-- 1
+	"a/+/c",		-- 2
+	"a/#",			-- 3
+	"#",			-- 4
+	"+/+",			-- 5
+	"+",			-- 6
+	"a/b/+",		-- 7
+	"$SYS/#",		-- 8
+	"$SYS/+/load",	-- 9
+	"/+",			-- 10
+	"a/+/+/d/#",	-- 11
+}
+
+local cases = {
+	{"a/b/c",			{1, 2, 3, 4, 7}},
+	{"a/x/c",			{2, 3, 4}},
+	{"a",				{3, 4, 6}},			-- a/# matches its parent level
+	{"a/b",				{3, 4, 5}},
+	{"a/b/c/d",			{3, 4, 11}},
+	{"a/b/c/d/e/f",		{3, 4, 11}},
+	{"b",				{4, 6}},
+	{"/x",				{4, 5, 10}},		-- an empty first level
+	{"a//c",			{2, 3, 4}},			-- + matches an empty level
+	{"a/b/",			{3, 4, 7}},
+	{"$SYS/broker/load",	{8, 9}},		-- wildcards skip $ topics at the root
+	{"$SYS",			{8}},
+	{"$other",			{}},
+	{"a/$x",			{3, 4, 5}},			-- but not below it
+}
+
+local m = mosq.matcher(filters)
+local failed = 0
+
+for _, c in ipairs(cases) do
+	local got = m:match(c[1])
+	if not same(got, c[2]) then
+		print(string.format("FAIL %q: got %s, expected %s", c[1], show(got), show(c[2])))
+		failed = failed + 1
+	end
+end
+
+-- match_many gives the same answers as match
+local topics = {}
+for i, c in ipairs(cases) do topics[i] = c[1] end
+for i, got in ipairs(m:match_many(topics)) do
+	if not same(got, cases[i][2]) then
+		print(string.format("FAIL match_many %q: got %s", topics[i], show(got)))
+		failed = failed + 1
+	end
+end
+
+-- and agrees with mosquitto's own topic_matches_sub
+for _, c in ipairs(cases) do
+	for i, f in ipairs(filters) do
+		local want = false
+		for _, j in ipairs(c[2]) do want = want or j == i end
+		if mosq.topic_matches_sub(f, c[1]) ~= want then
+			print(string.format("FAIL %q against %q disagrees with topic_matches_sub", c[1], f))
+			failed = failed + 1
+		end
+	end
+end
+
+-- deep topics, past any fixed limit on the number of levels
+local deep = string.rep("x/", 300) .. "x"
+if not same(m:match(deep), {4}) then
+	print("FAIL deep topic: got " .. show(m:match(deep)))
+	failed = failed + 1
+end
+if not same(mosq.matcher({string.rep("+/", 300) .. "+"}):match(deep), {1}) then
+	print("FAIL deep filter")
+	failed = failed + 1
+end
+
+-- invalid filters are refused
+for _, f in ipairs({"a/#/b", "a+", "a/b#", "#/"}) do
+	if pcall(mosq.matcher, {f}) then
+		print(string.format("FAIL invalid filter %q accepted", f))
+		failed = failed + 1
+	end
+end
+
+if failed > 0 then
+	print(failed .. " failed")
+	os.exit(1)
+end
+print("ok")
@@ -0,0 +1,126 @@
+#!/usr/bin/env lua
+
+-- checks what the offline buffer keeps under each of its policies
+
+if not arg[1] then
+	print(string.format("Usage: %s <host>", arg[0]))
+	os.exit(1)
+end
+
+local mosq = require "mosquitto"
+
+local MOSQ_HOST      = arg[1]
+local MOSQ_PORT      = 1883
+local MOSQ_KEEPALIVE = 60
+local TIMEOUT        = 5 -- seconds
+
+local PREFIX = "lmq-test/offline/" .. os.time() .. "/"
+
+local failed = 0
+
+local function check(cond, what)
+	if not cond then
+		print("FAIL " .. what)
+		failed = failed + 1
+	end
+end
+
+local function run(clients, done)
+	local deadline = os.time() + TIMEOUT
+	while not done() and os.time() < deadline do
+		for _, c in ipairs(clients) do
+			c:loop(10)
+		end
+	end
+	return done()
+end
+
+mosq.init()
+
+-- everything under PREFIX, in order of arrival
+local received = {}
+local sub = mosq.new(nil, true)
+local subscribed = false
+sub.ON_CONNECT = function() sub:subscribe(PREFIX .. "#", 0) end
+sub.ON_SUBSCRIBE = function() subscribed = true end
+sub.ON_MESSAGE = function(mid, topic, payload)
+	table.insert(received, {topic:sub(#PREFIX + 1), payload})
+end
+sub:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE)
+check(run({sub}, function() return subscribed end), "timed out subscribing")
+
+--[[
+Publishes {topic, payload} pairs while offline through a buffer with
+options, connects and returns what came through, up to a final message
+published once connected, and the buffer's stats before connecting.
+--]]
+local function scenario(name, options, publishes)
+	local c = mosq.new(nil, true)
+	check(c:offline_buffer(options), name .. ": offline_buffer")
+	for _, p in ipairs(publishes) do
+		check(c:publish(PREFIX .. name .. "/" .. p[1], p[2], 0, false) == 0,
+			name .. ": buffered publishes return mid 0")
+	end
+	local stats = c:stats()
+
+	received = {}
+	local connected = false
+	c.ON_CONNECT = function() connected = true end
+	c:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE)
+	check(run({sub, c}, function() return connected and c:stats().offline_buffered == 0 end),
+		name .. ": timed out flushing")
+
+	-- comes after whatever the buffer held
+	c:publish(PREFIX .. name .. "/end", "end", 0, false)
+	local function ended()
+		local last = received[#received]
+		return last and last[1] == name .. "/end"
+	end
+	check(run({sub, c}, ended), name .. ": timed out")
+
+	c:disconnect()
+	c:destroy()
+
+	local got = {}
+	for i = 1, #received - 1 do
+		got[i] = received[i][1]:sub(#name + 2) .. "=" .. received[i][2]
+	end
+	return got, stats
+end
+
+local function same(name, got, want)
+	check(table.concat(got, " ") == table.concat(want, " "), string.format("%s: got {%s}, expected {%s}",
+		name, table.concat(got, " "), table.concat(want, " ")))
+end
+
+local five = {{"t", "1"}, {"t", "2"}, {"t", "3"}, {"t", "4"}, {"t", "5"}}
+
+local got, stats = scenario("oldest", {max_messages = 3}, five)
+same("drop_oldest", got, {"t=3", "t=4", "t=5"})
+check(stats.offline_buffered == 3 and stats.offline_dropped == 2, "drop_oldest: stats")
+
+got, stats = scenario("newest", {max_messages = 3, policy = "drop_newest"}, five)
+same("drop_newest", got, {"t=1", "t=2", "t=3"})
+check(stats.offline_buffered == 3 and stats.offline_dropped == 2, "drop_newest: stats")
+
+got, stats = scenario("latest", {policy = "latest"},
+	{{"a", "1"}, {"b", "1"}, {"a", "2"}, {"b", "2"}, {"a", "3"}})
+table.sort(got)
+same("latest", got, {"a=3", "b=2"})
+check(stats.offline_buffered == 2 and stats.offline_replaced == 3, "latest: stats")
+
+-- topics and payloads count against max_bytes
+local topic_len = #(PREFIX .. "bytes/t")
+got, stats = scenario("bytes", {max_bytes = 2 * (topic_len + 1)}, five)
+same("max_bytes", got, {"t=4", "t=5"})
+check(stats.offline_buffered == 2 and stats.offline_dropped == 3, "max_bytes: stats")
+
+check(not pcall(sub.offline_buffer, sub, {policy = "drop_all"}), "invalid policy accepted")
+
+sub:disconnect()
+
+if failed > 0 then
+	print(failed .. " failed")
+	os.exit(1)
+end
+print("ok")
@@ -0,0 +1,119 @@
+#!/usr/bin/env lua
+
+-- checks the reject, queue and delay policies of rate limits, and prefix buckets
+
+if not arg[1] then
+	print(string.format("Usage: %s <host>", arg[0]))
+	os.exit(1)
+end
+
+local mosq = require "mosquitto"
+
+local MOSQ_HOST      = arg[1]
+local MOSQ_PORT      = 1883
+local MOSQ_KEEPALIVE = 60
+local TIMEOUT        = 10 -- seconds
+
+local PREFIX = "lmq-test/ratelimit/" .. os.time() .. "/"
+local EAGAIN = 11
+
+local failed = 0
+
+local function check(cond, what)
+	if not cond then
+		print("FAIL " .. what)
+		failed = failed + 1
+	end
+end
+
+local function run(clients, done)
+	local deadline = os.time() + TIMEOUT
+	while not done() and os.time() < deadline do
+		for _, c in ipairs(clients) do
+			c:loop(10)
+		end
+	end
+	return done()
+end
+
+mosq.init()
+
+local received = {}
+local sub = mosq.new(nil, true)
+local subscribed = false
+sub.ON_CONNECT = function() sub:subscribe(PREFIX .. "#", 0) end
+sub.ON_SUBSCRIBE = function() subscribed = true end
+sub.ON_MESSAGE = function(mid, topic, payload)
+	table.insert(received, topic:sub(#PREFIX + 1) .. "=" .. payload)
+end
+sub:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE)
+
+local pub = mosq.new(nil, true)
+local connected = false
+pub.ON_CONNECT = function() connected = true end
+pub:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE)
+check(run({sub, pub}, function() return subscribed and connected end), "timed out connecting")
+
+local function publish(topic, payload, priority)
+	return pub:publish(PREFIX .. topic, payload, 0, false, priority)
+end
+
+-- reject: the burst goes, the rest fails with EAGAIN
+check(pub:rate_limit{rate = 1, burst = 2}, "rate_limit reject")
+check(publish("reject", "1"), "reject: first of the burst")
+check(publish("reject", "2"), "reject: second of the burst")
+local ok, err = publish("reject", "3")
+check(ok == nil and err == EAGAIN, "reject: over the limit, got " .. tostring(err))
+check(publish("reject", "control", mosq.PRIORITY_CONTROL), "reject: control traffic held back")
+local stats = pub:stats()
+check(stats.rate_passed == 3 and stats.rate_rejected == 1, "reject: stats")
+
+-- queue: everything goes, in order, at the rate
+check(pub:rate_limit{rate = 2, burst = 1, policy = "queue"}, "rate_limit queue")
+local start = os.time()
+for i = 1, 5 do
+	check(publish("queue", tostring(i)), "queue: publish " .. i)
+end
+check(pub:stats().rate_queued == 4, "queue: rate_queued")
+received = {}
+check(run({sub, pub}, function() return #received == 5 end), "queue: timed out")
+check(table.concat(received, " ") == "queue=1 queue=2 queue=3 queue=4 queue=5", "queue: order")
+-- four messages at 2/s take 2s, os.time counts whole seconds
+check(os.time() - start >= 1, "queue: sent faster than the rate")
+
+-- delay: publish blocks until a token is there
+check(pub:rate_limit{rate = 2, burst = 1, policy = "delay"}, "rate_limit delay")
+start = os.time()
+for i = 1, 5 do
+	check(publish("delay", tostring(i)), "delay: publish " .. i)
+end
+check(os.time() - start >= 1, "delay: publishes didn't wait")
+stats = pub:stats()
+check(stats.rate_delayed >= 4 and stats.rate_delay_ms >= 1500, "delay: stats")
+
+-- a prefix has its own bucket, other topics aren't limited
+check(pub:rate_limit{prefixes = {["slow/"] = {rate = 1, burst = 1}}}, "rate_limit prefixes")
+check(publish("slow/a", "1"), "prefix: first")
+check(publish("slow/b", "2") == nil, "prefix: shares the bucket of its prefix")
+for i = 1, 5 do
+	check(publish("fast/a", tostring(i)), "prefix: other topics " .. i)
+end
+
+-- nil removes the limits
+check(pub:rate_limit(nil), "rate_limit nil")
+check(pub:stats().rate_passed == nil, "limits removed")
+for i = 1, 5 do
+	check(publish("free", tostring(i)), "unlimited " .. i)
+end
+
+check(not pcall(pub.rate_limit, pub, {rate = 1, policy = "wait"}), "invalid policy accepted")
+check(not pcall(pub.rate_limit, pub, {rate = -1}), "negative rate accepted")
+
+pub:disconnect()
+sub:disconnect()
+
+if failed > 0 then
+	print(failed .. " failed")
+	os.exit(1)
+end
+print("ok")
@@ -0,0 +1,114 @@
+#!/usr/bin/env lua
+
+-- records messages through a broker, replays the log and compares both passes
+
+if not arg[1] then
+	print(string.format("Usage: %s <host>", arg[0]))
+	os.exit(1)
+end
+
+local mosq = require "mosquitto"
+
+local MOSQ_HOST      = arg[1]
+local MOSQ_PORT      = 1883
+local MOSQ_KEEPALIVE = 60
+local TIMEOUT        = 10 -- seconds
+
+local PREFIX = "lmq-test/record/" .. os.time() .. "/"
+local LOG    = os.tmpname()
+
+local failed = 0
+
+local function check(cond, what)
+	if not cond then
+		print("FAIL " .. what)
+		failed = failed + 1
+	end
+end
+
+-- topic, payload, qos
+local messages = {
+	{"src/a", "first", 0},
+	{"src/a", "again, same topic", 1},
+	{"src/b/c", "", 2},
+	{"src/a", "\0\1\255 binary", 1},
+	{"src/" .. string.rep("long/", 50) .. "topic", "deep", 0},
+	{"src/big", string.rep("0123456789abcdef", 4096), 1},
+	{"src/b/c", "last", 2},
+}
+
+mosq.init()
+local mqtt = mosq.new(nil, true)
+
+local received = {}
+local recording = true
+
+-- messages compared as strings, sorted as qos may reorder them
+local function signature(topic, payload, qos)
+	return string.format("%s %d %d %s", topic, qos, #payload, payload)
+end
+
+mqtt.ON_CONNECT = function(success, rc, rc_string)
+	check(success, "connect: " .. tostring(rc_string))
+	mqtt:subscribe(PREFIX .. "#", 2)
+end
+
+mqtt.ON_SUBSCRIBE = function()
+	for _, m in ipairs(messages) do
+		mqtt:publish(PREFIX .. m[1], m[2], m[3], false)
+	end
+	-- outside the recorded filter
+	mqtt:publish(PREFIX .. "other", "not recorded", 0, false)
+end
+
+mqtt.ON_MESSAGE = function(mid, topic, payload, qos)
+	if topic == PREFIX .. "other" then
+		recording = false
+	else
+		table.insert(received, signature(topic, payload, qos))
+	end
+end
+
+local function run(done)
+	local deadline = os.time() + TIMEOUT
+	while not done() and os.time() < deadline do
+		mqtt:loop(100)
+	end
+	return done()
+end
+
+check(mqtt:record(LOG, PREFIX .. "src/#"), "record")
+mqtt:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE)
+
+check(run(function() return not recording and #received == #messages end), "timed out recording")
+check(mqtt:record(nil), "stop recording")
+
+local recorded = received
+table.sort(recorded)
+received = {}
+
+-- as fast as the connection takes it
+local replayed
+check(mosq.replay(LOG, mqtt, {speed = 0, done = function(n) replayed = n end}), "replay")
+
+check(run(function() return replayed and #received == #messages end), "timed out replaying")
+check(replayed == #messages, string.format("replayed %s of %d", tostring(replayed), #messages))
+
+table.sort(received)
+check(#received == #recorded, string.format("got %d messages back, recorded %d", #received, #recorded))
+for i = 1, math.max(#received, #recorded) do
+	check(received[i] == recorded[i], string.format("message %d differs: %q, recorded %q",
+		i, tostring(received[i]):sub(1, 60), tostring(recorded[i]):sub(1, 60)))
+end
+
+-- a missing log is an error, not a raise
+check(not mosq.replay(LOG .. ".missing", mqtt), "replay of a missing log")
+
+mqtt:disconnect()
+os.remove(LOG)
+
+if failed > 0 then
+	print(failed .. " failed")
+	os.exit(1)
+end
+print("ok")
@@ -0,0 +1,147 @@
+#!/usr/bin/env lua
+
+-- checks that request matches replies to their calls and times out the rest
+
+if not arg[1] then
+	print(string.format("Usage: %s <host>", arg[0]))
+	os.exit(1)
+end
+
+local mosq = require "mosquitto"
+
+local MOSQ_HOST      = arg[1]
+local MOSQ_PORT      = 1883
+local MOSQ_KEEPALIVE = 60
+local TIMEOUT        = 5 -- seconds
+local ETIMEDOUT      = 110
+
+local PREFIX = "lmq-test/request/" .. os.time() .. "/"
+
+local failed = 0
+
+local function check(cond, what)
+	if not cond then
+		print("FAIL " .. what)
+		failed = failed + 1
+	end
+end
+
+local function run(clients, done)
+	local deadline = os.time() + TIMEOUT
+	while not done() and os.time() < deadline do
+		for _, c in ipairs(clients) do
+			c:loop(10)
+		end
+	end
+	return done()
+end
+
+local function client()
+	local c = mosq.new(nil, true)
+	c:option(mosq.OPT_PROTOCOL_VERSION, mosq.MQTT_PROTOCOL_V5)
+	return c
+end
+
+mosq.init()
+
+--[[
+The responder answers svc/echo once it holds ECHOES requests, in reverse
+order, answers svc/bogus with correlation data of no request, and never
+answers svc/none.
+--]]
+local ECHOES = 4
+local responder = client()
+local echoes = {}
+local subscribed = false
+responder.ON_CONNECT = function() responder:subscribe(PREFIX .. "svc/#", 1) end
+responder.ON_SUBSCRIBE = function() subscribed = true end
+responder.ON_MESSAGE_V5 = function(mid, topic, payload, qos, retain, props)
+	local name = topic:sub(#PREFIX + 1)
+	if name == "svc/echo" then
+		table.insert(echoes, {payload, props})
+		if #echoes == ECHOES then
+			for i = #echoes, 1, -1 do
+				local p = echoes[i][2]
+				responder:publish_v5(p["response-topic"], "echo " .. echoes[i][1], 1, false,
+					{["correlation-data"] = p["correlation-data"]})
+			end
+		end
+	elseif name == "svc/bogus" then
+		responder:publish_v5(props["response-topic"], "bogus", 1, false,
+			{["correlation-data"] = string.rep("0", 16)})
+	end
+end
+responder:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE)
+
+local requester = client()
+local connected = false
+requester.ON_CONNECT = function() connected = true end
+-- replies never reach the Lua callbacks
+requester.ON_MESSAGE_V5 = function(mid, topic)
+	check(false, "reply passed on to ON_MESSAGE_V5: " .. topic)
+end
+requester:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE)
+check(run({responder, requester}, function() return subscribed and connected end), "timed out connecting")
+
+local replies = {}
+local function expect(name)
+	return function(payload, props_or_err, description)
+		replies[name] = {payload, props_or_err, description}
+	end
+end
+
+local ids = {}
+for _, name in ipairs({"a", "b", "c"}) do
+	local id = requester:request(PREFIX .. "svc/echo", name, 2000, expect(name))
+	check(type(id) == "string" and #id == 16, "correlation id")
+	check(not ids[id], "correlation id reused")
+	ids[id] = true
+end
+
+-- without a callback, from a coroutine
+local co = coroutine.create(function()
+	local payload, props = requester:request(PREFIX .. "svc/echo", "co", 2000)
+	replies.co = {payload, props}
+end)
+assert(coroutine.resume(co))
+check(coroutine.status(co) == "suspended", "request yields without a callback")
+
+requester:request(PREFIX .. "svc/none", "none", 300, expect("none"))
+requester:request(PREFIX .. "svc/bogus", "bogus", 300, expect("bogus"))
+check(requester:stats().rpc_pending == 6, "rpc_pending")
+
+check(run({responder, requester}, function()
+	return replies.a and replies.b and replies.c and replies.co and replies.none and replies.bogus
+end), "timed out waiting for replies")
+
+-- each call gets its own reply, whatever the order they came in
+for _, name in ipairs({"a", "b", "c", "co"}) do
+	local r = replies[name] or {}
+	check(r[1] == "echo " .. name, string.format("%s: got %s", name, tostring(r[1])))
+	check(type(r[2]) == "table", name .. ": reply properties")
+end
+check(coroutine.status(co) == "dead", "coroutine resumed")
+
+-- no reply, or none with our correlation data, times out
+for _, name in ipairs({"none", "bogus"}) do
+	local r = replies[name] or {}
+	check(r[1] == nil and r[2] == ETIMEDOUT and type(r[3]) == "string", name .. ": timeout")
+end
+
+local stats = requester:stats()
+check(stats.rpc_pending == 0, "rpc_pending after")
+check(stats.rpc_requests == 6, "rpc_requests")
+check(stats.rpc_replies == 4, "rpc_replies")
+check(stats.rpc_timeouts == 2, "rpc_timeouts")
+check(stats.rpc_unmatched == 1, "rpc_unmatched")
+
+check(not pcall(requester.request, requester, PREFIX .. "svc/echo", "x", 1000), "request outside a coroutine without a callback")
+
+requester:disconnect()
+responder:disconnect()
+
+if failed > 0 then
+	print(failed .. " failed")
+	os.exit(1)
+end
+print("ok")
@@ -0,0 +1,138 @@
+#!/usr/bin/env lua
+
+-- checks rule conditions and projections, missing paths included, through a broker
+
+if not arg[1] then
+	print(string.format("Usage: %s <host>", arg[0]))
+	os.exit(1)
+end
+
+local mosq = require "mosquitto"
+
+local MOSQ_HOST      = arg[1]
+local MOSQ_PORT      = 1883
+local MOSQ_KEEPALIVE = 60
+local TIMEOUT        = 5 -- seconds
+
+local PREFIX = "lmq-test/rule/" .. os.time() .. "/"
+
+local failed = 0
+
+local function check(cond, what)
+	if not cond then
+		print("FAIL " .. what)
+		failed = failed + 1
+	end
+end
+
+-- the fields of a flat JSON object as strings, field order isn't kept
+local function fields(json)
+	local t = {}
+	for k, v in json:gmatch('"(%w+)":([^,}]+)') do
+		t[k] = v
+	end
+	return t
+end
+
+mosq.init()
+local mqtt = mosq.new(nil, true)
+
+-- invalid rules are refused
+local bad = {
+	{republish = PREFIX .. "out"},
+	{match = PREFIX .. "#/x", republish = PREFIX .. "out"},
+	{match = PREFIX .. "in/+"},
+	{match = PREFIX .. "in/+", republish = PREFIX .. "out/{0}"},
+	{match = PREFIX .. "in/+", republish = PREFIX .. "out/{x}"},
+	{match = PREFIX .. "in/+", republish = PREFIX .. "out/{2"},
+	{match = PREFIX .. "in/+", republish = PREFIX .. "out", qos = 3},
+}
+for i, r in ipairs(bad) do
+	check(not pcall(mqtt.rule, mqtt, r), "invalid rule " .. i .. " accepted")
+end
+
+local IN = PREFIX .. "in/+"
+
+-- a table projection, missing paths become null
+mqtt:rule{match = IN, republish = PREFIX .. "obj/{5}",
+	project = {t = "temp", h = "hum", first = "list.0", deep = "a.b.c"}}
+-- a single path, the message is dropped when it's missing
+mqtt:rule{match = IN, republish = PREFIX .. "str/{5}", project = "name"}
+-- a condition, failed by a missing path, and the payload passed on
+mqtt:rule{match = IN, republish = PREFIX .. "hot/{topic}", where = {"temp", ">", 20}}
+-- a derived message matching its rule again isn't published
+mqtt:rule{match = PREFIX .. "#", republish = PREFIX .. "loop"}
+
+local inputs = {
+	{"1", '{"temp": 21.5, "hum": 40, "name": "kitchen", "list": [7, 8], "a": {"b": {"c": "x"}}}'},
+	{"2", '{"temp": 10, "list": []}'},
+	{"3", 'not json'},
+	{"4", '{"name": "end"}'},
+}
+
+local expected = {
+	["obj/1"] = {t = "21.5", h = "40", first = "7", deep = '"x"'},
+	["obj/2"] = {t = "10", h = "null", first = "null", deep = "null"},
+	["obj/3"] = {t = "null", h = "null", first = "null", deep = "null"},
+	["obj/4"] = {t = "null", h = "null", first = "null", deep = "null"},
+	["str/1"] = "kitchen",
+	["str/4"] = "end",
+	["hot/" .. PREFIX .. "in/1"] = inputs[1][2],
+}
+
+local got = {}
+local done = false
+
+mqtt.ON_CONNECT = function(success, rc, rc_string)
+	check(success, "connect: " .. tostring(rc_string))
+	mqtt:subscribe(PREFIX .. "#", 0)
+end
+
+mqtt.ON_SUBSCRIBE = function()
+	for _, i in ipairs(inputs) do
+		mqtt:publish(PREFIX .. "in/" .. i[1], i[2], 0, false)
+	end
+end
+
+mqtt.ON_MESSAGE = function(mid, topic, payload)
+	local name = topic:sub(#PREFIX + 1)
+	if name:sub(1, 3) ~= "in/" then
+		check(got[name] == nil, "duplicate " .. name)
+		got[name] = payload
+	end
+	-- derived from the last input by the last rule producing anything
+	done = done or name == "str/4"
+end
+
+mqtt:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE)
+
+local deadline = os.time() + TIMEOUT
+while not done and os.time() < deadline do
+	mqtt:loop(100)
+end
+check(done, "timed out")
+
+for name, want in pairs(expected) do
+	local payload = got[name]
+	if payload == nil then
+		check(false, "missing " .. name)
+	elseif type(want) == "table" then
+		local f = fields(payload)
+		for k, v in pairs(want) do
+			check(f[k] == v, string.format("%s.%s: got %s, expected %s", name, k, tostring(f[k]), v))
+		end
+	else
+		check(payload == want, string.format("%s: got %q, expected %q", name, payload, want))
+	end
+end
+for name in pairs(got) do
+	check(expected[name] ~= nil, "unexpected " .. name)
+end
+
+mqtt:disconnect()
+
+if failed > 0 then
+	print(failed .. " failed")
+	os.exit(1)
+end
+print("ok")
@@ -0,0 +1,118 @@
+#!/usr/bin/env lua
+
+-- checks that shed drops filtered QoS 0 traffic only while the client lags
+
+if not arg[1] then
+	print(string.format("Usage: %s <host>", arg[0]))
+	os.exit(1)
+end
+
+local mosq = require "mosquitto"
+
+local MOSQ_HOST      = arg[1]
+local MOSQ_PORT      = 1883
+local MOSQ_KEEPALIVE = 60
+local TIMEOUT        = 10 -- seconds
+local LOW            = 2000
+local HIGH           = 20
+
+local PREFIX = "lmq-test/shed/" .. os.time() .. "/"
+
+local failed = 0
+
+local function check(cond, what)
+	if not cond then
+		print("FAIL " .. what)
+		failed = failed + 1
+	end
+end
+
+local function run(clients, done)
+	local deadline = os.time() + TIMEOUT
+	while not done() and os.time() < deadline do
+		for _, c in ipairs(clients) do
+			c:loop(10)
+		end
+	end
+	return done()
+end
+
+mosq.init()
+
+local sub = mosq.new(nil, true)
+local subscribed = false
+local received = {low = 0, high = 0}
+local last
+sub.ON_CONNECT = function() sub:subscribe(PREFIX .. "#", 1) end
+sub.ON_SUBSCRIBE = function() subscribed = true end
+sub.ON_MESSAGE = function(mid, topic, payload)
+	local kind = topic:sub(#PREFIX + 1):match("^(%w+)/")
+	received[kind] = (received[kind] or 0) + 1
+	last = topic:sub(#PREFIX + 1)
+end
+
+check(not pcall(sub.shed, sub, {depth_high = 50}), "filters required")
+check(not pcall(sub.shed, sub, {filters = {PREFIX .. "low/#"}, depth_high = 50, depth_low = 50}),
+	"depth_low below depth_high required")
+check(not pcall(sub.shed, sub, {filters = {PREFIX .. "low/#"}, lag_high = 100, lag_low = 100}),
+	"lag_low below lag_high required")
+sub:shed({filters = {PREFIX .. "low/#"}, depth_high = 50, depth_low = 5})
+sub:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE)
+
+local pub = mosq.new(nil, true)
+local connected = false
+local acked = 0
+pub.ON_CONNECT = function() connected = true end
+pub.ON_PUBLISH = function() acked = acked + 1 end
+pub:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE)
+
+check(run({sub, pub}, function() return subscribed and connected end), "timed out connecting")
+
+local stats = sub:stats()
+check(stats.shedding == false and stats.shed_dropped == 0 and stats.shed_episodes == 0, "idle stats")
+
+-- flood while the subscriber doesn't read, its backlog piles up in the socket
+local payload = string.rep("x", 100)
+for i = 1, LOW do
+	pub:publish(PREFIX .. "low/" .. i, payload, 0)
+	if i % (LOW / HIGH) == 0 then
+		pub:publish(PREFIX .. "high/" .. i, payload, 1)
+	end
+	pub:loop(0)
+end
+check(run({pub}, function() return acked == HIGH end), "timed out publishing")
+-- give the broker time to pass it all on
+local later = os.time() + 1
+run({pub}, function() return os.time() > later end)
+
+-- only QoS 1 messages end the test, QoS 0 ones may be lost under load
+pub:publish(PREFIX .. "high/end", "end", 1)
+check(run({sub, pub}, function() return last == "high/end" end), "timed out draining")
+
+stats = sub:stats()
+check(stats.shed_episodes >= 1, "shed_episodes")
+check(stats.shed_dropped > 0, "shed_dropped")
+check(received.low + stats.shed_dropped <= LOW, "low messages counted once")
+check(received.high == HIGH + 1, string.format("high: got %d, want %d", received.high, HIGH + 1))
+
+-- drained, the next low message goes through
+local dropped, low = stats.shed_dropped, received.low
+pub:publish(PREFIX .. "low/after", "after", 0)
+pub:publish(PREFIX .. "high/end2", "end", 1)
+check(run({sub, pub}, function() return last == "high/end2" end), "timed out after draining")
+stats = sub:stats()
+check(stats.shedding == false, "shedding stops once drained")
+check(stats.shed_dropped == dropped and received.low == low + 1, "nothing dropped once drained")
+
+-- nil stops shedding
+sub:shed(nil)
+check(sub:stats().shed_dropped == nil, "no shed stats once stopped")
+
+pub:disconnect()
+sub:disconnect()
+
+if failed > 0 then
+	print(failed .. " failed")
+	os.exit(1)
+end
+print("ok")
@@ -0,0 +1,91 @@
+#!/usr/bin/env lua
+
+-- checks that a spool publishes again what a previous run left unacknowledged
+
+if not arg[1] then
+	print(string.format("Usage: %s <host>", arg[0]))
+	os.exit(1)
+end
+
+local mosq = require "mosquitto"
+
+local MOSQ_HOST      = arg[1]
+local MOSQ_PORT      = 1883
+local MOSQ_KEEPALIVE = 60
+local TIMEOUT        = 5 -- seconds
+
+local TOPIC = "lmq-test/spool/" .. os.time()
+local SPOOL = os.tmpname()
+local N     = 5
+
+local failed = 0
+
+local function check(cond, what)
+	if not cond then
+		print("FAIL " .. what)
+		failed = failed + 1
+	end
+end
+
+local function run(clients, done)
+	local deadline = os.time() + TIMEOUT
+	while not done() and os.time() < deadline do
+		for _, c in ipairs(clients) do
+			c:loop(10)
+		end
+	end
+	return done()
+end
+
+mosq.init()
+
+-- the first run publishes while offline and goes away before any ack
+local first = mosq.new(nil, true)
+check(first:spool(SPOOL, {sync_ms = 0}) == 0, "a new spool replays nothing")
+for i = 1, N do
+	check(first:publish(TOPIC, "message " .. i, 1, false), "publish " .. i)
+end
+check(first:stats().spooled == N, "spooled before the restart")
+first:destroy()
+
+-- a subscriber, ready before the second run connects
+local received = {}
+local sub = mosq.new(nil, true)
+local subscribed = false
+sub.ON_CONNECT = function() sub:subscribe(TOPIC, 1) end
+sub.ON_SUBSCRIBE = function() subscribed = true end
+sub.ON_MESSAGE = function(mid, topic, payload) table.insert(received, payload) end
+sub:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE)
+check(run({sub}, function() return subscribed end), "timed out subscribing")
+
+-- the second run finds the messages and sends them once connected
+local second = mosq.new(nil, true)
+check(second:spool(SPOOL, {sync_ms = 0}) == N, "messages replayed after the restart")
+second:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE)
+
+check(run({sub, second}, function()
+	return #received == N and second:stats().spooled == 0
+end), "timed out replaying")
+
+for i = 1, N do
+	check(received[i] == "message " .. i, string.format("message %d: got %s", i, tostring(received[i])))
+end
+local stats = second:stats()
+check(stats.spool_replayed == N, "spool_replayed")
+check(stats.spool_acked == N, "spool_acked")
+
+-- acknowledged messages aren't replayed by a third run
+second:disconnect()
+second:destroy()
+local third = mosq.new(nil, true)
+check(third:spool(SPOOL, {sync_ms = 0}) == 0, "acknowledged messages replayed again")
+third:destroy()
+
+sub:disconnect()
+os.remove(SPOOL)
+
+if failed > 0 then
+	print(failed .. " failed")
+	os.exit(1)
+end
+print("ok")
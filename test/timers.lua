@@ -0,0 +1,134 @@
+#!/usr/bin/env lua
+
+-- checks publish_every, publish_at and cancel_timer
+
+if not arg[1] then
+	print(string.format("Usage: %s <host>", arg[0]))
+	os.exit(1)
+end
+
+local mosq = require "mosquitto"
+
+local MOSQ_HOST      = arg[1]
+local MOSQ_PORT      = 1883
+local MOSQ_KEEPALIVE = 60
+local TIMEOUT        = 5 -- seconds
+local INTERVAL       = 200 -- ms
+
+local PREFIX = "lmq-test/timers/" .. os.time() .. "/"
+
+local failed = 0
+
+local function check(cond, what)
+	if not cond then
+		print("FAIL " .. what)
+		failed = failed + 1
+	end
+end
+
+local function run(clients, done)
+	local deadline = os.time() + TIMEOUT
+	while not done() and os.time() < deadline do
+		for _, c in ipairs(clients) do
+			c:loop(10)
+		end
+	end
+	return done()
+end
+
+mosq.init()
+
+-- messages per topic, and the last one
+local count = {}
+local last
+local sub = mosq.new(nil, true)
+local subscribed = false
+sub.ON_CONNECT = function() sub:subscribe(PREFIX .. "#", 0) end
+sub.ON_SUBSCRIBE = function() subscribed = true end
+sub.ON_MESSAGE = function(mid, topic, payload)
+	local name = topic:sub(#PREFIX + 1)
+	count[name] = (count[name] or 0) + 1
+	last = name .. "=" .. payload
+end
+sub:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE)
+
+local pub = mosq.new(nil, true)
+local connected = false
+pub.ON_CONNECT = function() connected = true end
+pub:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE)
+check(run({sub, pub}, function() return subscribed and connected end), "timed out connecting")
+
+-- waits for everything pub published so far to come in
+local sentinels = 0
+local function drain()
+	sentinels = sentinels + 1
+	local want = "end=" .. sentinels
+	pub:publish(PREFIX .. "end", tostring(sentinels), 0, false)
+	check(run({sub, pub}, function() return last == want end), "timed out draining")
+end
+
+local static = pub:publish_every(INTERVAL, PREFIX .. "static", "tick")
+
+-- the function skips every other beat
+local calls = 0
+local fn_id
+fn_id = pub:publish_every(INTERVAL, PREFIX .. "fn", function(topic, id)
+	check(topic == PREFIX .. "fn" and id == fn_id, "payload function arguments")
+	calls = calls + 1
+	if calls % 2 == 0 then
+		return nil
+	end
+	return "call " .. calls
+end)
+
+-- a function may cancel its own timer
+local once = 0
+local once_id
+once_id = pub:publish_every(INTERVAL, PREFIX .. "once", function()
+	once = once + 1
+	check(pub:cancel_timer(once_id), "cancel from the payload function")
+	return "once"
+end)
+
+-- in the past, goes on the next loop
+pub:publish_at(os.time() - 10, PREFIX .. "at", "late")
+check(pub:stats().timers == 4, "four timers pending")
+
+-- two to three seconds of wall clock
+local start = os.time()
+run({sub, pub}, function() return os.time() >= start + 3 end)
+
+check(pub:cancel_timer(static), "cancel a pending timer")
+check(not pub:cancel_timer(static), "cancel a cancelled timer")
+check(pub:cancel_timer(fn_id), "cancel the function timer")
+check(not pub:cancel_timer(12345), "cancel an unknown timer")
+drain()
+
+-- at 200ms, beats aren't bunched up or missed
+local ticks = count.static or 0
+check(ticks >= 2000 / INTERVAL - 1 and ticks <= 3000 / INTERVAL + 1, "static ticks: " .. ticks)
+check((count.fn or 0) == math.ceil(calls / 2), string.format("fn: %d messages for %d calls", count.fn or 0, calls))
+check(once == 1 and count.once == 1, "self cancelled timer fired " .. once .. " times")
+check(count.at == 1, "publish_at in the past")
+
+local stats = pub:stats()
+check(stats.timers == 0, "timers left pending")
+check(stats.timers_fired == ticks + calls + once + 1, "timers_fired")
+check(stats.timer_errors == 0, "timer_errors")
+
+-- nothing fires once cancelled
+start = os.time()
+run({sub, pub}, function() return os.time() >= start + 1 end)
+drain()
+check(count.static == ticks, "a cancelled timer fired")
+
+check(not pcall(pub.publish_every, pub, 0, PREFIX .. "x", "x"), "zero interval accepted")
+
+pub:disconnect()
+sub:disconnect()
+
+if failed > 0 then
+	print(failed .. " failed")
+	os.exit(1)
+end
+print("ok")